@@ -0,0 +1,145 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include "get-exe-icon.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+// Microbenchmark of extracting an icon from a PE file in memory, comparing
+// get_exe_icon_from_memory(), which allocates the ICO, with
+// get_exe_icon_from_memory_into() writing into one reused buffer. Reports
+// calls per second and heap allocations per call.
+//
+// Usage: bench-alloc [path]
+//
+// Without a path, a test exe is used (run from the repository root).
+// Allocations are counted by replacing malloc and friends, which is only
+// done with glibc; elsewhere they are reported as "n/a".
+
+#define ITERATIONS 200000
+
+#ifdef __GLIBC__
+#define COUNT_ALLOCATIONS 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static size_t numAllocations = 0;
+
+void *malloc(size_t size)
+{
+	numAllocations ++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+	numAllocations ++;
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	numAllocations ++;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+#else
+static size_t numAllocations = 0;
+#endif
+
+static double now_seconds(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+static void report(const char *name, double elapsed, size_t allocations)
+{
+	printf("%-32s %12.0f", name, ITERATIONS / elapsed);
+#ifdef COUNT_ALLOCATIONS
+	printf(" %14.2f\n", (double)allocations / ITERATIONS);
+#else
+	(void)allocations;
+	printf(" %14s\n", "n/a");
+#endif
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = argc > 1
+		? argv[1]
+		: "testdata/dummyexes_\xf0\x9f\x98\xba/dummy_exe_with_explorer_icon.exe";
+
+	FILE *f = fopen(path, "rb");
+	if (!f || fseek(f, 0, SEEK_END) != 0) {
+		fprintf(stderr, "Cannot open '%s'\n", path);
+		return 1;
+	}
+	long len = ftell(f);
+	BYTE *exe = (BYTE *)malloc(len > 0 ? (size_t)len : 1);
+	if (len <= 0 || fseek(f, 0, SEEK_SET) != 0 || fread(exe, (size_t)len, 1, f) != 1) {
+		fprintf(stderr, "Cannot read '%s'\n", path);
+		return 1;
+	}
+	fclose(f);
+
+	GetExeIconOptions options;
+	memset(&options, 0, sizeof(options));
+	options.allowEmbeddedPNGs = TRUE;
+
+	// Size the reused buffer with the first call
+	DWORD icoLen = 0;
+	get_exe_icon_from_memory_into(exe, (size_t)len, &options, NULL, 0, &icoLen);
+	if (icoLen == 0) {
+		fprintf(stderr, "'%s' has no icon\n", path);
+		return 1;
+	}
+	PBYTE icoBuf = (PBYTE)malloc(icoLen);
+
+	printf("%d calls on a %ld byte file, %u byte ICO\n", ITERATIONS, len, (unsigned)icoLen);
+	printf("%-32s %12s %14s\n", "", "calls/s", "allocs/call");
+
+	size_t startAllocations = numAllocations;
+	double start = now_seconds();
+	for (int i = 0; i < ITERATIONS; i++) {
+		DWORD bufLen;
+		free(get_exe_icon_from_memory(exe, (size_t)len, TRUE, &bufLen));
+	}
+	report("get_exe_icon_from_memory", now_seconds() - start, numAllocations - startAllocations);
+
+	startAllocations = numAllocations;
+	start = now_seconds();
+	for (int i = 0; i < ITERATIONS; i++) {
+		DWORD bufLen;
+		if (!get_exe_icon_from_memory_into(exe, (size_t)len, &options, icoBuf, icoLen, &bufLen)) {
+			fprintf(stderr, "Extraction failed (error %d)\n", (int)get_exe_icon_last_error());
+			return 1;
+		}
+	}
+	report("get_exe_icon_from_memory_into", now_seconds() - start, numAllocations - startAllocations);
+
+	free(icoBuf);
+	free(exe);
+	return 0;
+}
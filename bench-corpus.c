@@ -0,0 +1,389 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include "get-exe-icon.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+
+// Benchmarks each way of extracting icons over a corpus of PE files, such as
+// one made by gen-corpus. For each API, reports throughput (files and MB of
+// ICO output per second), the median and 99th percentile time per file, how
+// much of each file was read, and heap allocations per file.
+//
+// Usage: bench-corpus [--runs N] <directory | file...>
+//
+// Every file is read once before timing starts, so the page cache is warm.
+// "KB read" is exact for the reader API, and for the file API (which maps
+// the file) it is the number of pages faulted in, which is only measured on
+// POSIX systems. Allocations are counted as in bench-alloc, which is only
+// done with glibc; elsewhere they are reported as "n/a".
+
+#ifdef __GLIBC__
+#define COUNT_ALLOCATIONS 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static size_t numAllocations = 0;
+
+void *malloc(size_t size)
+{
+	__atomic_fetch_add(&numAllocations, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+	__atomic_fetch_add(&numAllocations, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__atomic_fetch_add(&numAllocations, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+#else
+static size_t numAllocations = 0;
+#endif
+
+typedef enum
+{
+	API_FILE,
+	API_MEMORY,
+	API_MEMORY_INTO,
+	API_READER,
+	API_MODULE,
+	NUM_APIS,
+} Api;
+
+static const char *apiNames[NUM_APIS] = {
+	"get_exe_icon_from_file_utf8",
+	"get_exe_icon_from_memory",
+	"get_exe_icon_from_memory_into",
+	"get_exe_icon_from_reader",
+	"module (every group)",
+};
+
+typedef struct
+{
+	char *path;
+	uint64_t size;
+} CorpusEntry;
+
+static double now_seconds(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+// Bytes of mapped files brought in by page faults so far, or 0 if unknown
+static uint64_t faulted_bytes(void)
+{
+#ifdef _WIN32
+	return 0;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (uint64_t)(usage.ru_minflt + usage.ru_majflt) * (uint64_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+static BYTE *read_whole_file(const char *path, uint64_t *size)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f || fseek(f, 0, SEEK_END) != 0) {
+		if (f) {
+			fclose(f);
+		}
+		return NULL;
+	}
+	long len = ftell(f);
+	BYTE *buf = (BYTE *)malloc(len > 0 ? (size_t)len : 1);
+	if (len < 0 || !buf || fseek(f, 0, SEEK_SET) != 0 || (len > 0 && fread(buf, (size_t)len, 1, f) != 1)) {
+		free(buf);
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+	*size = (uint64_t)len;
+	return buf;
+}
+
+// GetExeIconReader callback reading from a FILE *
+static BOOL file_read_at(void *ctx, uint64_t offset, DWORD len, void *dst)
+{
+	FILE *f = (FILE *)ctx;
+	return fseek(f, (long)offset, SEEK_SET) == 0 && fread(dst, len, 1, f) == 1;
+}
+
+static void add_path(CorpusEntry **entries, size_t *count, size_t *capacity, const char *path)
+{
+	if (*count == *capacity) {
+		*capacity = *capacity ? *capacity * 2 : 64;
+		*entries = (CorpusEntry *)realloc(*entries, sizeof(CorpusEntry) * *capacity);
+		if (!*entries) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	CorpusEntry *entry = &(*entries)[(*count)++];
+	entry->path = (char *)malloc(strlen(path) + 1);
+	strcpy(entry->path, path);
+	entry->size = 0;
+}
+
+// Adds the files in directory 'dir' (not its subdirectories). Returns FALSE
+// if it's not a directory.
+static BOOL add_directory(CorpusEntry **entries, size_t *count, size_t *capacity, const char *dir)
+{
+	char path[4096];
+#ifdef _WIN32
+	WIN32_FIND_DATAA data;
+	snprintf(path, sizeof(path), "%s\\*", dir);
+	HANDLE find = FindFirstFileA(path, &data);
+	if (find == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+	do {
+		if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+			snprintf(path, sizeof(path), "%s\\%s", dir, data.cFileName);
+			add_path(entries, count, capacity, path);
+		}
+	} while (FindNextFileA(find, &data));
+	FindClose(find);
+#else
+	DIR *d = opendir(dir);
+	if (!d) {
+		return FALSE;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(d)) != NULL) {
+		if (entry->d_name[0] != '.') {
+			snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+			add_path(entries, count, capacity, path);
+		}
+	}
+	closedir(d);
+#endif
+	return TRUE;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+	return da < db ? -1 : da > db;
+}
+
+// Extracts the icon of one file with one API. Only the extraction is timed;
+// for the memory APIs the file is read in beforehand.
+static BOOL run_one(Api api, const CorpusEntry *entry, double *seconds, uint64_t *bytesRead, uint64_t *icoBytes, size_t *allocations, PBYTE *intoBuf, DWORD *intoSize)
+{
+	*seconds = 0;
+	*bytesRead = 0;
+	*icoBytes = 0;
+	*allocations = 0;
+
+	GetExeIconOptions options;
+	memset(&options, 0, sizeof(options));
+	options.allowEmbeddedPNGs = TRUE;
+
+	uint64_t size = 0;
+	BYTE *exe = NULL;
+	FILE *f = NULL;
+	GetExeIconReader reader;
+	if (api == API_MEMORY || api == API_MEMORY_INTO) {
+		exe = read_whole_file(entry->path, &size);
+		if (!exe) {
+			return FALSE;
+		}
+	} else if (api == API_READER) {
+		f = fopen(entry->path, "rb");
+		if (!f) {
+			return FALSE;
+		}
+		memset(&reader, 0, sizeof(reader));
+		reader.readAt = file_read_at;
+		reader.ctx = f;
+		reader.size = entry->size;
+	}
+
+	BOOL ok = FALSE;
+	DWORD bufLen = 0;
+	PBYTE icoBuf = NULL;
+	uint64_t startFaulted = faulted_bytes();
+	size_t startAllocations = numAllocations;
+	double start = now_seconds();
+
+	switch (api) {
+	case API_FILE:
+		icoBuf = get_exe_icon_from_file_utf8(entry->path, TRUE, &bufLen);
+		ok = icoBuf != NULL;
+		break;
+	case API_MEMORY:
+		icoBuf = get_exe_icon_from_memory(exe, (size_t)size, TRUE, &bufLen);
+		ok = icoBuf != NULL;
+		break;
+	case API_MEMORY_INTO:
+		// The buffer is reused across files, and only grows when one
+		// doesn't fit
+		ok = get_exe_icon_from_memory_into(exe, (size_t)size, &options, *intoBuf, *intoSize, &bufLen);
+		if (!ok && get_exe_icon_last_error() == GET_EXE_ICON_ERROR_BUFFER_TOO_SMALL) {
+			free(*intoBuf);
+			*intoBuf = (PBYTE)malloc(bufLen);
+			*intoSize = *intoBuf ? bufLen : 0;
+			ok = get_exe_icon_from_memory_into(exe, (size_t)size, &options, *intoBuf, *intoSize, &bufLen);
+		}
+		break;
+	case API_READER:
+		icoBuf = get_exe_icon_from_reader(&reader, TRUE, &bufLen);
+		ok = icoBuf != NULL;
+		break;
+	case API_MODULE: {
+		GetExeIconModule *module = get_exe_icon_module_open_utf8(entry->path);
+		ok = module != NULL;
+		for (DWORD i = 0; ok && i < get_exe_icon_module_num_groups(module); i++) {
+			PBYTE groupBuf = get_exe_icon_module_extract_group(module, i, &options, &bufLen);
+			ok = groupBuf != NULL;
+			*icoBytes += ok ? bufLen : 0;
+			free(groupBuf);
+		}
+		get_exe_icon_module_close(module);
+		break;
+	}
+	default:
+		break;
+	}
+	free(icoBuf);
+	if (api != API_MODULE && ok) {
+		*icoBytes = bufLen;
+	}
+
+	*seconds = now_seconds() - start;
+	*allocations = numAllocations - startAllocations;
+	*bytesRead = api == API_READER ? reader.bytesRead
+		: api == API_FILE || api == API_MODULE ? faulted_bytes() - startFaulted
+		: 0;
+
+	free(exe);
+	if (f) {
+		fclose(f);
+	}
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	int runs = 3;
+	CorpusEntry *entries = NULL;
+	size_t count = 0, capacity = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+			runs = atoi(argv[++i]);
+		} else if (!add_directory(&entries, &count, &capacity, argv[i])) {
+			add_path(&entries, &count, &capacity, argv[i]);
+		}
+	}
+	if (count == 0 || runs < 1) {
+		fprintf(stderr, "Usage: %s [--runs N] <directory | file...>\n", argv[0]);
+		return 2;
+	}
+
+	// Warm the page cache, and get the sizes
+	uint64_t totalBytes = 0;
+	for (size_t i = 0; i < count; i++) {
+		BYTE *exe = read_whole_file(entries[i].path, &entries[i].size);
+		if (!exe) {
+			fprintf(stderr, "Cannot read '%s'\n", entries[i].path);
+			return 1;
+		}
+		free(exe);
+		totalBytes += entries[i].size;
+	}
+
+	printf("%zd files, %.1f MB, %d runs\n", count, (double)totalBytes / 1e6, runs);
+	printf("%-30s %10s %10s %9s %9s %9s %12s\n", "", "files/s", "ICO MB/s", "p50 us", "p99 us", "KB read", "allocs/file");
+
+	double *latencies = (double *)malloc(sizeof(double) * count * runs);
+	PBYTE intoBuf = NULL;
+	DWORD intoSize = 0;
+
+	for (int api = 0; api < NUM_APIS; api++) {
+		double total = 0;
+		uint64_t bytesRead = 0, icoBytes = 0;
+		size_t allocations = 0, failed = 0, numLatencies = 0;
+
+		for (int run = 0; run < runs; run++) {
+			for (size_t i = 0; i < count; i++) {
+				double seconds;
+				uint64_t fileBytesRead, fileIcoBytes;
+				size_t fileAllocations;
+				if (!run_one((Api)api, &entries[i], &seconds, &fileBytesRead, &fileIcoBytes, &fileAllocations, &intoBuf, &intoSize)) {
+					failed++;
+				}
+				latencies[numLatencies++] = seconds;
+				total += seconds;
+				bytesRead += fileBytesRead;
+				icoBytes += fileIcoBytes;
+				allocations += fileAllocations;
+			}
+		}
+
+		qsort(latencies, numLatencies, sizeof(double), compare_doubles);
+		double p50 = latencies[numLatencies / 2];
+		double p99 = latencies[numLatencies * 99 / 100];
+
+		printf("%-30s %10.0f %10.1f %9.1f %9.1f", apiNames[api],
+			(double)numLatencies / total,
+			(double)icoBytes / total / 1e6,
+			p50 * 1e6, p99 * 1e6);
+		if (api == API_MEMORY || api == API_MEMORY_INTO) {
+			printf(" %9s", "-");
+		} else {
+			printf(" %9.1f", (double)bytesRead / numLatencies / 1024);
+		}
+#ifdef COUNT_ALLOCATIONS
+		printf(" %12.2f", (double)allocations / numLatencies);
+#else
+		(void)allocations;
+		printf(" %12s", "n/a");
+#endif
+		if (failed) {
+			printf("  (%zd failed)", failed);
+		}
+		printf("\n");
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		free(entries[i].path);
+	}
+	free(entries);
+	free(latencies);
+	free(intoBuf);
+	return 0;
+}
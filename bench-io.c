@@ -0,0 +1,238 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include "get-exe-icon.h"
+#include "get-exe-icon-batch.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// Compares the I/O backends of get_exe_icons_batch(): blocking extraction on
+// pools of threads of a few sizes, and io_uring at a few queue depths, with
+// one thread and with one per CPU.
+//
+// Usage: bench-io [--cold] [--runs N] <directory | file...>
+//
+// With --cold, the files are dropped from the page cache before every run
+// (with posix_fadvise(POSIX_FADV_DONTNEED), which needs no privileges but
+// only drops pages no other process has mapped), so every run reads them from
+// disk. That is where io_uring helps: with the files already cached, the
+// backends do the same work and run at about the same speed. Only on Linux;
+// elsewhere --cold is ignored and io_uring is reported as unavailable.
+
+typedef struct
+{
+	GetExeIconBatchBackend backend;
+	DWORD threads;     // 0 = cpuFactor threads per CPU
+	DWORD cpuFactor;
+	DWORD queueDepth;
+} Config;
+
+static const Config configs[] = {
+	{ GET_EXE_ICON_BATCH_THREADS,  1, 0, 0 },
+	{ GET_EXE_ICON_BATCH_THREADS,  0, 1, 0 },
+	{ GET_EXE_ICON_BATCH_THREADS,  0, 4, 0 },
+	{ GET_EXE_ICON_BATCH_THREADS,  0, 16, 0 },
+	{ GET_EXE_ICON_BATCH_IO_URING, 1, 0, 16 },
+	{ GET_EXE_ICON_BATCH_IO_URING, 1, 0, 64 },
+	{ GET_EXE_ICON_BATCH_IO_URING, 1, 0, 256 },
+	{ GET_EXE_ICON_BATCH_IO_URING, 0, 1, 128 },
+};
+
+static double now_seconds(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+static DWORD num_cpus(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (DWORD)n : 1;
+#endif
+}
+
+// Drops a file's pages from the page cache. Returns FALSE if it can't.
+static BOOL drop_from_cache(const char *path)
+{
+#ifdef __linux__
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return FALSE;
+	}
+	BOOL ret = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+	close(fd);
+	return ret;
+#else
+	(void)path;
+	return FALSE;
+#endif
+}
+
+static void add_path(char ***paths, size_t *count, size_t *capacity, const char *path)
+{
+	if (*count == *capacity) {
+		*capacity = *capacity ? *capacity * 2 : 64;
+		*paths = (char **)realloc(*paths, sizeof(char *) * *capacity);
+		if (!*paths) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	(*paths)[*count] = (char *)malloc(strlen(path) + 1);
+	strcpy((*paths)[(*count)++], path);
+}
+
+// Adds the files in directory 'dir' (not its subdirectories). Returns FALSE
+// if it's not a directory.
+static BOOL add_directory(char ***paths, size_t *count, size_t *capacity, const char *dir)
+{
+	char path[4096];
+#ifdef _WIN32
+	WIN32_FIND_DATAA data;
+	snprintf(path, sizeof(path), "%s\\*", dir);
+	HANDLE find = FindFirstFileA(path, &data);
+	if (find == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+	do {
+		if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+			snprintf(path, sizeof(path), "%s\\%s", dir, data.cFileName);
+			add_path(paths, count, capacity, path);
+		}
+	} while (FindNextFileA(find, &data));
+	FindClose(find);
+#else
+	DIR *d = opendir(dir);
+	if (!d) {
+		return FALSE;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(d)) != NULL) {
+		if (entry->d_name[0] != '.') {
+			snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+			add_path(paths, count, capacity, path);
+		}
+	}
+	closedir(d);
+#endif
+	return TRUE;
+}
+
+int main(int argc, char **argv)
+{
+	BOOL cold = FALSE;
+	int runs = 3;
+	char **paths = NULL;
+	size_t count = 0, capacity = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--cold") == 0) {
+			cold = TRUE;
+		} else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+			runs = atoi(argv[++i]);
+		} else if (!add_directory(&paths, &count, &capacity, argv[i])) {
+			add_path(&paths, &count, &capacity, argv[i]);
+		}
+	}
+	if (count == 0 || runs < 1) {
+		fprintf(stderr, "Usage: bench-io [--cold] [--runs N] <directory | file...>\n");
+		return 1;
+	}
+	if (cold && !drop_from_cache(paths[0])) {
+		fprintf(stderr, "Can't drop files from the page cache here; running warm\n");
+		cold = FALSE;
+	}
+
+	GetExeIconBatchResult *results = (GetExeIconBatchResult *)malloc(sizeof(GetExeIconBatchResult) * count);
+	if (!results) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	const DWORD cpus = num_cpus();
+	const BOOL haveUring = get_exe_icon_batch_io_uring_available();
+	printf("%zd files, %u CPUs, %s page cache, best of %d runs\n",
+		count, (unsigned)cpus, cold ? "cold" : "warm", runs);
+	if (!haveUring) {
+		printf("io_uring is unavailable, so its rows are the thread fallback\n");
+	}
+	printf("%-10s %8s %6s %12s %12s %10s\n", "backend", "threads", "depth", "files/s", "ICO MB/s", "failed");
+
+	double threadsRate = 0;
+	for (size_t c = 0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+		const Config *config = &configs[c];
+
+		GetExeIconBatchOptions options;
+		memset(&options, 0, sizeof(options));
+		options.allowEmbeddedPNGs = TRUE;
+		options.backend = config->backend;
+		options.numThreads = config->threads ? config->threads : config->cpuFactor * cpus;
+		options.queueDepth = config->queueDepth;
+
+		double best = 0, outBytes = 0;
+		size_t failed = 0;
+		for (int run = 0; run < runs; run++) {
+			if (cold) {
+				for (size_t i = 0; i < count; i++) {
+					drop_from_cache(paths[i]);
+				}
+			}
+
+			double start = now_seconds();
+			size_t extracted = get_exe_icons_batch((const PCSTR *)paths, count, &options, results);
+			double elapsed = now_seconds() - start;
+
+			outBytes = 0;
+			for (size_t i = 0; i < count; i++) {
+				outBytes += results[i].bufLen;
+				free(results[i].icoBuf);
+			}
+			failed = count - extracted;
+			if (run == 0 || elapsed < best) {
+				best = elapsed;
+			}
+		}
+
+		double rate = (double)count / best;
+		if (c == 0) {
+			threadsRate = rate;
+		}
+		char depth[16] = "-";
+		if (config->queueDepth) {
+			snprintf(depth, sizeof(depth), "%u", (unsigned)config->queueDepth);
+		}
+		printf("%-10s %8u %6s %12.0f %12.1f %10zd",
+			config->backend == GET_EXE_ICON_BATCH_IO_URING ? "io_uring" : "threads",
+			(unsigned)options.numThreads, depth, rate, outBytes / best / 1e6, failed);
+		printf("  %.2fx\n", rate / threadsRate);
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		free(paths[i]);
+	}
+	free(paths);
+	free(results);
+	return 0;
+}
@@ -0,0 +1,207 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include "get-exe-icon-pack.h"
+#include "get-exe-icon-store.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+// Benchmark of serving icons from a pack compared to a store with a file per
+// icon. N copies of an icon, each with a few bytes changed to make it
+// distinct, are added to both, and then looked up in a random order. Also
+// times committing and compacting the pack.
+//
+// Usage: bench-pack [--icons N] [store directory]
+//
+// The pack is written next to the store directory, with ".pack" added to
+// its name.
+
+#define NUM_LOOKUPS  200000
+
+static double now_seconds(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+static uint64_t next_random(uint64_t *state)
+{
+	// xorshift64*
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 2685821657736338717ull;
+}
+
+// Makes the i'th icon from the original by changing its last bytes
+static void make_icon(PBYTE icoBuf, DWORD bufLen, uint32_t i)
+{
+	memcpy(icoBuf + bufLen - sizeof(i), &i, sizeof(i));
+}
+
+static void fail(const char *what)
+{
+	fprintf(stderr, "%s failed (error %d)\n", what, (int)get_exe_icon_last_error());
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t numIcons = 100000;
+	const char *storeDir = "bench_pack_store";
+	const char *path = "testdata/dummyexes_\xf0\x9f\x98\xba/dummy_exe_with_write_icon.exe";
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--icons") == 0 && i + 1 < argc) {
+			numIcons = (uint32_t)strtoul(argv[++i], NULL, 10);
+		} else {
+			storeDir = argv[i];
+		}
+	}
+	if (numIcons == 0) {
+		fprintf(stderr, "Usage: bench-pack [--icons N] [store directory]\n");
+		return 1;
+	}
+
+	DWORD bufLen;
+	PBYTE icoBuf = get_exe_icon_from_file_utf8(path, TRUE, &bufLen);
+	if (!icoBuf) {
+		fail("Extracting the icon");
+	}
+	char *packPath = (char *)malloc(strlen(storeDir) + 6);
+	GetExeIconHash *keys = (GetExeIconHash *)malloc(sizeof(GetExeIconHash) * numIcons);
+	if (!packPath || !keys) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	sprintf(packPath, "%s.pack", storeDir);
+	remove(packPath);
+
+	printf("%u icons of %lu bytes\n", (unsigned)numIcons, (unsigned long)bufLen);
+	printf("%-28s %10s\n", "", "ms");
+
+	GetExeIconStore *store = get_exe_icon_store_open(storeDir);
+	if (!store) {
+		fail("Opening the store");
+	}
+	double start = now_seconds();
+	for (uint32_t i = 0; i < numIcons; i++) {
+		make_icon(icoBuf, bufLen, i);
+		if (!get_exe_icon_store_add(store, icoBuf, bufLen, &keys[i], NULL)) {
+			fail("Adding to the store");
+		}
+	}
+	printf("%-28s %10.1f\n", "store add", (now_seconds() - start) * 1e3);
+
+	GetExeIconPackWriter *writer = get_exe_icon_pack_writer_open(packPath, NULL);
+	if (!writer) {
+		fail("Opening the pack writer");
+	}
+	start = now_seconds();
+	for (uint32_t i = 0; i < numIcons; i++) {
+		make_icon(icoBuf, bufLen, i);
+		if (!get_exe_icon_pack_writer_add(writer, &keys[i], icoBuf, bufLen)) {
+			fail("Adding to the pack");
+		}
+	}
+	printf("%-28s %10.1f\n", "pack add", (now_seconds() - start) * 1e3);
+	start = now_seconds();
+	if (!get_exe_icon_pack_writer_commit(writer)) {
+		fail("Committing the pack");
+	}
+	printf("%-28s %10.1f\n", "pack commit", (now_seconds() - start) * 1e3);
+
+	// Replace a tenth of the icons, leaving dead space to compact
+	for (uint32_t i = 0; i < numIcons; i += 10) {
+		make_icon(icoBuf, bufLen, i);
+		if (!get_exe_icon_pack_writer_add(writer, &keys[i], icoBuf, bufLen)) {
+			fail("Adding to the pack");
+		}
+	}
+	start = now_seconds();
+	if (!get_exe_icon_pack_writer_commit(writer)) {
+		fail("Committing the pack");
+	}
+	printf("%-28s %10.1f\n", "pack commit of a tenth", (now_seconds() - start) * 1e3);
+	get_exe_icon_pack_writer_close(writer);
+
+	start = now_seconds();
+	if (!get_exe_icon_pack_compact(packPath)) {
+		fail("Compacting the pack");
+	}
+	printf("%-28s %10.1f\n", "pack compact", (now_seconds() - start) * 1e3);
+
+	start = now_seconds();
+	GetExeIconPack *pack = get_exe_icon_pack_open(packPath);
+	if (!pack) {
+		fail("Opening the pack");
+	}
+	printf("%-28s %10.3f\n", "pack open", (now_seconds() - start) * 1e3);
+
+	// Every lookup reads the icon's bytes, as serving it would
+	uint32_t *order = (uint32_t *)malloc(sizeof(uint32_t) * NUM_LOOKUPS);
+	if (!order) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	uint64_t state = 0x9e3779b97f4a7c15ull;
+	for (size_t i = 0; i < NUM_LOOKUPS; i++) {
+		order[i] = (uint32_t)(next_random(&state) % numIcons);
+	}
+
+	printf("\n%-28s %12s %10s\n", "lookup", "lookups/s", "us/lookup");
+	uint64_t checksum = 0;
+	start = now_seconds();
+	for (size_t i = 0; i < NUM_LOOKUPS; i++) {
+		DWORD len;
+		const BYTE *data = get_exe_icon_pack_get(pack, &keys[order[i]], &len, NULL);
+		if (!data) {
+			fail("Looking up an icon in the pack");
+		}
+		for (DWORD j = 0; j < len; j += 64) {
+			checksum += data[j];
+		}
+	}
+	double elapsed = now_seconds() - start;
+	printf("%-28s %12.0f %10.3f\n", "pack (zero-copy)", NUM_LOOKUPS / elapsed, elapsed / NUM_LOOKUPS * 1e6);
+
+	// The store is much slower, so a tenth of the lookups
+	start = now_seconds();
+	for (size_t i = 0; i < NUM_LOOKUPS / 10; i++) {
+		DWORD len;
+		PBYTE data = get_exe_icon_store_get(store, &keys[order[i]], &len);
+		if (!data) {
+			fail("Looking up an icon in the store");
+		}
+		checksum += data[0];
+		free(data);
+	}
+	elapsed = now_seconds() - start;
+	printf("%-28s %12.0f %10.3f\n", "store (file per icon)", NUM_LOOKUPS / 10 / elapsed, elapsed / (NUM_LOOKUPS / 10) * 1e6);
+
+	GetExeIconPackStats stats;
+	get_exe_icon_pack_stats(pack, &stats);
+	printf("\npack: %llu bytes for %llu bytes of icons (checksum %llu)\n", (unsigned long long)stats.fileSize,
+		(unsigned long long)stats.liveBytes, (unsigned long long)checksum);
+
+	get_exe_icon_pack_close(pack);
+	get_exe_icon_store_close(store);
+	free(order);
+	free(keys);
+	free(packPath);
+	free(icoBuf);
+	return 0;
+}
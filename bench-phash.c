@@ -0,0 +1,188 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include "get-exe-icon-phash.h"
+#include "get-exe-icon-resample.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+// Benchmark of perceptual hashing with each instruction set, and of building
+// and querying an index of many codes. The codes are random, with a few
+// near-duplicates of each query code mixed in, so that the queries find
+// something. Each query is also answered by a linear scan of the codes, to
+// compare and to check the index's answers.
+//
+// Usage: bench-phash [--codes N] [path]
+
+// Each hashing case runs until it has taken at least this long
+#define MIN_SECONDS 0.5
+
+#define NUM_QUERIES     1000
+#define DUPS_PER_QUERY  8
+
+static double now_seconds(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+static const char *isaNames[] = { "auto", "scalar", "sse2", "avx2" };
+
+static uint64_t next_random(uint64_t *state)
+{
+	// xorshift64*
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 2685821657736338717ull;
+}
+
+static void run_hash_case(const char *name, const GetExeIconBitmap *bitmap, GetExeIconIsa isa)
+{
+	GetExeIconPHashOptions options;
+	memset(&options, 0, sizeof(options));
+	options.isa = isa;
+
+	size_t iterations = 0;
+	double start = now_seconds();
+	double elapsed;
+	do {
+		for (int i = 0; i < 64; i++) {
+			GetExeIconPHash hash;
+			if (!get_exe_icon_phash_bitmap(bitmap, &options, &hash)) {
+				fprintf(stderr, "Hashing failed (error %d)\n", (int)get_exe_icon_last_error());
+				exit(1);
+			}
+		}
+		iterations += 64;
+		elapsed = now_seconds() - start;
+	} while (elapsed < MIN_SECONDS);
+
+	printf("%-12s %-7s %12.0f %10.2f\n", name, isaNames[isa], iterations / elapsed, elapsed / iterations * 1e6);
+}
+
+int main(int argc, char **argv)
+{
+	size_t numCodes = 10000000;
+	const char *path = "testdata/dummyexes_\xf0\x9f\x98\xba/dummy_exe_with_explorer_icon.exe";
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--codes") == 0 && i + 1 < argc) {
+			numCodes = (size_t)strtoull(argv[++i], NULL, 10);
+		} else {
+			path = argv[i];
+		}
+	}
+	if (numCodes < NUM_QUERIES * (DUPS_PER_QUERY + 1)) {
+		fprintf(stderr, "Usage: bench-phash [--codes N] [path], with N at least %d\n", NUM_QUERIES * (DUPS_PER_QUERY + 1));
+		return 1;
+	}
+
+	GetExeIconBitmap sized, large;
+	if (!get_exe_icon_bitmap_from_file_utf8(path, GET_EXE_ICON_PHASH_SIZE, GET_EXE_ICON_PHASH_SIZE, NULL, &sized)
+		|| !get_exe_icon_bitmap_from_file_utf8(path, 48, 48, NULL, &large))
+	{
+		fprintf(stderr, "Cannot get an icon from '%s' (error %d)\n", path, (int)get_exe_icon_last_error());
+		return 1;
+	}
+
+	printf("CPU supports %s\n", isaNames[get_exe_icon_cpu_isa()]);
+	printf("%-12s %-7s %12s %10s\n", "bitmap", "isa", "hashes/s", "us/hash");
+	for (int isa = GET_EXE_ICON_ISA_SCALAR; isa <= (int)get_exe_icon_cpu_isa(); isa++) {
+		run_hash_case("32x32", &sized, (GetExeIconIsa)isa);
+	}
+	for (int isa = GET_EXE_ICON_ISA_SCALAR; isa <= (int)get_exe_icon_cpu_isa(); isa++) {
+		run_hash_case("48x48", &large, (GetExeIconIsa)isa);
+	}
+	get_exe_icon_bitmap_free(&sized);
+	get_exe_icon_bitmap_free(&large);
+
+	// Random codes, where the first DUPS_PER_QUERY after each query's slot
+	// are that query's code with 1 to 12 bits flipped
+	uint64_t *codes = (uint64_t *)malloc(sizeof(uint64_t) * numCodes);
+	if (!codes) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	uint64_t state = 0x9e3779b97f4a7c15ull;
+	for (size_t i = 0; i < numCodes; i++) {
+		codes[i] = next_random(&state);
+	}
+	size_t stride = numCodes / NUM_QUERIES;
+	for (size_t q = 0; q < NUM_QUERIES; q++) {
+		for (size_t d = 1; d <= DUPS_PER_QUERY; d++) {
+			uint64_t code = codes[q * stride];
+			DWORD flips = 1 + (DWORD)(next_random(&state) % 12);
+			for (DWORD f = 0; f < flips; f++) {
+				code ^= (uint64_t)1 << (next_random(&state) % 64);
+			}
+			codes[q * stride + d] = code;
+		}
+	}
+
+	printf("\n%zd codes\n", numCodes);
+	printf("%-10s %10s\n", "threads", "build ms");
+	GetExeIconPHashIndex *index = NULL;
+	DWORD threadCounts[] = { 1, 0 };
+	for (int t = 0; t < 2; t++) {
+		get_exe_icon_phash_index_free(index);
+		double start = now_seconds();
+		index = get_exe_icon_phash_index_build(codes, numCodes, threadCounts[t]);
+		double elapsed = now_seconds() - start;
+		if (!index) {
+			fprintf(stderr, "Building the index failed (error %d)\n", (int)get_exe_icon_last_error());
+			return 1;
+		}
+		printf("%-10s %10.1f\n", threadCounts[t] ? "1" : "all", elapsed * 1e3);
+	}
+
+	printf("%-10s %14s %14s %12s\n", "distance", "index ms/q", "linear ms/q", "matches/q");
+	DWORD distances[] = { 4, 8, 10, 12, 16 };
+	GetExeIconPHashMatch matches[4096];
+	for (int d = 0; d < 5; d++) {
+		size_t found = 0, expected = 0;
+		double start = now_seconds();
+		for (size_t q = 0; q < NUM_QUERIES; q++) {
+			found += get_exe_icon_phash_index_query(index, codes[q * stride], distances[d], matches, 4096);
+		}
+		double indexTime = now_seconds() - start;
+
+		// Only a tenth of the queries, since a scan of many codes is slow
+		start = now_seconds();
+		for (size_t q = 0; q < NUM_QUERIES; q += 10) {
+			for (size_t i = 0; i < numCodes; i++) {
+				expected += get_exe_icon_phash_distance(codes[i], codes[q * stride]) <= distances[d];
+			}
+		}
+		double linearTime = (now_seconds() - start) * 10;
+
+		size_t sampled = 0;
+		for (size_t q = 0; q < NUM_QUERIES; q += 10) {
+			sampled += get_exe_icon_phash_index_query(index, codes[q * stride], distances[d], NULL, 0);
+		}
+		if (sampled != expected) {
+			fprintf(stderr, "The index found %zd codes where the scan found %zd\n", sampled, expected);
+			return 1;
+		}
+
+		printf("%-10u %14.3f %14.3f %12.1f\n", (unsigned)distances[d],
+			indexTime / NUM_QUERIES * 1e3, linearTime / NUM_QUERIES * 1e3, (double)found / NUM_QUERIES);
+	}
+
+	get_exe_icon_phash_index_free(index);
+	free(codes);
+	return 0;
+}
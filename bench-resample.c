@@ -0,0 +1,116 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include "get-exe-icon-resample.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+// Benchmark of resampling icons with each instruction set: shrinking a
+// 256x256 image to 48x48 (the common case of a large icon shown in a list),
+// enlarging a 48x48 image to 256x256, and a large image on several threads.
+// The images are made by resampling the test exe's icon (or that of the file
+// given), so they look like real icons.
+//
+// Usage: bench-resample [path]
+
+// Each case runs until it has taken at least this long
+#define MIN_SECONDS 0.5
+
+static double now_seconds(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+static const char *isaNames[] = { "auto", "scalar", "sse2", "avx2" };
+static const char *filterNames[] = { "auto", "box", "bicubic", "lanczos3" };
+
+static void run_case(const GetExeIconBitmap *src, DWORD width, DWORD height, GetExeIconFilter filter, GetExeIconIsa isa, DWORD numThreads)
+{
+	GetExeIconResampleOptions options;
+	memset(&options, 0, sizeof(options));
+	options.filter = filter;
+	options.isa = isa;
+	options.numThreads = numThreads;
+
+	size_t iterations = 0;
+	double start = now_seconds();
+	double elapsed;
+	do {
+		for (int i = 0; i < 16; i++) {
+			GetExeIconBitmap dst;
+			if (!get_exe_icon_resample(src, width, height, &options, &dst)) {
+				fprintf(stderr, "Resampling failed (error %d)\n", (int)get_exe_icon_last_error());
+				exit(1);
+			}
+			get_exe_icon_bitmap_free(&dst);
+		}
+		iterations += 16;
+		elapsed = now_seconds() - start;
+	} while (elapsed < MIN_SECONDS);
+
+	// Throughput counts the pixels of the larger of the two images
+	double pixels = (double)src->width * src->height;
+	if ((double)width * height > pixels) {
+		pixels = (double)width * height;
+	}
+
+	char threads[16];
+	snprintf(threads, sizeof(threads), numThreads ? "%u" : "auto", (unsigned)numThreads);
+	printf("%4ux%-4u -> %4ux%-4u %-9s %-7s %7s %12.0f %10.1f %10.1f\n",
+		(unsigned)src->width, (unsigned)src->height,
+		(unsigned)width, (unsigned)height,
+		filterNames[filter], isaNames[isa], threads,
+		iterations / elapsed,
+		elapsed / iterations * 1e6,
+		pixels * iterations / elapsed / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = argc > 1
+		? argv[1]
+		: "testdata/dummyexes_\xf0\x9f\x98\xba/dummy_exe_with_explorer_icon.exe";
+
+	GetExeIconBitmap small, large, huge;
+	if (!get_exe_icon_bitmap_from_file_utf8(path, 48, 48, NULL, &small)
+		|| !get_exe_icon_resample(&small, 256, 256, NULL, &large)
+		|| !get_exe_icon_resample(&small, 2048, 2048, NULL, &huge))
+	{
+		fprintf(stderr, "Cannot get an icon from '%s' (error %d)\n", path, (int)get_exe_icon_last_error());
+		return 1;
+	}
+
+	printf("CPU supports %s\n", isaNames[get_exe_icon_cpu_isa()]);
+	printf("%-20s %-9s %-7s %7s %12s %10s %10s\n", "", "filter", "isa", "threads", "images/s", "us/image", "Mpx/s");
+
+	for (int isa = GET_EXE_ICON_ISA_SCALAR; isa <= (int)get_exe_icon_cpu_isa(); isa++) {
+		run_case(&large, 48, 48, GET_EXE_ICON_FILTER_BOX, (GetExeIconIsa)isa, 1);
+	}
+	for (int isa = GET_EXE_ICON_ISA_SCALAR; isa <= (int)get_exe_icon_cpu_isa(); isa++) {
+		run_case(&small, 256, 256, GET_EXE_ICON_FILTER_LANCZOS3, (GetExeIconIsa)isa, 1);
+	}
+	run_case(&small, 256, 256, GET_EXE_ICON_FILTER_BICUBIC, GET_EXE_ICON_ISA_AUTO, 1);
+
+	run_case(&huge, 512, 512, GET_EXE_ICON_FILTER_LANCZOS3, GET_EXE_ICON_ISA_AUTO, 1);
+	run_case(&huge, 512, 512, GET_EXE_ICON_FILTER_LANCZOS3, GET_EXE_ICON_ISA_AUTO, 0);
+
+	get_exe_icon_bitmap_free(&small);
+	get_exe_icon_bitmap_free(&large);
+	get_exe_icon_bitmap_free(&huge);
+	return 0;
+}
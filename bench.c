@@ -0,0 +1,117 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include "get-exe-icon.h"
+#include "get-exe-icon-batch.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// Benchmarks get_exe_icons_batch() with 1, 2, 4, ... threads up to the number
+// of CPUs, to show how extraction scales with threads.
+//
+// Usage: bench [path...]
+//
+// Without paths, the test exes are used (run from the repository root). The
+// paths are repeated until each run extracts at least MIN_FILES files.
+
+#define MIN_FILES 20000
+
+static double now_seconds(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+static DWORD num_cpus(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (DWORD)n : 1;
+#endif
+}
+
+int main(int argc, char **argv)
+{
+	const char *defaultPaths[] = {
+		"testdata/dummyexes_\xf0\x9f\x98\xba/dummy_exe_with_explorer_icon.exe",
+		"testdata/dummyexes_\xf0\x9f\x98\xba/dummy_exe_with_write_icon.exe",
+	};
+
+	const char **inPaths = argc > 1 ? (const char **)argv + 1 : defaultPaths;
+	size_t numInPaths = argc > 1 ? (size_t)argc - 1 : sizeof(defaultPaths) / sizeof(defaultPaths[0]);
+
+	size_t count = MIN_FILES < numInPaths ? numInPaths : MIN_FILES;
+	PCSTR *paths = (PCSTR *)malloc(sizeof(PCSTR) * count);
+	GetExeIconBatchResult *results = (GetExeIconBatchResult *)malloc(sizeof(GetExeIconBatchResult) * count);
+	if (!paths || !results) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	for (size_t i = 0; i < count; i++) {
+		paths[i] = inPaths[i % numInPaths];
+	}
+
+	DWORD maxThreads = num_cpus();
+	double baseRate = 0;
+
+	printf("%zd files per run, %u CPUs\n", count, (unsigned)maxThreads);
+	printf("%8s %12s %12s %8s\n", "threads", "files/s", "ICO MB/s", "speedup");
+
+	for (DWORD threads = 1; ; threads *= 2) {
+		if (threads > maxThreads) {
+			threads = maxThreads;
+		}
+
+		GetExeIconBatchOptions options;
+		memset(&options, 0, sizeof(options));
+		options.numThreads = threads;
+		options.allowEmbeddedPNGs = TRUE;
+
+		double start = now_seconds();
+		size_t extracted = get_exe_icons_batch(paths, count, &options, results);
+		double elapsed = now_seconds() - start;
+
+		double outBytes = 0;
+		for (size_t i = 0; i < count; i++) {
+			outBytes += results[i].bufLen;
+			free(results[i].icoBuf);
+		}
+
+		double rate = (double)count / elapsed;
+		if (threads == 1) {
+			baseRate = rate;
+		}
+		printf("%8u %12.0f %12.1f %7.2fx", (unsigned)threads, rate, outBytes / elapsed / 1e6, rate / baseRate);
+		if (extracted != count) {
+			printf("  (%zd failed)", count - extracted);
+		}
+		printf("\n");
+
+		if (threads >= maxThreads) {
+			break;
+		}
+	}
+
+	free(paths);
+	free(results);
+	return 0;
+}
@@ -0,0 +1,353 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include "get-exe-icon.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+// Fuzz target for the extraction entry points, for libFuzzer or AFL. Each
+// input is treated as a PE file and run through the memory, reader, _into,
+// layout and module APIs, with small work limits. Besides the sanitizers'
+// checks, every input must stay within worst-case bounds, or the run aborts:
+//
+// - No call takes longer than FUZZ_MAX_MS milliseconds in all.
+// - The heap never holds more than FUZZ_MAX_HEAP bytes more than before the
+//   input (measured only with glibc and without ASan, which replaces malloc;
+//   under libFuzzer, use -malloc_limit_mb instead).
+// - No ICO is larger than the output limit, and all the APIs agree on it.
+//
+// The last byte of the input selects the options (PNGs, size targeting, raw
+// images and hashing), since it rarely matters to the PE file itself.
+//
+// libFuzzer: clang -g -O1 -fsanitize=fuzzer,address -DFUZZ_NO_MAIN -o fuzz fuzz.c get-exe-icon.c
+//            ./fuzz -malloc_limit_mb=64 corpus/
+// AFL:       afl-clang-fast -g -O1 -o fuzz fuzz.c get-exe-icon.c
+//            afl-fuzz -i corpus -o findings ./fuzz @@
+// Replay:    cc -g -o fuzz fuzz.c get-exe-icon.c && ./fuzz file...
+//
+// Without arguments, the standalone build reads one input from stdin. A seed
+// corpus can be made with gen-corpus, or taken from testdata.
+
+#ifndef FUZZ_MAX_NODES
+#define FUZZ_MAX_NODES   100000
+#endif
+#ifndef FUZZ_MAX_OUTPUT
+#define FUZZ_MAX_OUTPUT  (1u << 20)
+#endif
+#ifndef FUZZ_MAX_MS
+#define FUZZ_MAX_MS      1000
+#endif
+
+// The ICO, plus the per-image scratch of a group of 65535 entries, the
+// reader's block cache and the module
+#define FUZZ_MAX_HEAP    (FUZZ_MAX_OUTPUT + (2u << 20))
+
+// Only this many groups of a module are extracted, since each call has its
+// own budget
+#define FUZZ_MAX_GROUPS  8
+
+#define FUZZ_INTO_SIZE   65536
+
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(memory_sanitizer)
+#define FUZZ_SANITIZED_MALLOC 1
+#endif
+#endif
+#ifdef __SANITIZE_ADDRESS__
+#define FUZZ_SANITIZED_MALLOC 1
+#endif
+
+#if defined(__GLIBC__) && !defined(FUZZ_SANITIZED_MALLOC)
+#define TRACK_HEAP 1
+#include <malloc.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static long long liveBytes = 0;
+static long long peakBytes = 0;
+
+static void *track(void *ptr)
+{
+	if (ptr) {
+		liveBytes += (long long)malloc_usable_size(ptr);
+		if (liveBytes > peakBytes) {
+			peakBytes = liveBytes;
+		}
+	}
+	return ptr;
+}
+
+void *malloc(size_t size)
+{
+	return track(__libc_malloc(size));
+}
+
+void *calloc(size_t count, size_t size)
+{
+	return track(__libc_calloc(count, size));
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	size_t oldSize = ptr ? malloc_usable_size(ptr) : 0;
+	void *newPtr = __libc_realloc(ptr, size);
+	if (newPtr || size == 0) {
+		liveBytes -= (long long)oldSize;
+	}
+	return track(newPtr);
+}
+
+void free(void *ptr)
+{
+	if (ptr) {
+		liveBytes -= (long long)malloc_usable_size(ptr);
+	}
+	__libc_free(ptr);
+}
+#endif
+
+static void fail(const char *message)
+{
+	fprintf(stderr, "fuzz: %s\n", message);
+	abort();
+}
+
+static double now_ms(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart * 1000.0 / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+#endif
+}
+
+static BOOL read_input(void *ctx, uint64_t offset, DWORD len, void *dst)
+{
+	memcpy(dst, (const BYTE *)ctx + offset, len);
+	return TRUE;
+}
+
+// Checks the outcome of a call that returns an ICO
+static void check_ico(PBYTE ico, DWORD len)
+{
+	if (ico) {
+		if (len == 0 || len > FUZZ_MAX_OUTPUT) {
+			fail("ICO of an impossible size");
+		}
+	} else if (len != 0 || get_exe_icon_last_error() == GET_EXE_ICON_OK) {
+		fail("failure without an error");
+	}
+}
+
+static void check_same_ico(PBYTE ico, DWORD len, PBYTE other, DWORD otherLen, const char *message)
+{
+	if ((ico == NULL) != (other == NULL)
+		|| len != otherLen
+		|| (ico && memcmp(ico, other, len) != 0))
+	{
+		fail(message);
+	}
+}
+
+static void fuzz_layout(const uint8_t *data, size_t size, const GetExeIconOptions *options, PBYTE ico, DWORD len)
+{
+	GetExeIconLayout layout;
+	if (!get_exe_icon_layout_from_memory(data, size, options, &layout)) {
+		if (ico && get_exe_icon_last_error() != GET_EXE_ICON_ERROR_INVALID_ARGUMENT) {
+			fail("layout failed where extraction succeeded");
+		}
+		return;
+	}
+	if (!ico || layout.totalLen != len || layout.headerLen > len
+		|| memcmp(layout.header, ico, layout.headerLen) != 0)
+	{
+		fail("layout and extraction disagree");
+	}
+
+	DWORD pos = layout.headerLen;
+	for (DWORD i = 0; i < layout.numSegments; i++) {
+		const GetExeIconSegment *segment = &layout.segments[i];
+		if (segment->len > len - pos
+			|| segment->offset > size
+			|| segment->len > size - segment->offset
+			|| segment->data != data + segment->offset
+			|| memcmp(segment->data, ico + pos, segment->len) != 0)
+		{
+			fail("bad layout segment");
+		}
+		pos += segment->len;
+	}
+	if (pos != len) {
+		fail("layout segments don't add up");
+	}
+	get_exe_icon_layout_free(&layout);
+}
+
+static void fuzz_module(const uint8_t *data, size_t size, const GetExeIconOptions *options, BYTE flags)
+{
+	GetExeIconModule *module = get_exe_icon_module_open_memory(data, size);
+	if (!module) {
+		return;
+	}
+
+	DWORD numGroups = get_exe_icon_module_num_groups(module);
+	for (DWORD i = 0; i < numGroups && i < FUZZ_MAX_GROUPS; i++) {
+		GetExeIconGroupInfo info;
+		WCHAR name[64];
+		GetExeIconEntryInfo entries[16];
+		DWORD numEntries, len;
+		get_exe_icon_module_group(module, i, &info);
+		get_exe_icon_module_group_name(module, i, name, 64);
+		get_exe_icon_module_group_entries(module, i, entries, 16, &numEntries);
+
+		PBYTE ico = get_exe_icon_module_extract_group(module, i, options, &len);
+		check_ico(ico, len);
+		free(ico);
+	}
+
+	static const WCHAR mainIcon[] = { 'M', 'A', 'I', 'N', 'I', 'C', 'O', 'N', 0 };
+	DWORD index;
+	get_exe_icon_module_find_group_id(module, flags, &index);
+	get_exe_icon_module_find_group_name(module, mainIcon, &index);
+
+	get_exe_icon_module_close(module);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	const BYTE flags = size > 0 ? data[size - 1] : 0;
+	GetExeIconHash hash;
+	GetExeIconImageInfo imageInfo;
+	GetExeIconOptions options;
+	memset(&options, 0, sizeof(options));
+	options.allowEmbeddedPNGs = flags & 1;
+	if (flags & 2) {
+		options.targetWidth = 16u << ((flags >> 2) & 3);
+		options.rawImage = (flags >> 4) & 1;
+		options.sizePolicy = (GetExeIconSizePolicy)((flags >> 5) % 3);
+		options.imageInfo = &imageInfo;
+	}
+	if (flags & 0x80) {
+		options.hash = &hash;
+	}
+	options.maxNodes = FUZZ_MAX_NODES;
+	options.maxOutputBytes = FUZZ_MAX_OUTPUT;
+
+	static BYTE intoBuf[FUZZ_INTO_SIZE];
+	const double start = now_ms();
+#ifdef TRACK_HEAP
+	const long long startBytes = liveBytes;
+	peakBytes = liveBytes;
+#endif
+
+	DWORD len;
+	PBYTE ico = get_exe_icon_from_memory_ex(data, size, &options, &len);
+	check_ico(ico, len);
+
+	// A reader must see exactly the same file
+	GetExeIconReader reader;
+	memset(&reader, 0, sizeof(reader));
+	reader.readAt = read_input;
+	reader.ctx = (void *)data;
+	reader.size = size;
+	DWORD readerLen;
+	PBYTE readerIco = get_exe_icon_from_reader_ex(&reader, &options, &readerLen);
+	check_ico(readerIco, readerLen);
+	check_same_ico(ico, len, readerIco, readerLen, "memory and reader APIs disagree");
+	free(readerIco);
+
+	DWORD intoLen;
+	if (get_exe_icon_from_memory_into(data, size, &options, intoBuf, sizeof(intoBuf), &intoLen)) {
+		check_same_ico(ico, len, intoBuf, intoLen, "memory and _into APIs disagree");
+	} else if (get_exe_icon_last_error() == GET_EXE_ICON_ERROR_BUFFER_TOO_SMALL) {
+		if (!ico || intoLen != len || len <= sizeof(intoBuf)) {
+			fail("wrong size for a buffer too small");
+		}
+	} else if (ico) {
+		fail("_into failed where extraction succeeded");
+	}
+
+	fuzz_layout(data, size, &options, ico, len);
+	free(ico);
+
+	fuzz_module(data, size, &options, flags);
+
+	if (now_ms() - start > FUZZ_MAX_MS) {
+		fail("input took too long");
+	}
+#ifdef TRACK_HEAP
+	if (peakBytes - startBytes > FUZZ_MAX_HEAP) {
+		fail("input used too much memory");
+	}
+#endif
+	return 0;
+}
+
+#ifndef FUZZ_NO_MAIN
+static uint8_t *read_all(FILE *file, size_t *len)
+{
+	size_t cap = 65536;
+	uint8_t *buf = (uint8_t *)malloc(cap);
+	*len = 0;
+	while (buf) {
+		*len += fread(buf + *len, 1, cap - *len, file);
+		if (*len < cap) {
+			break;
+		}
+		cap *= 2;
+		uint8_t *newBuf = (uint8_t *)realloc(buf, cap);
+		if (!newBuf) {
+			free(buf);
+		}
+		buf = newBuf;
+	}
+	return buf;
+}
+
+static int run_file(FILE *file, const char *name)
+{
+	size_t len;
+	uint8_t *data = read_all(file, &len);
+	if (!data) {
+		fprintf(stderr, "Cannot read %s\n", name);
+		return 1;
+	}
+	LLVMFuzzerTestOneInput(data, len);
+	free(data);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		return run_file(stdin, "stdin");
+	}
+
+	int ret = 0;
+	for (int i = 1; i < argc; i++) {
+		FILE *file = fopen(argv[i], "rb");
+		if (!file) {
+			fprintf(stderr, "Cannot open %s\n", argv[i]);
+			ret = 1;
+			continue;
+		}
+		ret |= run_file(file, argv[i]);
+		fclose(file);
+	}
+	return ret;
+}
+#endif
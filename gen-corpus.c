@@ -0,0 +1,338 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "gen-pe.h"
+
+#ifdef _WIN32
+#include <direct.h>
+#define make_dir(path) _mkdir(path)
+#else
+#include <sys/stat.h>
+#define make_dir(path) mkdir(path, 0755)
+#endif
+
+// Generates a corpus of synthetic PE files with icons, for benchmarking with
+// bench-corpus. The files are the same on every run (for a given seed), so
+// that results from different builds can be compared.
+//
+// Usage: gen-corpus [options] <output directory>
+//
+//   --seed N      Seed for the random parts of the files (default 1)
+//   --random N    Number of files with randomly chosen shapes (default 200)
+//   --pad-mb N    Size of the padding in the "padded" file, in MB (default
+//                 256, 0 to leave the file out). The padding is written as a
+//                 hole, so it takes no disk space on most filesystems.
+//
+// Besides the random files, there is one file for each extreme that the
+// random ones rarely reach: PE32 and PE32+ files with a typical icon, many
+// groups, a group with many entries, mostly-PNG icons, images of 1 MB, a
+// resource directory with a large fan-out, and a file whose resources start
+// hundreds of MB in. The files only have headers, a section table and a
+// resource section; they have no code and can't be run.
+
+#define MAX_ENTRY_BYTES  (1024 * 1024)
+
+typedef struct
+{
+	const char *name;
+	int pe64;
+	int numGroups;
+	int entriesPerGroup;     // Random from 1 to this if randomEntries
+	int randomEntries;
+	int pngPercent;          // Chance of each image being a PNG
+	int namedPercent;        // Chance of each group being named
+	int maxEntryBytes;       // Images are made no larger than this
+	int pngBytes;            // If nonzero, the size of every PNG image
+	int numOtherTypes;       // Other resource types, for directory fan-out
+	int otherPerType;        // Resources of each other type
+	int numLangs;            // Languages of every resource
+	uint32_t padBytes;       // Gap before the resource section
+} CorpusFile;
+
+static uint32_t rngState = 1;
+
+static uint32_t rng(void)
+{
+	// xorshift32
+	rngState ^= rngState << 13;
+	rngState ^= rngState >> 17;
+	rngState ^= rngState << 5;
+	return rngState;
+}
+
+static int rng_range(int lo, int hi)
+{
+	return lo + (int)(rng() % (uint32_t)(hi - lo + 1));
+}
+
+static void *xmalloc(size_t size)
+{
+	void *p = malloc(size ? size : 1);
+	if (!p) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+static void fill_random(uint8_t *p, uint32_t len)
+{
+	for (uint32_t i = 0; i < len; i++) {
+		p[i] = (uint8_t)(rng() >> 24);
+	}
+}
+
+// Makes an RT_ICON image: a DIB the size that its dimensions call for, or a
+// PNG (a signature and IHDR followed by filler) of about the size a real one
+// would be. Either is capped at maxBytes.
+static uint8_t *make_image(int dim, int bitCount, int png, int pngBytes, int maxBytes, uint32_t *size)
+{
+	if (png) {
+		uint32_t len = pngBytes ? (uint32_t)pngBytes : (uint32_t)rng_range(dim * dim / 4 + 64, dim * dim + 64);
+		if (len > (uint32_t)maxBytes) {
+			len = (uint32_t)maxBytes;
+		}
+		if (len < 33) {
+			len = 33;
+		}
+		uint8_t *img = (uint8_t *)xmalloc(len);
+		fill_random(img, len);
+		memcpy(img, "\x89PNG\r\n\x1a\n\0\0\0\x0dIHDR", 16);
+		img[16] = img[20] = 0;
+		img[17] = img[21] = 0;
+		img[18] = img[22] = (uint8_t)(dim >> 8);
+		img[19] = img[23] = (uint8_t)dim;
+		*size = len;
+		return img;
+	}
+
+	uint32_t numColors = bitCount <= 8 ? 1u << bitCount : 0;
+	uint32_t stride = ((uint32_t)dim * bitCount + 31) / 32 * 4;
+	uint32_t maskStride = ((uint32_t)dim + 31) / 32 * 4;
+	uint32_t len = 40 + numColors * 4 + (stride + maskStride) * dim;
+	if (len > (uint32_t)maxBytes) {
+		len = (uint32_t)maxBytes;
+	}
+	uint8_t *img = (uint8_t *)xmalloc(len);
+	fill_random(img, len);
+	memset(img, 0, 40);
+	put32(img, 40);
+	put32(img + 4, (uint32_t)dim);
+	put32(img + 8, (uint32_t)dim * 2);
+	put16(img + 12, 1);
+	put16(img + 14, (uint32_t)bitCount);
+	*size = len;
+	return img;
+}
+
+// Writes the headers, a single .rsrc section at file offset 0x200 + padBytes,
+// and the resource section itself.
+static int write_pe(const char *path, int pe64, const uint8_t *rsrc, uint32_t rsrcLen, uint32_t padBytes)
+{
+	uint8_t headers[PE_HEADERS_SIZE];
+	uint32_t rawSize;
+	uint32_t rawPointer = build_pe_headers(headers, pe64, rsrcLen, padBytes, &rawSize);
+
+	FILE *f = fopen(path, "wb");
+	if (!f) {
+		fprintf(stderr, "Cannot create '%s'\n", path);
+		return 0;
+	}
+	int ok = fwrite(headers, sizeof(headers), 1, f) == 1
+		&& fseek(f, (long)rawPointer, SEEK_SET) == 0
+		&& fwrite(rsrc, rsrcLen, 1, f) == 1;
+	for (uint32_t i = rsrcLen; ok && i < rawSize; i++) {
+		ok = fputc(0, f) != EOF;
+	}
+	if (fclose(f) != 0 || !ok) {
+		fprintf(stderr, "Cannot write '%s'\n", path);
+		return 0;
+	}
+	return 1;
+}
+
+static const int iconDims[] = { 16, 20, 24, 32, 40, 48, 64, 96, 128, 256 };
+static const int bitCounts[] = { 32, 8, 4, 32 };
+
+static int generate(const char *dir, const CorpusFile *spec)
+{
+	int numGroups = spec->numGroups;
+	ResourceType types[2 + 64];
+	int numTypes = 0;
+
+	// RT_ICON and RT_GROUP_ICON; the icon IDs are numbered across groups
+	int *groupSizes = (int *)xmalloc(sizeof(int) * numGroups);
+	int numIcons = 0;
+	for (int g = 0; g < numGroups; g++) {
+		groupSizes[g] = spec->randomEntries ? rng_range(1, spec->entriesPerGroup) : spec->entriesPerGroup;
+		numIcons += groupSizes[g];
+	}
+
+	ResourceType *icons = &types[numTypes++];
+	icons->type = 3;
+	icons->count = numIcons;
+	icons->items = (Resource *)xmalloc(sizeof(Resource) * numIcons);
+
+	ResourceType *groups = &types[numTypes++];
+	groups->type = 14;
+	groups->count = numGroups;
+	groups->items = (Resource *)xmalloc(sizeof(Resource) * numGroups);
+
+	int iconId = 1;
+	for (int g = 0; g < numGroups; g++) {
+		Resource *group = &groups->items[g];
+		memset(group, 0, sizeof(Resource));
+		group->id = (uint32_t)(100 + g);
+		if (rng_range(1, 100) <= spec->namedPercent) {
+			snprintf(group->name, sizeof(group->name), "ICON_%04d", g);
+		}
+		group->size = 6 + 14 * (uint32_t)groupSizes[g];
+		group->data = (uint8_t *)xmalloc(group->size);
+		memset(group->data, 0, group->size);
+		put16(group->data + 2, 1);
+		put16(group->data + 4, (uint32_t)groupSizes[g]);
+
+		for (int e = 0; e < groupSizes[g]; e++, iconId++) {
+			int dim = iconDims[e % 10];
+			int bitCount = bitCounts[(e / 10) % 4];
+			int png = rng_range(1, 100) <= spec->pngPercent;
+			Resource *icon = &icons->items[iconId - 1];
+			memset(icon, 0, sizeof(Resource));
+			icon->id = (uint32_t)iconId;
+			icon->data = make_image(dim, png ? 32 : bitCount, png, spec->pngBytes, spec->maxEntryBytes, &icon->size);
+
+			uint8_t *entry = group->data + 6 + 14 * e;
+			entry[0] = (uint8_t)(dim >= 256 ? 0 : dim);
+			entry[1] = entry[0];
+			entry[2] = (uint8_t)(!png && bitCount < 8 ? 1 << bitCount : 0);
+			put16(entry + 4, 1);
+			put16(entry + 6, png ? 32 : (uint32_t)bitCount);
+			put32(entry + 8, icon->size);
+			put16(entry + 12, (uint32_t)iconId);
+		}
+	}
+	qsort(groups->items, numGroups, sizeof(Resource), compare_resources);
+
+	// Other resource types, which come after RT_GROUP_ICON
+	static uint8_t otherData[64];
+	for (int t = 0; t < spec->numOtherTypes && numTypes < (int)(sizeof(types) / sizeof(types[0])); t++) {
+		ResourceType *other = &types[numTypes++];
+		other->type = (uint32_t)(256 + t);
+		other->count = spec->otherPerType;
+		other->items = (Resource *)xmalloc(sizeof(Resource) * other->count);
+		for (int i = 0; i < other->count; i++) {
+			memset(&other->items[i], 0, sizeof(Resource));
+			other->items[i].id = (uint32_t)(i + 1);
+			other->items[i].data = otherData;
+			other->items[i].size = sizeof(otherData);
+		}
+	}
+
+	uint32_t rsrcLen;
+	uint8_t *rsrc = build_rsrc(types, numTypes, spec->numLangs, PE_RSRC_RVA, &rsrcLen);
+	if (!rsrc) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/%s.exe", dir, spec->name);
+	int ok = write_pe(path, spec->pe64, rsrc, rsrcLen, spec->padBytes);
+
+	for (int i = 0; i < icons->count; i++) {
+		free(icons->items[i].data);
+	}
+	for (int i = 0; i < groups->count; i++) {
+		free(groups->items[i].data);
+	}
+	for (int t = 0; t < numTypes; t++) {
+		free(types[t].items);
+	}
+	free(groupSizes);
+	free(rsrc);
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	const char *dir = NULL;
+	uint32_t seed = 1;
+	int numRandom = 200;
+	uint32_t padMB = 256;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+			seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--random") == 0 && i + 1 < argc) {
+			numRandom = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--pad-mb") == 0 && i + 1 < argc) {
+			padMB = (uint32_t)strtoul(argv[++i], NULL, 10);
+		} else if (argv[i][0] != '-' && !dir) {
+			dir = argv[i];
+		} else {
+			dir = NULL;
+			break;
+		}
+	}
+	if (!dir || padMB > 2047) {
+		fprintf(stderr, "Usage: %s [--seed N] [--random N] [--pad-mb N] <output directory>\n", argv[0]);
+		return 2;
+	}
+	make_dir(dir);
+	rngState = seed ? seed : 1;
+
+	// name, pe64, groups, entries, random entries, png %, named %, max image
+	// size, PNG size, other types, resources per type, languages, padding
+	const CorpusFile fixed[] = {
+		{ "pe32_typical",   0,   1,  6, 0,  0,  0, MAX_ENTRY_BYTES, 0,  0,   0, 1, 0 },
+		{ "pe64_typical",   1,   1,  9, 0, 15,  0, MAX_ENTRY_BYTES, 0,  0,   0, 1, 0 },
+		{ "pe64_png_heavy", 1,   1, 10, 0, 80,  0, MAX_ENTRY_BYTES, 0,  0,   0, 1, 0 },
+		{ "many_groups",    0, 500,  6, 1, 20, 30, MAX_ENTRY_BYTES, 0,  0,   0, 1, 0 },
+		{ "wide_group",     1,   1, 64, 0, 20,  0, MAX_ENTRY_BYTES, 0,  0,   0, 1, 0 },
+		{ "large_entries",  1,   1, 10, 0, 60,  0, MAX_ENTRY_BYTES, MAX_ENTRY_BYTES, 0, 0, 1, 0 },
+		{ "fanout",         1,   3,  6, 0, 20, 50, MAX_ENTRY_BYTES, 0, 64, 200, 4, 0 },
+		{ "padded",         0,   1,  9, 0, 15,  0, MAX_ENTRY_BYTES, 0,  0,   0, 1, padMB * 1024 * 1024 },
+	};
+
+	int numFiles = 0;
+	for (size_t i = 0; i < sizeof(fixed) / sizeof(fixed[0]); i++) {
+		if (fixed[i].padBytes == 0 && strcmp(fixed[i].name, "padded") == 0) {
+			continue;
+		}
+		if (!generate(dir, &fixed[i])) {
+			return 1;
+		}
+		numFiles++;
+	}
+
+	for (int i = 0; i < numRandom; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "random_%04d", i);
+		CorpusFile spec;
+		memset(&spec, 0, sizeof(spec));
+		spec.name = name;
+		spec.pe64 = rng_range(0, 1);
+		spec.numGroups = rng_range(0, 9) == 0 ? rng_range(20, 200) : rng_range(1, 5);
+		spec.entriesPerGroup = rng_range(0, 9) == 0 ? 40 : 12;
+		spec.randomEntries = 1;
+		spec.pngPercent = rng_range(0, 100);
+		spec.namedPercent = rng_range(0, 3) == 0 ? 50 : 0;
+		spec.maxEntryBytes = rng_range(0, 19) == 0 ? MAX_ENTRY_BYTES : 300 * 1024;
+		spec.numOtherTypes = rng_range(0, 8);
+		spec.otherPerType = rng_range(1, 30);
+		spec.numLangs = rng_range(1, 3);
+		spec.padBytes = rng_range(0, 4) == 0 ? (uint32_t)rng_range(0, 8 * 1024 * 1024) : 0;
+		if (!generate(dir, &spec)) {
+			return 1;
+		}
+		numFiles++;
+	}
+
+	printf("Wrote %d files to '%s'\n", numFiles, dir);
+	return 0;
+}
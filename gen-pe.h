@@ -0,0 +1,183 @@
+#ifndef GEN_PE_H
+#define GEN_PE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Builds PE files whose only section holds resources, for gen-corpus.c and
+// tests.c. The files have headers, a section table and a resource section;
+// they have no code and can't be run.
+
+// A resource's data is shared by all of its languages
+typedef struct
+{
+	uint32_t id;
+	char name[16];           // Uppercase ASCII, or empty for an ID
+	uint8_t *data;
+	uint32_t size;
+} Resource;
+
+typedef struct
+{
+	uint32_t type;
+	Resource *items;         // Named first, by name, then by ID
+	int count;
+} ResourceType;
+
+#define PE_HEADERS_SIZE  0x200
+#define PE_RSRC_RVA      0x1000
+
+static void put16(uint8_t *p, uint32_t v) { p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); }
+static void put32(uint8_t *p, uint32_t v) { put16(p, v); put16(p + 2, v >> 16); }
+
+static uint32_t align_up(uint32_t v, uint32_t a)
+{
+	return (v + a - 1) & ~(a - 1);
+}
+
+// Sorts the items of a ResourceType into the order they're listed in
+static int compare_resources(const void *a, const void *b)
+{
+	const Resource *ra = (const Resource *)a, *rb = (const Resource *)b;
+	if (ra->name[0] && rb->name[0]) {
+		return strcmp(ra->name, rb->name);
+	}
+	if (ra->name[0] || rb->name[0]) {
+		return ra->name[0] ? -1 : 1;
+	}
+	return ra->id < rb->id ? -1 : ra->id > rb->id;
+}
+
+// Lays out a resource section at 'rva': the three levels of directories
+// (type, name, language), then the name strings, the data entries and the
+// data. The types have to be sorted by ID. Returns NULL if out of memory.
+static uint8_t *build_rsrc(const ResourceType *types, int numTypes, int numLangs, uint32_t rva, uint32_t *len)
+{
+	uint32_t dirsSize = 16 + 8 * (uint32_t)numTypes;
+	uint32_t stringsSize = 0, numItems = 0, dataSize = 0;
+	for (int t = 0; t < numTypes; t++) {
+		dirsSize += 16 + 8 * (uint32_t)types[t].count;
+		for (int i = 0; i < types[t].count; i++) {
+			const Resource *r = &types[t].items[i];
+			dirsSize += 16 + 8 * (uint32_t)numLangs;
+			stringsSize += r->name[0] ? 2 + 2 * (uint32_t)strlen(r->name) : 0;
+			dataSize += align_up(r->size, 8);
+			numItems++;
+		}
+	}
+
+	uint32_t stringsOffset = dirsSize;
+	uint32_t entriesOffset = align_up(stringsOffset + stringsSize, 8);
+	uint32_t dataOffset = entriesOffset + 16 * numItems;
+	*len = dataOffset + dataSize;
+
+	uint8_t *rsrc = (uint8_t *)calloc(1, *len);
+	if (!rsrc) {
+		return NULL;
+	}
+
+	// Directory tables are laid out breadth first
+	uint32_t typeDirOffset = 16 + 8 * (uint32_t)numTypes;
+	uint32_t langDirOffset = typeDirOffset;
+	for (int t = 0; t < numTypes; t++) {
+		langDirOffset += 16 + 8 * (uint32_t)types[t].count;
+	}
+
+	put16(rsrc + 14, (uint32_t)numTypes);
+	uint32_t item = 0;
+	for (int t = 0; t < numTypes; t++) {
+		put32(rsrc + 16 + 8 * t, types[t].type);
+		put32(rsrc + 16 + 8 * t + 4, 0x80000000 | typeDirOffset);
+
+		int numNamed = 0;
+		for (int i = 0; i < types[t].count; i++) {
+			numNamed += types[t].items[i].name[0] != 0;
+		}
+		put16(rsrc + typeDirOffset + 12, (uint32_t)numNamed);
+		put16(rsrc + typeDirOffset + 14, (uint32_t)(types[t].count - numNamed));
+
+		for (int i = 0; i < types[t].count; i++, item++) {
+			const Resource *r = &types[t].items[i];
+			uint8_t *entry = rsrc + typeDirOffset + 16 + 8 * i;
+			if (r->name[0]) {
+				size_t nameLen = strlen(r->name);
+				put32(entry, 0x80000000 | stringsOffset);
+				put16(rsrc + stringsOffset, (uint32_t)nameLen);
+				for (size_t c = 0; c < nameLen; c++) {
+					put16(rsrc + stringsOffset + 2 + 2 * c, (uint8_t)r->name[c]);
+				}
+				stringsOffset += 2 + 2 * (uint32_t)nameLen;
+			} else {
+				put32(entry, r->id);
+			}
+			put32(entry + 4, 0x80000000 | langDirOffset);
+
+			// Every language points at the same data entry
+			uint32_t dataEntry = entriesOffset + 16 * item;
+			put16(rsrc + langDirOffset + 14, (uint32_t)numLangs);
+			for (int l = 0; l < numLangs; l++) {
+				put32(rsrc + langDirOffset + 16 + 8 * l, 0x0409 + (uint32_t)l);
+				put32(rsrc + langDirOffset + 16 + 8 * l + 4, dataEntry);
+			}
+			langDirOffset += 16 + 8 * (uint32_t)numLangs;
+
+			put32(rsrc + dataEntry, rva + dataOffset);
+			put32(rsrc + dataEntry + 4, r->size);
+			memcpy(rsrc + dataOffset, r->data, r->size);
+			dataOffset += align_up(r->size, 8);
+		}
+		typeDirOffset += 16 + 8 * (uint32_t)types[t].count;
+	}
+	return rsrc;
+}
+
+// Fills in the headers of a PE whose single .rsrc section, built with
+// build_rsrc() at PE_RSRC_RVA, starts 'padBytes' (rounded up to the file
+// alignment) after them. Returns the section's file offset, and its size
+// on disk in rawSize.
+static uint32_t build_pe_headers(uint8_t headers[PE_HEADERS_SIZE], int pe64, uint32_t rsrcLen, uint32_t padBytes, uint32_t *rawSize)
+{
+	const uint32_t fileAlign = PE_HEADERS_SIZE, sectionAlign = 0x1000;
+	const uint32_t peOffset = 0x40;
+	const uint32_t optSize = pe64 ? 240 : 224;
+	uint32_t rawPointer = fileAlign + align_up(padBytes, fileAlign);
+	*rawSize = align_up(rsrcLen, fileAlign);
+
+	memset(headers, 0, PE_HEADERS_SIZE);
+	headers[0] = 'M';
+	headers[1] = 'Z';
+	put32(headers + 0x3c, peOffset);
+
+	uint8_t *coff = headers + peOffset;
+	memcpy(coff, "PE\0\0", 4);
+	put16(coff + 4, pe64 ? 0x8664 : 0x14c);
+	put16(coff + 6, 1);
+	put16(coff + 20, optSize);
+	put16(coff + 22, pe64 ? 0x0022 : 0x0102);
+
+	uint8_t *opt = coff + 24;
+	put16(opt, pe64 ? 0x20b : 0x10b);
+	put32(opt + 32, sectionAlign);
+	put32(opt + 36, fileAlign);
+	put16(opt + 40, 6);
+	put16(opt + 48, 6);
+	put32(opt + 56, PE_RSRC_RVA + align_up(rsrcLen, sectionAlign));
+	put32(opt + 60, fileAlign);
+	put16(opt + 68, 2); // IMAGE_SUBSYSTEM_WINDOWS_GUI
+	uint8_t *dirs = opt + (pe64 ? 112 : 96);
+	put32(dirs - 4, 16);
+	put32(dirs + 2 * 8, PE_RSRC_RVA);
+	put32(dirs + 2 * 8 + 4, rsrcLen);
+
+	uint8_t *section = opt + optSize;
+	memcpy(section, ".rsrc", 5);
+	put32(section + 8, rsrcLen);
+	put32(section + 12, PE_RSRC_RVA);
+	put32(section + 16, *rawSize);
+	put32(section + 20, rawPointer);
+	put32(section + 36, 0x40000040); // Initialized data, readable
+	return rawPointer;
+}
+
+#endif
@@ -0,0 +1,908 @@
+// Copyright (c) 2021 Aury Snow
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE // For syscall()
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include "get-exe-icon-batch.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && !defined(GET_EXE_ICON_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define USE_IO_URING 1
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+// Notes about the code:
+//
+// Each file's extraction is independent and costs anywhere from microseconds
+// to (on a cold network share) seconds, so there is no point in splitting the
+// work up front. Instead, every thread repeatedly claims the next unclaimed
+// index with an atomic increment. That balances the load as well as per-thread
+// queues with work stealing would, since a thread that runs into a slow file
+// simply stops claiming new ones while the others carry on.
+//
+// With io_uring, each thread claims files the same way but keeps up to
+// queueDepth of them going at once, as a small state machine each: open, read
+// the first 4 KB (the DOS and PE headers and the section table, in almost
+// every file), find out what else is needed, read that, and so on. Rather than
+// a second, asynchronous parser, "find out what else is needed" runs the
+// usual parser through a GetExeIconReader over the parts of the file read so
+// far. A read of a part that isn't there yet is noted and answered with zeros
+// so that the parse goes on to note further missing parts; a parse that
+// missed anything is thrown away, the missing parts (rounded out to 64 KB, so
+// that e.g. one read usually gets the whole resource directory) are all read
+// at once, and the parse is run again. Parsing costs microseconds and a read
+// from disk far more, so re-parsing is cheap, and it takes only a few rounds.
+// The parse that misses nothing gives the ICO's layout, and then the images
+// are all read at once, straight into the ICO. Files that need too many
+// rounds or too much memory are finished with a plain blocking extraction.
+
+typedef struct
+{
+	const PCSTR *paths;
+	size_t count;
+	BOOL allowEmbeddedPNGs;
+	GetExeIconBatchBackend backend;
+	DWORD queueDepth;
+	GetExeIconBatchResult *results;
+
+	// Index of the next path to be claimed by a thread. Only accessed
+	// atomically.
+	volatile int64_t next;
+} BatchJob;
+
+static size_t claim_next_index(BatchJob *job)
+{
+#ifdef _WIN32
+	return (size_t)InterlockedExchangeAdd64((volatile LONG64 *)&job->next, 1);
+#else
+	return (size_t)__atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+static void run_batch_worker(BatchJob *job)
+{
+	for (;;) {
+		size_t i = claim_next_index(job);
+		if (i >= job->count) {
+			break;
+		}
+
+		GetExeIconBatchResult *result = &job->results[i];
+		result->bufLen = 0;
+		result->icoBuf = get_exe_icon_from_file_utf8(job->paths[i],
+			job->allowEmbeddedPNGs,
+			&result->bufLen);
+		result->error = get_exe_icon_last_error();
+	}
+}
+
+#ifdef USE_IO_URING
+#define HEADER_READ_SIZE     4096
+#define PREFETCH_SIZE        65536
+#define MAX_MISSES           16
+#define MAX_WINDOWS          64
+#define MAX_WINDOW_BYTES     (4u << 20)
+
+// Where an io_uring worker is with one file
+typedef enum
+{
+	OP_OPENING,
+	OP_PARSING,   // Reading the parts of the file the parser needs
+	OP_READING,   // Reading the images into the ICO
+} OpState;
+
+// A part of a file that has been read
+typedef struct
+{
+	uint64_t offset;
+	DWORD    len;
+	PBYTE    data;
+} Window;
+
+// A read to be made into 'dst'. The first request of a file opens it.
+typedef struct
+{
+	PBYTE    dst;
+	uint64_t offset;
+	DWORD    len;
+} Request;
+
+typedef struct
+{
+	size_t   index;       // Into the job's paths
+	int      fd;
+	uint64_t size;
+	OpState  state;
+	GetExeIconError error;
+
+	Window   windows[MAX_WINDOWS];
+	DWORD    numWindows;
+	DWORD    windowBytes;
+
+	// Ranges found missing by the last parse, rounded out to what to read
+	Window   misses[MAX_MISSES];
+	DWORD    numMisses;
+
+	Request *requests;
+	DWORD    requestCapacity;
+	DWORD    numRequests;
+	DWORD    numSubmitted;
+	DWORD    numPending;    // Submitted but not completed
+	BOOL     waiting;       // In the queue of files waiting for room in the ring
+	BOOL     active;        // Started and not yet finished
+
+	PBYTE    icoBuf;
+	DWORD    bufLen;
+} FileOp;
+
+// The mappings of an io_uring instance. Only the thread that made it uses it.
+typedef struct
+{
+	int fd;
+	unsigned *sqHead;
+	unsigned *sqTail;
+	unsigned *sqMask;
+	unsigned *sqArray;
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned *cqMask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned numEntries;
+
+	// SQEs queued but not yet given to the kernel, and SQEs given to the
+	// kernel whose CQE hasn't been seen yet. The latter never exceeds
+	// numEntries, so the SQ can't overflow, and neither can the CQ, which is
+	// bigger.
+	unsigned numQueued;
+	unsigned numInFlight;
+
+	void  *sqRing;
+	void  *cqRing;
+	size_t sqRingLen;
+	size_t cqRingLen;
+	size_t sqesLen;
+} Ring;
+
+static BOOL supports_ops(int fd)
+{
+	size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, len);
+	if (!probe) {
+		return FALSE;
+	}
+	BOOL ret = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0
+		&& probe->ops_len > IORING_OP_READ
+		&& probe->ops_len > IORING_OP_OPENAT
+		&& (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)
+		&& (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return ret;
+}
+
+static void close_ring(Ring *ring)
+{
+	if (ring->sqes) {
+		munmap(ring->sqes, ring->sqesLen);
+	}
+	if (ring->cqRing && ring->cqRing != ring->sqRing) {
+		munmap(ring->cqRing, ring->cqRingLen);
+	}
+	if (ring->sqRing) {
+		munmap(ring->sqRing, ring->sqRingLen);
+	}
+	close(ring->fd);
+}
+
+static BOOL open_ring(Ring *ring, unsigned numEntries)
+{
+	memset(ring, 0, sizeof(Ring));
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = numEntries * 2;
+	ring->fd = (int)syscall(__NR_io_uring_setup, numEntries, &params);
+	if (ring->fd < 0) {
+		return FALSE;
+	}
+	if (!supports_ops(ring->fd)) {
+		close(ring->fd);
+		return FALSE;
+	}
+
+	ring->sqRingLen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cqRingLen = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqesLen = params.sq_entries * sizeof(struct io_uring_sqe);
+	BOOL singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (singleMap && ring->cqRingLen > ring->sqRingLen) {
+		ring->sqRingLen = ring->cqRingLen;
+	}
+
+	ring->sqRing = mmap(NULL, ring->sqRingLen, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sqRing == MAP_FAILED) {
+		ring->sqRing = NULL;
+		close_ring(ring);
+		return FALSE;
+	}
+	ring->cqRing = singleMap
+		? ring->sqRing
+		: mmap(NULL, ring->cqRingLen, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_CQ_RING);
+	if (ring->cqRing == MAP_FAILED) {
+		ring->cqRing = NULL;
+		close_ring(ring);
+		return FALSE;
+	}
+	void *sqes = mmap(NULL, ring->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		close_ring(ring);
+		return FALSE;
+	}
+
+	BYTE *sq = (BYTE *)ring->sqRing, *cq = (BYTE *)ring->cqRing;
+	ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+	ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+	ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+	ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+	ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+	ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	ring->sqes = (struct io_uring_sqe *)sqes;
+	ring->numEntries = params.sq_entries;
+	return TRUE;
+}
+
+// Gives the queued SQEs to the kernel and waits for at least minComplete
+// CQEs. Returns FALSE if the ring can't be used anymore.
+static BOOL enter_ring(Ring *ring, unsigned minComplete)
+{
+	for (;;) {
+		long n = syscall(__NR_io_uring_enter, ring->fd, ring->numQueued, minComplete,
+			minComplete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (n >= 0) {
+			ring->numQueued -= (unsigned)n;
+			if (ring->numQueued == 0) {
+				return TRUE;
+			}
+		} else if (errno == EAGAIN || errno == EBUSY) {
+			// Out of resources for now; handling completions frees some,
+			// and the rest of the SQEs go in on the next call
+			return TRUE;
+		} else if (errno != EINTR) {
+			return FALSE;
+		}
+	}
+}
+
+static void queue_sqe(Ring *ring, BYTE opcode, int fd, const void *addr, DWORD len, uint64_t offset, uint64_t userData)
+{
+	unsigned tail = *ring->sqTail;
+	unsigned index = tail & *ring->sqMask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)addr;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = userData;
+	if (opcode == IORING_OP_OPENAT) {
+		sqe->open_flags = O_RDONLY | O_CLOEXEC;
+	}
+	ring->sqArray[index] = index;
+	__atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+	ring->numQueued ++;
+	ring->numInFlight ++;
+}
+
+// The state of one io_uring worker thread
+typedef struct
+{
+	BatchJob *job;
+	Ring      ring;
+	FileOp   *ops;
+	DWORD     numOps;
+	DWORD    *freeOps;    // Stack of unused ops
+	DWORD     numFree;
+	DWORD    *waiting;    // Queue of ops with requests that didn't fit in the ring
+	DWORD     waitHead;
+	DWORD     numWaiting;
+} UringWorker;
+
+// Submits as many of an op's requests as there's room for in the ring.
+// Returns FALSE if some didn't fit.
+static BOOL submit_requests(UringWorker *worker, DWORD opIndex)
+{
+	FileOp *op = &worker->ops[opIndex];
+	Ring *ring = &worker->ring;
+	while (op->numSubmitted < op->numRequests && ring->numInFlight < ring->numEntries) {
+		Request *request = &op->requests[op->numSubmitted];
+		uint64_t userData = ((uint64_t)opIndex << 32) | op->numSubmitted;
+		if (op->state == OP_OPENING) {
+			queue_sqe(ring, IORING_OP_OPENAT, AT_FDCWD, worker->job->paths[op->index], 0, 0, userData);
+		} else {
+			queue_sqe(ring, IORING_OP_READ, op->fd, request->dst, request->len, request->offset, userData);
+		}
+		op->numSubmitted ++;
+		op->numPending ++;
+	}
+	return op->numSubmitted == op->numRequests;
+}
+
+static void submit_or_wait(UringWorker *worker, DWORD opIndex)
+{
+	FileOp *op = &worker->ops[opIndex];
+	if (!submit_requests(worker, opIndex) && !op->waiting) {
+		op->waiting = TRUE;
+		worker->waiting[(worker->waitHead + worker->numWaiting) % worker->numOps] = opIndex;
+		worker->numWaiting ++;
+	}
+}
+
+static void submit_waiting(UringWorker *worker)
+{
+	while (worker->numWaiting > 0) {
+		DWORD opIndex = worker->waiting[worker->waitHead];
+		if (!submit_requests(worker, opIndex)) {
+			return;
+		}
+		worker->ops[opIndex].waiting = FALSE;
+		worker->waitHead = (worker->waitHead + 1) % worker->numOps;
+		worker->numWaiting --;
+	}
+}
+
+static BOOL add_request(FileOp *op, PBYTE dst, uint64_t offset, DWORD len)
+{
+	if (op->numRequests == op->requestCapacity) {
+		DWORD capacity = op->requestCapacity ? op->requestCapacity * 2 : 4;
+		Request *requests = (Request *)realloc(op->requests, sizeof(Request) * capacity);
+		if (!requests) {
+			return FALSE;
+		}
+		op->requests = requests;
+		op->requestCapacity = capacity;
+	}
+	Request *request = &op->requests[op->numRequests++];
+	request->dst = dst;
+	request->offset = offset;
+	request->len = len;
+	return TRUE;
+}
+
+static void free_windows(FileOp *op)
+{
+	for (DWORD i = 0; i < op->numWindows; i++) {
+		free(op->windows[i].data);
+	}
+	op->numWindows = 0;
+	op->windowBytes = 0;
+}
+
+static void finish_op(UringWorker *worker, DWORD opIndex)
+{
+	FileOp *op = &worker->ops[opIndex];
+	if (op->fd >= 0) {
+		close(op->fd);
+	}
+	free_windows(op);
+	free(op->requests);
+
+	GetExeIconBatchResult *result = &worker->job->results[op->index];
+	if (op->error == GET_EXE_ICON_OK) {
+		result->icoBuf = op->icoBuf;
+		result->bufLen = op->bufLen;
+	} else {
+		free(op->icoBuf);
+		result->icoBuf = NULL;
+		result->bufLen = 0;
+	}
+	result->error = op->error;
+	op->active = FALSE;
+	worker->freeOps[worker->numFree++] = opIndex;
+}
+
+// Gives up on reading the file piece by piece and extracts its icon the usual
+// way
+static void finish_op_blocking(UringWorker *worker, DWORD opIndex)
+{
+	FileOp *op = &worker->ops[opIndex];
+	free(op->icoBuf);
+	op->icoBuf = get_exe_icon_from_file_utf8(worker->job->paths[op->index],
+		worker->job->allowEmbeddedPNGs,
+		&op->bufLen);
+	op->error = get_exe_icon_last_error();
+	finish_op(worker, opIndex);
+}
+
+static const Window *find_window(const FileOp *op, uint64_t offset, DWORD len)
+{
+	for (DWORD i = 0; i < op->numWindows; i++) {
+		const Window *window = &op->windows[i];
+		if (offset >= window->offset && offset - window->offset <= window->len
+			&& len <= window->len - (offset - window->offset))
+		{
+			return window;
+		}
+	}
+	return NULL;
+}
+
+// Notes a range the parser asked for that hasn't been read, to be read
+// (rounded out) before the next parse
+static void add_miss(FileOp *op, uint64_t offset, DWORD len)
+{
+	for (DWORD i = 0; i < op->numMisses; i++) {
+		const Window *miss = &op->misses[i];
+		if (offset >= miss->offset && offset + len <= miss->offset + miss->len) {
+			return;
+		}
+	}
+	if (op->numMisses == MAX_MISSES) {
+		return;
+	}
+
+	uint64_t start = offset - offset % HEADER_READ_SIZE;
+	uint64_t end = offset + len;
+	if (end < start + PREFETCH_SIZE) {
+		end = start + PREFETCH_SIZE;
+	}
+	if (end > op->size) {
+		end = op->size;
+	}
+	Window *miss = &op->misses[op->numMisses++];
+	miss->offset = start;
+	miss->len = (DWORD)(end - start);
+	miss->data = NULL;
+}
+
+// GetExeIconReader callback for a parse, reading from the windows
+static BOOL read_from_windows(void *ctx, uint64_t offset, DWORD len, void *dst)
+{
+	FileOp *op = (FileOp *)ctx;
+	const Window *window = find_window(op, offset, len);
+	if (window) {
+		memcpy(dst, window->data + (offset - window->offset), len);
+		return TRUE;
+	}
+
+	// Let the parse carry on to find whatever else is missing. Its result is
+	// thrown away.
+	add_miss(op, offset, len);
+	memset(dst, 0, len);
+	return TRUE;
+}
+
+// Reads the windows for the misses of the last parse
+static void read_misses(UringWorker *worker, DWORD opIndex)
+{
+	FileOp *op = &worker->ops[opIndex];
+	op->numRequests = 0;
+	op->numSubmitted = 0;
+	for (DWORD i = 0; i < op->numMisses; i++) {
+		Window *window = &op->windows[op->numWindows];
+		*window = op->misses[i];
+		window->data = (PBYTE)malloc(window->len);
+		if (!window->data || !add_request(op, window->data, window->offset, window->len)) {
+			free(window->data);
+			op->error = GET_EXE_ICON_ERROR_OUT_OF_MEMORY;
+			finish_op(worker, opIndex);
+			return;
+		}
+		op->numWindows ++;
+		op->windowBytes += window->len;
+	}
+	submit_or_wait(worker, opIndex);
+}
+
+// Starts reading the images of the ICO laid out by 'layout'
+static void read_images(UringWorker *worker, DWORD opIndex, const GetExeIconLayout *layout)
+{
+	FileOp *op = &worker->ops[opIndex];
+	op->icoBuf = (PBYTE)malloc(layout->totalLen);
+	if (!op->icoBuf) {
+		op->error = GET_EXE_ICON_ERROR_OUT_OF_MEMORY;
+		finish_op(worker, opIndex);
+		return;
+	}
+	op->bufLen = layout->totalLen;
+	memcpy(op->icoBuf, layout->header, layout->headerLen);
+
+	op->state = OP_READING;
+	op->numRequests = 0;
+	op->numSubmitted = 0;
+	PBYTE dst = op->icoBuf + layout->headerLen;
+	for (DWORD i = 0; i < layout->numSegments; i++) {
+		const GetExeIconSegment *segment = &layout->segments[i];
+		const Window *window = find_window(op, segment->offset, segment->len);
+		if (window) {
+			memcpy(dst, window->data + (segment->offset - window->offset), segment->len);
+		} else if (!add_request(op, dst, segment->offset, segment->len)) {
+			op->error = GET_EXE_ICON_ERROR_OUT_OF_MEMORY;
+			finish_op(worker, opIndex);
+			return;
+		}
+		dst += segment->len;
+	}
+	free_windows(op);
+
+	if (op->numRequests == 0) {
+		finish_op(worker, opIndex);
+	} else {
+		submit_or_wait(worker, opIndex);
+	}
+}
+
+// Runs the parser over what has been read so far, and either reads what it
+// missed or goes on to the images
+static void parse_file(UringWorker *worker, DWORD opIndex)
+{
+	FileOp *op = &worker->ops[opIndex];
+
+	GetExeIconReader reader;
+	memset(&reader, 0, sizeof(reader));
+	reader.readAt = read_from_windows;
+	reader.ctx = op;
+	reader.size = op->size;
+
+	GetExeIconOptions options;
+	memset(&options, 0, sizeof(options));
+	options.allowEmbeddedPNGs = worker->job->allowEmbeddedPNGs;
+
+	GetExeIconLayout layout;
+	op->numMisses = 0;
+	BOOL ok = get_exe_icon_layout_from_reader(&reader, &options, &layout);
+	GetExeIconError error = get_exe_icon_last_error();
+
+	if (op->numMisses > 0) {
+		if (ok) {
+			get_exe_icon_layout_free(&layout);
+		}
+		if (op->numWindows + op->numMisses > MAX_WINDOWS || op->windowBytes > MAX_WINDOW_BYTES) {
+			finish_op_blocking(worker, opIndex);
+		} else {
+			read_misses(worker, opIndex);
+		}
+	} else if (ok) {
+		read_images(worker, opIndex, &layout);
+		get_exe_icon_layout_free(&layout);
+	} else {
+		op->error = error;
+		finish_op(worker, opIndex);
+	}
+}
+
+static void start_op(UringWorker *worker, size_t index)
+{
+	DWORD opIndex = worker->freeOps[--worker->numFree];
+	FileOp *op = &worker->ops[opIndex];
+	memset(op, 0, sizeof(FileOp));
+	op->index = index;
+	op->fd = -1;
+	op->state = OP_OPENING;
+	op->active = TRUE;
+	if (!add_request(op, NULL, 0, 0)) {
+		op->error = GET_EXE_ICON_ERROR_OUT_OF_MEMORY;
+		finish_op(worker, opIndex);
+		return;
+	}
+	submit_or_wait(worker, opIndex);
+}
+
+// Handles the open of a file completing with result 'res'
+static void file_opened(UringWorker *worker, DWORD opIndex, int res)
+{
+	FileOp *op = &worker->ops[opIndex];
+	struct stat st;
+	op->fd = res;
+	if (res < 0 || fstat(op->fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+		op->error = GET_EXE_ICON_ERROR_OPEN_FAILED;
+		finish_op(worker, opIndex);
+		return;
+	}
+	op->size = (uint64_t)st.st_size;
+
+	// There's no use parsing before the headers are in
+	op->state = OP_PARSING;
+	op->misses[0].offset = 0;
+	op->misses[0].len = op->size < HEADER_READ_SIZE ? (DWORD)op->size : HEADER_READ_SIZE;
+	op->numMisses = 1;
+	read_misses(worker, opIndex);
+}
+
+// Handles a read completing with result 'res'
+static void read_done(UringWorker *worker, DWORD opIndex, DWORD requestIndex, int res)
+{
+	FileOp *op = &worker->ops[opIndex];
+	Request *request = &op->requests[requestIndex];
+
+	// A short read means the file shrank, or a signal arrived; finish it
+	// with a blocking read, which tells which
+	if (res >= 0 && (DWORD)res < request->len) {
+		DWORD done = (DWORD)res;
+		while (done < request->len) {
+			ssize_t n = pread(op->fd, request->dst + done, request->len - done, (off_t)(request->offset + done));
+			if (n <= 0) {
+				break;
+			}
+			done += (DWORD)n;
+		}
+		res = done == request->len ? (int)done : -EIO;
+	}
+	if (res < 0) {
+		op->error = GET_EXE_ICON_ERROR_READ_FAILED;
+	}
+
+	if (op->numPending > 0 || op->numSubmitted < op->numRequests) {
+		return;
+	}
+	if (op->error != GET_EXE_ICON_OK || op->state == OP_READING) {
+		finish_op(worker, opIndex);
+	} else {
+		parse_file(worker, opIndex);
+	}
+}
+
+static void handle_completions(UringWorker *worker)
+{
+	Ring *ring = &worker->ring;
+	unsigned head = *ring->cqHead;
+	unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+		uint64_t userData = cqe->user_data;
+		int res = cqe->res;
+		head ++;
+		__atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+		ring->numInFlight --;
+
+		DWORD opIndex = (DWORD)(userData >> 32);
+		FileOp *op = &worker->ops[opIndex];
+		op->numPending --;
+		if (op->state == OP_OPENING) {
+			file_opened(worker, opIndex, res);
+		} else {
+			read_done(worker, opIndex, (DWORD)userData, res);
+		}
+	}
+}
+
+// Gives up on the ring after io_uring_enter() failed: extracts the icons of
+// the files in progress the usual way and closes the ring.
+static void abandon_ring(UringWorker *worker)
+{
+	close_ring(&worker->ring);
+	for (DWORD i = 0; i < worker->numOps; i++) {
+		FileOp *op = &worker->ops[i];
+		if (!op->active) {
+			continue;
+		}
+		if (op->numPending > 0) {
+			// The kernel may not be done reading into the op's buffers, so
+			// they're left allocated
+			op->icoBuf = NULL;
+			op->numWindows = 0;
+		}
+		finish_op_blocking(worker, i);
+	}
+}
+
+// Runs one io_uring worker thread. Returns FALSE if io_uring can't be used,
+// or stopped working partway, in which case the files this thread started
+// are done and the rest are left for run_batch_worker().
+static BOOL run_uring_worker(BatchJob *job)
+{
+	UringWorker worker;
+	memset(&worker, 0, sizeof(worker));
+	worker.job = job;
+	worker.numOps = job->queueDepth;
+	if (!open_ring(&worker.ring, job->queueDepth)) {
+		return FALSE;
+	}
+	worker.ops = (FileOp *)calloc(worker.numOps, sizeof(FileOp));
+	worker.freeOps = (DWORD *)malloc(sizeof(DWORD) * worker.numOps);
+	worker.waiting = (DWORD *)malloc(sizeof(DWORD) * worker.numOps);
+	if (!worker.ops || !worker.freeOps || !worker.waiting) {
+		free(worker.ops);
+		free(worker.freeOps);
+		free(worker.waiting);
+		close_ring(&worker.ring);
+		return FALSE;
+	}
+	for (DWORD i = 0; i < worker.numOps; i++) {
+		worker.freeOps[i] = worker.numOps - 1 - i;
+	}
+	worker.numFree = worker.numOps;
+
+	BOOL claimedAll = FALSE;
+	BOOL ringFailed = FALSE;
+	for (;;) {
+		// Files already started come first, so that no more are open at once
+		// than the queue depth allows
+		submit_waiting(&worker);
+		while (!claimedAll && worker.numFree > 0 && worker.numWaiting == 0) {
+			size_t i = claim_next_index(job);
+			if (i >= job->count) {
+				claimedAll = TRUE;
+				break;
+			}
+			start_op(&worker, i);
+		}
+		if (worker.numFree == worker.numOps) {
+			break;
+		}
+
+		if (!enter_ring(&worker.ring, 1)) {
+			ringFailed = TRUE;
+			break;
+		}
+		handle_completions(&worker);
+	}
+
+	if (ringFailed) {
+		abandon_ring(&worker);
+	} else {
+		close_ring(&worker.ring);
+	}
+	free(worker.ops);
+	free(worker.freeOps);
+	free(worker.waiting);
+	return !ringFailed;
+}
+#endif
+
+static void run_worker(BatchJob *job)
+{
+#ifdef USE_IO_URING
+	if (job->backend == GET_EXE_ICON_BATCH_IO_URING && run_uring_worker(job)) {
+		return;
+	}
+#endif
+	run_batch_worker(job);
+}
+
+BOOL get_exe_icon_batch_io_uring_available(void)
+{
+#ifdef USE_IO_URING
+	Ring ring;
+	if (open_ring(&ring, 4)) {
+		close_ring(&ring);
+		return TRUE;
+	}
+#endif
+	return FALSE;
+}
+
+#ifdef _WIN32
+typedef HANDLE Thread;
+
+static DWORD WINAPI batch_thread_main(LPVOID arg)
+{
+	run_worker((BatchJob *)arg);
+	return 0;
+}
+
+static BOOL start_thread(Thread *thread, BatchJob *job)
+{
+	*thread = CreateThread(NULL, 0, batch_thread_main, job, 0, NULL);
+	return *thread != NULL;
+}
+
+static void join_thread(Thread thread)
+{
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+
+static DWORD num_cpus(void)
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+}
+#else
+typedef pthread_t Thread;
+
+static void *batch_thread_main(void *arg)
+{
+	run_worker((BatchJob *)arg);
+	return NULL;
+}
+
+static BOOL start_thread(Thread *thread, BatchJob *job)
+{
+	return pthread_create(thread, NULL, batch_thread_main, job) == 0;
+}
+
+static void join_thread(Thread thread)
+{
+	pthread_join(thread, NULL);
+}
+
+static DWORD num_cpus(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (DWORD)n : 1;
+}
+#endif
+
+size_t get_exe_icons_batch(const PCSTR *paths, size_t count, const GetExeIconBatchOptions *options, GetExeIconBatchResult *results)
+{
+	if (!paths || !results) {
+		return 0;
+	}
+
+	BatchJob job;
+	job.paths = paths;
+	job.count = count;
+	job.allowEmbeddedPNGs = options ? options->allowEmbeddedPNGs : FALSE;
+	job.backend = options ? options->backend : GET_EXE_ICON_BATCH_THREADS;
+	job.queueDepth = options && options->queueDepth ? options->queueDepth : GET_EXE_ICON_BATCH_DEFAULT_QUEUE_DEPTH;
+	job.results = results;
+	job.next = 0;
+
+	DWORD numThreads = options && options->numThreads ? options->numThreads : num_cpus();
+	if (numThreads > count) {
+		numThreads = count > 0 ? (DWORD)count : 1;
+	}
+
+	// The calling thread is one of the workers. If some threads can't be
+	// started, the rest of them just do more of the work.
+	Thread *threads = NULL;
+	DWORD numStarted = 0;
+	if (numThreads > 1) {
+		threads = (Thread *)malloc(sizeof(Thread) * (numThreads - 1));
+	}
+	while (threads && numStarted < numThreads - 1 && start_thread(&threads[numStarted], &job)) {
+		numStarted ++;
+	}
+
+	run_worker(&job);
+
+	for (DWORD i = 0; i < numStarted; i++) {
+		join_thread(threads[i]);
+	}
+	free(threads);
+
+	size_t numExtracted = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (results[i].icoBuf) {
+			numExtracted ++;
+		}
+	}
+	return numExtracted;
+}
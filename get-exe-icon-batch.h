@@ -0,0 +1,93 @@
+// Copyright (c) 2021 Aury Snow
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef GET_EXE_ICON_BATCH_H
+#define GET_EXE_ICON_BATCH_H
+
+#include "get-exe-icon.h"
+
+// How get_exe_icons_batch() does its I/O.
+typedef enum
+{
+	// Each thread maps one file at a time and reads it through page faults,
+	// so there are only ever as many reads in flight as threads.
+	GET_EXE_ICON_BATCH_THREADS = 0,
+
+	// Linux only: each thread keeps up to queueDepth files open at once and
+	// reads them through io_uring, which keeps the disk busy with far fewer
+	// threads when the files aren't in the page cache. Each file's reads are
+	// issued as soon as the previous ones say where to look next: the headers,
+	// then the resource directories, then all of the icon's images at once.
+	// Falls back to GET_EXE_ICON_BATCH_THREADS where io_uring is unavailable
+	// (see get_exe_icon_batch_io_uring_available()).
+	GET_EXE_ICON_BATCH_IO_URING,
+} GetExeIconBatchBackend;
+
+#define GET_EXE_ICON_BATCH_DEFAULT_QUEUE_DEPTH  128
+
+// Options for get_exe_icons_batch(). Zero-initialize for the defaults.
+typedef struct
+{
+	// Number of threads to extract icons on, including the calling thread.
+	// 0 uses one thread per CPU.
+	DWORD numThreads;
+
+	// Same as in get_exe_icon_from_file_utf16().
+	BOOL allowEmbeddedPNGs;
+
+	GetExeIconBatchBackend backend;
+
+	// For GET_EXE_ICON_BATCH_IO_URING: the most files each thread works on at
+	// once. 0 means GET_EXE_ICON_BATCH_DEFAULT_QUEUE_DEPTH.
+	DWORD queueDepth;
+} GetExeIconBatchOptions;
+
+// The outcome of extracting one file's icon in get_exe_icons_batch().
+typedef struct
+{
+	// The ICO file, or NULL if error is not GET_EXE_ICON_OK. Free with
+	// free(3).
+	PBYTE icoBuf;
+	DWORD bufLen;
+	GetExeIconError error;
+} GetExeIconBatchResult;
+
+// Gets the primary icons of many files at once, spread across a pool of
+// threads. Files are handed to threads one at a time as each thread becomes
+// free, so a few huge or slow files only ever hold up the thread working on
+// them. The calling thread does its share and returns once every file is done.
+//
+// paths: UTF-8 paths of the 'count' files to extract icons from, as given to
+//        get_exe_icon_from_file_utf8().
+//
+// options: May be NULL to use the defaults.
+//
+// results (OUT): An array of 'count' results. results[i] is the outcome for
+//                paths[i].
+//
+// Return Value: The number of files that an icon was extracted from.
+size_t get_exe_icons_batch(const PCSTR *paths, size_t count, const GetExeIconBatchOptions *options, GetExeIconBatchResult *results);
+
+// Whether GET_EXE_ICON_BATCH_IO_URING can be used, i.e. on Linux 5.6 or later
+// (and not disabled, e.g. by a seccomp filter or the
+// kernel.io_uring_disabled sysctl).
+BOOL get_exe_icon_batch_io_uring_available(void);
+
+#endif
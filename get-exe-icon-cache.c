@@ -0,0 +1,1011 @@
+// Copyright (c) 2021 Aury Snow
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE // For flock()
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include "get-exe-icon-cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Notes about the code:
+//
+// The index file is a header followed by a fixed number of slots forming an
+// open-addressing hash table with linear probing. It is mapped shared and
+// read-write, so lookups and updates are plain memory accesses and the OS
+// writes them back. The blob file is only ever appended to; entries that are
+// replaced or evicted leave dead space behind, which is reclaimed by copying
+// the live blobs to a new file once the dead space outweighs the live data.
+//
+// Each entry stores a hash of its blob, which is checked whenever the blob
+// is read. If the process dies between writing a blob and updating the
+// index (or in the middle of a compaction), the affected entries just fail
+// that check and are treated as misses.
+//
+// The files use the host's byte order and are not meant to be shared
+// between machines.
+
+#define CACHE_MAGIC          "GEICACHE"
+#define CACHE_VERSION        1
+#define CACHE_HEADER_SIZE    64
+
+#define DEFAULT_MAX_BYTES    (256ull << 20)
+#define DEFAULT_MAX_ENTRIES  262144
+#define HEADER_HASH_BYTES    4096
+
+// Entry flags. The low byte holds flags and the next byte the error code
+// of a cached failure.
+#define ENTRY_FLAG_PNGS      0x1
+#define ENTRY_ERROR_SHIFT    8
+
+typedef struct
+{
+	char      magic[8];
+	uint32_t  version;
+	uint32_t  capacity;      // Number of slots, a power of 2
+	uint32_t  numEntries;
+	uint32_t  reserved;
+	uint64_t  clock;         // Incremented on every access, for LRU
+	uint64_t  liveBytes;     // Bytes of the blob file referenced by entries
+	uint64_t  blobFileSize;  // Bytes written to the blob file
+	BYTE      padding[CACHE_HEADER_SIZE - 48];
+} CacheHeader;
+
+typedef struct
+{
+	uint64_t  key;           // Hash of the identity and flags; 0 if unused
+	uint64_t  device;
+	uint64_t  inode;
+	uint64_t  fileSize;
+	int64_t   mtime;         // In the platform's units (see get_file_identity())
+	uint64_t  headerHash;    // Hash of the file's first 4KB, if enabled
+	uint64_t  blobOffset;
+	uint64_t  blobHash;
+	uint64_t  lastAccess;    // Value of the clock when last used
+	uint32_t  blobLen;       // 0 for a cached failure
+	uint32_t  flags;
+} CacheEntry;
+
+// What identifies a file and tells whether it has changed
+typedef struct
+{
+	uint64_t  device;
+	uint64_t  inode;
+	uint64_t  fileSize;
+	int64_t   mtime;   // 100ns units on Windows, nanoseconds elsewhere
+} FileIdentity;
+
+#ifdef _WIN32
+typedef HANDLE FileHandle;
+#define INVALID_FILE INVALID_HANDLE_VALUE
+typedef CRITICAL_SECTION Mutex;
+typedef SRWLOCK RWLock;
+#else
+typedef int FileHandle;
+#define INVALID_FILE (-1)
+typedef pthread_mutex_t Mutex;
+typedef pthread_rwlock_t RWLock;
+#endif
+
+struct GetExeIconCache
+{
+	Mutex         lock;
+	RWLock        blobLock;      // Held shared while reading blobs, and
+	                             // exclusively while compacting them
+	char         *indexPath;
+	char         *blobPath;
+	char         *tmpBlobPath;
+	FileHandle    indexFile;
+	FileHandle    blobFile;
+	BYTE         *indexMap;
+	size_t        indexMapSize;
+#ifdef _WIN32
+	HANDLE        indexMapping;
+#endif
+	CacheHeader  *header;
+	CacheEntry   *entries;
+	uint64_t      maxBytes;
+	BOOL          hashHeaders;
+	GetExeIconCacheStats stats;
+};
+
+// FNV-1a. Only needs to be fast and spread keys well, not resist attacks.
+static uint64_t hash_bytes(const void *data, size_t len, uint64_t hash)
+{
+	const BYTE *p = (const BYTE *)data;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+#define HASH_SEED 0xcbf29ce484222325ull
+
+// Platform wrappers for the handful of file, mapping and lock operations
+// needed below.
+
+#ifdef _WIN32
+static PWSTR utf8_to_wide(PCSTR str)
+{
+	int len = MultiByteToWideChar(CP_UTF8, 0, str, -1, NULL, 0);
+	if (len <= 0) {
+		return NULL;
+	}
+	PWSTR wStr = (PWSTR)malloc(sizeof(WCHAR) * len);
+	if (wStr && MultiByteToWideChar(CP_UTF8, 0, str, -1, wStr, len) <= 0) {
+		free(wStr);
+		return NULL;
+	}
+	return wStr;
+}
+
+static FileHandle open_file(PCSTR path, BOOL create, BOOL truncate)
+{
+	PWSTR wPath = utf8_to_wide(path);
+	if (!wPath) {
+		return INVALID_FILE;
+	}
+	DWORD disposition = truncate ? CREATE_ALWAYS : (create ? OPEN_ALWAYS : OPEN_EXISTING);
+	HANDLE file = CreateFileW(wPath,
+		GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_DELETE,
+		NULL,
+		disposition,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL);
+	free(wPath);
+	return file;
+}
+
+static void close_file(FileHandle file)
+{
+	CloseHandle(file);
+}
+
+static BOOL read_at(FileHandle file, uint64_t offset, void *buf, DWORD len)
+{
+	OVERLAPPED overlapped;
+	memset(&overlapped, 0, sizeof(overlapped));
+	overlapped.Offset = (DWORD)offset;
+	overlapped.OffsetHigh = (DWORD)(offset >> 32);
+	DWORD numRead = 0;
+	return ReadFile(file, buf, len, &numRead, &overlapped) && numRead == len;
+}
+
+static BOOL write_at(FileHandle file, uint64_t offset, const void *buf, DWORD len)
+{
+	OVERLAPPED overlapped;
+	memset(&overlapped, 0, sizeof(overlapped));
+	overlapped.Offset = (DWORD)offset;
+	overlapped.OffsetHigh = (DWORD)(offset >> 32);
+	DWORD numWritten = 0;
+	return WriteFile(file, buf, len, &numWritten, &overlapped) && numWritten == len;
+}
+
+static BOOL get_file_size(FileHandle file, uint64_t *size)
+{
+	LARGE_INTEGER li;
+	if (!GetFileSizeEx(file, &li)) {
+		return FALSE;
+	}
+	*size = (uint64_t)li.QuadPart;
+	return TRUE;
+}
+
+static BOOL set_file_size(FileHandle file, uint64_t size)
+{
+	LARGE_INTEGER li;
+	li.QuadPart = (LONGLONG)size;
+	return SetFilePointerEx(file, li, NULL, FILE_BEGIN) && SetEndOfFile(file);
+}
+
+static BOOL replace_file(PCSTR from, PCSTR to)
+{
+	PWSTR wFrom = utf8_to_wide(from);
+	PWSTR wTo = utf8_to_wide(to);
+	BOOL ret = wFrom && wTo && MoveFileExW(wFrom, wTo, MOVEFILE_REPLACE_EXISTING);
+	free(wFrom);
+	free(wTo);
+	return ret;
+}
+
+// Fails if the file is locked through another handle, in this process or
+// another
+static BOOL lock_file(FileHandle file)
+{
+	OVERLAPPED overlapped;
+	memset(&overlapped, 0, sizeof(overlapped));
+	return LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &overlapped);
+}
+
+static BOOL map_index(GetExeIconCache *cache, size_t size)
+{
+	cache->indexMapping = CreateFileMappingW(cache->indexFile, NULL, PAGE_READWRITE, 0, 0, NULL);
+	if (!cache->indexMapping) {
+		return FALSE;
+	}
+	cache->indexMap = (BYTE *)MapViewOfFile(cache->indexMapping, FILE_MAP_WRITE, 0, 0, size);
+	if (!cache->indexMap) {
+		CloseHandle(cache->indexMapping);
+		return FALSE;
+	}
+	cache->indexMapSize = size;
+	return TRUE;
+}
+
+static void unmap_index(GetExeIconCache *cache)
+{
+	FlushViewOfFile(cache->indexMap, 0);
+	UnmapViewOfFile(cache->indexMap);
+	CloseHandle(cache->indexMapping);
+}
+
+static BOOL get_file_identity(PCSTR path, FileIdentity *id)
+{
+	PWSTR wPath = utf8_to_wide(path);
+	if (!wPath) {
+		return FALSE;
+	}
+	HANDLE file = CreateFileW(wPath,
+		FILE_READ_ATTRIBUTES,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL);
+	free(wPath);
+	if (file == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+
+	BY_HANDLE_FILE_INFORMATION info;
+	BOOL ret = GetFileInformationByHandle(file, &info);
+	CloseHandle(file);
+	if (!ret) {
+		return FALSE;
+	}
+
+	id->device = info.dwVolumeSerialNumber;
+	id->inode = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+	id->fileSize = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+	id->mtime = (int64_t)(((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32)
+		| info.ftLastWriteTime.dwLowDateTime);
+	return TRUE;
+}
+
+static FileHandle open_for_reading(PCSTR path)
+{
+	PWSTR wPath = utf8_to_wide(path);
+	if (!wPath) {
+		return INVALID_FILE;
+	}
+	HANDLE file = CreateFileW(wPath,
+		GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL);
+	free(wPath);
+	return file;
+}
+
+static void init_mutex(Mutex *mutex) { InitializeCriticalSection(mutex); }
+static void destroy_mutex(Mutex *mutex) { DeleteCriticalSection(mutex); }
+static void lock_mutex(Mutex *mutex) { EnterCriticalSection(mutex); }
+static void unlock_mutex(Mutex *mutex) { LeaveCriticalSection(mutex); }
+static void init_rwlock(RWLock *rwlock) { InitializeSRWLock(rwlock); }
+static void destroy_rwlock(RWLock *rwlock) { (void)rwlock; }
+static void lock_shared(RWLock *rwlock) { AcquireSRWLockShared(rwlock); }
+static void unlock_shared(RWLock *rwlock) { ReleaseSRWLockShared(rwlock); }
+static void lock_exclusive(RWLock *rwlock) { AcquireSRWLockExclusive(rwlock); }
+static void unlock_exclusive(RWLock *rwlock) { ReleaseSRWLockExclusive(rwlock); }
+#else
+static FileHandle open_file(PCSTR path, BOOL create, BOOL truncate)
+{
+	int flags = O_RDWR | O_CLOEXEC;
+	if (create) {
+		flags |= O_CREAT;
+	}
+	if (truncate) {
+		flags |= O_CREAT | O_TRUNC;
+	}
+	return open(path, flags, 0644);
+}
+
+static void close_file(FileHandle file)
+{
+	close(file);
+}
+
+static BOOL read_at(FileHandle file, uint64_t offset, void *buf, DWORD len)
+{
+	BYTE *p = (BYTE *)buf;
+	while (len > 0) {
+		ssize_t n = pread(file, p, len, (off_t)offset);
+		if (n <= 0) {
+			return FALSE;
+		}
+		p += n;
+		offset += (uint64_t)n;
+		len -= (DWORD)n;
+	}
+	return TRUE;
+}
+
+static BOOL write_at(FileHandle file, uint64_t offset, const void *buf, DWORD len)
+{
+	const BYTE *p = (const BYTE *)buf;
+	while (len > 0) {
+		ssize_t n = pwrite(file, p, len, (off_t)offset);
+		if (n <= 0) {
+			return FALSE;
+		}
+		p += n;
+		offset += (uint64_t)n;
+		len -= (DWORD)n;
+	}
+	return TRUE;
+}
+
+static BOOL get_file_size(FileHandle file, uint64_t *size)
+{
+	struct stat st;
+	if (fstat(file, &st) != 0) {
+		return FALSE;
+	}
+	*size = (uint64_t)st.st_size;
+	return TRUE;
+}
+
+static BOOL set_file_size(FileHandle file, uint64_t size)
+{
+	return ftruncate(file, (off_t)size) == 0;
+}
+
+static BOOL replace_file(PCSTR from, PCSTR to)
+{
+	return rename(from, to) == 0;
+}
+
+// Fails if the file is locked through another open of it, by this process
+// or another. flock() locks belong to the open file rather than the process
+// as fcntl() locks do, so a second open in the same process fails too, and
+// closing some other descriptor for the file doesn't drop the lock.
+static BOOL lock_file(FileHandle file)
+{
+	return flock(file, LOCK_EX | LOCK_NB) == 0;
+}
+
+static BOOL map_index(GetExeIconCache *cache, size_t size)
+{
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, cache->indexFile, 0);
+	if (map == MAP_FAILED) {
+		return FALSE;
+	}
+	cache->indexMap = (BYTE *)map;
+	cache->indexMapSize = size;
+	return TRUE;
+}
+
+static void unmap_index(GetExeIconCache *cache)
+{
+	msync(cache->indexMap, cache->indexMapSize, MS_SYNC);
+	munmap(cache->indexMap, cache->indexMapSize);
+}
+
+static BOOL get_file_identity(PCSTR path, FileIdentity *id)
+{
+	struct stat st;
+	if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+		return FALSE;
+	}
+
+	id->device = (uint64_t)st.st_dev;
+	id->inode = (uint64_t)st.st_ino;
+	id->fileSize = (uint64_t)st.st_size;
+#ifdef __APPLE__
+	id->mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+	id->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+	return TRUE;
+}
+
+static FileHandle open_for_reading(PCSTR path)
+{
+	return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+static void init_mutex(Mutex *mutex) { pthread_mutex_init(mutex, NULL); }
+static void destroy_mutex(Mutex *mutex) { pthread_mutex_destroy(mutex); }
+static void lock_mutex(Mutex *mutex) { pthread_mutex_lock(mutex); }
+static void unlock_mutex(Mutex *mutex) { pthread_mutex_unlock(mutex); }
+static void init_rwlock(RWLock *rwlock) { pthread_rwlock_init(rwlock, NULL); }
+static void destroy_rwlock(RWLock *rwlock) { pthread_rwlock_destroy(rwlock); }
+static void lock_shared(RWLock *rwlock) { pthread_rwlock_rdlock(rwlock); }
+static void unlock_shared(RWLock *rwlock) { pthread_rwlock_unlock(rwlock); }
+static void lock_exclusive(RWLock *rwlock) { pthread_rwlock_wrlock(rwlock); }
+static void unlock_exclusive(RWLock *rwlock) { pthread_rwlock_unlock(rwlock); }
+#endif
+
+// Hashes the first HEADER_HASH_BYTES of a file (or all of it, if smaller)
+static BOOL hash_file_header(PCSTR path, uint64_t fileSize, uint64_t *hash)
+{
+	FileHandle file = open_for_reading(path);
+	if (file == INVALID_FILE) {
+		return FALSE;
+	}
+
+	BYTE buf[HEADER_HASH_BYTES];
+	DWORD len = fileSize < sizeof(buf) ? (DWORD)fileSize : (DWORD)sizeof(buf);
+	BOOL ret = read_at(file, 0, buf, len);
+	close_file(file);
+
+	*hash = hash_bytes(buf, len, HASH_SEED);
+	return ret;
+}
+
+static char *join_path(PCSTR dir, PCSTR name)
+{
+	size_t dirLen = strlen(dir);
+	size_t nameLen = strlen(name);
+	char *path = (char *)malloc(dirLen + 1 + nameLen + 1);
+	if (path) {
+		memcpy(path, dir, dirLen);
+		path[dirLen] = '/';
+		memcpy(path + dirLen + 1, name, nameLen + 1);
+	}
+	return path;
+}
+
+static uint64_t entry_key(const FileIdentity *id, uint32_t flags)
+{
+	uint64_t key = hash_bytes(&id->device, sizeof(id->device), HASH_SEED);
+	key = hash_bytes(&id->inode, sizeof(id->inode), key);
+	key = hash_bytes(&flags, sizeof(flags), key);
+	return key ? key : 1;
+}
+
+// Finds the slot holding the entry for a file, or the empty slot where it
+// would go.
+static CacheEntry *find_slot(GetExeIconCache *cache, uint64_t key, const FileIdentity *id, uint32_t flags)
+{
+	uint32_t mask = cache->header->capacity - 1;
+	for (uint32_t i = (uint32_t)key & mask; ; i = (i + 1) & mask) {
+		CacheEntry *entry = &cache->entries[i];
+		if (entry->key == 0) {
+			return entry;
+		}
+		if (entry->key == key
+			&& entry->device == id->device
+			&& entry->inode == id->inode
+			&& (entry->flags & 0xff) == flags)
+		{
+			return entry;
+		}
+	}
+}
+
+// Rewrites the blob file with only the blobs that entries still reference.
+// On failure the old blob file is kept as is.
+static void compact_blobs(GetExeIconCache *cache)
+{
+	const uint32_t capacity = cache->header->capacity;
+	uint64_t *newOffsets = (uint64_t *)malloc(sizeof(uint64_t) * capacity);
+	BYTE *buf = NULL;
+	DWORD bufSize = 0;
+	FileHandle tmpFile = open_file(cache->tmpBlobPath, TRUE, TRUE);
+	if (!newOffsets || tmpFile == INVALID_FILE) {
+		free(newOffsets);
+		if (tmpFile != INVALID_FILE) {
+			close_file(tmpFile);
+		}
+		return;
+	}
+
+	uint64_t offset = 0;
+	BOOL ok = TRUE;
+	for (uint32_t i = 0; i < capacity && ok; i++) {
+		CacheEntry *entry = &cache->entries[i];
+		if (entry->key == 0 || entry->blobLen == 0) {
+			continue;
+		}
+
+		if (entry->blobLen > bufSize) {
+			BYTE *newBuf = (BYTE *)realloc(buf, entry->blobLen);
+			if (!newBuf) {
+				ok = FALSE;
+				break;
+			}
+			buf = newBuf;
+			bufSize = entry->blobLen;
+		}
+
+		ok = read_at(cache->blobFile, entry->blobOffset, buf, entry->blobLen)
+			&& write_at(tmpFile, offset, buf, entry->blobLen);
+		newOffsets[i] = offset;
+		offset += entry->blobLen;
+	}
+	free(buf);
+
+	close_file(tmpFile);
+	if (ok) {
+		close_file(cache->blobFile);
+		ok = replace_file(cache->tmpBlobPath, cache->blobPath);
+		cache->blobFile = open_file(cache->blobPath, TRUE, FALSE);
+		if (cache->blobFile == INVALID_FILE) {
+			// Nothing can be read anymore, so forget everything
+			memset(cache->entries, 0, sizeof(CacheEntry) * capacity);
+			cache->header->numEntries = 0;
+			cache->header->liveBytes = 0;
+			cache->header->blobFileSize = 0;
+			free(newOffsets);
+			return;
+		}
+	}
+
+	if (ok) {
+		for (uint32_t i = 0; i < capacity; i++) {
+			CacheEntry *entry = &cache->entries[i];
+			if (entry->key != 0 && entry->blobLen != 0) {
+				entry->blobOffset = newOffsets[i];
+			}
+		}
+		cache->header->blobFileSize = offset;
+		cache->header->liveBytes = offset;
+	}
+	free(newOffsets);
+}
+
+// Compacts the blob file once the dead space outweighs the live data.
+// Called with the lock held.
+static void compact_if_mostly_dead(GetExeIconCache *cache)
+{
+	if (cache->header->blobFileSize > 2 * cache->header->liveBytes + (1 << 20)) {
+		// Wait for reads of the old blob file to finish
+		lock_exclusive(&cache->blobLock);
+		compact_blobs(cache);
+		unlock_exclusive(&cache->blobLock);
+	}
+}
+
+typedef struct
+{
+	uint64_t  lastAccess;
+	uint32_t  blobLen;
+} AccessRecord;
+
+static int compare_access_records(const void *a, const void *b)
+{
+	uint64_t x = ((const AccessRecord *)a)->lastAccess;
+	uint64_t y = ((const AccessRecord *)b)->lastAccess;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Evicts the least recently used entries until there is room for an entry
+// with a 'newBytes' long blob. It evicts down to three quarters of the byte
+// cap and half of the slots, so that eviction happens in batches.
+static void evict(GetExeIconCache *cache, uint64_t newBytes)
+{
+	CacheHeader *header = cache->header;
+	const uint32_t capacity = header->capacity;
+	const uint64_t targetBytes = cache->maxBytes / 4 * 3;
+	const uint32_t targetEntries = capacity / 2;
+
+	AccessRecord *records = (AccessRecord *)malloc(sizeof(AccessRecord) * (header->numEntries + 1));
+	CacheEntry *survivors = (CacheEntry *)malloc(sizeof(CacheEntry) * (header->numEntries + 1));
+	if (!records || !survivors) {
+		free(records);
+		free(survivors);
+		return;
+	}
+
+	uint32_t n = 0;
+	for (uint32_t i = 0; i < capacity && n < header->numEntries; i++) {
+		if (cache->entries[i].key != 0) {
+			records[n].lastAccess = cache->entries[i].lastAccess;
+			records[n].blobLen = cache->entries[i].blobLen;
+			n++;
+		}
+	}
+	qsort(records, n, sizeof(AccessRecord), compare_access_records);
+
+	// Access times are unique, so evicting every entry last accessed at
+	// or before the cutoff evicts exactly the oldest ones.
+	uint64_t cutoff = 0;
+	uint32_t numEvicted = 0;
+	uint64_t liveBytes = header->liveBytes;
+	while (numEvicted < n
+		&& (liveBytes + newBytes > targetBytes || n - numEvicted + 1 > targetEntries))
+	{
+		cutoff = records[numEvicted].lastAccess;
+		liveBytes -= records[numEvicted].blobLen;
+		numEvicted ++;
+	}
+	free(records);
+
+	if (numEvicted == 0) {
+		free(survivors);
+		return;
+	}
+
+	// Rebuild the table from the survivors, since removing entries from
+	// a linear probing table one at a time means shuffling the others.
+	uint32_t numSurvivors = 0;
+	for (uint32_t i = 0; i < capacity; i++) {
+		CacheEntry *entry = &cache->entries[i];
+		if (entry->key != 0 && entry->lastAccess > cutoff) {
+			survivors[numSurvivors++] = *entry;
+		}
+	}
+
+	memset(cache->entries, 0, sizeof(CacheEntry) * capacity);
+	const uint32_t mask = capacity - 1;
+	for (uint32_t k = 0; k < numSurvivors; k++) {
+		uint32_t i = (uint32_t)survivors[k].key & mask;
+		while (cache->entries[i].key != 0) {
+			i = (i + 1) & mask;
+		}
+		cache->entries[i] = survivors[k];
+	}
+	free(survivors);
+
+	cache->stats.evictions += numEvicted;
+	header->numEntries = numSurvivors;
+	header->liveBytes = liveBytes;
+
+	compact_if_mostly_dead(cache);
+}
+
+// Resets the index and blob file to empty
+static BOOL init_cache_files(GetExeIconCache *cache, uint32_t capacity)
+{
+	size_t indexSize = CACHE_HEADER_SIZE + (size_t)capacity * sizeof(CacheEntry);
+	if (!set_file_size(cache->indexFile, 0)
+		|| !set_file_size(cache->indexFile, indexSize)
+		|| !set_file_size(cache->blobFile, 0)
+		|| !map_index(cache, indexSize))
+	{
+		return FALSE;
+	}
+
+	// The file is zero-filled, so all slots are already empty
+	cache->header = (CacheHeader *)cache->indexMap;
+	memcpy(cache->header->magic, CACHE_MAGIC, sizeof(cache->header->magic));
+	cache->header->version = CACHE_VERSION;
+	cache->header->capacity = capacity;
+	return TRUE;
+}
+
+// Maps an existing index, if it is valid and matches the blob file
+static BOOL open_cache_files(GetExeIconCache *cache)
+{
+	uint64_t indexSize, blobSize;
+	CacheHeader header;
+	if (!get_file_size(cache->indexFile, &indexSize)
+		|| !get_file_size(cache->blobFile, &blobSize)
+		|| indexSize < CACHE_HEADER_SIZE
+		|| !read_at(cache->indexFile, 0, &header, sizeof(header)))
+	{
+		return FALSE;
+	}
+
+	if (memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0
+		|| header.version != CACHE_VERSION
+		|| header.capacity == 0
+		|| (header.capacity & (header.capacity - 1)) != 0
+		|| indexSize != CACHE_HEADER_SIZE + (uint64_t)header.capacity * sizeof(CacheEntry)
+		|| header.blobFileSize > blobSize
+		|| header.numEntries >= header.capacity)
+	{
+		return FALSE;
+	}
+
+	if (!map_index(cache, (size_t)indexSize)) {
+		return FALSE;
+	}
+	cache->header = (CacheHeader *)cache->indexMap;
+	return TRUE;
+}
+
+static void free_cache(GetExeIconCache *cache)
+{
+	if (cache->indexFile != INVALID_FILE) {
+		close_file(cache->indexFile);
+	}
+	if (cache->blobFile != INVALID_FILE) {
+		close_file(cache->blobFile);
+	}
+	free((void *)cache->indexPath);
+	free((void *)cache->blobPath);
+	free((void *)cache->tmpBlobPath);
+	free(cache);
+}
+
+GetExeIconCache *get_exe_icon_cache_open(PCSTR dirPath, const GetExeIconCacheOptions *options)
+{
+	if (!dirPath) {
+		return NULL;
+	}
+
+	GetExeIconCache *cache = (GetExeIconCache *)calloc(1, sizeof(GetExeIconCache));
+	if (!cache) {
+		return NULL;
+	}
+	cache->indexFile = INVALID_FILE;
+	cache->blobFile = INVALID_FILE;
+	cache->maxBytes = options && options->maxBytes ? options->maxBytes : DEFAULT_MAX_BYTES;
+	cache->hashHeaders = options ? options->hashHeaders : FALSE;
+
+	// Round the capacity up to a power of 2
+	uint32_t maxEntries = options && options->maxEntries ? options->maxEntries : DEFAULT_MAX_ENTRIES;
+	uint32_t capacity = 16;
+	while (capacity < maxEntries && capacity < (1u << 30)) {
+		capacity <<= 1;
+	}
+
+	cache->indexPath = join_path(dirPath, "index");
+	cache->blobPath = join_path(dirPath, "blobs");
+	cache->tmpBlobPath = join_path(dirPath, "blobs.tmp");
+	if (!cache->indexPath || !cache->blobPath || !cache->tmpBlobPath) {
+		free_cache(cache);
+		return NULL;
+	}
+
+	cache->indexFile = open_file(cache->indexPath, TRUE, FALSE);
+	if (cache->indexFile == INVALID_FILE || !lock_file(cache->indexFile)) {
+		free_cache(cache);
+		return NULL;
+	}
+	cache->blobFile = open_file(cache->blobPath, TRUE, FALSE);
+	if (cache->blobFile == INVALID_FILE) {
+		free_cache(cache);
+		return NULL;
+	}
+
+	// Anything unexpected (a new cache, another version, a crash while
+	// writing the header) starts the cache over.
+	if (!open_cache_files(cache) && !init_cache_files(cache, capacity)) {
+		free_cache(cache);
+		return NULL;
+	}
+	cache->entries = (CacheEntry *)(cache->indexMap + CACHE_HEADER_SIZE);
+
+	init_mutex(&cache->lock);
+	init_rwlock(&cache->blobLock);
+	return cache;
+}
+
+void get_exe_icon_cache_close(GetExeIconCache *cache)
+{
+	if (!cache) {
+		return;
+	}
+	unmap_index(cache);
+	destroy_mutex(&cache->lock);
+	destroy_rwlock(&cache->blobLock);
+	free_cache(cache);
+}
+
+void get_exe_icon_cache_stats(GetExeIconCache *cache, GetExeIconCacheStats *stats)
+{
+	if (!cache || !stats) {
+		return;
+	}
+	lock_mutex(&cache->lock);
+	*stats = cache->stats;
+	stats->numEntries = cache->header->numEntries;
+	stats->cachedBytes = cache->header->liveBytes;
+	unlock_mutex(&cache->lock);
+}
+
+// Where a cache hit's ICO is in the blob file
+typedef struct
+{
+	uint64_t  offset;
+	uint64_t  hash;
+	DWORD     len;      // 0 for a cached failure
+} BlobRef;
+
+// Looks up a file in the cache. Returns TRUE on a hit, with where to find
+// the cached ICO in 'blob', or the cached error in 'error'. Called with the
+// lock held; the blob is read after it's released (see read_blob()).
+static BOOL lookup(GetExeIconCache *cache, const FileIdentity *id, uint32_t flags, uint64_t headerHash, BlobRef *blob, GetExeIconError *error)
+{
+	uint64_t key = entry_key(id, flags);
+	CacheEntry *entry = find_slot(cache, key, id, flags);
+	if (entry->key == 0
+		|| entry->fileSize != id->fileSize
+		|| entry->mtime != id->mtime
+		|| entry->headerHash != headerHash)
+	{
+		return FALSE;
+	}
+
+	blob->offset = entry->blobOffset;
+	blob->hash = entry->blobHash;
+	blob->len = entry->blobLen;
+	*error = blob->len == 0 ? (GetExeIconError)(entry->flags >> ENTRY_ERROR_SHIFT) : GET_EXE_ICON_OK;
+	entry->lastAccess = ++cache->header->clock;
+	return TRUE;
+}
+
+// Reads a cached ICO and checks it against its hash. Called with blobLock
+// held shared, so that the blob file isn't compacted in the meantime, but
+// not the main lock, so that hits on other threads don't wait for the read.
+static PBYTE read_blob(GetExeIconCache *cache, const BlobRef *blob)
+{
+	PBYTE buf = (PBYTE)malloc(blob->len);
+	if (!buf) {
+		return NULL;
+	}
+	if (!read_at(cache->blobFile, blob->offset, buf, blob->len)
+		|| hash_bytes(buf, blob->len, HASH_SEED) != blob->hash)
+	{
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+// Adds or replaces a file's entry. Called with the lock held.
+static void store(GetExeIconCache *cache, const FileIdentity *id, uint32_t flags, uint64_t headerHash, PBYTE icoBuf, DWORD bufLen, GetExeIconError error)
+{
+	CacheHeader *header = cache->header;
+	if (bufLen > cache->maxBytes / 4 * 3) {
+		return;
+	}
+
+	uint64_t key = entry_key(id, flags);
+	CacheEntry *entry = find_slot(cache, key, id, flags);
+	uint64_t oldLen = entry->key != 0 ? entry->blobLen : 0;
+
+	if ((entry->key == 0 && header->numEntries + 1 > header->capacity / 4 * 3)
+		|| header->liveBytes - oldLen + bufLen > cache->maxBytes)
+	{
+		// This may evict the file's old entry too
+		evict(cache, bufLen);
+		entry = find_slot(cache, key, id, flags);
+		if (entry->key == 0 && header->numEntries + 1 > header->capacity / 4 * 3) {
+			return;
+		}
+	}
+
+	uint64_t blobOffset = header->blobFileSize;
+	if (bufLen > 0 && !write_at(cache->blobFile, blobOffset, icoBuf, bufLen)) {
+		return;
+	}
+
+	if (entry->key == 0) {
+		header->numEntries ++;
+	} else {
+		// The old blob becomes dead space
+		header->liveBytes -= entry->blobLen;
+	}
+	entry->key = key;
+	entry->device = id->device;
+	entry->inode = id->inode;
+	entry->fileSize = id->fileSize;
+	entry->mtime = id->mtime;
+	entry->headerHash = headerHash;
+	entry->blobOffset = blobOffset;
+	entry->blobHash = bufLen > 0 ? hash_bytes(icoBuf, bufLen, HASH_SEED) : 0;
+	entry->blobLen = bufLen;
+	entry->flags = flags | ((uint32_t)error << ENTRY_ERROR_SHIFT);
+	entry->lastAccess = ++header->clock;
+
+	header->blobFileSize += bufLen;
+	header->liveBytes += bufLen;
+
+	// Files that keep changing leave dead space without ever filling the
+	// cache enough to evict
+	compact_if_mostly_dead(cache);
+}
+
+PBYTE get_exe_icon_cached(GetExeIconCache *cache, PCSTR path, BOOL allowEmbeddedPNGs, PDWORD bufLen)
+{
+	if (!cache || !path || !bufLen) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return NULL;
+	}
+
+	FileIdentity id;
+	if (!get_file_identity(path, &id)) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OPEN_FAILED);
+		return NULL;
+	}
+
+	uint64_t headerHash = 0;
+	if (cache->hashHeaders && !hash_file_header(path, id.fileSize, &headerHash)) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OPEN_FAILED);
+		return NULL;
+	}
+
+	uint32_t flags = allowEmbeddedPNGs ? ENTRY_FLAG_PNGS : 0;
+	PBYTE icoBuf = NULL;
+	GetExeIconError error;
+
+	BlobRef blob;
+
+	lock_mutex(&cache->lock);
+	BOOL hit = lookup(cache, &id, flags, headerHash, &blob, &error);
+	if (hit) {
+		cache->stats.hits ++;
+		if (blob.len > 0) {
+			lock_shared(&cache->blobLock);
+		}
+	} else {
+		cache->stats.misses ++;
+	}
+	unlock_mutex(&cache->lock);
+
+	if (hit && blob.len > 0) {
+		icoBuf = read_blob(cache, &blob);
+		unlock_shared(&cache->blobLock);
+		if (icoBuf) {
+			*bufLen = blob.len;
+		} else {
+			// A damaged blob (or no memory for it) makes this a miss
+			hit = FALSE;
+			lock_mutex(&cache->lock);
+			cache->stats.hits --;
+			cache->stats.misses ++;
+			unlock_mutex(&cache->lock);
+		}
+	} else if (hit) {
+		*bufLen = 0;
+	}
+
+	if (hit) {
+		get_exe_icon_set_last_error(error);
+		return icoBuf;
+	}
+
+	icoBuf = get_exe_icon_from_file_utf8(path, allowEmbeddedPNGs, bufLen);
+	error = get_exe_icon_last_error();
+
+	// Only cache outcomes that depend on nothing but the file's contents
+	if (error == GET_EXE_ICON_OK
+		|| error == GET_EXE_ICON_ERROR_NOT_PE
+		|| error == GET_EXE_ICON_ERROR_NO_ICON
+		|| error == GET_EXE_ICON_ERROR_TOO_LARGE)
+	{
+		lock_mutex(&cache->lock);
+		store(cache, &id, flags, headerHash, icoBuf, icoBuf ? *bufLen : 0, error);
+		unlock_mutex(&cache->lock);
+	}
+
+	get_exe_icon_set_last_error(error);
+	return icoBuf;
+}
@@ -0,0 +1,90 @@
+// Copyright (c) 2021 Aury Snow
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef GET_EXE_ICON_CACHE_H
+#define GET_EXE_ICON_CACHE_H
+
+#include "get-exe-icon.h"
+
+// A persistent cache of extracted icons, so that rescanning a set of mostly
+// unchanged files costs a stat and a read of the cached ICO per file instead
+// of a parse of each file's resources.
+//
+// The cache lives in a directory holding two files: 'index', a hash table
+// that is memory-mapped while the cache is open, and 'blobs', the cached ICO
+// files one after another. Entries are keyed by file identity (device and
+// inode, or volume serial and file index on Windows) and the
+// allowEmbeddedPNGs flag. An entry is only used if the file's size and
+// modification time (and optionally a hash of its first 4KB) still match
+// what they were when the icon was extracted; otherwise the icon is extracted
+// again and the entry replaced. Files without an icon are cached too.
+//
+// When the cached ICOs exceed maxBytes, or the index gets too full, the least
+// recently used entries are evicted, and the blob file is compacted once
+// most of it is unreferenced.
+//
+// One cache may be used by many threads at once, but may only be open once at
+// a time: opening a cache directory that is already open, in this process or
+// another, fails.
+typedef struct GetExeIconCache GetExeIconCache;
+
+// Options for get_exe_icon_cache_open(). Zero-initialize for the defaults.
+typedef struct
+{
+	// Cap on the total size of cached ICOs. 0 means 256MB.
+	uint64_t maxBytes;
+
+	// Number of entries the index has room for. The index file takes 80
+	// bytes per entry. 0 means 262144. Only used when creating the index.
+	DWORD maxEntries;
+
+	// Also check a hash of the first 4KB of the file (its headers) before
+	// using an entry. This catches files rewritten without their size or
+	// modification time changing, at the cost of a small read per file.
+	BOOL hashHeaders;
+} GetExeIconCacheOptions;
+
+// Opens (creating it if needed) the cache in directory 'dirPath', given as a
+// UTF-8 string. The directory must exist. 'options' may be NULL to use the
+// defaults. Returns NULL on error.
+GetExeIconCache *get_exe_icon_cache_open(PCSTR dirPath, const GetExeIconCacheOptions *options);
+
+// Writes out and closes the cache.
+void get_exe_icon_cache_close(GetExeIconCache *cache);
+
+// Same as get_exe_icon_from_file_utf8() except the icon is served from the
+// cache if the file is unchanged since it was cached, and cached otherwise.
+// A cached "no icon" result returns NULL with the same
+// get_exe_icon_last_error() as the original extraction.
+PBYTE get_exe_icon_cached(GetExeIconCache *cache, PCSTR path, BOOL allowEmbeddedPNGs, PDWORD bufLen);
+
+// Statistics about a cache since it was opened
+typedef struct
+{
+	uint64_t hits;
+	uint64_t misses;        // Includes entries found to be out of date
+	uint64_t evictions;
+	DWORD numEntries;
+	uint64_t cachedBytes;   // Total size of cached ICOs
+} GetExeIconCacheStats;
+
+void get_exe_icon_cache_stats(GetExeIconCache *cache, GetExeIconCacheStats *stats);
+
+#endif
@@ -0,0 +1,1077 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include "get-exe-icon.h"
+#include "get-exe-icon-png.h"
+#include "get-exe-icon-scan.h"
+#include "get-exe-icon-store.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+// Command line tool to extract the icons of many files at once.
+//
+// Usage: get-exe-icon [options] <file | directory | ->...
+//
+//   -o DIR                Store each distinct icon in DIR as
+//                         "<xx>/<hash>.ico" (see get-exe-icon-store.h)
+//   --png                 Also store each icon's largest image as
+//                         "<xx>/<hash>.png" (needs -o)
+//   --no-embedded-png     Leave PNG images out of the ICOs
+//   -m FILE               Write the manifest to FILE instead of stdout
+//   -j N                  Use N worker threads (default: one per CPU)
+//   --skip-unchanged FILE Reuse the results in FILE, the manifest of an
+//                         earlier run, for files whose size and modification
+//                         time haven't changed
+//   --dry-run             Only list each file's icon, without reading its
+//                         images or writing anything but the manifest
+//
+// Directories are searched recursively, and only their files starting with
+// "MZ" are considered; symbolic links are not followed. "-" reads a list of
+// paths from stdin, one per line. Icons are extracted on the worker threads
+// while the main thread takes the executables that get-exe-icon-scan.c finds
+// in directories, and the scan waits whenever the workers fall behind.
+//
+// The manifest has one JSON object per line for each file, in the order the
+// workers finish them:
+//
+//   {"path":"a.exe","status":"ok","file_size":123904,"mtime_ns":...,
+//    "hash":"...","ico_size":5430,"png_size":2210,"new":true,
+//    "images":[[16,16,32],[32,32,32]],"time_us":180,"open_us":20,
+//    "enumerate_us":5,"locate_us":3,"assemble_us":12}
+//
+// "status" is "ok" or the lowercase name of the GetExeIconError, e.g.
+// "no_icon", or "write_failed" if an output couldn't be written. "new" says
+// whether the ICO wasn't in the output directory yet. "hash", "png_size" and
+// "new" are left out in dry runs, and lines reused from an earlier manifest
+// have "skipped":true. Files that fail don't change the exit status, which is
+// 1 if an output couldn't be written and 2 for bad arguments.
+
+#define PATH_QUEUE_SIZE  256
+#define MIN_TABLE_SIZE   1024
+
+#ifdef _WIN32
+#define PATH_SEPARATOR '\\'
+#else
+#define PATH_SEPARATOR '/'
+#endif
+
+#ifdef _WIN32
+typedef HANDLE Thread;
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE Cond;
+#else
+typedef pthread_t Thread;
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Cond;
+#endif
+
+typedef enum
+{
+	ENTRY_OTHER,
+	ENTRY_FILE,
+	ENTRY_DIR,
+} EntryType;
+
+typedef struct
+{
+	char *path;
+	BOOL  walked;   // Found by a scan rather than named by the user
+} QueuedPath;
+
+// A file's line from the previous manifest
+typedef struct
+{
+	char     *path;
+	char     *line;
+	uint64_t  size;
+	uint64_t  mtime;
+	BOOL      hasHash;
+	BOOL      hasPng;
+} PreviousEntry;
+
+typedef struct
+{
+	// Settings
+	const char *outDir;
+	BOOL        png;
+	BOOL        allowEmbeddedPNGs;
+	BOOL        dryRun;
+
+	GetExeIconStore *store;
+	FILE            *manifest;
+
+	PreviousEntry *previous;      // Open addressing, NULL path = empty
+	size_t         previousSize;  // A power of 2
+
+	Mutex  lock;
+	Cond   pathReady;   // A path was queued, or the input is over
+	Cond   pathSpace;   // A path was taken from the queue
+
+	// All of the below are protected by lock
+
+	BOOL        inputDone;
+	QueuedPath  paths[PATH_QUEUE_SIZE];
+	size_t      pathHead;
+	size_t      pathCount;
+
+	uint64_t numFiles;
+	uint64_t numIcons;
+	uint64_t numNew;
+	uint64_t numNoIcon;
+	uint64_t numFailed;
+	uint64_t numSkipped;
+	uint64_t tmpCounter;   // Makes temporary file names unique
+	BOOL     writeFailed;
+} Job;
+
+// Growable buffer for a manifest line
+typedef struct
+{
+	char   *buf;
+	size_t  len;
+	size_t  capacity;
+} Line;
+
+static const char *statusNames[] = {
+	"ok",
+	"invalid_argument",
+	"open_failed",
+	"read_failed",
+	"not_pe",
+	"no_icon",
+	"too_large",
+	"out_of_memory",
+	"buffer_too_small",
+	"unsupported",
+	"limit_exceeded",
+	"bad_archive",
+};
+
+static void run_worker(Job *job);
+
+static const char *status_name(GetExeIconError error)
+{
+	return (size_t)error < sizeof(statusNames) / sizeof(statusNames[0]) ? statusNames[error] : "error";
+}
+
+static void *xmalloc(size_t size)
+{
+	void *ptr = malloc(size ? size : 1);
+	if (!ptr) {
+		fprintf(stderr, "Out of memory\n");
+		exit(2);
+	}
+	return ptr;
+}
+
+static char *xstrdup(const char *str)
+{
+	size_t len = strlen(str);
+	char *copy = (char *)xmalloc(len + 1);
+	memcpy(copy, str, len + 1);
+	return copy;
+}
+
+// Platform wrappers for threads, locks and files
+
+#ifdef _WIN32
+static void init_sync(Job *job)
+{
+	InitializeCriticalSection(&job->lock);
+	InitializeConditionVariable(&job->pathReady);
+	InitializeConditionVariable(&job->pathSpace);
+}
+
+static void destroy_sync(Job *job)
+{
+	DeleteCriticalSection(&job->lock);
+}
+
+static void lock_mutex(Mutex *mutex) { EnterCriticalSection(mutex); }
+static void unlock_mutex(Mutex *mutex) { LeaveCriticalSection(mutex); }
+static void wait_cond(Cond *cond, Mutex *mutex) { SleepConditionVariableCS(cond, mutex, INFINITE); }
+static void signal_cond(Cond *cond) { WakeConditionVariable(cond); }
+static void broadcast_cond(Cond *cond) { WakeAllConditionVariable(cond); }
+
+static DWORD WINAPI worker_thread_main(LPVOID arg)
+{
+	run_worker((Job *)arg);
+	return 0;
+}
+
+static BOOL start_thread(Thread *thread, Job *job)
+{
+	*thread = CreateThread(NULL, 0, worker_thread_main, job, 0, NULL);
+	return *thread != NULL;
+}
+
+static void join_thread(Thread thread)
+{
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+
+static DWORD num_cpus(void)
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+}
+
+static unsigned long process_id(void)
+{
+	return GetCurrentProcessId();
+}
+
+static uint64_t now_ns(void)
+{
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)((double)count.QuadPart * 1e9 / (double)freq.QuadPart);
+}
+
+static PWSTR utf8_to_wide(PCSTR str)
+{
+	int len = MultiByteToWideChar(CP_UTF8, 0, str, -1, NULL, 0);
+	if (len <= 0) {
+		return NULL;
+	}
+	PWSTR wStr = (PWSTR)malloc(sizeof(WCHAR) * len);
+	if (wStr && MultiByteToWideChar(CP_UTF8, 0, str, -1, wStr, len) <= 0) {
+		free(wStr);
+		return NULL;
+	}
+	return wStr;
+}
+
+// Gets the type, size and modification time (in ns since 1970) of a file
+static EntryType get_file_info(PCSTR path, uint64_t *size, uint64_t *mtime)
+{
+	PWSTR wPath = utf8_to_wide(path);
+	if (!wPath) {
+		return ENTRY_OTHER;
+	}
+	WIN32_FILE_ATTRIBUTE_DATA info;
+	BOOL ret = GetFileAttributesExW(wPath, GetFileExInfoStandard, &info);
+	free(wPath);
+	if (!ret) {
+		return ENTRY_OTHER;
+	}
+	if (info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+		return ENTRY_DIR;
+	}
+	uint64_t ticks = ((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+	*size = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+	*mtime = ticks >= 116444736000000000ull ? (ticks - 116444736000000000ull) * 100 : 0;
+	return ENTRY_FILE;
+}
+
+// Writes a new file through a temporary file, so it's never seen partially
+// written
+static BOOL write_file_atomic(PCSTR path, PCSTR tmpPath, const void *data, DWORD len)
+{
+	PWSTR wPath = utf8_to_wide(path);
+	PWSTR wTmpPath = utf8_to_wide(tmpPath);
+	BOOL ret = FALSE;
+	if (wPath && wTmpPath) {
+		HANDLE file = CreateFileW(wTmpPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file != INVALID_HANDLE_VALUE) {
+			DWORD written = 0;
+			ret = WriteFile(file, data, len, &written, NULL) && written == len;
+			CloseHandle(file);
+			ret = ret && MoveFileExW(wTmpPath, wPath, MOVEFILE_REPLACE_EXISTING);
+			if (!ret) {
+				DeleteFileW(wTmpPath);
+			}
+		}
+	}
+	free(wPath);
+	free(wTmpPath);
+	return ret;
+}
+
+#else
+static void init_sync(Job *job)
+{
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->pathReady, NULL);
+	pthread_cond_init(&job->pathSpace, NULL);
+}
+
+static void destroy_sync(Job *job)
+{
+	pthread_mutex_destroy(&job->lock);
+	pthread_cond_destroy(&job->pathReady);
+	pthread_cond_destroy(&job->pathSpace);
+}
+
+static void lock_mutex(Mutex *mutex) { pthread_mutex_lock(mutex); }
+static void unlock_mutex(Mutex *mutex) { pthread_mutex_unlock(mutex); }
+static void wait_cond(Cond *cond, Mutex *mutex) { pthread_cond_wait(cond, mutex); }
+static void signal_cond(Cond *cond) { pthread_cond_signal(cond); }
+static void broadcast_cond(Cond *cond) { pthread_cond_broadcast(cond); }
+
+static void *worker_thread_main(void *arg)
+{
+	run_worker((Job *)arg);
+	return NULL;
+}
+
+static BOOL start_thread(Thread *thread, Job *job)
+{
+	return pthread_create(thread, NULL, worker_thread_main, job) == 0;
+}
+
+static void join_thread(Thread thread)
+{
+	pthread_join(thread, NULL);
+}
+
+static DWORD num_cpus(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (DWORD)n : 1;
+}
+
+static unsigned long process_id(void)
+{
+	return (unsigned long)getpid();
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Gets the type, size and modification time (in ns since 1970) of a file
+static EntryType get_file_info(PCSTR path, uint64_t *size, uint64_t *mtime)
+{
+	struct stat st;
+	if (stat(path, &st) != 0) {
+		return ENTRY_OTHER;
+	}
+	if (S_ISDIR(st.st_mode)) {
+		return ENTRY_DIR;
+	}
+	*size = (uint64_t)st.st_size;
+	*mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000u + (uint64_t)st.st_mtim.tv_nsec;
+	return ENTRY_FILE;
+}
+
+// Writes a new file through a temporary file, so it's never seen partially
+// written
+static BOOL write_file_atomic(PCSTR path, PCSTR tmpPath, const void *data, DWORD len)
+{
+	int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return FALSE;
+	}
+	const BYTE *p = (const BYTE *)data;
+	BOOL ret = TRUE;
+	while (len > 0 && ret) {
+		ssize_t n = write(fd, p, len);
+		ret = n > 0;
+		if (ret) {
+			p += n;
+			len -= (DWORD)n;
+		}
+	}
+	ret = close(fd) == 0 && ret && rename(tmpPath, path) == 0;
+	if (!ret) {
+		unlink(tmpPath);
+	}
+	return ret;
+}
+
+#endif
+
+static char *join_path(PCSTR dir, PCSTR name)
+{
+	size_t dirLen = strlen(dir), nameLen = strlen(name);
+	BOOL addSeparator = dirLen > 0 && dir[dirLen - 1] != PATH_SEPARATOR && dir[dirLen - 1] != '/';
+	char *path = (char *)xmalloc(dirLen + addSeparator + nameLen + 1);
+	memcpy(path, dir, dirLen);
+	if (addSeparator) {
+		path[dirLen] = PATH_SEPARATOR;
+	}
+	memcpy(path + dirLen + addSeparator, name, nameLen + 1);
+	return path;
+}
+
+// Reads a line of any length without its line ending. Returns NULL at the
+// end of the file.
+static char *read_line(FILE *file)
+{
+	size_t len = 0, capacity = 256;
+	char *line = (char *)xmalloc(capacity);
+	while (fgets(line + len, (int)(capacity - len), file)) {
+		len += strlen(line + len);
+		if (len > 0 && line[len - 1] == '\n') {
+			break;
+		}
+		if (len + 1 == capacity) {
+			capacity *= 2;
+			char *newLine = (char *)realloc(line, capacity);
+			if (!newLine) {
+				free(line);
+				return NULL;
+			}
+			line = newLine;
+		}
+	}
+	if (len == 0 && (feof(file) || ferror(file))) {
+		free(line);
+		return NULL;
+	}
+	while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+		line[--len] = '\0';
+	}
+	return line;
+}
+
+// Manifest lines
+
+static void line_append_n(Line *line, const char *str, size_t len)
+{
+	if (line->len + len + 1 > line->capacity) {
+		size_t capacity = line->capacity ? line->capacity : 512;
+		while (line->len + len + 1 > capacity) {
+			capacity *= 2;
+		}
+		char *buf = (char *)realloc(line->buf, capacity);
+		if (!buf) {
+			fprintf(stderr, "Out of memory\n");
+			exit(2);
+		}
+		line->buf = buf;
+		line->capacity = capacity;
+	}
+	memcpy(line->buf + line->len, str, len);
+	line->len += len;
+	line->buf[line->len] = '\0';
+}
+
+static void line_append(Line *line, const char *str)
+{
+	line_append_n(line, str, strlen(str));
+}
+
+static void line_append_number(Line *line, const char *key, uint64_t value)
+{
+	char buf[64];
+	snprintf(buf, sizeof(buf), ",\"%s\":%llu", key, (unsigned long long)value);
+	line_append(line, buf);
+}
+
+// Appends a JSON string. Bytes that aren't valid UTF-8 (which POSIX paths
+// may contain) are passed through as they are.
+static void line_append_string(Line *line, const char *str)
+{
+	line_append(line, "\"");
+	for (const char *p = str; *p; p++) {
+		unsigned char c = (unsigned char)*p;
+		if (c == '"' || c == '\\') {
+			char escaped[2] = { '\\', (char)c };
+			line_append_n(line, escaped, 2);
+		} else if (c < 0x20) {
+			char escaped[8];
+			snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+			line_append(line, escaped);
+		} else {
+			line_append_n(line, p, 1);
+		}
+	}
+	line_append(line, "\"");
+}
+
+// Parses the JSON string at *p, as written by line_append_string(), and
+// moves *p past it. Returns NULL if it isn't one.
+static char *parse_string(const char **p)
+{
+	const char *s = *p;
+	if (*s != '"') {
+		return NULL;
+	}
+	char *str = (char *)xmalloc(strlen(s));
+	size_t len = 0;
+	for (s++; *s != '"'; s++) {
+		if (*s == '\0') {
+			free(str);
+			return NULL;
+		}
+		if (*s != '\\') {
+			str[len++] = *s;
+			continue;
+		}
+		s++;
+		switch (*s) {
+			case 'n': str[len++] = '\n'; break;
+			case 'r': str[len++] = '\r'; break;
+			case 't': str[len++] = '\t'; break;
+			case 'u': {
+				unsigned value;
+				if (sscanf(s + 1, "%4x", &value) != 1 || value == 0 || value >= 0x80) {
+					free(str);
+					return NULL;
+				}
+				str[len++] = (char)value;
+				s += 4;
+				break;
+			}
+			case '\0':
+				free(str);
+				return NULL;
+			default:
+				str[len++] = *s;
+		}
+	}
+	str[len] = '\0';
+	*p = s + 1;
+	return str;
+}
+
+static BOOL find_number(const char *line, const char *key, uint64_t *value)
+{
+	const char *p = strstr(line, key);
+	if (!p) {
+		return FALSE;
+	}
+	*value = strtoull(p + strlen(key), NULL, 10);
+	return TRUE;
+}
+
+// Appends [width, height, bits per pixel] for each image in an ICO
+// directory
+static void line_append_images(Line *line, const BYTE *ico, DWORD len)
+{
+	DWORD numImages = len >= 6 ? (DWORD)(ico[4] | (ico[5] << 8)) : 0;
+	line_append(line, ",\"images\":[");
+	for (DWORD i = 0; i < numImages && 6 + (i + 1) * 16 <= len; i++) {
+		const BYTE *entry = ico + 6 + i * 16;
+		char buf[64];
+		snprintf(buf, sizeof(buf), "%s[%u,%u,%u]", i > 0 ? "," : "",
+			entry[0] ? entry[0] : 256, entry[1] ? entry[1] : 256, (unsigned)(entry[6] | (entry[7] << 8)));
+		line_append(line, buf);
+	}
+	line_append(line, "]");
+}
+
+// The previous manifest, for --skip-unchanged
+
+static size_t hash_path(const char *path)
+{
+	size_t hash = 2166136261u;
+	for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+		hash = (hash ^ *p) * 16777619u;
+	}
+	return hash;
+}
+
+static PreviousEntry *find_previous(const Job *job, const char *path)
+{
+	if (!job->previous) {
+		return NULL;
+	}
+	size_t mask = job->previousSize - 1;
+	for (size_t i = hash_path(path) & mask; job->previous[i].path; i = (i + 1) & mask) {
+		if (strcmp(job->previous[i].path, path) == 0) {
+			return &job->previous[i];
+		}
+	}
+	return NULL;
+}
+
+// Only results that would come out the same again are reused
+static BOOL is_reusable_status(const char *line)
+{
+	return !strstr(line, "\"status\":\"open_failed\"")
+		&& !strstr(line, "\"status\":\"read_failed\"")
+		&& !strstr(line, "\"status\":\"out_of_memory\"")
+		&& !strstr(line, "\"status\":\"write_failed\"");
+}
+
+static BOOL load_previous(Job *job, const char *manifestPath)
+{
+	FILE *file = fopen(manifestPath, "rb");
+	if (!file) {
+		return FALSE;
+	}
+
+	// Collected in a list first, then put in a table half full at most
+	PreviousEntry *entries = NULL;
+	size_t numEntries = 0, capacity = 0;
+	char *line;
+	while ((line = read_line(file)) != NULL) {
+		const char *p = line;
+		PreviousEntry entry;
+		memset(&entry, 0, sizeof(entry));
+		if (strncmp(p, "{\"path\":", 8) == 0) {
+			p += 8;
+			entry.path = parse_string(&p);
+		}
+		if (!entry.path
+			|| line[strlen(line) - 1] != '}'
+			|| !find_number(p, "\"file_size\":", &entry.size)
+			|| !find_number(p, "\"mtime_ns\":", &entry.mtime)
+			|| !is_reusable_status(p))
+		{
+			free(entry.path);
+			free(line);
+			continue;
+		}
+		entry.hasHash = strstr(p, "\"hash\":") != NULL;
+		entry.hasPng = strstr(p, "\"png_size\":") != NULL;
+		entry.line = line;
+
+		if (numEntries == capacity) {
+			capacity = capacity ? capacity * 2 : 256;
+			PreviousEntry *newEntries = (PreviousEntry *)realloc(entries, sizeof(PreviousEntry) * capacity);
+			if (!newEntries) {
+				fprintf(stderr, "Out of memory\n");
+				exit(2);
+			}
+			entries = newEntries;
+		}
+		entries[numEntries++] = entry;
+	}
+	fclose(file);
+
+	job->previousSize = MIN_TABLE_SIZE;
+	while (job->previousSize < numEntries * 2) {
+		job->previousSize *= 2;
+	}
+	job->previous = (PreviousEntry *)xmalloc(sizeof(PreviousEntry) * job->previousSize);
+	memset(job->previous, 0, sizeof(PreviousEntry) * job->previousSize);
+
+	// Later lines for the same path replace earlier ones
+	for (size_t i = 0; i < numEntries; i++) {
+		PreviousEntry *existing = find_previous(job, entries[i].path);
+		if (existing) {
+			free(existing->line);
+			free(entries[i].path);
+			existing->line = entries[i].line;
+			existing->size = entries[i].size;
+			existing->mtime = entries[i].mtime;
+			existing->hasHash = entries[i].hasHash;
+			existing->hasPng = entries[i].hasPng;
+			continue;
+		}
+		size_t mask = job->previousSize - 1;
+		size_t slot = hash_path(entries[i].path) & mask;
+		while (job->previous[slot].path) {
+			slot = (slot + 1) & mask;
+		}
+		job->previous[slot] = entries[i];
+	}
+	free(entries);
+	return TRUE;
+}
+
+static void free_previous(Job *job)
+{
+	for (size_t i = 0; job->previous && i < job->previousSize; i++) {
+		free(job->previous[i].path);
+		free(job->previous[i].line);
+	}
+	free(job->previous);
+}
+
+// Whether a line from the previous manifest can stand for this run's
+static BOOL can_reuse(const Job *job, const PreviousEntry *entry, uint64_t size, uint64_t mtime)
+{
+	if (!entry || entry->size != size || entry->mtime != mtime) {
+		return FALSE;
+	}
+	if (!strstr(entry->line, "\"status\":\"ok\"")) {
+		return TRUE;
+	}
+	// Results of a dry run can't stand for icons that weren't written
+	return job->dryRun || (entry->hasHash && (entry->hasPng || !job->png));
+}
+
+// Workers
+
+// Writes the icon's largest image as a PNG beside its ICO, unless it's
+// already there. Returns the size of the PNG, or 0 on error.
+static DWORD write_png(Job *job, const BYTE *ico, DWORD icoLen, const char hashString[33], BOOL *failed)
+{
+	char name[40];
+	snprintf(name, sizeof(name), "%.2s%c%s.png", hashString, PATH_SEPARATOR, hashString);
+	char *pngPath = join_path(job->outDir, name);
+
+	uint64_t size, mtime;
+	DWORD pngLen = 0;
+	if (get_file_info(pngPath, &size, &mtime) == ENTRY_FILE) {
+		pngLen = (DWORD)size;
+	} else {
+		PBYTE png = get_exe_icon_best_png_from_ico(ico, icoLen, NULL, &pngLen);
+		if (png) {
+			lock_mutex(&job->lock);
+			unsigned long long counter = job->tmpCounter++;
+			unlock_mutex(&job->lock);
+
+			size_t tmpLen = strlen(pngPath) + 48;
+			char *tmpPath = (char *)xmalloc(tmpLen);
+			snprintf(tmpPath, tmpLen, "%s.%lu.%llu.tmp", pngPath, process_id(), counter);
+			if (!write_file_atomic(pngPath, tmpPath, png, pngLen)) {
+				*failed = TRUE;
+			}
+			free(tmpPath);
+			free(png);
+		}
+	}
+	free(pngPath);
+	return pngLen;
+}
+
+static void process_file(Job *job, QueuedPath *item, Line *line)
+{
+	const uint64_t start = now_ns();
+	uint64_t size = 0, mtime = 0;
+	EntryType type = get_file_info(item->path, &size, &mtime);
+	if (item->walked && type != ENTRY_FILE) {
+		return;
+	}
+
+	PreviousEntry *previous = type == ENTRY_FILE ? find_previous(job, item->path) : NULL;
+	if (can_reuse(job, previous, size, mtime)) {
+		line_append(line, previous->line);
+		if (!strstr(previous->line, "\"skipped\":true")) {
+			line->len --;
+			line_append(line, ",\"skipped\":true}");
+		}
+		line_append(line, "\n");
+
+		lock_mutex(&job->lock);
+		job->numFiles ++;
+		job->numSkipped ++;
+		fputs(line->buf, job->manifest);
+		unlock_mutex(&job->lock);
+		return;
+	}
+
+	GetExeIconHash hash;
+	GetExeIconStats stats;
+	GetExeIconOptions options;
+	memset(&options, 0, sizeof(options));
+	options.allowEmbeddedPNGs = job->allowEmbeddedPNGs;
+	options.stats = &stats;
+	memset(&stats, 0, sizeof(stats));
+
+	GetExeIconError error = GET_EXE_ICON_OK;
+	BOOL isNew = FALSE, writeFailed = FALSE;
+	DWORD icoLen = 0, pngLen = 0;
+	PBYTE ico = NULL;
+	GetExeIconLayout layout;
+	char hashString[33];
+
+	if (type != ENTRY_FILE) {
+		error = GET_EXE_ICON_ERROR_OPEN_FAILED;
+	} else if (job->dryRun) {
+		if (get_exe_icon_layout_from_file_utf8(item->path, &options, &layout)) {
+			icoLen = layout.totalLen;
+		} else {
+			error = get_exe_icon_last_error();
+		}
+	} else {
+		options.hash = &hash;
+		ico = get_exe_icon_from_file_utf8_ex(item->path, &options, &icoLen);
+		if (!ico) {
+			error = get_exe_icon_last_error();
+		} else {
+			get_exe_icon_hash_to_string(&hash, hashString);
+			if (job->store && !get_exe_icon_store_add(job->store, ico, icoLen, &hash, &isNew)) {
+				writeFailed = TRUE;
+			} else if (job->png) {
+				pngLen = write_png(job, ico, icoLen, hashString, &writeFailed);
+			}
+		}
+	}
+
+	line_append(line, "{\"path\":");
+	line_append_string(line, item->path);
+	line_append(line, ",\"status\":\"");
+	line_append(line, writeFailed ? "write_failed" : status_name(error));
+	line_append(line, "\"");
+	if (type == ENTRY_FILE) {
+		line_append_number(line, "file_size", size);
+		line_append_number(line, "mtime_ns", mtime);
+	}
+	if (error == GET_EXE_ICON_OK) {
+		if (ico) {
+			line_append(line, ",\"hash\":\"");
+			line_append(line, hashString);
+			line_append(line, "\"");
+		}
+		line_append_number(line, "ico_size", icoLen);
+		if (pngLen > 0) {
+			line_append_number(line, "png_size", pngLen);
+		}
+		if (job->store) {
+			line_append(line, isNew ? ",\"new\":true" : ",\"new\":false");
+		}
+		if (ico) {
+			line_append_images(line, ico, icoLen);
+		} else {
+			line_append_images(line, layout.header, layout.headerLen);
+			get_exe_icon_layout_free(&layout);
+		}
+	}
+	line_append_number(line, "time_us", (now_ns() - start) / 1000);
+	if (type == ENTRY_FILE) {
+		line_append_number(line, "open_us", stats.openNs / 1000);
+		line_append_number(line, "enumerate_us", stats.enumerateNs / 1000);
+		line_append_number(line, "locate_us", stats.locateNs / 1000);
+		line_append_number(line, "assemble_us", stats.assembleNs / 1000);
+	}
+	line_append(line, "}\n");
+	free(ico);
+
+	lock_mutex(&job->lock);
+	job->numFiles ++;
+	if (writeFailed) {
+		job->numFailed ++;
+		job->writeFailed = TRUE;
+	} else if (error == GET_EXE_ICON_OK) {
+		job->numIcons ++;
+		job->numNew += isNew;
+	} else if (error == GET_EXE_ICON_ERROR_NO_ICON) {
+		job->numNoIcon ++;
+	} else {
+		job->numFailed ++;
+	}
+	fputs(line->buf, job->manifest);
+	unlock_mutex(&job->lock);
+}
+
+static void run_worker(Job *job)
+{
+	Line line;
+	memset(&line, 0, sizeof(line));
+
+	lock_mutex(&job->lock);
+	for (;;) {
+		while (job->pathCount == 0 && !job->inputDone) {
+			wait_cond(&job->pathReady, &job->lock);
+		}
+		if (job->pathCount == 0) {
+			break;
+		}
+
+		QueuedPath item = job->paths[job->pathHead];
+		job->pathHead = (job->pathHead + 1) % PATH_QUEUE_SIZE;
+		job->pathCount --;
+		signal_cond(&job->pathSpace);
+		unlock_mutex(&job->lock);
+
+		line.len = 0;
+		process_file(job, &item, &line);
+		free(item.path);
+
+		lock_mutex(&job->lock);
+	}
+	unlock_mutex(&job->lock);
+	free(line.buf);
+}
+
+// Input
+
+// Queues a file for the workers, taking ownership of path, and waiting for
+// room if needed
+static void push_path(Job *job, char *path, BOOL walked)
+{
+	lock_mutex(&job->lock);
+	while (job->pathCount == PATH_QUEUE_SIZE) {
+		wait_cond(&job->pathSpace, &job->lock);
+	}
+	QueuedPath *item = &job->paths[(job->pathHead + job->pathCount) % PATH_QUEUE_SIZE];
+	item->path = path;
+	item->walked = walked;
+	job->pathCount ++;
+	signal_cond(&job->pathReady);
+	unlock_mutex(&job->lock);
+}
+
+// Queues every file in the tree under root that starts with "MZ"
+static void scan_tree(Job *job, PCSTR root)
+{
+	GetExeIconScanOptions options;
+	memset(&options, 0, sizeof(options));
+	options.pathsOnly = TRUE;
+	GetExeIconScan *scan = get_exe_icon_scan_open(root, &options);
+	if (!scan) {
+		fprintf(stderr, "Cannot list %s\n", root);
+		return;
+	}
+	GetExeIconScanResult result;
+	while (get_exe_icon_scan_next(scan, &result)) {
+		push_path(job, result.path, TRUE);
+	}
+	get_exe_icon_scan_close(scan);
+}
+
+static void add_input(Job *job, PCSTR path)
+{
+	uint64_t size, mtime;
+	if (get_file_info(path, &size, &mtime) == ENTRY_DIR) {
+		scan_tree(job, path);
+	} else {
+		push_path(job, xstrdup(path), FALSE);
+	}
+}
+
+static int usage(void)
+{
+	fprintf(stderr,
+		"Usage: get-exe-icon [options] <file | directory | ->...\n"
+		"\n"
+		"Extracts the primary icon of each file, searching directories recursively.\n"
+		"\"-\" reads a list of paths from stdin, one per line. Writes a JSON line\n"
+		"per file to the manifest.\n"
+		"\n"
+		"  -o DIR                 Store each distinct icon in DIR as <xx>/<hash>.ico\n"
+		"  --png                  Also store each icon's largest image as <xx>/<hash>.png\n"
+		"  --no-embedded-png      Leave PNG images out of the ICOs\n"
+		"  -m FILE                Write the manifest to FILE instead of stdout\n"
+		"  -j N                   Use N worker threads (default: one per CPU)\n"
+		"  --skip-unchanged FILE  Reuse the results in an earlier manifest for files\n"
+		"                         whose size and modification time haven't changed\n"
+		"  --dry-run              Only list the icons, without writing them\n");
+	return 2;
+}
+
+int main(int argc, char **argv)
+{
+	Job job;
+	memset(&job, 0, sizeof(job));
+	job.allowEmbeddedPNGs = TRUE;
+
+	const char *manifestPath = NULL, *previousPath = NULL;
+	DWORD numThreads = 0;
+	int firstInput = argc;
+	for (int i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		BOOL hasValue = i + 1 < argc;
+		if (strcmp(arg, "-o") == 0 && hasValue) {
+			job.outDir = argv[++i];
+		} else if (strcmp(arg, "-m") == 0 && hasValue) {
+			manifestPath = argv[++i];
+		} else if (strcmp(arg, "-j") == 0 && hasValue) {
+			numThreads = (DWORD)strtoul(argv[++i], NULL, 10);
+		} else if (strcmp(arg, "--skip-unchanged") == 0 && hasValue) {
+			previousPath = argv[++i];
+		} else if (strcmp(arg, "--png") == 0) {
+			job.png = TRUE;
+		} else if (strcmp(arg, "--no-embedded-png") == 0) {
+			job.allowEmbeddedPNGs = FALSE;
+		} else if (strcmp(arg, "--dry-run") == 0) {
+			job.dryRun = TRUE;
+		} else if (strcmp(arg, "--") == 0) {
+			firstInput = i + 1;
+			break;
+		} else if (arg[0] == '-' && arg[1] != '\0') {
+			return usage();
+		} else {
+			firstInput = i;
+			break;
+		}
+	}
+	if (firstInput >= argc || (job.png && !job.outDir)) {
+		return usage();
+	}
+	if (job.dryRun) {
+		job.outDir = NULL;
+		job.png = FALSE;
+	}
+
+	// The previous manifest is read before the new one is opened, which may
+	// be the same file
+	if (previousPath && !load_previous(&job, previousPath)) {
+		fprintf(stderr, "Cannot read %s\n", previousPath);
+		return 2;
+	}
+	job.manifest = manifestPath ? fopen(manifestPath, "wb") : stdout;
+	if (!job.manifest) {
+		fprintf(stderr, "Cannot write %s\n", manifestPath);
+		return 2;
+	}
+	if (job.outDir) {
+		job.store = get_exe_icon_store_open(job.outDir);
+		if (!job.store) {
+			fprintf(stderr, "Cannot open %s\n", job.outDir);
+			return 2;
+		}
+	}
+
+	init_sync(&job);
+	if (numThreads == 0) {
+		numThreads = num_cpus();
+	}
+	Thread *workers = (Thread *)xmalloc(sizeof(Thread) * numThreads);
+	DWORD numWorkers = 0;
+	while (numWorkers < numThreads && start_thread(&workers[numWorkers], &job)) {
+		numWorkers ++;
+	}
+	if (numWorkers == 0) {
+		fprintf(stderr, "Cannot start threads\n");
+		return 2;
+	}
+
+	const uint64_t start = now_ns();
+	for (int i = firstInput; i < argc; i++) {
+		if (strcmp(argv[i], "-") != 0) {
+			add_input(&job, argv[i]);
+			continue;
+		}
+		char *line;
+		while ((line = read_line(stdin)) != NULL) {
+			if (line[0] != '\0') {
+				add_input(&job, line);
+			}
+			free(line);
+		}
+	}
+
+	lock_mutex(&job.lock);
+	job.inputDone = TRUE;
+	broadcast_cond(&job.pathReady);
+	unlock_mutex(&job.lock);
+	for (DWORD i = 0; i < numWorkers; i++) {
+		join_thread(workers[i]);
+	}
+	const double seconds = (double)(now_ns() - start) / 1e9;
+
+	BOOL manifestFailed = fflush(job.manifest) != 0 || ferror(job.manifest);
+	if (manifestPath) {
+		manifestFailed |= fclose(job.manifest) != 0;
+	}
+	if (manifestFailed) {
+		fprintf(stderr, "Cannot write %s\n", manifestPath ? manifestPath : "the manifest");
+	}
+
+	fprintf(stderr, "%llu files: %llu icons (%llu new), %llu without an icon, %llu failed, %llu unchanged; %.2f s, %.0f files/s\n",
+		(unsigned long long)job.numFiles, (unsigned long long)job.numIcons, (unsigned long long)job.numNew,
+		(unsigned long long)job.numNoIcon, (unsigned long long)job.numFailed, (unsigned long long)job.numSkipped,
+		seconds, seconds > 0 ? (double)job.numFiles / seconds : 0.0);
+
+	if (job.store) {
+		get_exe_icon_store_close(job.store);
+	}
+	free(workers);
+	free_previous(&job);
+	destroy_sync(&job);
+	return job.writeFailed || manifestFailed ? 1 : 0;
+}
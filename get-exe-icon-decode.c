@@ -0,0 +1,662 @@
+// Copyright (c) 2021 Aury Snow
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#define WIN32_LEAN_AND_MEAN
+#include "get-exe-icon-decode.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Notes about the code:
+//
+// A DIB in an ICO is a BITMAPINFOHEADER whose height is twice the image's,
+// because it covers two images: the color ("XOR") image, followed by the 1
+// bit AND mask. Both are stored bottom-up, with each row padded to 4 bytes.
+// Images of 8 bits or fewer are palette indices into the color table that
+// follows the header; 24 and 32 bit images are BGR(A).
+//
+// Each row is decoded in up to three steps: converting it to RGBA (a palette
+// lookup or a byte swizzle), applying the AND mask to get alpha (only if
+// there is no alpha channel), and premultiplying (only if there is). Row y
+// of the output is row height-1-y of the DIB, which flips the image without
+// another pass. The steps are done by kernels chosen at runtime from the
+// plain C, SSE2 and AVX2 versions below. Only x86 has vector kernels; other
+// platforms always use the plain C ones.
+//
+// Where a kernel has no worthwhile SSE2 version (palette lookups need a
+// gather, and 24 bit swizzles need a byte shuffle, which are AVX2 and SSSE3
+// instructions), the SSE2 set uses the plain C one.
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define DECODE_X86
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define DECODE_X86
+#define TARGET_SSE2
+#define TARGET_AVX2
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+#define BI_RGB  0
+
+// Size of the fixed part of a BITMAPINFOHEADER, and of an ICO's header and
+// directory entries
+#define DIB_HEADER_SIZE     40
+#define ICO_HEADER_SIZE     6
+#define ICO_DIR_ENTRY_SIZE  16
+
+typedef struct
+{
+	// Converts a row of 'width' 32 bit BGRA pixels to RGBA
+	void (*bgra_to_rgba)(const BYTE *src, BYTE *dst, DWORD width);
+
+	// Converts a row of 24 bit BGR pixels to opaque RGBA
+	void (*bgr_to_rgba)(const BYTE *src, BYTE *dst, DWORD width);
+
+	// Looks up a row of 8 bit indices in a 256 entry RGBA palette
+	void (*lookup_palette)(const BYTE *indices, const BYTE *palette, BYTE *dst, DWORD width);
+
+	// Makes each pixel of a row whose bit is set in 'mask' 0, and the rest
+	// opaque
+	void (*apply_mask)(BYTE *pixels, const BYTE *mask, DWORD width);
+
+	// Multiplies the colors of a row of RGBA pixels by their alpha
+	void (*premultiply)(BYTE *pixels, DWORD width);
+
+	// Whether any of 'numPixels' BGRA pixels has a non-zero alpha
+	BOOL (*has_alpha)(const BYTE *src, size_t numPixels);
+} DecodeKernels;
+
+// x * a / 255, rounded to nearest, for x and a in 0-255
+static BYTE mul_div_255(uint32_t x, uint32_t a)
+{
+	uint32_t t = x * a + 128;
+	return (BYTE)((t + (t >> 8)) >> 8);
+}
+
+static uint32_t read_le32(const BYTE *p)
+{
+	return (uint32_t)p[0]
+	       | ((uint32_t)p[1] << 8)
+	       | ((uint32_t)p[2] << 16)
+	       | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t read_le16(const BYTE *p)
+{
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+// Plain C kernels
+
+static void bgra_to_rgba_scalar(const BYTE *src, BYTE *dst, DWORD width)
+{
+	for (DWORD x = 0; x < width; x++, src += 4, dst += 4) {
+		dst[0] = src[2];
+		dst[1] = src[1];
+		dst[2] = src[0];
+		dst[3] = src[3];
+	}
+}
+
+static void bgr_to_rgba_scalar(const BYTE *src, BYTE *dst, DWORD width)
+{
+	for (DWORD x = 0; x < width; x++, src += 3, dst += 4) {
+		dst[0] = src[2];
+		dst[1] = src[1];
+		dst[2] = src[0];
+		dst[3] = 255;
+	}
+}
+
+static void lookup_palette_scalar(const BYTE *indices, const BYTE *palette, BYTE *dst, DWORD width)
+{
+	for (DWORD x = 0; x < width; x++, dst += 4) {
+		memcpy(dst, palette + indices[x] * 4, 4);
+	}
+}
+
+static void apply_mask_scalar(BYTE *pixels, const BYTE *mask, DWORD width)
+{
+	for (DWORD x = 0; x < width; x++, pixels += 4) {
+		if (mask[x >> 3] & (0x80 >> (x & 7))) {
+			memset(pixels, 0, 4);
+		} else {
+			pixels[3] = 255;
+		}
+	}
+}
+
+static void premultiply_scalar(BYTE *pixels, DWORD width)
+{
+	for (DWORD x = 0; x < width; x++, pixels += 4) {
+		pixels[0] = mul_div_255(pixels[0], pixels[3]);
+		pixels[1] = mul_div_255(pixels[1], pixels[3]);
+		pixels[2] = mul_div_255(pixels[2], pixels[3]);
+	}
+}
+
+static BOOL has_alpha_scalar(const BYTE *src, size_t numPixels)
+{
+	for (size_t i = 0; i < numPixels; i++) {
+		if (src[i * 4 + 3]) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static const DecodeKernels scalarKernels = {
+	bgra_to_rgba_scalar,
+	bgr_to_rgba_scalar,
+	lookup_palette_scalar,
+	apply_mask_scalar,
+	premultiply_scalar,
+	has_alpha_scalar,
+};
+
+#ifdef DECODE_X86
+// SSE2 kernels, 4 pixels at a time
+
+TARGET_SSE2 static void bgra_to_rgba_sse2(const BYTE *src, BYTE *dst, DWORD width)
+{
+	const __m128i rbMask = _mm_set1_epi32(0x00ff00ff);
+	DWORD x = 0;
+	for (; x + 4 <= width; x += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + x * 4));
+
+		// Swap bytes 0 and 2 of each pixel, keeping 1 and 3
+		__m128i rb = _mm_and_si128(v, rbMask);
+		__m128i ga = _mm_andnot_si128(rbMask, v);
+		rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+		_mm_storeu_si128((__m128i *)(dst + x * 4), _mm_or_si128(rb, ga));
+	}
+	bgra_to_rgba_scalar(src + x * 4, dst + x * 4, width - x);
+}
+
+TARGET_SSE2 static void apply_mask_sse2(BYTE *pixels, const BYTE *mask, DWORD width)
+{
+	const __m128i opaque = _mm_set1_epi32((int)0xff000000);
+	const __m128i bitsLo = _mm_set_epi32(0x10, 0x20, 0x40, 0x80);
+	const __m128i bitsHi = _mm_set_epi32(0x01, 0x02, 0x04, 0x08);
+	DWORD x = 0;
+	for (; x + 8 <= width; x += 8) {
+		// Each mask byte covers 8 pixels, the first in its highest bit
+		__m128i m = _mm_set1_epi32(mask[x >> 3]);
+		__m128i setLo = _mm_cmpeq_epi32(_mm_and_si128(m, bitsLo), bitsLo);
+		__m128i setHi = _mm_cmpeq_epi32(_mm_and_si128(m, bitsHi), bitsHi);
+
+		__m128i *p = (__m128i *)(pixels + x * 4);
+		__m128i lo = _mm_or_si128(_mm_loadu_si128(p), opaque);
+		__m128i hi = _mm_or_si128(_mm_loadu_si128(p + 1), opaque);
+		_mm_storeu_si128(p, _mm_andnot_si128(setLo, lo));
+		_mm_storeu_si128(p + 1, _mm_andnot_si128(setHi, hi));
+	}
+	for (; x < width; x++) {
+		BYTE *pixel = pixels + x * 4;
+		if (mask[x >> 3] & (0x80 >> (x & 7))) {
+			memset(pixel, 0, 4);
+		} else {
+			pixel[3] = 255;
+		}
+	}
+}
+
+// Premultiplies 2 pixels unpacked to 16 bits per channel. The alpha channel
+// is multiplied by 255, which leaves it as it is.
+TARGET_SSE2 static __m128i premultiply_16_sse2(__m128i v)
+{
+	const __m128i colorMask = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+	const __m128i alpha255 = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+	const __m128i round = _mm_set1_epi16(128);
+
+	__m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xff), 0xff);
+	a = _mm_or_si128(_mm_and_si128(a, colorMask), alpha255);
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(v, a), round);
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+TARGET_SSE2 static void premultiply_sse2(BYTE *pixels, DWORD width)
+{
+	const __m128i zero = _mm_setzero_si128();
+	DWORD x = 0;
+	for (; x + 4 <= width; x += 4) {
+		__m128i *p = (__m128i *)(pixels + x * 4);
+		__m128i v = _mm_loadu_si128(p);
+		__m128i lo = premultiply_16_sse2(_mm_unpacklo_epi8(v, zero));
+		__m128i hi = premultiply_16_sse2(_mm_unpackhi_epi8(v, zero));
+		_mm_storeu_si128(p, _mm_packus_epi16(lo, hi));
+	}
+	premultiply_scalar(pixels + x * 4, width - x);
+}
+
+TARGET_SSE2 static BOOL has_alpha_sse2(const BYTE *src, size_t numPixels)
+{
+	__m128i acc = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 4 <= numPixels; i += 4) {
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(src + i * 4)));
+	}
+	acc = _mm_and_si128(acc, _mm_set1_epi32((int)0xff000000));
+	if (_mm_movemask_epi8(_mm_cmpeq_epi32(acc, _mm_setzero_si128())) != 0xffff) {
+		return TRUE;
+	}
+	return has_alpha_scalar(src + i * 4, numPixels - i);
+}
+
+static const DecodeKernels sse2Kernels = {
+	bgra_to_rgba_sse2,
+	bgr_to_rgba_scalar,
+	lookup_palette_scalar,
+	apply_mask_sse2,
+	premultiply_sse2,
+	has_alpha_sse2,
+};
+
+// AVX2 kernels, 8 pixels at a time
+
+TARGET_AVX2 static void bgra_to_rgba_avx2(const BYTE *src, BYTE *dst, DWORD width)
+{
+	const __m256i shuffle = _mm256_setr_epi8(
+		2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+		2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+	DWORD x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + x * 4));
+		_mm256_storeu_si256((__m256i *)(dst + x * 4), _mm256_shuffle_epi8(v, shuffle));
+	}
+	bgra_to_rgba_scalar(src + x * 4, dst + x * 4, width - x);
+}
+
+TARGET_AVX2 static void bgr_to_rgba_avx2(const BYTE *src, BYTE *dst, DWORD width)
+{
+	// Move the second 4 pixels (bytes 12-23) to the upper lane, since
+	// byte shuffles can't cross lanes, then spread each lane's 12 bytes
+	// into 16
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+	const __m256i shuffle = _mm256_setr_epi8(
+		2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+		2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+	const __m256i opaque = _mm256_set1_epi32((int)0xff000000);
+	DWORD x = 0;
+
+	// Each step loads 32 bytes but uses 24, so stop while the full 32 are
+	// still within the row
+	for (; x + 11 <= width; x += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + x * 3));
+		v = _mm256_permutevar8x32_epi32(v, lanes);
+		v = _mm256_or_si256(_mm256_shuffle_epi8(v, shuffle), opaque);
+		_mm256_storeu_si256((__m256i *)(dst + x * 4), v);
+	}
+	bgr_to_rgba_scalar(src + x * 3, dst + x * 4, width - x);
+}
+
+TARGET_AVX2 static void lookup_palette_avx2(const BYTE *indices, const BYTE *palette, BYTE *dst, DWORD width)
+{
+	DWORD x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(indices + x)));
+		__m256i v = _mm256_i32gather_epi32((const int *)palette, idx, 4);
+		_mm256_storeu_si256((__m256i *)(dst + x * 4), v);
+	}
+	lookup_palette_scalar(indices + x, palette, dst + x * 4, width - x);
+}
+
+TARGET_AVX2 static void apply_mask_avx2(BYTE *pixels, const BYTE *mask, DWORD width)
+{
+	const __m256i opaque = _mm256_set1_epi32((int)0xff000000);
+	const __m256i bits = _mm256_setr_epi32(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+	DWORD x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m256i m = _mm256_set1_epi32(mask[x >> 3]);
+		__m256i set = _mm256_cmpeq_epi32(_mm256_and_si256(m, bits), bits);
+		__m256i *p = (__m256i *)(pixels + x * 4);
+		__m256i v = _mm256_or_si256(_mm256_loadu_si256(p), opaque);
+		_mm256_storeu_si256(p, _mm256_andnot_si256(set, v));
+	}
+
+	// Needed before calling SSE code, which GCC doesn't always see
+	_mm256_zeroupper();
+	apply_mask_sse2(pixels + x * 4, mask + (x >> 3), width - x);
+}
+
+TARGET_AVX2 static __m256i premultiply_16_avx2(__m256i v)
+{
+	const __m256i colorMask = _mm256_set_epi16(0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1);
+	const __m256i alpha255 = _mm256_set_epi16(255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0);
+	const __m256i round = _mm256_set1_epi16(128);
+
+	__m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(v, 0xff), 0xff);
+	a = _mm256_or_si256(_mm256_and_si256(a, colorMask), alpha255);
+	__m256i t = _mm256_add_epi16(_mm256_mullo_epi16(v, a), round);
+	return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+TARGET_AVX2 static void premultiply_avx2(BYTE *pixels, DWORD width)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	DWORD x = 0;
+	for (; x + 8 <= width; x += 8) {
+		// Unpacking and packing both work within lanes, so they cancel out
+		__m256i *p = (__m256i *)(pixels + x * 4);
+		__m256i v = _mm256_loadu_si256(p);
+		__m256i lo = premultiply_16_avx2(_mm256_unpacklo_epi8(v, zero));
+		__m256i hi = premultiply_16_avx2(_mm256_unpackhi_epi8(v, zero));
+		_mm256_storeu_si256(p, _mm256_packus_epi16(lo, hi));
+	}
+	_mm256_zeroupper();
+	premultiply_sse2(pixels + x * 4, width - x);
+}
+
+TARGET_AVX2 static BOOL has_alpha_avx2(const BYTE *src, size_t numPixels)
+{
+	__m256i acc = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 8 <= numPixels; i += 8) {
+		acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i *)(src + i * 4)));
+	}
+	if (!_mm256_testz_si256(acc, _mm256_set1_epi32((int)0xff000000))) {
+		return TRUE;
+	}
+	return has_alpha_sse2(src + i * 4, numPixels - i);
+}
+
+static const DecodeKernels avx2Kernels = {
+	bgra_to_rgba_avx2,
+	bgr_to_rgba_avx2,
+	lookup_palette_avx2,
+	apply_mask_avx2,
+	premultiply_avx2,
+	has_alpha_avx2,
+};
+
+static BOOL cpu_has_sse2(void)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+	return TRUE;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[3] & (1 << 26)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+#endif
+}
+
+static BOOL cpu_has_avx2(void)
+{
+#ifdef _MSC_VER
+	// AVX2 needs both the CPU and the OS (which must save the YMM
+	// registers) to support it
+	int info[4];
+	__cpuid(info, 1);
+	if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6) {
+		return FALSE;
+	}
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+GetExeIconIsa get_exe_icon_cpu_isa(void)
+{
+#ifdef DECODE_X86
+	if (cpu_has_avx2()) {
+		return GET_EXE_ICON_ISA_AVX2;
+	}
+	if (cpu_has_sse2()) {
+		return GET_EXE_ICON_ISA_SSE2;
+	}
+#endif
+	return GET_EXE_ICON_ISA_SCALAR;
+}
+
+// Chooses the kernels for the most advanced instruction set that is both
+// allowed by 'isa' and supported by the CPU.
+static const DecodeKernels *select_kernels(GetExeIconIsa isa)
+{
+	GetExeIconIsa cpuIsa = get_exe_icon_cpu_isa();
+	if (isa == GET_EXE_ICON_ISA_AUTO || isa > cpuIsa) {
+		isa = cpuIsa;
+	}
+
+	switch (isa) {
+#ifdef DECODE_X86
+	case GET_EXE_ICON_ISA_AVX2:
+		return &avx2Kernels;
+	case GET_EXE_ICON_ISA_SSE2:
+		return &sse2Kernels;
+#endif
+	default:
+		return &scalarKernels;
+	}
+}
+
+// Unpacks a row of 1 or 4 bit palette indices to one byte each
+static void unpack_indices(const BYTE *src, uint32_t bitCount, BYTE *indices, DWORD width)
+{
+	if (bitCount == 1) {
+		for (DWORD x = 0; x < width; x++) {
+			indices[x] = (src[x >> 3] >> (7 - (x & 7))) & 1;
+		}
+	} else {
+		for (DWORD x = 0; x < width; x++) {
+			indices[x] = (src[x >> 1] >> ((x & 1) ? 0 : 4)) & 0xf;
+		}
+	}
+}
+
+BOOL get_exe_icon_decode_dib(const void *data, size_t len, const GetExeIconDecodeOptions *options, GetExeIconBitmap *bitmap)
+{
+	if (bitmap) {
+		memset(bitmap, 0, sizeof(GetExeIconBitmap));
+	}
+	if (!data || !options || !bitmap) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return FALSE;
+	}
+
+	const BYTE *dib = (const BYTE *)data;
+	if (len >= 8 && memcmp(dib, "\x89PNG\r\n\x1a\n", 8) == 0) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_UNSUPPORTED);
+		return FALSE;
+	}
+	if (len < DIB_HEADER_SIZE) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_NO_ICON);
+		return FALSE;
+	}
+
+	uint32_t headerSize = read_le32(dib);
+	int32_t dibWidth = (int32_t)read_le32(dib + 4);
+	int32_t dibHeight = (int32_t)read_le32(dib + 8);
+	uint32_t bitCount = read_le16(dib + 14);
+	uint32_t compression = read_le32(dib + 16);
+	uint32_t colorsUsed = read_le32(dib + 32);
+
+	// The height covers both the image and the mask. Bottom-up images (with
+	// positive heights) are the only kind allowed in ICOs.
+	if (headerSize < DIB_HEADER_SIZE
+		|| headerSize > len
+		|| dibWidth <= 0
+		|| dibHeight < 2)
+	{
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_NO_ICON);
+		return FALSE;
+	}
+	if (compression != BI_RGB
+		|| (bitCount != 1 && bitCount != 4 && bitCount != 8 && bitCount != 24 && bitCount != 32))
+	{
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_UNSUPPORTED);
+		return FALSE;
+	}
+
+	const DWORD width = (DWORD)dibWidth;
+	const DWORD height = (DWORD)dibHeight / 2;
+
+	// The color table, with unused entries black
+	BYTE palette[256 * 4];
+	uint64_t offset = headerSize;
+	if (bitCount <= 8) {
+		uint32_t numColors = 1u << bitCount;
+		if (colorsUsed > 0 && colorsUsed < numColors) {
+			numColors = colorsUsed;
+		}
+		if (numColors * 4 > len - offset) {
+			get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_NO_ICON);
+			return FALSE;
+		}
+		memset(palette, 0, sizeof(palette));
+		for (uint32_t i = 0; i < 256; i++) {
+			palette[i * 4 + 3] = 255;
+		}
+		for (uint32_t i = 0; i < numColors; i++) {
+			const BYTE *bgrx = dib + offset + i * 4;
+			palette[i * 4 + 0] = bgrx[2];
+			palette[i * 4 + 1] = bgrx[1];
+			palette[i * 4 + 2] = bgrx[0];
+		}
+		offset += numColors * 4;
+	}
+
+	// The image must be present; the mask may be missing, in which case
+	// every pixel is opaque
+	const uint64_t stride = ((uint64_t)width * bitCount + 31) / 32 * 4;
+	const uint64_t maskStride = ((uint64_t)width + 31) / 32 * 4;
+	if (stride * height > len - offset) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_NO_ICON);
+		return FALSE;
+	}
+	const BYTE *pixels = dib + offset;
+	const BYTE *mask = NULL;
+	if (maskStride * height <= len - offset - stride * height) {
+		mask = pixels + stride * height;
+	}
+
+	if ((uint64_t)width * height > SIZE_MAX / 4) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_TOO_LARGE);
+		return FALSE;
+	}
+	PBYTE out = (PBYTE)malloc((size_t)width * height * 4);
+
+	// Scratch space for a row of unpacked indices, and an empty mask for
+	// images without one
+	BYTE *scratch = (BYTE *)calloc(1, (size_t)(width + maskStride));
+	if (!out || !scratch) {
+		free(out);
+		free(scratch);
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+		return FALSE;
+	}
+	BYTE *indices = scratch;
+	const BYTE *emptyMask = scratch + width;
+
+	const DecodeKernels *k = select_kernels(options->isa);
+	BOOL alpha = bitCount == 32 && k->has_alpha(pixels, (size_t)width * height);
+
+	for (DWORD y = 0; y < height; y++) {
+		const BYTE *src = pixels + (height - 1 - y) * stride;
+		BYTE *dst = out + (size_t)y * width * 4;
+
+		switch (bitCount) {
+		case 32:
+			k->bgra_to_rgba(src, dst, width);
+			break;
+		case 24:
+			k->bgr_to_rgba(src, dst, width);
+			break;
+		case 8:
+			k->lookup_palette(src, palette, dst, width);
+			break;
+		default:
+			unpack_indices(src, bitCount, indices, width);
+			k->lookup_palette(indices, palette, dst, width);
+			break;
+		}
+
+		if (alpha) {
+			if (options->premultiplied) {
+				k->premultiply(dst, width);
+			}
+		} else {
+			// Opaque or fully transparent pixels are the same either
+			// way, premultiplied or not
+			k->apply_mask(dst, mask ? mask + (height - 1 - y) * maskStride : emptyMask, width);
+		}
+	}
+
+	free(scratch);
+
+	bitmap->width = width;
+	bitmap->height = height;
+	bitmap->pixels = out;
+	get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+	return TRUE;
+}
+
+BOOL get_exe_icon_decode_ico_image(const void *icoBuf, size_t bufLen, DWORD index, const GetExeIconDecodeOptions *options, GetExeIconBitmap *bitmap)
+{
+	if (bitmap) {
+		memset(bitmap, 0, sizeof(GetExeIconBitmap));
+	}
+	if (!icoBuf || !options || !bitmap) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return FALSE;
+	}
+
+	const BYTE *ico = (const BYTE *)icoBuf;
+	if (bufLen < ICO_HEADER_SIZE || read_le16(ico + 2) != 1) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_NO_ICON);
+		return FALSE;
+	}
+	if (index >= read_le16(ico + 4)) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return FALSE;
+	}
+
+	uint64_t entryOffset = ICO_HEADER_SIZE + (uint64_t)index * ICO_DIR_ENTRY_SIZE;
+	if (entryOffset + ICO_DIR_ENTRY_SIZE > bufLen) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_NO_ICON);
+		return FALSE;
+	}
+	uint32_t imageLen = read_le32(ico + entryOffset + 8);
+	uint32_t imageOffset = read_le32(ico + entryOffset + 12);
+	if (imageOffset > bufLen || imageLen > bufLen - imageOffset) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_NO_ICON);
+		return FALSE;
+	}
+
+	return get_exe_icon_decode_dib(ico + imageOffset, imageLen, options, bitmap);
+}
+
+void get_exe_icon_bitmap_free(GetExeIconBitmap *bitmap)
+{
+	if (!bitmap) {
+		return;
+	}
+	free(bitmap->pixels);
+	memset(bitmap, 0, sizeof(GetExeIconBitmap));
+}
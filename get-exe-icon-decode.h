@@ -0,0 +1,94 @@
+// Copyright (c) 2021 Aury Snow
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef GET_EXE_ICON_DECODE_H
+#define GET_EXE_ICON_DECODE_H
+
+#include "get-exe-icon.h"
+
+// Decodes the bitmap (DIB) images of ICOs to RGBA pixels. 1, 4, 8, 24 and 32
+// bit images are supported, along with their 1 bit AND masks. PNG images are
+// not decoded (they are already in a standard format); decoding one fails
+// with GET_EXE_ICON_ERROR_UNSUPPORTED.
+//
+// The per-row work (palette lookups, BGR to RGBA conversion, applying the
+// mask and premultiplying) is done by SSE2 or AVX2 code when the CPU supports
+// it, chosen at runtime, with plain C code as the fallback. All of them give
+// identical results.
+
+// The instruction sets the decoder can use
+typedef enum
+{
+	GET_EXE_ICON_ISA_AUTO = 0,  // The best one the CPU supports
+	GET_EXE_ICON_ISA_SCALAR,
+	GET_EXE_ICON_ISA_SSE2,
+	GET_EXE_ICON_ISA_AVX2,
+} GetExeIconIsa;
+
+// Gets the most advanced instruction set that the CPU supports, out of those
+// above. Never GET_EXE_ICON_ISA_AUTO.
+GetExeIconIsa get_exe_icon_cpu_isa(void);
+
+// Options for decoding. Zero-initialize it and set the fields that are needed.
+typedef struct
+{
+	// Multiply each pixel's color by its alpha, as most compositors and
+	// resamplers expect. Otherwise the colors are left as they are.
+	BOOL premultiplied;
+
+	// The most advanced instruction set to use, if the CPU supports it.
+	// Lower ones are only useful for testing and benchmarking.
+	GetExeIconIsa isa;
+} GetExeIconDecodeOptions;
+
+// An image as RGBA pixels: 4 bytes per pixel, in the order red, green, blue,
+// alpha, with rows from top to bottom and no padding between them.
+typedef struct
+{
+	DWORD width;
+	DWORD height;
+	PBYTE pixels;
+} GetExeIconBitmap;
+
+// Decodes a DIB as stored in an ICO file: a BITMAPINFOHEADER with twice the
+// image's height, the color table (for 8 bits or fewer), the pixels, and then
+// the AND mask. This is the form of the images returned with
+// GetExeIconOptions.rawImage. Pixels set in the mask are transparent, unless
+// the image is 32 bit and has an alpha channel (one that isn't all 0), which
+// is used instead. Transparent pixels from the mask are decoded as 0.
+//
+// data, len: The DIB. Every offset is checked against len, so it may come
+//            from an untrusted source.
+//
+// bitmap (OUT): The decoded image. Free its pixels with
+//               get_exe_icon_bitmap_free().
+//
+// Return Value: TRUE on success. On error FALSE is returned, and
+//               get_exe_icon_last_error() says why.
+BOOL get_exe_icon_decode_dib(const void *data, size_t len, const GetExeIconDecodeOptions *options, GetExeIconBitmap *bitmap);
+
+// Same as get_exe_icon_decode_dib() except the DIB is image 'index' of an ICO
+// file, e.g. one returned by get_exe_icon_from_file_utf16().
+BOOL get_exe_icon_decode_ico_image(const void *icoBuf, size_t bufLen, DWORD index, const GetExeIconDecodeOptions *options, GetExeIconBitmap *bitmap);
+
+// Frees a bitmap's pixels and zeroes it.
+void get_exe_icon_bitmap_free(GetExeIconBitmap *bitmap);
+
+#endif
@@ -0,0 +1,1274 @@
+// Copyright (c) 2021 Aury Snow
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include "get-exe-icon-deflate.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Notes about the code:
+//
+// The compressor has the whole input in memory, so unlike zlib it has no
+// sliding window to maintain: positions are offsets into the input, and the
+// hash chains only remember the last 32K positions, which is as far back as
+// a match can reach. The hash covers 4 bytes rather than deflate's minimum
+// match of 3, which finds fewer short matches but skips most false hits, and
+// lines up with the 4 bytes of an RGBA pixel. Levels 1-3 take the first
+// long enough match (greedy); levels 4-9 check whether the next position has
+// a longer one before taking it (lazy), as zlib does.
+//
+// Matches and literals are collected as tokens, up to BLOCK_TOKENS of them
+// per block. For each block, the size it would take with dynamic Huffman
+// codes, the fixed codes, or stored is computed from the symbol frequencies,
+// and the smallest is written. Huffman code lengths are limited to 15 bits
+// (7 for the code length code) by the same adjustment miniz uses, which
+// moves codes up from the longest level until the lengths form a complete
+// code again.
+//
+// The decompressor also has the whole input in memory, and writes into a
+// buffer of a size known up front (a ZIP entry's), so matches are copied
+// from earlier in that buffer and there is no window either. Input is read
+// into a 64 bit buffer that is topped up once per symbol, which is enough
+// for a length, distance and their extra bits, so decoding a match checks
+// for the end of the input only once. Past the end, zeros are read and it's
+// checked afterwards whether any of them were used.
+
+#define WINDOW_SIZE  32768
+#define WINDOW_MASK  (WINDOW_SIZE - 1)
+#define HASH_BITS    15
+#define HASH_SIZE    (1 << HASH_BITS)
+
+#define MIN_MATCH  4
+#define MAX_MATCH  258
+
+#define BLOCK_TOKENS  32768
+
+#define NUM_LITLEN_CODES  286
+#define NUM_DIST_CODES    30
+#define NUM_CL_CODES      19
+#define END_OF_BLOCK      256
+
+// The fixed code also has lengths for two codes of each that are never used
+#define NUM_FIXED_LITLEN_CODES  288
+#define NUM_FIXED_DIST_CODES    32
+
+#define MAX_CODE_BITS     15
+#define MAX_CL_CODE_BITS  7
+
+// Largest stored block
+#define MAX_STORED  65535
+
+// A literal (dist 0, litLen the byte) or a match (litLen bytes from dist
+// bytes back)
+typedef struct
+{
+	uint16_t litLen;
+	uint16_t dist;
+} Token;
+
+typedef struct
+{
+	DWORD maxChain;  // Most hash chain entries to check per position
+	DWORD niceLen;   // Stop looking once a match is this long
+	BOOL lazy;
+} LevelParams;
+
+static const LevelParams levelParams[] = {
+	{ 0, 0, FALSE },       // 0: stored
+	{ 4, 16, FALSE },
+	{ 8, 32, FALSE },
+	{ 16, 64, FALSE },
+	{ 16, 32, TRUE },
+	{ 32, 64, TRUE },
+	{ 128, 128, TRUE },
+	{ 256, MAX_MATCH, TRUE },
+	{ 1024, MAX_MATCH, TRUE },
+	{ 4096, MAX_MATCH, TRUE },
+};
+
+// The order that code length code lengths are written in
+static const BYTE clOrder[NUM_CL_CODES] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+static const uint32_t crcTable[256] = {
+	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
+	0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+	0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
+	0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+	0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
+	0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+	0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
+	0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+	0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
+	0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+	0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
+	0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+	0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
+	0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+	0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
+	0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+	0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
+	0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+	0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
+	0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+	0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
+	0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+	0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
+	0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+	0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
+	0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+	0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
+	0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+	0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
+	0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+	0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
+	0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+	0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
+	0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+	0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
+	0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+	0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
+	0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+	0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
+	0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+	0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
+	0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d,
+};
+
+typedef struct
+{
+	PBYTE buf;
+	size_t len;
+	size_t cap;
+	uint64_t bitBuf;
+	DWORD numBits;
+} BitWriter;
+
+typedef struct
+{
+	const BYTE *data;
+	size_t len;
+	LevelParams params;
+
+	int32_t *head;   // HASH_SIZE entries: the last position with each hash
+	int32_t *prev;   // WINDOW_SIZE entries: the position before each one with its hash
+
+	Token *tokens;
+	DWORD numTokens;
+	size_t blockStart;  // Input offset of the current block's first token
+	size_t blockEnd;    // Input offset after its last token
+
+	BitWriter out;
+} Deflater;
+
+uint32_t get_exe_icon_crc32(uint32_t crc, const void *data, size_t len)
+{
+	const BYTE *p = (const BYTE *)data;
+	crc = ~crc;
+	for (size_t i = 0; i < len; i++) {
+		crc = crcTable[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+uint32_t get_exe_icon_adler32(uint32_t adler, const void *data, size_t len)
+{
+	// The most bytes that can be summed before b could overflow 32 bits
+	const size_t maxRun = 5552;
+
+	const BYTE *p = (const BYTE *)data;
+	uint32_t a = adler & 0xffff;
+	uint32_t b = adler >> 16;
+	while (len > 0) {
+		size_t n = len < maxRun ? len : maxRun;
+		len -= n;
+		while (n--) {
+			a += *p++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return a | (b << 16);
+}
+
+// Reads 4 bytes in native byte order, for hashing and comparing
+static uint32_t load32(const BYTE *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static uint32_t hash4(const BYTE *p)
+{
+	return (load32(p) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static DWORD floor_log2(DWORD x)
+{
+	DWORD n = 0;
+	while (x >>= 1) {
+		n ++;
+	}
+	return n;
+}
+
+// The code for a match length, with its extra bits (count and value)
+static DWORD length_code(DWORD len, DWORD *numExtra, DWORD *extra)
+{
+	DWORD l = len - 3;
+	if (l < 8 || l == 255) {
+		*numExtra = 0;
+		*extra = 0;
+		return l < 8 ? 257 + l : 285;
+	}
+	DWORD e = floor_log2(l) - 2;
+	DWORD k = (l >> e) & 3;
+	*numExtra = e;
+	*extra = l - ((4 | k) << e);
+	return 257 + 4 * e + 4 + k;
+}
+
+// The code for a match distance, with its extra bits
+static DWORD dist_code(DWORD dist, DWORD *numExtra, DWORD *extra)
+{
+	DWORD d = dist - 1;
+	if (d < 4) {
+		*numExtra = 0;
+		*extra = 0;
+		return d;
+	}
+	DWORD e = floor_log2(d) - 1;
+	DWORD k = (d >> e) & 1;
+	*numExtra = e;
+	*extra = d - ((2 | k) << e);
+	return 2 * e + 2 + k;
+}
+
+// Extra bits that come with each length and distance code
+static DWORD length_extra_bits(DWORD code)
+{
+	return code < 265 || code == 285 ? 0 : (code - 261) / 4;
+}
+
+static DWORD dist_extra_bits(DWORD code)
+{
+	return code < 4 ? 0 : code / 2 - 1;
+}
+
+// Bit output. Blocks reserve the space they need before they're written, so
+// put_bits doesn't check.
+
+static BOOL reserve(BitWriter *w, size_t bytes)
+{
+	if (w->cap - w->len >= bytes) {
+		return TRUE;
+	}
+	size_t cap = w->cap * 2 > w->len + bytes ? w->cap * 2 : w->len + bytes;
+	PBYTE buf = (PBYTE)realloc(w->buf, cap);
+	if (!buf) {
+		return FALSE;
+	}
+	w->buf = buf;
+	w->cap = cap;
+	return TRUE;
+}
+
+// Writes up to 32 bits, least significant first
+static void put_bits(BitWriter *w, uint32_t bits, DWORD n)
+{
+	w->bitBuf |= (uint64_t)bits << w->numBits;
+	w->numBits += n;
+	if (w->numBits >= 32) {
+		w->buf[w->len++] = (BYTE)w->bitBuf;
+		w->buf[w->len++] = (BYTE)(w->bitBuf >> 8);
+		w->buf[w->len++] = (BYTE)(w->bitBuf >> 16);
+		w->buf[w->len++] = (BYTE)(w->bitBuf >> 24);
+		w->bitBuf >>= 32;
+		w->numBits -= 32;
+	}
+}
+
+// Pads to a byte boundary and writes out the bits waiting in bitBuf
+static void flush_bits(BitWriter *w)
+{
+	while (w->numBits > 0) {
+		w->buf[w->len++] = (BYTE)w->bitBuf;
+		w->bitBuf >>= 8;
+		w->numBits = w->numBits > 8 ? w->numBits - 8 : 0;
+	}
+	w->bitBuf = 0;
+}
+
+// Huffman codes
+
+static int compare_uint32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+// Builds the code lengths, of at most maxBits, of a Huffman code for
+// 'numSymbols' symbols with the given frequencies. A code always has at
+// least two symbols, since inflaters reject incomplete codes.
+static void build_lengths(const uint32_t *freqs, DWORD numSymbols, DWORD maxBits, BYTE *lengths)
+{
+	// Symbols by ascending frequency, as (frequency << 9) | symbol
+	uint32_t sorted[NUM_LITLEN_CODES];
+	uint32_t weights[2 * NUM_LITLEN_CODES];
+	uint16_t parents[2 * NUM_LITLEN_CODES];
+	uint16_t depths[2 * NUM_LITLEN_CODES];
+	DWORD counts[MAX_CODE_BITS + 1] = { 0 };
+
+	memset(lengths, 0, numSymbols);
+	DWORD n = 0;
+	for (DWORD s = 0; s < numSymbols; s++) {
+		if (freqs[s]) {
+			sorted[n++] = (freqs[s] << 9) | s;
+		}
+	}
+	if (n < 2) {
+		// A lone symbol (or none) gets a partner to make the code complete
+		DWORD s = n == 1 ? sorted[0] & 511 : 0;
+		lengths[s] = 1;
+		lengths[s == 0 ? 1 : 0] = 1;
+		return;
+	}
+	qsort(sorted, n, sizeof(uint32_t), compare_uint32);
+
+	// Leaves are nodes 0 to n-1 and internal nodes n to 2n-2, both created
+	// in order of weight, so the two lightest nodes are always at the front
+	// of one queue or the other
+	for (DWORD i = 0; i < n; i++) {
+		weights[i] = sorted[i] >> 9;
+	}
+	DWORD leaf = 0, node = n;
+	for (DWORD next = n; next < 2 * n - 1; next++) {
+		weights[next] = 0;
+		for (int c = 0; c < 2; c++) {
+			DWORD child = leaf < n && (node >= next || weights[leaf] <= weights[node]) ? leaf++ : node++;
+			weights[next] += weights[child];
+			parents[child] = (uint16_t)next;
+		}
+	}
+	depths[2 * n - 2] = 0;
+	for (DWORD i = 2 * n - 2; i-- > 0;) {
+		depths[i] = (uint16_t)(depths[parents[i]] + 1);
+	}
+
+	// Limit the lengths, then shorten codes at the longest length until
+	// they form a complete code again
+	for (DWORD i = 0; i < n; i++) {
+		counts[depths[i] > maxBits ? maxBits : depths[i]] ++;
+	}
+	uint32_t total = 0;
+	for (DWORD len = 1; len <= maxBits; len++) {
+		total += counts[len] << (maxBits - len);
+	}
+	while (total > (1u << maxBits)) {
+		counts[maxBits] --;
+		for (DWORD len = maxBits - 1; len > 0; len--) {
+			if (counts[len]) {
+				counts[len] --;
+				counts[len + 1] += 2;
+				break;
+			}
+		}
+		total --;
+	}
+
+	// The least frequent symbols get the longest codes
+	DWORD i = 0;
+	for (DWORD len = maxBits; len > 0; len--) {
+		for (DWORD c = 0; c < counts[len]; c++) {
+			lengths[sorted[i++] & 511] = (BYTE)len;
+		}
+	}
+}
+
+// Builds the canonical codes for the given lengths, bit-reversed since
+// deflate writes them from the most significant bit
+static void build_codes(const BYTE *lengths, DWORD numSymbols, uint16_t *codes)
+{
+	DWORD counts[MAX_CODE_BITS + 1] = { 0 };
+	DWORD next[MAX_CODE_BITS + 1];
+	for (DWORD s = 0; s < numSymbols; s++) {
+		counts[lengths[s]] ++;
+	}
+	counts[0] = 0;
+	DWORD code = 0;
+	for (DWORD len = 1; len <= MAX_CODE_BITS; len++) {
+		code = (code + counts[len - 1]) << 1;
+		next[len] = code;
+	}
+	for (DWORD s = 0; s < numSymbols; s++) {
+		DWORD len = lengths[s];
+		if (len == 0) {
+			codes[s] = 0;
+			continue;
+		}
+		DWORD c = next[len]++;
+		DWORD reversed = 0;
+		for (DWORD b = 0; b < len; b++) {
+			reversed = (reversed << 1) | ((c >> b) & 1);
+		}
+		codes[s] = (uint16_t)reversed;
+	}
+}
+
+static void fixed_lengths(BYTE *litLens, BYTE *distLens)
+{
+	memset(litLens, 8, 144);
+	memset(litLens + 144, 9, 112);
+	memset(litLens + 256, 7, 24);
+	memset(litLens + 280, 8, 8);
+	memset(distLens, 5, 32);
+}
+
+// Run-length encodes code lengths with the code length code's symbols 16
+// (repeat the previous length), 17 and 18 (runs of zeros). Returns the
+// number of symbols.
+static DWORD rle_lengths(const BYTE *lengths, DWORD n, BYTE *symbols, BYTE *extras)
+{
+	DWORD count = 0;
+	for (DWORD i = 0; i < n;) {
+		BYTE len = lengths[i];
+		DWORD run = 1;
+		while (i + run < n && lengths[i + run] == len) {
+			run ++;
+		}
+		i += run;
+
+		if (len == 0) {
+			while (run >= 11) {
+				DWORD r = run < 138 ? run : 138;
+				symbols[count] = 18;
+				extras[count++] = (BYTE)(r - 11);
+				run -= r;
+			}
+			if (run >= 3) {
+				symbols[count] = 17;
+				extras[count++] = (BYTE)(run - 3);
+				run = 0;
+			}
+		} else {
+			symbols[count] = len;
+			extras[count++] = 0;
+			run --;
+			while (run >= 3) {
+				DWORD r = run < 6 ? run : 6;
+				symbols[count] = 16;
+				extras[count++] = (BYTE)(r - 3);
+				run -= r;
+			}
+		}
+		while (run > 0) {
+			symbols[count] = len;
+			extras[count++] = 0;
+			run --;
+		}
+	}
+	return count;
+}
+
+// Blocks
+
+// Bits needed to write tokens with the given code lengths
+static uint64_t tokens_cost(const uint32_t *litFreqs, const uint32_t *distFreqs, const BYTE *litLens, const BYTE *distLens)
+{
+	uint64_t bits = 0;
+	for (DWORD s = 0; s < NUM_LITLEN_CODES; s++) {
+		bits += (uint64_t)litFreqs[s] * (litLens[s] + (s > END_OF_BLOCK ? length_extra_bits(s) : 0));
+	}
+	for (DWORD s = 0; s < NUM_DIST_CODES; s++) {
+		bits += (uint64_t)distFreqs[s] * (distLens[s] + dist_extra_bits(s));
+	}
+	return bits;
+}
+
+// Writes the block's tokens with the given code lengths for numLit
+// literal/length and numDist distance symbols. The fixed code has lengths
+// for two more of each, which affect the codes of the others.
+static void write_tokens(Deflater *d, const BYTE *litLens, DWORD numLit, const BYTE *distLens, DWORD numDist)
+{
+	uint16_t litCodes[NUM_FIXED_LITLEN_CODES], distCodes[NUM_FIXED_DIST_CODES];
+	build_codes(litLens, numLit, litCodes);
+	build_codes(distLens, numDist, distCodes);
+
+	BitWriter *w = &d->out;
+	for (DWORD i = 0; i < d->numTokens; i++) {
+		const Token *t = &d->tokens[i];
+		if (t->dist == 0) {
+			put_bits(w, litCodes[t->litLen], litLens[t->litLen]);
+			continue;
+		}
+		DWORD numExtra, extra;
+		DWORD code = length_code(t->litLen, &numExtra, &extra);
+		put_bits(w, litCodes[code] | (extra << litLens[code]), litLens[code] + numExtra);
+		code = dist_code(t->dist, &numExtra, &extra);
+		put_bits(w, distCodes[code] | (extra << distLens[code]), distLens[code] + numExtra);
+	}
+	put_bits(w, litCodes[END_OF_BLOCK], litLens[END_OF_BLOCK]);
+}
+
+static void write_stored(Deflater *d, BOOL final)
+{
+	BitWriter *w = &d->out;
+	size_t pos = d->blockStart;
+	do {
+		size_t n = d->blockEnd - pos < MAX_STORED ? d->blockEnd - pos : MAX_STORED;
+		put_bits(w, final && pos + n == d->blockEnd, 3);
+		flush_bits(w);
+		w->buf[w->len++] = (BYTE)n;
+		w->buf[w->len++] = (BYTE)(n >> 8);
+		w->buf[w->len++] = (BYTE)~n;
+		w->buf[w->len++] = (BYTE)(~n >> 8);
+		memcpy(w->buf + w->len, d->data + pos, n);
+		w->len += n;
+		pos += n;
+	} while (pos < d->blockEnd);
+}
+
+// Writes the tokens collected so far as a block
+static BOOL write_block(Deflater *d, BOOL final)
+{
+	uint32_t litFreqs[NUM_LITLEN_CODES] = { 0 };
+	uint32_t distFreqs[NUM_DIST_CODES] = { 0 };
+	for (DWORD i = 0; i < d->numTokens; i++) {
+		const Token *t = &d->tokens[i];
+		if (t->dist == 0) {
+			litFreqs[t->litLen] ++;
+		} else {
+			DWORD numExtra, extra;
+			litFreqs[length_code(t->litLen, &numExtra, &extra)] ++;
+			distFreqs[dist_code(t->dist, &numExtra, &extra)] ++;
+		}
+	}
+	litFreqs[END_OF_BLOCK] = 1;
+
+	BYTE dynLens[NUM_LITLEN_CODES + NUM_DIST_CODES];
+	BYTE *dynLitLens = dynLens, *dynDistLens = dynLens + NUM_LITLEN_CODES;
+	build_lengths(litFreqs, NUM_LITLEN_CODES, MAX_CODE_BITS, dynLitLens);
+	build_lengths(distFreqs, NUM_DIST_CODES, MAX_CODE_BITS, dynDistLens);
+
+	// The dynamic block's header: how many of each code's lengths are
+	// written (trailing zeros are left out), run-length encoded with the
+	// code length code
+	DWORD numLit = NUM_LITLEN_CODES, numDist = NUM_DIST_CODES;
+	while (numLit > 257 && dynLitLens[numLit - 1] == 0) {
+		numLit --;
+	}
+	while (numDist > 1 && dynDistLens[numDist - 1] == 0) {
+		numDist --;
+	}
+	BYTE allLens[NUM_LITLEN_CODES + NUM_DIST_CODES];
+	memcpy(allLens, dynLitLens, numLit);
+	memcpy(allLens + numLit, dynDistLens, numDist);
+	BYTE clSymbols[NUM_LITLEN_CODES + NUM_DIST_CODES], clExtras[NUM_LITLEN_CODES + NUM_DIST_CODES];
+	DWORD numClSymbols = rle_lengths(allLens, numLit + numDist, clSymbols, clExtras);
+
+	uint32_t clFreqs[NUM_CL_CODES] = { 0 };
+	for (DWORD i = 0; i < numClSymbols; i++) {
+		clFreqs[clSymbols[i]] ++;
+	}
+	BYTE clLens[NUM_CL_CODES];
+	build_lengths(clFreqs, NUM_CL_CODES, MAX_CL_CODE_BITS, clLens);
+	DWORD numCl = NUM_CL_CODES;
+	while (numCl > 4 && clLens[clOrder[numCl - 1]] == 0) {
+		numCl --;
+	}
+
+	uint64_t dynBits = 3 + 5 + 5 + 4 + 3 * numCl + tokens_cost(litFreqs, distFreqs, dynLitLens, dynDistLens);
+	for (DWORD s = 0; s < NUM_CL_CODES; s++) {
+		dynBits += (uint64_t)clFreqs[s] * clLens[s];
+	}
+	dynBits += 2 * clFreqs[16] + 3 * clFreqs[17] + 7 * clFreqs[18];
+
+	BYTE fixedLitLens[NUM_FIXED_LITLEN_CODES], fixedDistLens[NUM_FIXED_DIST_CODES];
+	fixed_lengths(fixedLitLens, fixedDistLens);
+	uint64_t fixedBits = 3 + tokens_cost(litFreqs, distFreqs, fixedLitLens, fixedDistLens);
+
+	// Stored blocks each need up to 7 bits of padding after their header
+	size_t rawLen = d->blockEnd - d->blockStart;
+	uint64_t numStored = rawLen / MAX_STORED + 1;
+	uint64_t storedBits = numStored * (3 + 7 + 32) + 8 * (uint64_t)rawLen;
+
+	uint64_t bits = dynBits < fixedBits ? dynBits : fixedBits;
+	if (storedBits < bits) {
+		bits = storedBits;
+	}
+	if (!reserve(&d->out, (size_t)(bits / 8) + 16)) {
+		return FALSE;
+	}
+
+	if (bits == storedBits) {
+		write_stored(d, final);
+	} else if (bits == fixedBits) {
+		put_bits(&d->out, final | (1 << 1), 3);
+		write_tokens(d, fixedLitLens, NUM_FIXED_LITLEN_CODES, fixedDistLens, NUM_FIXED_DIST_CODES);
+	} else {
+		BitWriter *w = &d->out;
+		put_bits(w, final | (2 << 1), 3);
+		put_bits(w, numLit - 257, 5);
+		put_bits(w, numDist - 1, 5);
+		put_bits(w, numCl - 4, 4);
+		for (DWORD i = 0; i < numCl; i++) {
+			put_bits(w, clLens[clOrder[i]], 3);
+		}
+		uint16_t clCodes[NUM_CL_CODES];
+		build_codes(clLens, NUM_CL_CODES, clCodes);
+		for (DWORD i = 0; i < numClSymbols; i++) {
+			BYTE s = clSymbols[i];
+			put_bits(w, clCodes[s], clLens[s]);
+			if (s >= 16) {
+				put_bits(w, clExtras[i], s == 16 ? 2 : s == 17 ? 3 : 7);
+			}
+		}
+		write_tokens(d, dynLitLens, NUM_LITLEN_CODES, dynDistLens, NUM_DIST_CODES);
+	}
+
+	d->numTokens = 0;
+	d->blockStart = d->blockEnd;
+	return TRUE;
+}
+
+// Matching
+
+static void add_token(Deflater *d, DWORD litLen, DWORD dist, DWORD len)
+{
+	Token *t = &d->tokens[d->numTokens++];
+	t->litLen = (uint16_t)litLen;
+	t->dist = (uint16_t)dist;
+	d->blockEnd += len;
+}
+
+// Adds a position to the hash chains, returning the previous position with
+// the same hash (or -1)
+static int32_t insert_hash(Deflater *d, size_t pos)
+{
+	uint32_t h = hash4(d->data + pos);
+	int32_t prev = d->head[h];
+	d->prev[pos & WINDOW_MASK] = prev;
+	d->head[h] = (int32_t)pos;
+	return prev;
+}
+
+// How many of the bytes at m and cur, up to maxLen, are the same, given
+// that the first MIN_MATCH are. Compares 8 bytes at a time where it can.
+static DWORD match_length(const BYTE *m, const BYTE *cur, DWORD maxLen)
+{
+	DWORD len = MIN_MATCH;
+	while (len + 8 <= maxLen) {
+		uint64_t x, y;
+		memcpy(&x, m + len, 8);
+		memcpy(&y, cur + len, 8);
+		if (x != y) {
+			break;
+		}
+		len += 8;
+	}
+	while (len < maxLen && m[len] == cur[len]) {
+		len ++;
+	}
+	return len;
+}
+
+// Finds the longest match for pos that is longer than 'best', starting
+// from the chain position 'cand'. Returns its length, or 'best' if there is
+// none.
+static DWORD longest_match(const Deflater *d, size_t pos, int32_t cand, DWORD best, DWORD *dist)
+{
+	const BYTE *data = d->data;
+	const BYTE *cur = data + pos;
+	const DWORD maxLen = d->len - pos < MAX_MATCH ? (DWORD)(d->len - pos) : MAX_MATCH;
+	DWORD chain = d->params.maxChain;
+	if (best >= maxLen) {
+		return best;
+	}
+
+	while (cand >= 0 && pos - (size_t)cand <= WINDOW_SIZE && chain-- > 0) {
+		const BYTE *m = data + cand;
+
+		// Only a match that beats 'best' is of interest, so check its
+		// last byte before the rest
+		if (m[best] == cur[best] && load32(m) == load32(cur)) {
+			DWORD len = match_length(m, cur, maxLen);
+			if (len > best) {
+				best = len;
+				*dist = (DWORD)(pos - (size_t)cand);
+				if (len >= d->params.niceLen || len == maxLen) {
+					break;
+				}
+			}
+		}
+		cand = d->prev[cand & WINDOW_MASK];
+	}
+	return best;
+}
+
+// Flushes a full block. Every token-adding step adds at most two tokens,
+// so this is called with room for two more.
+static BOOL flush_if_full(Deflater *d)
+{
+	return d->numTokens + 2 <= BLOCK_TOKENS || write_block(d, FALSE);
+}
+
+// Inserts the positions inside a match that was just taken into the hash
+// chains
+static void insert_range(Deflater *d, size_t from, size_t to)
+{
+	size_t end = d->len >= MIN_MATCH ? d->len - MIN_MATCH + 1 : 0;
+	if (to > end) {
+		to = end;
+	}
+	for (size_t p = from; p < to; p++) {
+		insert_hash(d, p);
+	}
+}
+
+static BOOL compress_greedy(Deflater *d)
+{
+	size_t pos = 0;
+	while (pos < d->len) {
+		DWORD len = 0, dist = 0;
+		if (pos + MIN_MATCH <= d->len) {
+			int32_t cand = insert_hash(d, pos);
+			len = longest_match(d, pos, cand, MIN_MATCH - 1, &dist);
+		}
+		if (len >= MIN_MATCH) {
+			add_token(d, len, dist, len);
+			insert_range(d, pos + 1, pos + len);
+			pos += len;
+		} else {
+			add_token(d, d->data[pos], 0, 1);
+			pos ++;
+		}
+		if (!flush_if_full(d)) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static BOOL compress_lazy(Deflater *d)
+{
+	// A match found at pos - 1, waiting to see if pos has a longer one
+	BOOL pending = FALSE;
+	DWORD prevLen = 0, prevDist = 0;
+
+	size_t pos = 0;
+	while (pos < d->len) {
+		DWORD len = 0, dist = 0;
+		if (pos + MIN_MATCH <= d->len) {
+			int32_t cand = insert_hash(d, pos);
+			if (prevLen < d->params.niceLen) {
+				len = longest_match(d, pos, cand, prevLen > MIN_MATCH - 1 ? prevLen : MIN_MATCH - 1, &dist);
+				if (len < MIN_MATCH || len <= prevLen) {
+					len = 0;
+				}
+			}
+		}
+
+		if (pending && prevLen >= MIN_MATCH && len == 0) {
+			// The match at pos - 1 is the better one
+			add_token(d, prevLen, prevDist, prevLen);
+			insert_range(d, pos + 1, pos - 1 + prevLen);
+			pos += prevLen - 1;
+			pending = FALSE;
+			prevLen = 0;
+		} else {
+			if (pending) {
+				add_token(d, d->data[pos - 1], 0, 1);
+			}
+			pending = TRUE;
+			prevLen = len;
+			prevDist = dist;
+			pos ++;
+		}
+		if (!flush_if_full(d)) {
+			return FALSE;
+		}
+	}
+
+	if (pending) {
+		if (prevLen >= MIN_MATCH) {
+			add_token(d, prevLen, prevDist, prevLen);
+		} else {
+			add_token(d, d->data[pos - 1], 0, 1);
+		}
+	}
+	return TRUE;
+}
+
+PBYTE get_exe_icon_zlib_compress(const void *data, size_t len, int level, size_t *outLen)
+{
+	if ((!data && len > 0) || !outLen
+		|| level < GET_EXE_ICON_DEFLATE_MIN_LEVEL || level > GET_EXE_ICON_DEFLATE_MAX_LEVEL)
+	{
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return NULL;
+	}
+	if (len > INT32_MAX) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_TOO_LARGE);
+		return NULL;
+	}
+
+	Deflater d;
+	memset(&d, 0, sizeof(d));
+	d.data = (const BYTE *)data;
+	d.len = len;
+	d.params = levelParams[level];
+
+	// Stored data is the worst case for output size, so start with room
+	// for that much and it will rarely grow
+	BOOL ok = reserve(&d.out, len + len / MAX_STORED * 5 + 64);
+	if (ok && level > 0) {
+		d.head = (int32_t *)malloc(sizeof(int32_t) * HASH_SIZE);
+		d.prev = (int32_t *)malloc(sizeof(int32_t) * WINDOW_SIZE);
+		d.tokens = (Token *)malloc(sizeof(Token) * BLOCK_TOKENS);
+		ok = d.head && d.prev && d.tokens;
+		if (ok) {
+			memset(d.head, 0xff, sizeof(int32_t) * HASH_SIZE);
+		}
+	}
+
+	if (ok) {
+		// CMF (deflate with a 32K window) and FLG, whose top bits are a hint
+		// of the level and which makes the pair a multiple of 31
+		BitWriter *w = &d.out;
+		w->buf[w->len++] = 0x78;
+		w->buf[w->len++] = level <= 1 ? 0x01 : level <= 5 ? 0x5e : level == 6 ? 0x9c : 0xda;
+
+		if (level == 0) {
+			d.blockEnd = len;
+			write_stored(&d, TRUE);
+		} else {
+			ok = (d.params.lazy ? compress_lazy(&d) : compress_greedy(&d))
+			     && write_block(&d, TRUE);
+			if (ok) {
+				flush_bits(w);
+			}
+		}
+	}
+	if (ok) {
+		ok = reserve(&d.out, 4);
+	}
+
+	free(d.head);
+	free(d.prev);
+	free(d.tokens);
+	if (!ok) {
+		free(d.out.buf);
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+		return NULL;
+	}
+
+	uint32_t adler = get_exe_icon_adler32(1, data, len);
+	BYTE *p = d.out.buf + d.out.len;
+	p[0] = (BYTE)(adler >> 24);
+	p[1] = (BYTE)(adler >> 16);
+	p[2] = (BYTE)(adler >> 8);
+	p[3] = (BYTE)adler;
+	*outLen = d.out.len + 4;
+	get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+	return d.out.buf;
+}
+
+// Decompression
+
+#define FAST_BITS  10
+#define FAST_MASK  ((1 << FAST_BITS) - 1)
+
+// How far reading may run past the end of the input, as zeros, before the
+// data is known to be truncated. Bits are read ahead in whole bytes, so the
+// last few symbols always do.
+#define MAX_OVERRUN  16
+
+// Base values and extra bits of the length codes (257-285) and distance codes
+static const uint16_t lengthBase[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const BYTE lengthExtra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t distBase[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const BYTE distExtra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// A Huffman code for decoding. Codes of up to FAST_BITS bits are looked up
+// in one step in 'fast', indexed by the next FAST_BITS input bits; longer
+// ones are decoded a bit at a time from the number of codes of each length,
+// as in zlib's puff.
+typedef struct
+{
+	uint16_t fast[1 << FAST_BITS];          // (symbol << 4) | length, or 0
+	uint16_t count[MAX_CODE_BITS + 1];      // Number of codes of each length
+	uint16_t symbol[NUM_FIXED_LITLEN_CODES]; // Symbols ordered by code
+} Huffman;
+
+typedef struct
+{
+	const BYTE *in;
+	size_t inLen;
+	size_t inPos;     // May pass inLen by up to MAX_OVERRUN (read as zeros)
+	uint64_t bitBuf;
+	DWORD numBits;
+
+	PBYTE out;
+	size_t outSize;
+	size_t outPos;
+} Inflater;
+
+// Tops the bit buffer up to at least 57 bits: enough for a length and
+// distance with their extra bits (48 bits at most) without checking again.
+static void refill(Inflater *s)
+{
+	while (s->numBits <= 56) {
+		BYTE b = s->inPos < s->inLen ? s->in[s->inPos] : 0;
+		s->inPos ++;
+		s->bitBuf |= (uint64_t)b << s->numBits;
+		s->numBits += 8;
+	}
+}
+
+static uint32_t take_bits(Inflater *s, DWORD n)
+{
+	uint32_t bits = (uint32_t)(s->bitBuf & ((1u << n) - 1));
+	s->bitBuf >>= n;
+	s->numBits -= n;
+	return bits;
+}
+
+// Whether the bits consumed so far have run past the end of the input
+static BOOL overran(const Inflater *s)
+{
+	return s->inPos > s->inLen && (s->inPos - s->inLen) * 8 > s->numBits;
+}
+
+// Builds a decoding table from code lengths. Incomplete codes are allowed
+// (a single distance code is common), and fail only if a missing code is
+// read; over-subscribed ones are rejected.
+static BOOL build_decoder(Huffman *h, const BYTE *lengths, DWORD numSymbols)
+{
+	memset(h->count, 0, sizeof(h->count));
+	for (DWORD i = 0; i < numSymbols; i++) {
+		h->count[lengths[i]] ++;
+	}
+	h->count[0] = 0;
+
+	int left = 1;
+	uint16_t offsets[MAX_CODE_BITS + 2];
+	offsets[1] = 0;
+	for (DWORD len = 1; len <= MAX_CODE_BITS; len++) {
+		left = (left << 1) - h->count[len];
+		if (left < 0) {
+			return FALSE;
+		}
+		offsets[len + 1] = offsets[len] + h->count[len];
+	}
+	for (DWORD i = 0; i < numSymbols; i++) {
+		if (lengths[i]) {
+			h->symbol[offsets[lengths[i]]++] = (uint16_t)i;
+		}
+	}
+
+	// Codes are assigned in order of length, then symbol, and are read
+	// starting from their most significant bit, so each one's table index is
+	// its bits reversed. Every index that starts with them decodes to it.
+	memset(h->fast, 0, sizeof(h->fast));
+	uint32_t code = 0;
+	DWORD index = 0;
+	for (DWORD len = 1; len <= FAST_BITS; len++) {
+		for (DWORD k = 0; k < h->count[len]; k++, index++, code++) {
+			uint32_t rev = 0;
+			for (DWORD b = 0; b < len; b++) {
+				rev |= ((code >> b) & 1) << (len - 1 - b);
+			}
+			uint16_t entry = (uint16_t)((h->symbol[index] << 4) | len);
+			for (uint32_t j = rev; j < (1u << FAST_BITS); j += 1u << len) {
+				h->fast[j] = entry;
+			}
+		}
+		code <<= 1;
+	}
+	return TRUE;
+}
+
+// Decodes one symbol. The bit buffer must hold at least 15 bits. Returns -1
+// for a code that isn't in the table.
+static int decode_symbol(Inflater *s, const Huffman *h)
+{
+	uint16_t entry = h->fast[s->bitBuf & FAST_MASK];
+	if (entry) {
+		take_bits(s, entry & 15);
+		return entry >> 4;
+	}
+
+	uint64_t bits = s->bitBuf;
+	int code = 0, first = 0, index = 0;
+	for (DWORD len = 1; len <= MAX_CODE_BITS; len++) {
+		code |= (int)(bits & 1);
+		bits >>= 1;
+		int count = h->count[len];
+		if (code - first < count) {
+			take_bits(s, len);
+			return h->symbol[index + code - first];
+		}
+		index += count;
+		first = (first + count) << 1;
+		code <<= 1;
+	}
+	return -1;
+}
+
+// Decodes the code lengths of a dynamic block's two codes and builds them
+static BOOL read_dynamic_codes(Inflater *s, Huffman *litLen, Huffman *dist)
+{
+	refill(s);
+	DWORD numLitLen = take_bits(s, 5) + 257;
+	DWORD numDist = take_bits(s, 5) + 1;
+	DWORD numCl = take_bits(s, 4) + 4;
+	if (numLitLen > NUM_LITLEN_CODES || numDist > NUM_DIST_CODES) {
+		return FALSE;
+	}
+
+	BYTE lengths[NUM_LITLEN_CODES + NUM_DIST_CODES];
+	memset(lengths, 0, NUM_CL_CODES);
+	refill(s);
+	for (DWORD i = 0; i < numCl; i++) {
+		lengths[clOrder[i]] = (BYTE)take_bits(s, 3);
+	}
+	Huffman cl;
+	if (!build_decoder(&cl, lengths, NUM_CL_CODES)) {
+		return FALSE;
+	}
+
+	DWORD total = numLitLen + numDist;
+	for (DWORD i = 0; i < total; ) {
+		refill(s);
+		int sym = decode_symbol(s, &cl);
+		if (sym < 0) {
+			return FALSE;
+		}
+		if (sym < 16) {
+			lengths[i++] = (BYTE)sym;
+			continue;
+		}
+
+		BYTE value = 0;
+		DWORD repeat;
+		if (sym == 16) {
+			if (i == 0) {
+				return FALSE;
+			}
+			value = lengths[i - 1];
+			repeat = 3 + take_bits(s, 2);
+		} else if (sym == 17) {
+			repeat = 3 + take_bits(s, 3);
+		} else {
+			repeat = 11 + take_bits(s, 7);
+		}
+		if (repeat > total - i) {
+			return FALSE;
+		}
+		memset(lengths + i, value, repeat);
+		i += repeat;
+	}
+
+	// A block with no end-of-block code could never end
+	return lengths[END_OF_BLOCK] != 0
+		&& build_decoder(litLen, lengths, numLitLen)
+		&& build_decoder(dist, lengths + numLitLen, numDist);
+}
+
+static void build_fixed_codes(Huffman *litLen, Huffman *dist)
+{
+	BYTE lengths[NUM_FIXED_LITLEN_CODES];
+	memset(lengths, 8, 144);
+	memset(lengths + 144, 9, 112);
+	memset(lengths + 256, 7, 24);
+	memset(lengths + 280, 8, 8);
+	build_decoder(litLen, lengths, NUM_FIXED_LITLEN_CODES);
+
+	memset(lengths, 5, NUM_FIXED_DIST_CODES);
+	build_decoder(dist, lengths, NUM_FIXED_DIST_CODES);
+}
+
+// Decodes a compressed block's symbols. Returns the error, or GET_EXE_ICON_OK.
+static GetExeIconError inflate_codes(Inflater *s, const Huffman *litLen, const Huffman *dist)
+{
+	for (;;) {
+		if (s->inPos > s->inLen + MAX_OVERRUN) {
+			return GET_EXE_ICON_ERROR_BAD_ARCHIVE;
+		}
+		refill(s);
+		int sym = decode_symbol(s, litLen);
+		if (sym < 256) {
+			if (sym < 0) {
+				return GET_EXE_ICON_ERROR_BAD_ARCHIVE;
+			}
+			if (s->outPos == s->outSize) {
+				return GET_EXE_ICON_ERROR_TOO_LARGE;
+			}
+			s->out[s->outPos++] = (BYTE)sym;
+			continue;
+		}
+		if (sym == END_OF_BLOCK) {
+			return GET_EXE_ICON_OK;
+		}
+
+		sym -= 257;
+		if (sym >= 29) {
+			return GET_EXE_ICON_ERROR_BAD_ARCHIVE;
+		}
+		size_t len = lengthBase[sym] + take_bits(s, lengthExtra[sym]);
+		int d = decode_symbol(s, dist);
+		if (d < 0 || d >= NUM_DIST_CODES) {
+			return GET_EXE_ICON_ERROR_BAD_ARCHIVE;
+		}
+		size_t distance = distBase[d] + take_bits(s, distExtra[d]);
+		if (distance > s->outPos) {
+			return GET_EXE_ICON_ERROR_BAD_ARCHIVE;
+		}
+		if (len > s->outSize - s->outPos) {
+			return GET_EXE_ICON_ERROR_TOO_LARGE;
+		}
+
+		PBYTE dst = s->out + s->outPos;
+		const BYTE *src = dst - distance;
+		if (distance >= len) {
+			memcpy(dst, src, len);
+		} else {
+			// Overlapping: the match repeats the last 'distance' bytes
+			for (size_t i = 0; i < len; i++) {
+				dst[i] = src[i];
+			}
+		}
+		s->outPos += len;
+	}
+}
+
+static GetExeIconError inflate_stored(Inflater *s)
+{
+	// Drop the bits up to the byte boundary, then hand back whole bytes of
+	// the bit buffer that were read ahead
+	take_bits(s, s->numBits & 7);
+	s->inPos -= s->numBits / 8;
+	s->bitBuf = 0;
+	s->numBits = 0;
+
+	if (s->inPos > s->inLen || s->inLen - s->inPos < 4) {
+		return GET_EXE_ICON_ERROR_BAD_ARCHIVE;
+	}
+	const BYTE *p = s->in + s->inPos;
+	DWORD len = p[0] | (p[1] << 8);
+	DWORD nlen = p[2] | (p[3] << 8);
+	s->inPos += 4;
+	if (len != (~nlen & 0xffff) || s->inLen - s->inPos < len) {
+		return GET_EXE_ICON_ERROR_BAD_ARCHIVE;
+	}
+	if (len > s->outSize - s->outPos) {
+		return GET_EXE_ICON_ERROR_TOO_LARGE;
+	}
+	memcpy(s->out + s->outPos, s->in + s->inPos, len);
+	s->outPos += len;
+	s->inPos += len;
+	return GET_EXE_ICON_OK;
+}
+
+BOOL get_exe_icon_inflate(const void *data, size_t len, void *out, size_t outSize, size_t *outLen)
+{
+	if ((!data && len > 0) || (!out && outSize > 0) || !outLen) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return FALSE;
+	}
+
+	Inflater s;
+	memset(&s, 0, sizeof(s));
+	s.in = (const BYTE *)data;
+	s.inLen = len;
+	s.out = (PBYTE)out;
+	s.outSize = outSize;
+
+	// The decoders are only built for the block types that occur
+	Huffman *codes = NULL;
+	BOOL haveFixed = FALSE;
+
+	GetExeIconError error = GET_EXE_ICON_OK;
+	BOOL last = FALSE;
+	while (!last && error == GET_EXE_ICON_OK) {
+		refill(&s);
+		last = take_bits(&s, 1);
+		DWORD type = take_bits(&s, 2);
+		if (overran(&s) || type == 3) {
+			error = GET_EXE_ICON_ERROR_BAD_ARCHIVE;
+			break;
+		}
+		if (type == 0) {
+			error = inflate_stored(&s);
+			continue;
+		}
+
+		if (!codes) {
+			// Two for the fixed codes, kept across blocks, and two for the
+			// current dynamic block
+			codes = (Huffman *)malloc(sizeof(Huffman) * 4);
+			if (!codes) {
+				error = GET_EXE_ICON_ERROR_OUT_OF_MEMORY;
+				break;
+			}
+		}
+		if (type == 1) {
+			if (!haveFixed) {
+				build_fixed_codes(&codes[0], &codes[1]);
+				haveFixed = TRUE;
+			}
+			error = inflate_codes(&s, &codes[0], &codes[1]);
+		} else if (!read_dynamic_codes(&s, &codes[2], &codes[3])) {
+			error = GET_EXE_ICON_ERROR_BAD_ARCHIVE;
+		} else {
+			error = inflate_codes(&s, &codes[2], &codes[3]);
+		}
+	}
+	free(codes);
+
+	// Truncated data decodes the zeros after it until something fails, so
+	// whatever did, that's the error
+	if (error != GET_EXE_ICON_ERROR_OUT_OF_MEMORY && overran(&s)) {
+		error = GET_EXE_ICON_ERROR_BAD_ARCHIVE;
+	}
+	*outLen = error == GET_EXE_ICON_OK ? s.outPos : 0;
+	get_exe_icon_set_last_error(error);
+	return error == GET_EXE_ICON_OK;
+}
@@ -0,0 +1,67 @@
+// Copyright (c) 2021 Aury Snow
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef GET_EXE_ICON_DEFLATE_H
+#define GET_EXE_ICON_DEFLATE_H
+
+#include "get-exe-icon.h"
+
+// A small deflate (RFC 1951) compressor, for writing PNG images without
+// depending on zlib. Matches are found with hash chains, as zlib does, and
+// each block is written with dynamic or fixed Huffman codes, or stored,
+// whichever is smallest. And a decompressor, for reading ZIP archives.
+
+// The compression levels: 1 is fastest, 9 gives the smallest output. Level 0
+// stores the data uncompressed.
+#define GET_EXE_ICON_DEFLATE_MIN_LEVEL  0
+#define GET_EXE_ICON_DEFLATE_MAX_LEVEL  9
+
+// Compresses data to the zlib format (RFC 1950): deflate data with a 2 byte
+// header and an Adler-32 checksum, as in PNG's IDAT chunks.
+//
+// level: The compression level, from GET_EXE_ICON_DEFLATE_MIN_LEVEL to
+//        GET_EXE_ICON_DEFLATE_MAX_LEVEL.
+//
+// Return Value: The compressed data, to be freed with free(3). On error NULL
+//               is returned, and get_exe_icon_last_error() says why.
+PBYTE get_exe_icon_zlib_compress(const void *data, size_t len, int level, size_t *outLen);
+
+// Decompresses raw deflate data (with no zlib header, as in ZIP archives)
+// into the caller's buffer.
+//
+// outSize: The size of 'out'. Data that decompresses to more fails with
+//          GET_EXE_ICON_ERROR_TOO_LARGE, so the buffer is never overrun
+//          whatever the input.
+//
+// outLen (OUT): The size of the decompressed data.
+//
+// Return Value: TRUE on success. Corrupt or truncated data fails with
+//               GET_EXE_ICON_ERROR_BAD_ARCHIVE.
+BOOL get_exe_icon_inflate(const void *data, size_t len, void *out, size_t outSize, size_t *outLen);
+
+// Updates a CRC-32 (as used by PNG, ZIP and gzip) with more data. Start with
+// crc 0.
+uint32_t get_exe_icon_crc32(uint32_t crc, const void *data, size_t len);
+
+// Updates an Adler-32 checksum (as used by zlib) with more data. Start with
+// adler 1.
+uint32_t get_exe_icon_adler32(uint32_t adler, const void *data, size_t len);
+
+#endif
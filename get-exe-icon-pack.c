@@ -0,0 +1,1162 @@
+// Copyright (c) 2021 Aury Snow
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE // For flock()
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include "get-exe-icon-pack.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Notes about the code:
+//
+// The file starts with two header slots. A commit writes the slot the
+// current header isn't in, with the next generation number, and readers take
+// the valid slot with the highest generation, so a header torn by a crash
+// leaves the previous one in effect. The header is only written once the
+// ICOs and the index it points to are on disk.
+//
+// The ICOs follow the header slots. After them comes the index: an array of
+// entries sorted by key, then a "fanout" table like that of git's pack
+// indexes, where fanout[b] is the number of entries whose key starts with a
+// value up to b in its first fanoutBits bits. The fanout table is sized for
+// about 8 entries per value, which for keys that are hashes leaves a binary
+// search of a handful of entries, all on one or two cache lines.
+//
+// A writer appends ICOs after the index of the last commit, and on commit
+// merges the old index with the ICOs added since into a new index after
+// them. The old index becomes dead space, like replaced ICOs. The merge
+// streams both in key order, so a commit needs memory only for the added
+// ICOs' entries, not for the whole index.
+//
+// Nothing in the index is trusted: offsets and lengths are checked against
+// the bounds of the ICOs before being used, and a damaged fanout table only
+// makes keys impossible to find.
+
+#define PACK_MAGIC             "GEIPACK"
+#define PACK_VERSION           1
+#define PACK_BYTE_ORDER        0x01020304
+#define PACK_HEADER_SIZE       64
+#define PACK_MAX_ALIGNMENT     4096
+#define MIN_FANOUT_BITS        8
+#define MAX_FANOUT_BITS        24
+#define ENTRIES_PER_BUCKET     8
+#define APPEND_BUFFER_SIZE     (1 << 20)
+#define MIN_PENDING_SLOTS      1024
+
+typedef struct
+{
+	char      magic[8];
+	uint32_t  version;
+	uint32_t  byteOrder;     // PACK_BYTE_ORDER, in the writer's byte order
+	uint64_t  generation;    // Of the commit; the slot is generation % 2
+	uint64_t  indexOffset;   // Also where the ICOs end
+	uint64_t  numEntries;
+	uint64_t  liveBytes;
+	uint32_t  alignment;
+	uint32_t  fanoutBits;
+	uint64_t  checksum;      // Of all of the above
+} PackHeader;
+
+typedef struct
+{
+	BYTE      key[16];
+	uint64_t  offset;
+	uint32_t  length;
+	uint32_t  reserved;
+} PackEntry;
+
+#ifdef _WIN32
+typedef HANDLE FileHandle;
+#define INVALID_FILE INVALID_HANDLE_VALUE
+#else
+typedef int FileHandle;
+#define INVALID_FILE (-1)
+#endif
+
+struct GetExeIconPack
+{
+	BYTE             *map;
+	uint64_t          mapSize;    // Up to the end of the index
+	PackHeader        header;
+	const PackEntry  *entries;
+	const uint32_t   *fanout;
+};
+
+// Buffers writes to the end of a file
+typedef struct
+{
+	FileHandle  file;
+	uint64_t    offset;   // Of buf[0] within the file
+	BYTE       *buf;
+	size_t      len;
+	BOOL        ok;       // Cleared by the first failed write
+} Appender;
+
+struct GetExeIconPackWriter
+{
+	char            *path;
+	FileHandle       file;
+	FileHandle       lockFile;
+	GetExeIconPack  *base;          // The pack as of the last commit
+	PackHeader       header;        // Of the last commit
+	BOOL             noSync;
+	Appender         out;
+
+	// Entries added since the last commit, and an open addressing table of
+	// their indexes plus 1 (0 for an empty slot) to find them by key
+	PackEntry       *pending;
+	size_t           numPending;
+	size_t           pendingCapacity;
+	size_t          *slots;
+	size_t           numSlots;      // A power of 2
+};
+
+// FNV-1a, for the header checksum
+static uint64_t hash_bytes(const void *data, size_t len)
+{
+	const BYTE *p = (const BYTE *)data;
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+// Platform wrappers for the handful of file and mapping operations needed
+// below.
+
+#ifdef _WIN32
+static PWSTR utf8_to_wide(PCSTR str)
+{
+	int len = MultiByteToWideChar(CP_UTF8, 0, str, -1, NULL, 0);
+	if (len <= 0) {
+		return NULL;
+	}
+	PWSTR wStr = (PWSTR)malloc(sizeof(WCHAR) * len);
+	if (wStr && MultiByteToWideChar(CP_UTF8, 0, str, -1, wStr, len) <= 0) {
+		free(wStr);
+		return NULL;
+	}
+	return wStr;
+}
+
+static FileHandle open_file(PCSTR path, BOOL write, BOOL truncate)
+{
+	PWSTR wPath = utf8_to_wide(path);
+	if (!wPath) {
+		return INVALID_FILE;
+	}
+	DWORD disposition = truncate ? CREATE_ALWAYS : (write ? OPEN_ALWAYS : OPEN_EXISTING);
+	HANDLE file = CreateFileW(wPath,
+		write ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL,
+		disposition,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL);
+	free(wPath);
+	return file;
+}
+
+static void close_file(FileHandle file)
+{
+	CloseHandle(file);
+}
+
+static BOOL read_at(FileHandle file, uint64_t offset, void *buf, DWORD len)
+{
+	OVERLAPPED overlapped;
+	memset(&overlapped, 0, sizeof(overlapped));
+	overlapped.Offset = (DWORD)offset;
+	overlapped.OffsetHigh = (DWORD)(offset >> 32);
+	DWORD numRead = 0;
+	return ReadFile(file, buf, len, &numRead, &overlapped) && numRead == len;
+}
+
+static BOOL write_at(FileHandle file, uint64_t offset, const void *buf, DWORD len)
+{
+	OVERLAPPED overlapped;
+	memset(&overlapped, 0, sizeof(overlapped));
+	overlapped.Offset = (DWORD)offset;
+	overlapped.OffsetHigh = (DWORD)(offset >> 32);
+	DWORD numWritten = 0;
+	return WriteFile(file, buf, len, &numWritten, &overlapped) && numWritten == len;
+}
+
+static BOOL sync_file(FileHandle file)
+{
+	return FlushFileBuffers(file);
+}
+
+static BOOL get_file_size(FileHandle file, uint64_t *size)
+{
+	LARGE_INTEGER li;
+	if (!GetFileSizeEx(file, &li)) {
+		return FALSE;
+	}
+	*size = (uint64_t)li.QuadPart;
+	return TRUE;
+}
+
+static BOOL replace_file(PCSTR from, PCSTR to)
+{
+	PWSTR wFrom = utf8_to_wide(from);
+	PWSTR wTo = utf8_to_wide(to);
+	BOOL ret = wFrom && wTo && MoveFileExW(wFrom, wTo, MOVEFILE_REPLACE_EXISTING);
+	free(wFrom);
+	free(wTo);
+	return ret;
+}
+
+static void remove_file(PCSTR path)
+{
+	PWSTR wPath = utf8_to_wide(path);
+	if (wPath) {
+		DeleteFileW(wPath);
+		free(wPath);
+	}
+}
+
+// Fails if the file is locked through another open of it, by this process
+// or another
+static BOOL lock_file(FileHandle file)
+{
+	OVERLAPPED overlapped;
+	memset(&overlapped, 0, sizeof(overlapped));
+	return LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &overlapped);
+}
+
+// The view keeps the mapping alive once the handles are closed
+static BYTE *map_file(FileHandle file, uint64_t size)
+{
+	HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, (DWORD)(size >> 32), (DWORD)size, NULL);
+	if (!mapping) {
+		return NULL;
+	}
+	BYTE *map = (BYTE *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, (SIZE_T)size);
+	CloseHandle(mapping);
+	return map;
+}
+
+static void unmap_file(BYTE *map, uint64_t size)
+{
+	(void)size;
+	UnmapViewOfFile(map);
+}
+#else
+static FileHandle open_file(PCSTR path, BOOL write, BOOL truncate)
+{
+	int flags = (write ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC;
+	if (truncate) {
+		flags |= O_TRUNC;
+	}
+	return open(path, flags, 0644);
+}
+
+static void close_file(FileHandle file)
+{
+	close(file);
+}
+
+static BOOL read_at(FileHandle file, uint64_t offset, void *buf, DWORD len)
+{
+	BYTE *p = (BYTE *)buf;
+	while (len > 0) {
+		ssize_t n = pread(file, p, len, (off_t)offset);
+		if (n <= 0) {
+			return FALSE;
+		}
+		p += n;
+		offset += (uint64_t)n;
+		len -= (DWORD)n;
+	}
+	return TRUE;
+}
+
+static BOOL write_at(FileHandle file, uint64_t offset, const void *buf, DWORD len)
+{
+	const BYTE *p = (const BYTE *)buf;
+	while (len > 0) {
+		ssize_t n = pwrite(file, p, len, (off_t)offset);
+		if (n <= 0) {
+			return FALSE;
+		}
+		p += n;
+		offset += (uint64_t)n;
+		len -= (DWORD)n;
+	}
+	return TRUE;
+}
+
+static BOOL sync_file(FileHandle file)
+{
+	return fsync(file) == 0;
+}
+
+static BOOL get_file_size(FileHandle file, uint64_t *size)
+{
+	struct stat st;
+	if (fstat(file, &st) != 0) {
+		return FALSE;
+	}
+	*size = (uint64_t)st.st_size;
+	return TRUE;
+}
+
+static BOOL replace_file(PCSTR from, PCSTR to)
+{
+	return rename(from, to) == 0;
+}
+
+static void remove_file(PCSTR path)
+{
+	unlink(path);
+}
+
+// Fails if the file is locked through another open of it, by this process
+// or another. flock() rather than fcntl(), whose locks belong to the process.
+static BOOL lock_file(FileHandle file)
+{
+	return flock(file, LOCK_EX | LOCK_NB) == 0;
+}
+
+static BYTE *map_file(FileHandle file, uint64_t size)
+{
+	void *map = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, file, 0);
+	return map == MAP_FAILED ? NULL : (BYTE *)map;
+}
+
+static void unmap_file(BYTE *map, uint64_t size)
+{
+	munmap(map, (size_t)size);
+}
+#endif
+
+static char *path_with_suffix(PCSTR path, PCSTR suffix)
+{
+	size_t pathLen = strlen(path);
+	size_t suffixLen = strlen(suffix);
+	char *newPath = (char *)malloc(pathLen + suffixLen + 1);
+	if (newPath) {
+		memcpy(newPath, path, pathLen);
+		memcpy(newPath + pathLen, suffix, suffixLen + 1);
+	}
+	return newPath;
+}
+
+static uint64_t align_up(uint64_t offset, uint64_t alignment)
+{
+	return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+// Where the first ICO goes
+static uint64_t data_start(uint32_t alignment)
+{
+	return align_up(2 * PACK_HEADER_SIZE, alignment);
+}
+
+// The fanout table's size for a number of entries
+static uint32_t fanout_bits(uint64_t numEntries)
+{
+	uint32_t bits = MIN_FANOUT_BITS;
+	while (bits < MAX_FANOUT_BITS && ((uint64_t)ENTRIES_PER_BUCKET << bits) < numEntries) {
+		bits ++;
+	}
+	return bits;
+}
+
+// The first 'bits' bits of a key, so that buckets are in key order
+static uint32_t key_bucket(const BYTE *key, uint32_t bits)
+{
+	uint32_t prefix = ((uint32_t)key[0] << 24) | ((uint32_t)key[1] << 16)
+		| ((uint32_t)key[2] << 8) | key[3];
+	return prefix >> (32 - bits);
+}
+
+static uint64_t header_checksum(const PackHeader *header)
+{
+	return hash_bytes(header, offsetof(PackHeader, checksum));
+}
+
+// Whether a header slot holds a valid header for a file of 'fileSize' bytes
+static BOOL check_header(const PackHeader *header, uint64_t fileSize)
+{
+	if (memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) != 0
+		|| header->version != PACK_VERSION
+		|| header->byteOrder != PACK_BYTE_ORDER
+		|| header->checksum != header_checksum(header)
+		|| header->alignment == 0
+		|| header->alignment > PACK_MAX_ALIGNMENT
+		|| (header->alignment & (header->alignment - 1)) != 0
+		|| header->fanoutBits < MIN_FANOUT_BITS
+		|| header->fanoutBits > MAX_FANOUT_BITS
+		|| header->indexOffset % 8 != 0
+		|| header->indexOffset < data_start(header->alignment)
+		|| header->indexOffset > fileSize
+		|| header->numEntries > (fileSize - header->indexOffset) / sizeof(PackEntry))
+	{
+		return FALSE;
+	}
+	uint64_t indexSize = header->numEntries * sizeof(PackEntry) + (sizeof(uint32_t) << header->fanoutBits);
+	return indexSize <= fileSize - header->indexOffset;
+}
+
+static uint64_t pack_size(const PackHeader *header)
+{
+	return header->indexOffset + header->numEntries * sizeof(PackEntry)
+		+ (sizeof(uint32_t) << header->fanoutBits);
+}
+
+// Checks an entry's ICO against the bounds of the pack's ICOs
+static const BYTE *entry_data(const GetExeIconPack *pack, const PackEntry *entry)
+{
+	if (entry->offset < data_start(pack->header.alignment)
+		|| entry->offset > pack->header.indexOffset
+		|| entry->length > pack->header.indexOffset - entry->offset)
+	{
+		return NULL;
+	}
+	return pack->map + entry->offset;
+}
+
+static const PackEntry *find_entry(const GetExeIconPack *pack, const BYTE *key)
+{
+	uint32_t bucket = key_bucket(key, pack->header.fanoutBits);
+	uint64_t lo = bucket > 0 ? pack->fanout[bucket - 1] : 0;
+	uint64_t hi = pack->fanout[bucket];
+	if (lo > hi || hi > pack->header.numEntries) {
+		return NULL;
+	}
+
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		int cmp = memcmp(pack->entries[mid].key, key, sizeof(pack->entries[mid].key));
+		if (cmp == 0) {
+			return &pack->entries[mid];
+		} else if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return NULL;
+}
+
+GetExeIconPack *get_exe_icon_pack_open(PCSTR path)
+{
+	if (!path) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return NULL;
+	}
+
+	FileHandle file = open_file(path, FALSE, FALSE);
+	if (file == INVALID_FILE) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OPEN_FAILED);
+		return NULL;
+	}
+
+	// Take the newest valid header
+	PackHeader headers[2];
+	uint64_t fileSize;
+	if (!get_file_size(file, &fileSize)) {
+		close_file(file);
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OPEN_FAILED);
+		return NULL;
+	}
+	const PackHeader *header = NULL;
+	if (fileSize >= 2 * PACK_HEADER_SIZE && read_at(file, 0, headers, sizeof(headers))) {
+		for (int i = 0; i < 2; i++) {
+			if (check_header(&headers[i], fileSize)
+				&& headers[i].generation % 2 == (uint64_t)i
+				&& (!header || headers[i].generation > header->generation))
+			{
+				header = &headers[i];
+			}
+		}
+	}
+	if (!header || pack_size(header) > (size_t)-1) {
+		close_file(file);
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_BAD_ARCHIVE);
+		return NULL;
+	}
+
+	GetExeIconPack *pack = (GetExeIconPack *)calloc(1, sizeof(GetExeIconPack));
+	if (!pack) {
+		close_file(file);
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+		return NULL;
+	}
+	pack->header = *header;
+	pack->mapSize = pack_size(header);
+	pack->map = map_file(file, pack->mapSize);
+	close_file(file);
+	if (!pack->map) {
+		free(pack);
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OPEN_FAILED);
+		return NULL;
+	}
+	pack->entries = (const PackEntry *)(pack->map + header->indexOffset);
+	pack->fanout = (const uint32_t *)(pack->entries + header->numEntries);
+
+	get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+	return pack;
+}
+
+void get_exe_icon_pack_close(GetExeIconPack *pack)
+{
+	if (!pack) {
+		return;
+	}
+	unmap_file(pack->map, pack->mapSize);
+	free(pack);
+}
+
+const BYTE *get_exe_icon_pack_get(const GetExeIconPack *pack, const GetExeIconHash *key, PDWORD bufLen, uint64_t *fileOffset)
+{
+	if (!pack || !key || !bufLen) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return NULL;
+	}
+
+	const PackEntry *entry = find_entry(pack, key->bytes);
+	const BYTE *data = entry ? entry_data(pack, entry) : NULL;
+	if (!data) {
+		get_exe_icon_set_last_error(entry ? GET_EXE_ICON_ERROR_BAD_ARCHIVE : GET_EXE_ICON_ERROR_NO_ICON);
+		return NULL;
+	}
+
+	*bufLen = entry->length;
+	if (fileOffset) {
+		*fileOffset = entry->offset;
+	}
+	get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+	return data;
+}
+
+size_t get_exe_icon_pack_count(const GetExeIconPack *pack)
+{
+	return pack ? (size_t)pack->header.numEntries : 0;
+}
+
+const BYTE *get_exe_icon_pack_entry(const GetExeIconPack *pack, size_t i, GetExeIconHash *key, PDWORD bufLen)
+{
+	if (!pack || i >= pack->header.numEntries || !key || !bufLen) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return NULL;
+	}
+
+	const PackEntry *entry = &pack->entries[i];
+	const BYTE *data = entry_data(pack, entry);
+	if (!data) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_BAD_ARCHIVE);
+		return NULL;
+	}
+
+	memcpy(key->bytes, entry->key, sizeof(key->bytes));
+	*bufLen = entry->length;
+	get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+	return data;
+}
+
+void get_exe_icon_pack_stats(const GetExeIconPack *pack, GetExeIconPackStats *stats)
+{
+	if (!pack || !stats) {
+		return;
+	}
+	stats->numEntries = pack->header.numEntries;
+	stats->liveBytes = pack->header.liveBytes;
+	stats->fileSize = pack->mapSize;
+	stats->alignment = pack->header.alignment;
+}
+
+static BOOL init_appender(Appender *out, FileHandle file, uint64_t offset)
+{
+	out->file = file;
+	out->offset = offset;
+	out->len = 0;
+	out->ok = TRUE;
+	out->buf = (BYTE *)malloc(APPEND_BUFFER_SIZE);
+	return out->buf != NULL;
+}
+
+static uint64_t appender_end(const Appender *out)
+{
+	return out->offset + out->len;
+}
+
+static void flush_appender(Appender *out)
+{
+	if (out->len > 0 && out->ok) {
+		out->ok = write_at(out->file, out->offset, out->buf, (DWORD)out->len);
+	}
+	out->offset += out->len;
+	out->len = 0;
+}
+
+// Appends 'data', or zeros if it's NULL
+static void append(Appender *out, const void *data, size_t len)
+{
+	const BYTE *p = (const BYTE *)data;
+	while (len > 0) {
+		if (out->len == APPEND_BUFFER_SIZE) {
+			flush_appender(out);
+		}
+		size_t n = APPEND_BUFFER_SIZE - out->len;
+		if (n > len) {
+			n = len;
+		}
+		if (p) {
+			memcpy(out->buf + out->len, p, n);
+			p += n;
+		} else {
+			memset(out->buf + out->len, 0, n);
+		}
+		out->len += n;
+		len -= n;
+	}
+}
+
+static void pad_appender(Appender *out, uint64_t alignment)
+{
+	uint64_t end = appender_end(out);
+	append(out, NULL, (size_t)(align_up(end, alignment) - end));
+}
+
+// Writes an index through an appender, given its entries in key order
+typedef struct
+{
+	Appender  *out;
+	uint32_t   fanoutBits;
+	uint32_t  *fanout;       // Counts of each bucket until it's finished
+	uint64_t   numEntries;
+	uint64_t   liveBytes;
+} IndexWriter;
+
+// 'maxEntries' sizes the fanout table. It may be more than the number of
+// entries written, e.g. when some of them end up replaced.
+static BOOL begin_index(IndexWriter *index, Appender *out, uint64_t maxEntries, uint64_t *indexOffset)
+{
+	pad_appender(out, 8);
+	*indexOffset = appender_end(out);
+	index->out = out;
+	index->fanoutBits = fanout_bits(maxEntries);
+	index->fanout = (uint32_t *)calloc((size_t)1 << index->fanoutBits, sizeof(uint32_t));
+	index->numEntries = 0;
+	index->liveBytes = 0;
+	return index->fanout != NULL;
+}
+
+static void add_to_index(IndexWriter *index, const PackEntry *entry)
+{
+	append(index->out, entry, sizeof(PackEntry));
+	index->fanout[key_bucket(entry->key, index->fanoutBits)] ++;
+	index->numEntries ++;
+	index->liveBytes += entry->length;
+}
+
+static void finish_index(IndexWriter *index)
+{
+	uint32_t total = 0;
+	for (size_t b = 0; b < ((size_t)1 << index->fanoutBits); b++) {
+		total += index->fanout[b];
+		index->fanout[b] = total;
+	}
+	append(index->out, index->fanout, sizeof(uint32_t) << index->fanoutBits);
+	free(index->fanout);
+}
+
+// Writes the header into its slot and flushes everything written before it
+// to disk first, so that it never points at an index that isn't there.
+static BOOL write_header(FileHandle file, PackHeader *header, BOOL sync)
+{
+	memcpy(header->magic, PACK_MAGIC, sizeof(header->magic));
+	header->version = PACK_VERSION;
+	header->byteOrder = PACK_BYTE_ORDER;
+	header->checksum = header_checksum(header);
+
+	BYTE slot[PACK_HEADER_SIZE];
+	memset(slot, 0, sizeof(slot));
+	memcpy(slot, header, sizeof(PackHeader));
+	return (!sync || sync_file(file))
+		&& write_at(file, (header->generation % 2) * PACK_HEADER_SIZE, slot, sizeof(slot))
+		&& (!sync || sync_file(file));
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	return memcmp(((const PackEntry *)a)->key, ((const PackEntry *)b)->key, sizeof(((const PackEntry *)a)->key));
+}
+
+// The hashes are already uniformly distributed, so any 8 bytes of one make a
+// fine index into the table
+static size_t slot_index(const BYTE *key, size_t numSlots)
+{
+	uint64_t bits;
+	memcpy(&bits, key + 8, sizeof(bits));
+	return (size_t)bits & (numSlots - 1);
+}
+
+// Finds the key's slot in the table of pending entries, or the empty slot it
+// would go in
+static size_t *find_pending(const GetExeIconPackWriter *writer, const BYTE *key)
+{
+	size_t i = slot_index(key, writer->numSlots);
+	while (writer->slots[i] != 0
+		&& memcmp(writer->pending[writer->slots[i] - 1].key, key, sizeof(writer->pending[0].key)) != 0)
+	{
+		i = (i + 1) & (writer->numSlots - 1);
+	}
+	return &writer->slots[i];
+}
+
+// Makes room for one more pending entry, growing the table once it's half
+// full
+static BOOL reserve_pending(GetExeIconPackWriter *writer)
+{
+	if (writer->numPending == writer->pendingCapacity) {
+		size_t capacity = writer->pendingCapacity * 2;
+		PackEntry *pending = (PackEntry *)realloc(writer->pending, sizeof(PackEntry) * capacity);
+		if (!pending) {
+			return FALSE;
+		}
+		writer->pending = pending;
+		writer->pendingCapacity = capacity;
+	}
+
+	if (writer->numPending + 1 > writer->numSlots / 2) {
+		size_t *slots = (size_t *)calloc(writer->numSlots * 2, sizeof(size_t));
+		if (!slots) {
+			return FALSE;
+		}
+		free(writer->slots);
+		writer->slots = slots;
+		writer->numSlots *= 2;
+		for (size_t i = 0; i < writer->numPending; i++) {
+			*find_pending(writer, writer->pending[i].key) = i + 1;
+		}
+	}
+	return TRUE;
+}
+
+static void clear_pending(GetExeIconPackWriter *writer)
+{
+	writer->numPending = 0;
+	memset(writer->slots, 0, sizeof(size_t) * writer->numSlots);
+}
+
+// After a failed write, the pending entries may point at ICOs that never
+// made it to the file, so they're all dropped and the writer carries on
+// after whatever was written.
+static void discard_pending(GetExeIconPackWriter *writer)
+{
+	clear_pending(writer);
+	writer->out.offset = appender_end(&writer->out);
+	writer->out.len = 0;
+	writer->out.ok = TRUE;
+	get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OPEN_FAILED);
+}
+
+static BOOL init_pending(GetExeIconPackWriter *writer)
+{
+	writer->pendingCapacity = MIN_PENDING_SLOTS / 2;
+	writer->numSlots = MIN_PENDING_SLOTS;
+	writer->pending = (PackEntry *)malloc(sizeof(PackEntry) * writer->pendingCapacity);
+	writer->slots = (size_t *)calloc(writer->numSlots, sizeof(size_t));
+	return writer->pending && writer->slots;
+}
+
+// Writes an index of the last commit's entries merged with the pending
+// ones, then a header pointing at it. If writing fails, the old header stays
+// in effect. If only reopening the pack fails, the pending entries are kept,
+// and the next commit writes the same index again.
+static BOOL write_commit(GetExeIconPackWriter *writer)
+{
+	const PackEntry *base = writer->base ? writer->base->entries : NULL;
+	uint64_t numBase = writer->base ? writer->base->header.numEntries : 0;
+
+	qsort(writer->pending, writer->numPending, sizeof(PackEntry), compare_entries);
+	memset(writer->slots, 0, sizeof(size_t) * writer->numSlots);
+	for (size_t i = 0; i < writer->numPending; i++) {
+		*find_pending(writer, writer->pending[i].key) = i + 1;
+	}
+
+	Appender *out = &writer->out;
+	IndexWriter index;
+	PackHeader header = writer->header;
+	if (!begin_index(&index, out, numBase + writer->numPending, &header.indexOffset)) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+		return FALSE;
+	}
+
+	// Pending entries replace the base ones with the same key
+	uint64_t i = 0;
+	size_t j = 0;
+	while (i < numBase || j < writer->numPending) {
+		int cmp = i == numBase ? 1
+			: (j == writer->numPending ? -1 : compare_entries(&base[i], &writer->pending[j]));
+		if (cmp < 0) {
+			add_to_index(&index, &base[i++]);
+		} else {
+			if (cmp == 0) {
+				i ++;
+			}
+			add_to_index(&index, &writer->pending[j++]);
+		}
+	}
+	header.numEntries = index.numEntries;
+	header.liveBytes = index.liveBytes;
+	header.fanoutBits = index.fanoutBits;
+	header.generation ++;
+	finish_index(&index);
+	flush_appender(out);
+
+	if (!out->ok || !write_header(writer->file, &header, !writer->noSync)) {
+		discard_pending(writer);
+		return FALSE;
+	}
+	writer->header = header;
+
+	GetExeIconPack *newBase = get_exe_icon_pack_open(writer->path);
+	if (!newBase) {
+		return FALSE;
+	}
+	get_exe_icon_pack_close(writer->base);
+	writer->base = newBase;
+	clear_pending(writer);
+	return TRUE;
+}
+
+static void free_writer(GetExeIconPackWriter *writer)
+{
+	get_exe_icon_pack_close(writer->base);
+	if (writer->file != INVALID_FILE) {
+		close_file(writer->file);
+	}
+	if (writer->lockFile != INVALID_FILE) {
+		close_file(writer->lockFile);
+	}
+	free(writer->out.buf);
+	free(writer->pending);
+	free(writer->slots);
+	free(writer->path);
+	free(writer);
+}
+
+// Opens and locks the lock file of the pack at 'path'
+static FileHandle lock_pack(PCSTR path)
+{
+	char *lockPath = path_with_suffix(path, ".lock");
+	if (!lockPath) {
+		return INVALID_FILE;
+	}
+	FileHandle lockFile = open_file(lockPath, TRUE, FALSE);
+	free(lockPath);
+	if (lockFile != INVALID_FILE && !lock_file(lockFile)) {
+		close_file(lockFile);
+		return INVALID_FILE;
+	}
+	return lockFile;
+}
+
+GetExeIconPackWriter *get_exe_icon_pack_writer_open(PCSTR path, const GetExeIconPackOptions *options)
+{
+	DWORD alignment = options && options->alignment ? options->alignment : GET_EXE_ICON_PACK_DEFAULT_ALIGNMENT;
+	if (!path || alignment > PACK_MAX_ALIGNMENT || (alignment & (alignment - 1)) != 0) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return NULL;
+	}
+
+	GetExeIconPackWriter *writer = (GetExeIconPackWriter *)calloc(1, sizeof(GetExeIconPackWriter));
+	if (!writer) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+		return NULL;
+	}
+	writer->file = INVALID_FILE;
+	writer->noSync = options ? options->noSync : FALSE;
+	writer->path = path_with_suffix(path, "");
+	if (!writer->path || !init_pending(writer)) {
+		free_writer(writer);
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+		return NULL;
+	}
+
+	writer->lockFile = lock_pack(path);
+	writer->file = writer->lockFile != INVALID_FILE ? open_file(path, TRUE, FALSE) : INVALID_FILE;
+	uint64_t fileSize;
+	if (writer->file == INVALID_FILE || !get_file_size(writer->file, &fileSize)) {
+		free_writer(writer);
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OPEN_FAILED);
+		return NULL;
+	}
+
+	if (fileSize > 0) {
+		// Append after the last commit, over anything a failed writer
+		// left behind
+		writer->base = get_exe_icon_pack_open(path);
+		if (!writer->base) {
+			GetExeIconError error = get_exe_icon_last_error();
+			free_writer(writer);
+			get_exe_icon_set_last_error(error);
+			return NULL;
+		}
+		writer->header = writer->base->header;
+		if (!init_appender(&writer->out, writer->file, writer->base->mapSize)) {
+			free_writer(writer);
+			get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+			return NULL;
+		}
+	} else {
+		// A new pack starts with an empty commit, so that it can be read
+		writer->header.alignment = alignment;
+		if (!init_appender(&writer->out, writer->file, data_start(alignment))) {
+			free_writer(writer);
+			get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+			return NULL;
+		}
+		if (!write_commit(writer)) {
+			GetExeIconError error = get_exe_icon_last_error();
+			free_writer(writer);
+			get_exe_icon_set_last_error(error);
+			return NULL;
+		}
+	}
+
+	get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+	return writer;
+}
+
+BOOL get_exe_icon_pack_writer_add(GetExeIconPackWriter *writer, const GetExeIconHash *key, const void *icoBuf, DWORD bufLen)
+{
+	if (!writer || !key || !icoBuf) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return FALSE;
+	}
+	uint64_t numBase = writer->base ? writer->base->header.numEntries : 0;
+	if (numBase + writer->numPending >= UINT32_MAX) {
+		// The fanout table counts entries in 32 bits
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_LIMIT_EXCEEDED);
+		return FALSE;
+	}
+	if (!reserve_pending(writer)) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+		return FALSE;
+	}
+
+	pad_appender(&writer->out, writer->header.alignment);
+	uint64_t offset = appender_end(&writer->out);
+	append(&writer->out, icoBuf, bufLen);
+	if (!writer->out.ok) {
+		discard_pending(writer);
+		return FALSE;
+	}
+
+	// A key added twice since the last commit keeps only its last ICO
+	size_t *slot = find_pending(writer, key->bytes);
+	if (*slot == 0) {
+		*slot = ++writer->numPending;
+	}
+	PackEntry *entry = &writer->pending[*slot - 1];
+	memcpy(entry->key, key->bytes, sizeof(entry->key));
+	entry->offset = offset;
+	entry->length = bufLen;
+	entry->reserved = 0;
+
+	get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+	return TRUE;
+}
+
+BOOL get_exe_icon_pack_writer_contains(const GetExeIconPackWriter *writer, const GetExeIconHash *key)
+{
+	if (!writer || !key) {
+		return FALSE;
+	}
+	return *find_pending(writer, key->bytes) != 0
+		|| (writer->base && find_entry(writer->base, key->bytes) != NULL);
+}
+
+BOOL get_exe_icon_pack_writer_add_batch(GetExeIconPackWriter *writer, const PCSTR *paths, const GetExeIconBatchResult *results, size_t count, GetExeIconPackKey keyType, GetExeIconHash *keys, size_t *numAdded)
+{
+	if (numAdded) {
+		*numAdded = 0;
+	}
+	if (!writer || (count > 0 && (!results || (keyType == GET_EXE_ICON_PACK_KEY_PATH && !paths)))) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return FALSE;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		GetExeIconHash key;
+		memset(&key, 0, sizeof(key));
+		if (results[i].icoBuf) {
+			if (keyType == GET_EXE_ICON_PACK_KEY_PATH) {
+				get_exe_icon_hash(paths[i], strlen(paths[i]), &key);
+			} else {
+				get_exe_icon_hash(results[i].icoBuf, results[i].bufLen, &key);
+			}
+
+			if (keyType == GET_EXE_ICON_PACK_KEY_PATH || !get_exe_icon_pack_writer_contains(writer, &key)) {
+				if (!get_exe_icon_pack_writer_add(writer, &key, results[i].icoBuf, results[i].bufLen)) {
+					return FALSE;
+				}
+				if (numAdded) {
+					(*numAdded) ++;
+				}
+			}
+		}
+		if (keys) {
+			keys[i] = key;
+		}
+	}
+
+	get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+	return TRUE;
+}
+
+BOOL get_exe_icon_pack_writer_commit(GetExeIconPackWriter *writer)
+{
+	if (!writer) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return FALSE;
+	}
+	if (!write_commit(writer)) {
+		return FALSE;
+	}
+	get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+	return TRUE;
+}
+
+void get_exe_icon_pack_writer_close(GetExeIconPackWriter *writer)
+{
+	if (writer) {
+		free_writer(writer);
+	}
+}
+
+// Copies the ICOs of 'pack' into a new pack through 'out', in key order
+static BOOL write_compacted(const GetExeIconPack *pack, Appender *out, BOOL sync)
+{
+	const PackHeader *old = &pack->header;
+	append(out, NULL, (size_t)data_start(old->alignment));
+	for (uint64_t i = 0; i < old->numEntries; i++) {
+		const BYTE *data = entry_data(pack, &pack->entries[i]);
+		if (!data) {
+			get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_BAD_ARCHIVE);
+			return FALSE;
+		}
+		pad_appender(out, old->alignment);
+		append(out, data, pack->entries[i].length);
+	}
+
+	// Lay the ICOs out again to find their new offsets
+	IndexWriter index;
+	PackHeader header;
+	memset(&header, 0, sizeof(header));
+	if (!begin_index(&index, out, old->numEntries, &header.indexOffset)) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+		return FALSE;
+	}
+	uint64_t offset = data_start(old->alignment);
+	for (uint64_t i = 0; i < old->numEntries; i++) {
+		PackEntry entry = pack->entries[i];
+		entry.offset = align_up(offset, old->alignment);
+		offset = entry.offset + entry.length;
+		add_to_index(&index, &entry);
+	}
+	header.numEntries = index.numEntries;
+	header.liveBytes = index.liveBytes;
+	header.fanoutBits = index.fanoutBits;
+	header.alignment = old->alignment;
+	header.generation = 1;
+	finish_index(&index);
+	flush_appender(out);
+
+	if (!out->ok || !write_header(out->file, &header, sync)) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OPEN_FAILED);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+BOOL get_exe_icon_pack_compact(PCSTR path)
+{
+	if (!path) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return FALSE;
+	}
+
+	FileHandle lockFile = lock_pack(path);
+	if (lockFile == INVALID_FILE) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OPEN_FAILED);
+		return FALSE;
+	}
+	GetExeIconPack *pack = get_exe_icon_pack_open(path);
+	if (!pack) {
+		GetExeIconError error = get_exe_icon_last_error();
+		close_file(lockFile);
+		get_exe_icon_set_last_error(error);
+		return FALSE;
+	}
+
+	char *tmpPath = path_with_suffix(path, ".tmp");
+	FileHandle tmpFile = tmpPath ? open_file(tmpPath, TRUE, TRUE) : INVALID_FILE;
+	Appender out;
+	memset(&out, 0, sizeof(out));
+	BOOL ret = FALSE;
+	if (tmpFile == INVALID_FILE) {
+		get_exe_icon_set_last_error(tmpPath ? GET_EXE_ICON_ERROR_OPEN_FAILED : GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+	} else if (!init_appender(&out, tmpFile, 0)) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+	} else {
+		ret = write_compacted(pack, &out, TRUE);
+	}
+	free(out.buf);
+	if (tmpFile != INVALID_FILE) {
+		close_file(tmpFile);
+	}
+	get_exe_icon_pack_close(pack);
+
+	if (ret && !replace_file(tmpPath, path)) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OPEN_FAILED);
+		ret = FALSE;
+	}
+	if (!ret && tmpFile != INVALID_FILE) {
+		remove_file(tmpPath);
+	}
+	free(tmpPath);
+	close_file(lockFile);
+	if (ret) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+	}
+	return ret;
+}
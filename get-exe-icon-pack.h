@@ -0,0 +1,180 @@
+// Copyright (c) 2021 Aury Snow
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef GET_EXE_ICON_PACK_H
+#define GET_EXE_ICON_PACK_H
+
+#include "get-exe-icon-batch.h"
+
+// A pack of many ICOs in a single file, for serving them without opening a
+// file per icon. The file holds the ICOs one after another, each starting at
+// a multiple of an alignment, followed by an index of their keys sorted for
+// binary search. Readers map the whole pack and get a pointer to an ICO in the
+// mapping, so a lookup costs a couple of cache misses and copies nothing.
+//
+// Each ICO is found by a 16 byte key, typically either:
+//  - The hash of the ICO (GetExeIconOptions.hash or get_exe_icon_hash()), to
+//    store each distinct icon once like get-exe-icon-store.h does.
+//  - get_exe_icon_hash() of the UTF-8 path of the file it came from, to look
+//    up icons by path.
+// Keys are assumed to be well spread out, as hashes are; lookups of other
+// keys still work, but get slower.
+//
+// A pack is only ever appended to. A writer adds ICOs at the end of the file
+// and commits them by writing a new index after them and pointing the header
+// at it, so a crash before a commit loses only the ICOs added since the last
+// one. Readers see the pack as it was when they opened it, and keep working
+// while a writer appends to it or it is compacted. ICOs that were replaced
+// and the indexes of earlier commits are left as dead space, which
+// get_exe_icon_pack_compact() reclaims.
+//
+// The file uses the host's byte order, and can't be opened on a host with
+// the other one.
+
+#define GET_EXE_ICON_PACK_DEFAULT_ALIGNMENT  16
+
+// A pack opened for reading. Safe to use from any number of threads at once.
+typedef struct GetExeIconPack GetExeIconPack;
+
+// Opens a pack for reading, given its path as a UTF-8 string, and maps it
+// into memory. Returns NULL on error, with get_exe_icon_last_error() saying
+// why: GET_EXE_ICON_ERROR_OPEN_FAILED if the file can't be opened or mapped,
+// or GET_EXE_ICON_ERROR_BAD_ARCHIVE if it isn't a valid pack.
+GetExeIconPack *get_exe_icon_pack_open(PCSTR path);
+
+// Unmaps the pack. Pointers returned by get_exe_icon_pack_get() become
+// invalid.
+void get_exe_icon_pack_close(GetExeIconPack *pack);
+
+// Finds the ICO with the given key. This is a binary search of the keys
+// sharing the key's first few bits, which for hashes are about 8 keys.
+//
+// bufLen (OUT): The length of the ICO.
+//
+// fileOffset (OUT, optional): The offset of the ICO within the pack file,
+//                             e.g. for sendfile(2).
+//
+// Return Value: A pointer to the ICO within the pack's mapping, valid until
+//               the pack is closed. NULL (with GET_EXE_ICON_ERROR_NO_ICON)
+//               if the pack doesn't have the key.
+const BYTE *get_exe_icon_pack_get(const GetExeIconPack *pack, const GetExeIconHash *key, PDWORD bufLen, uint64_t *fileOffset);
+
+// The number of ICOs in the pack
+size_t get_exe_icon_pack_count(const GetExeIconPack *pack);
+
+// Gets the i'th ICO (0 <= i < get_exe_icon_pack_count()) in the order of
+// their keys, e.g. to list the pack. Returns NULL (with
+// GET_EXE_ICON_ERROR_INVALID_ARGUMENT) if i is out of range, or (with
+// GET_EXE_ICON_ERROR_BAD_ARCHIVE) if the ICO's entry is damaged.
+const BYTE *get_exe_icon_pack_entry(const GetExeIconPack *pack, size_t i, GetExeIconHash *key, PDWORD bufLen);
+
+// Statistics about a pack as it was when it was opened
+typedef struct
+{
+	uint64_t numEntries;
+	uint64_t liveBytes;   // Total size of the ICOs in the index
+	uint64_t fileSize;    // Up to the end of the index
+	DWORD alignment;
+} GetExeIconPackStats;
+
+void get_exe_icon_pack_stats(const GetExeIconPack *pack, GetExeIconPackStats *stats);
+
+// Adds ICOs to a pack. Only one writer may have a pack open at a time, and a
+// writer may only be used by one thread at a time.
+//
+// If writing to the file fails, the ICOs added since the last commit are
+// discarded, leaving the pack as it was at that commit.
+typedef struct GetExeIconPackWriter GetExeIconPackWriter;
+
+// Options for get_exe_icon_pack_writer_open(). Zero-initialize for the
+// defaults.
+typedef struct
+{
+	// What each ICO's offset in the file is a multiple of: a power of 2 up to
+	// 4096. 0 means GET_EXE_ICON_PACK_DEFAULT_ALIGNMENT. Only used when
+	// creating the pack; later writers keep its alignment.
+	DWORD alignment;
+
+	// Skip flushing the file to disk on each commit. Commits are much faster,
+	// but a system crash (not just a crash of the process) may then damage
+	// the pack.
+	BOOL noSync;
+} GetExeIconPackOptions;
+
+// Opens the pack at 'path', given as a UTF-8 string, for adding to it. The
+// pack is created if it doesn't exist. 'options' may be NULL to use the
+// defaults. Returns NULL on error, with get_exe_icon_last_error() saying why:
+// GET_EXE_ICON_ERROR_OPEN_FAILED if the file can't be opened or the pack is
+// already open for writing (in this process or another), or
+// GET_EXE_ICON_ERROR_BAD_ARCHIVE if the file exists but isn't a pack.
+//
+// Writers are kept apart by locking a file named after the pack with ".lock"
+// added, which is left behind.
+GetExeIconPackWriter *get_exe_icon_pack_writer_open(PCSTR path, const GetExeIconPackOptions *options);
+
+// Adds an ICO to the pack, replacing the ICO the pack had for the key, if
+// any. It's written to the file at once, but only becomes part of the pack
+// (for readers opened afterwards) once it's committed.
+BOOL get_exe_icon_pack_writer_add(GetExeIconPackWriter *writer, const GetExeIconHash *key, const void *icoBuf, DWORD bufLen);
+
+// Whether the pack has an ICO for the key, counting ICOs added but not yet
+// committed.
+BOOL get_exe_icon_pack_writer_contains(const GetExeIconPackWriter *writer, const GetExeIconHash *key);
+
+// How get_exe_icon_pack_writer_add_batch() keys the ICOs
+typedef enum
+{
+	// The hash of the ICO. An ICO the pack already has is not added again.
+	GET_EXE_ICON_PACK_KEY_CONTENT = 0,
+
+	// get_exe_icon_hash() of the path the ICO was extracted from
+	GET_EXE_ICON_PACK_KEY_PATH,
+} GetExeIconPackKey;
+
+// Adds the ICOs extracted by get_exe_icons_batch() from 'paths'. Results
+// with an error are skipped.
+//
+// keys (OUT, optional): An array of 'count' keys, receiving the key of each
+//                       result that has an ICO (and all 0 for the rest).
+//
+// numAdded (OUT, optional): The number of ICOs written to the pack.
+//
+// Return Value: FALSE if writing failed, in which case
+//               get_exe_icon_last_error() says why.
+BOOL get_exe_icon_pack_writer_add_batch(GetExeIconPackWriter *writer, const PCSTR *paths, const GetExeIconBatchResult *results, size_t count, GetExeIconPackKey keyType, GetExeIconHash *keys, size_t *numAdded);
+
+// Makes the ICOs added so far part of the pack by writing a new index after
+// them. Writing the index takes time in proportion to the size of the whole
+// pack, so commit after adding many ICOs rather than after each one.
+BOOL get_exe_icon_pack_writer_commit(GetExeIconPackWriter *writer);
+
+// Closes the writer. ICOs added since the last commit are discarded.
+void get_exe_icon_pack_writer_close(GetExeIconPackWriter *writer);
+
+// Rewrites the pack at 'path' with only the ICOs in its index, in the order
+// of their keys, and replaces the file with the result. The pack must not be
+// open for writing: this fails with GET_EXE_ICON_ERROR_OPEN_FAILED if another
+// process has a writer open, and must not be called while this one does.
+// Readers that have the old file open keep using it until they reopen the
+// pack (on Windows, the old file can't be replaced while it's open, so close
+// them first).
+BOOL get_exe_icon_pack_compact(PCSTR path);
+
+#endif
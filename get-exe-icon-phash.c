@@ -0,0 +1,867 @@
+// Copyright (c) 2021 Aury Snow
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include "get-exe-icon-phash.h"
+#include "get-exe-icon-resample.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+// Notes about the code:
+//
+// An icon is hashed from one image, the one get_exe_icon_bitmap_from_file_utf8()
+// picks for 32x32, decoded and resampled to 32x32 with the vector code of
+// the decode and resample modules. Its pixels are composited over mid gray
+// and turned into luminance, so that the shape of a dark icon on a
+// transparent background shows as well as that of a light one.
+//
+// Only the 8x8 lowest frequencies of the 32x32 DCT-II are needed (leaving
+// out the first row and column, whose DC and lowest horizontal and vertical
+// terms mostly say how bright the icon is), so the transform is two small
+// matrix products rather than a full FFT-style DCT: the 8 wanted basis rows
+// times the image's columns gives an 8x32 matrix, and that times the 8
+// wanted basis columns gives the 8x8 coefficients. The scaling factors of
+// the DCT are left out, since the hash only compares coefficients with their
+// median. The products are written so that each coefficient is a sum taken
+// in the same order in the plain C and the SSE2 and AVX2 kernels, with no
+// fused multiply-adds, so they give bit-identical results.
+//
+// The index is built with a counting sort of the codes into the buckets of
+// each of its four tables: each thread counts the values in its chunk of the
+// codes, the counts are turned into where each chunk's codes go in each
+// bucket, and then each thread writes its chunk's indices there. A bucket
+// lists its codes in ascending order, whatever the number of threads. A query
+// looks up its parts' buckets and those of every value within r / 4 bits of
+// them, skipping codes that it has already found through an earlier table.
+// For large distances so many buckets would be looked in that a linear scan
+// of all the codes is faster, so that's done instead.
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PHASH_X86
+#define PHASH_POPCNT
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_POPCNT __attribute__((target("popcnt")))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define PHASH_X86
+#define TARGET_SSE2
+#define TARGET_AVX2
+#include <immintrin.h>
+#endif
+
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define ALWAYS_INLINE __forceinline
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+#define HASH_SIZE  GET_EXE_ICON_PHASH_SIZE
+#define DCT_SIZE   8
+
+#define NUM_PARTS    4
+#define PART_BITS    16
+#define NUM_BUCKETS  (1u << PART_BITS)
+
+// Each chunk of codes that a thread counts and sorts while building an index
+// is at least this large
+#define MIN_CODES_PER_CHUNK  65536
+
+// A query scans all the codes instead of its buckets when those would hold
+// more than 1 / LINEAR_SCAN_SHARE of the codes on average
+#define LINEAR_SCAN_SHARE  8
+
+// cos(m * pi / 64) for m from 0 to 32
+static const float cosTable[33] = {
+	1.000000000f, 0.998795456f, 0.995184727f, 0.989176510f, 0.980785280f, 0.970031253f,
+	0.956940336f, 0.941544065f, 0.923879533f, 0.903989293f, 0.881921264f, 0.857728610f,
+	0.831469612f, 0.803207531f, 0.773010453f, 0.740951125f, 0.707106781f, 0.671558955f,
+	0.634393284f, 0.595699304f, 0.555570233f, 0.514102744f, 0.471396737f, 0.427555093f,
+	0.382683432f, 0.336889853f, 0.290284677f, 0.242980180f, 0.195090322f, 0.146730474f,
+	0.098017140f, 0.049067674f, 0.000000000f,
+};
+
+// The basis functions for frequencies 1 to DCT_SIZE, both ways round:
+// rows[u][x] and columns[x][u] are cos((2x + 1)(u + 1) pi / 64)
+typedef struct
+{
+	float rows[DCT_SIZE][HASH_SIZE];
+	float columns[HASH_SIZE][DCT_SIZE];
+} DctBasis;
+
+static float dct_basis(DWORD u, DWORD x)
+{
+	DWORD m = (2 * x + 1) * u % 128;
+	if (m > 64) {
+		m = 128 - m;
+	}
+	return m > 32 ? -cosTable[64 - m] : cosTable[m];
+}
+
+// Made once, on the first hash
+static DctBasis dctBasis;
+
+static void init_dct_basis(void)
+{
+	for (DWORD u = 0; u < DCT_SIZE; u++) {
+		for (DWORD x = 0; x < HASH_SIZE; x++) {
+			dctBasis.rows[u][x] = dctBasis.columns[x][u] = dct_basis(u + 1, x);
+		}
+	}
+}
+
+#ifdef _WIN32
+static INIT_ONCE dctBasisOnce = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK init_dct_basis_once(PINIT_ONCE once, PVOID param, PVOID *context)
+{
+	(void)once;
+	(void)param;
+	(void)context;
+	init_dct_basis();
+	return TRUE;
+}
+
+static const DctBasis *get_dct_basis(void)
+{
+	InitOnceExecuteOnce(&dctBasisOnce, init_dct_basis_once, NULL, NULL);
+	return &dctBasis;
+}
+#else
+static pthread_once_t dctBasisOnce = PTHREAD_ONCE_INIT;
+
+static const DctBasis *get_dct_basis(void)
+{
+	pthread_once(&dctBasisOnce, init_dct_basis);
+	return &dctBasis;
+}
+#endif
+
+// Computes the DCT_SIZE x DCT_SIZE coefficients of a HASH_SIZE x HASH_SIZE image
+typedef void (*DctKernel)(const float *image, const DctBasis *basis, float *coeffs);
+
+static void dct_scalar(const float *image, const DctBasis *basis, float *coeffs)
+{
+	float tmp[DCT_SIZE][HASH_SIZE];
+	for (DWORD u = 0; u < DCT_SIZE; u++) {
+		for (DWORD x = 0; x < HASH_SIZE; x++) {
+			tmp[u][x] = 0;
+		}
+		for (DWORD y = 0; y < HASH_SIZE; y++) {
+			const float w = basis->rows[u][y];
+			for (DWORD x = 0; x < HASH_SIZE; x++) {
+				tmp[u][x] += w * image[y * HASH_SIZE + x];
+			}
+		}
+	}
+
+	for (DWORD u = 0; u < DCT_SIZE; u++) {
+		float *out = coeffs + u * DCT_SIZE;
+		for (DWORD v = 0; v < DCT_SIZE; v++) {
+			out[v] = 0;
+		}
+		for (DWORD x = 0; x < HASH_SIZE; x++) {
+			const float t = tmp[u][x];
+			for (DWORD v = 0; v < DCT_SIZE; v++) {
+				out[v] += t * basis->columns[x][v];
+			}
+		}
+	}
+}
+
+#ifdef PHASH_X86
+TARGET_SSE2 static void dct_sse2(const float *image, const DctBasis *basis, float *coeffs)
+{
+	float tmp[DCT_SIZE][HASH_SIZE];
+	for (DWORD u = 0; u < DCT_SIZE; u++) {
+		__m128 sums[HASH_SIZE / 4];
+		for (DWORD k = 0; k < HASH_SIZE / 4; k++) {
+			sums[k] = _mm_setzero_ps();
+		}
+		for (DWORD y = 0; y < HASH_SIZE; y++) {
+			const __m128 w = _mm_set1_ps(basis->rows[u][y]);
+			for (DWORD k = 0; k < HASH_SIZE / 4; k++) {
+				sums[k] = _mm_add_ps(sums[k], _mm_mul_ps(w, _mm_loadu_ps(image + y * HASH_SIZE + k * 4)));
+			}
+		}
+		for (DWORD k = 0; k < HASH_SIZE / 4; k++) {
+			_mm_storeu_ps(tmp[u] + k * 4, sums[k]);
+		}
+	}
+
+	for (DWORD u = 0; u < DCT_SIZE; u++) {
+		__m128 lo = _mm_setzero_ps(), hi = _mm_setzero_ps();
+		for (DWORD x = 0; x < HASH_SIZE; x++) {
+			const __m128 t = _mm_set1_ps(tmp[u][x]);
+			lo = _mm_add_ps(lo, _mm_mul_ps(t, _mm_loadu_ps(basis->columns[x])));
+			hi = _mm_add_ps(hi, _mm_mul_ps(t, _mm_loadu_ps(basis->columns[x] + 4)));
+		}
+		_mm_storeu_ps(coeffs + u * DCT_SIZE, lo);
+		_mm_storeu_ps(coeffs + u * DCT_SIZE + 4, hi);
+	}
+}
+
+TARGET_AVX2 static void dct_avx2(const float *image, const DctBasis *basis, float *coeffs)
+{
+	float tmp[DCT_SIZE][HASH_SIZE];
+	for (DWORD u = 0; u < DCT_SIZE; u++) {
+		__m256 sums[HASH_SIZE / 8];
+		for (DWORD k = 0; k < HASH_SIZE / 8; k++) {
+			sums[k] = _mm256_setzero_ps();
+		}
+		for (DWORD y = 0; y < HASH_SIZE; y++) {
+			const __m256 w = _mm256_set1_ps(basis->rows[u][y]);
+			for (DWORD k = 0; k < HASH_SIZE / 8; k++) {
+				sums[k] = _mm256_add_ps(sums[k], _mm256_mul_ps(w, _mm256_loadu_ps(image + y * HASH_SIZE + k * 8)));
+			}
+		}
+		for (DWORD k = 0; k < HASH_SIZE / 8; k++) {
+			_mm256_storeu_ps(tmp[u] + k * 8, sums[k]);
+		}
+	}
+
+	for (DWORD u = 0; u < DCT_SIZE; u++) {
+		__m256 sums = _mm256_setzero_ps();
+		for (DWORD x = 0; x < HASH_SIZE; x++) {
+			sums = _mm256_add_ps(sums, _mm256_mul_ps(_mm256_set1_ps(tmp[u][x]), _mm256_loadu_ps(basis->columns[x])));
+		}
+		_mm256_storeu_ps(coeffs + u * DCT_SIZE, sums);
+	}
+	_mm256_zeroupper();
+}
+#endif
+
+static DctKernel select_dct_kernel(GetExeIconIsa isa)
+{
+	GetExeIconIsa cpuIsa = get_exe_icon_cpu_isa();
+	if (isa == GET_EXE_ICON_ISA_AUTO || isa > cpuIsa) {
+		isa = cpuIsa;
+	}
+
+	switch (isa) {
+#ifdef PHASH_X86
+	case GET_EXE_ICON_ISA_AVX2:
+		return dct_avx2;
+	case GET_EXE_ICON_ISA_SSE2:
+		return dct_sse2;
+#endif
+	default:
+		return dct_scalar;
+	}
+}
+
+static ALWAYS_INLINE DWORD popcount64(uint64_t x)
+{
+#ifdef __GNUC__
+	return (DWORD)__builtin_popcountll(x);
+#else
+	x = x - ((x >> 1) & 0x5555555555555555ull);
+	x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0full;
+	return (DWORD)((x * 0x0101010101010101ull) >> 56);
+#endif
+}
+
+// Hashes a premultiplied HASH_SIZE x HASH_SIZE bitmap
+static void hash_pixels(const BYTE *pixels, GetExeIconIsa isa, GetExeIconPHash *hash)
+{
+	float image[HASH_SIZE * HASH_SIZE];
+	DWORD counts[GET_EXE_ICON_PHASH_HISTOGRAM_BINS] = { 0 };
+	DWORD numOpaque = 0;
+	for (DWORD i = 0; i < HASH_SIZE * HASH_SIZE; i++) {
+		const BYTE *p = pixels + i * 4;
+		DWORD a = p[3];
+
+		// Luminance over mid gray, scaled by 255 to stay an integer
+		DWORD luma = (77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8;
+		image[i] = (float)(luma * 255 + (255 - a) * 128);
+
+		// The top 2 bits of each unpremultiplied color, c * 255 / a. With
+		// 'scale' rounded up, c * scale >> 16 is exactly that for any
+		// c <= a, as the error is under 1 / 256 and the fraction is a
+		// multiple of 1 / a.
+		if (a >= 128) {
+			DWORD scale = (255u << 16) / a + 1;
+			counts[((p[0] * scale) >> 22) * 16 + ((p[1] * scale) >> 22) * 4 + ((p[2] * scale) >> 22)] ++;
+			numOpaque ++;
+		}
+	}
+	for (DWORD i = 0; i < GET_EXE_ICON_PHASH_HISTOGRAM_BINS; i++) {
+		hash->histogram[i] = numOpaque ? (BYTE)((counts[i] * 255 + numOpaque / 2) / numOpaque) : 0;
+	}
+
+	float coeffs[DCT_SIZE * DCT_SIZE];
+	select_dct_kernel(isa)(image, get_dct_basis(), coeffs);
+
+	// The median, from a sorted copy
+	float sorted[DCT_SIZE * DCT_SIZE];
+	for (DWORD i = 0; i < DCT_SIZE * DCT_SIZE; i++) {
+		float c = coeffs[i];
+		DWORD j = i;
+		for (; j > 0 && sorted[j - 1] > c; j--) {
+			sorted[j] = sorted[j - 1];
+		}
+		sorted[j] = c;
+	}
+	const float median = (sorted[DCT_SIZE * DCT_SIZE / 2 - 1] + sorted[DCT_SIZE * DCT_SIZE / 2]) / 2;
+
+	hash->code = 0;
+	for (DWORD i = 0; i < DCT_SIZE * DCT_SIZE; i++) {
+		if (coeffs[i] > median) {
+			hash->code |= (uint64_t)1 << i;
+		}
+	}
+}
+
+static void init_resample_options(GetExeIconResampleOptions *resampleOptions, const GetExeIconPHashOptions *options)
+{
+	memset(resampleOptions, 0, sizeof(GetExeIconResampleOptions));
+	resampleOptions->numThreads = 1;
+	resampleOptions->isa = options ? options->isa : GET_EXE_ICON_ISA_AUTO;
+}
+
+// Hashes a bitmap that's already HASH_SIZE x HASH_SIZE, and frees it
+static BOOL hash_sized_bitmap(GetExeIconBitmap *bitmap, const GetExeIconPHashOptions *options, GetExeIconPHash *hash)
+{
+	hash_pixels(bitmap->pixels, options ? options->isa : GET_EXE_ICON_ISA_AUTO, hash);
+	get_exe_icon_bitmap_free(bitmap);
+	get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+	return TRUE;
+}
+
+BOOL get_exe_icon_phash_bitmap(const GetExeIconBitmap *bitmap, const GetExeIconPHashOptions *options, GetExeIconPHash *hash)
+{
+	if (hash) {
+		memset(hash, 0, sizeof(GetExeIconPHash));
+	}
+	if (!bitmap || !bitmap->pixels || bitmap->width == 0 || bitmap->height == 0 || !hash) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return FALSE;
+	}
+
+	if (bitmap->width == HASH_SIZE && bitmap->height == HASH_SIZE) {
+		hash_pixels(bitmap->pixels, options ? options->isa : GET_EXE_ICON_ISA_AUTO, hash);
+		get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+		return TRUE;
+	}
+
+	GetExeIconResampleOptions resampleOptions;
+	init_resample_options(&resampleOptions, options);
+	GetExeIconBitmap sized;
+	if (!get_exe_icon_resample(bitmap, HASH_SIZE, HASH_SIZE, &resampleOptions, &sized)) {
+		return FALSE;
+	}
+	return hash_sized_bitmap(&sized, options, hash);
+}
+
+BOOL get_exe_icon_phash_from_file_utf8(PCSTR path, const GetExeIconPHashOptions *options, GetExeIconPHash *hash)
+{
+	if (hash) {
+		memset(hash, 0, sizeof(GetExeIconPHash));
+	}
+	if (!path || !hash) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return FALSE;
+	}
+
+	GetExeIconResampleOptions resampleOptions;
+	init_resample_options(&resampleOptions, options);
+	GetExeIconBitmap sized;
+	if (!get_exe_icon_bitmap_from_file_utf8(path, HASH_SIZE, HASH_SIZE, &resampleOptions, &sized)) {
+		return FALSE;
+	}
+	return hash_sized_bitmap(&sized, options, hash);
+}
+
+BOOL get_exe_icon_phash_from_memory(const void *data, size_t len, const GetExeIconPHashOptions *options, GetExeIconPHash *hash)
+{
+	if (hash) {
+		memset(hash, 0, sizeof(GetExeIconPHash));
+	}
+	if (!data || !hash) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return FALSE;
+	}
+
+	GetExeIconResampleOptions resampleOptions;
+	init_resample_options(&resampleOptions, options);
+	GetExeIconBitmap sized;
+	if (!get_exe_icon_bitmap_from_memory(data, len, HASH_SIZE, HASH_SIZE, &resampleOptions, &sized)) {
+		return FALSE;
+	}
+	return hash_sized_bitmap(&sized, options, hash);
+}
+
+DWORD get_exe_icon_phash_distance(uint64_t a, uint64_t b)
+{
+	return popcount64(a ^ b);
+}
+
+DWORD get_exe_icon_phash_histogram_distance(const GetExeIconPHash *a, const GetExeIconPHash *b)
+{
+	DWORD distance = 0;
+	for (DWORD i = 0; i < GET_EXE_ICON_PHASH_HISTOGRAM_BINS; i++) {
+		distance += a->histogram[i] > b->histogram[i]
+			? a->histogram[i] - b->histogram[i]
+			: b->histogram[i] - a->histogram[i];
+	}
+	return distance;
+}
+
+// Work spread over threads, each claiming the next item (a file, or a chunk
+// of codes) with an atomic increment as get-exe-icon-batch.c does
+typedef struct
+{
+	void (*run)(void *job, size_t item);
+	void *job;
+	size_t count;
+
+	// Index of the next item to be claimed by a thread. Only accessed
+	// atomically.
+	volatile int64_t next;
+} Work;
+
+static size_t claim_next_item(Work *work)
+{
+#ifdef _WIN32
+	return (size_t)InterlockedExchangeAdd64((volatile LONG64 *)&work->next, 1);
+#else
+	return (size_t)__atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+static void run_worker(Work *work)
+{
+	for (;;) {
+		size_t i = claim_next_item(work);
+		if (i >= work->count) {
+			break;
+		}
+		work->run(work->job, i);
+	}
+}
+
+// Platform wrappers for running the threads
+
+#ifdef _WIN32
+typedef HANDLE Thread;
+
+static DWORD WINAPI phash_thread_main(LPVOID arg)
+{
+	run_worker((Work *)arg);
+	return 0;
+}
+
+static BOOL start_thread(Thread *thread, Work *work)
+{
+	*thread = CreateThread(NULL, 0, phash_thread_main, work, 0, NULL);
+	return *thread != NULL;
+}
+
+static void join_thread(Thread thread)
+{
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+
+static DWORD num_cpus(void)
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+}
+#else
+typedef pthread_t Thread;
+
+static void *phash_thread_main(void *arg)
+{
+	run_worker((Work *)arg);
+	return NULL;
+}
+
+static BOOL start_thread(Thread *thread, Work *work)
+{
+	return pthread_create(thread, NULL, phash_thread_main, work) == 0;
+}
+
+static void join_thread(Thread thread)
+{
+	pthread_join(thread, NULL);
+}
+
+static DWORD num_cpus(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (DWORD)n : 1;
+}
+#endif
+
+// Runs run(job, i) for each i below count on up to numThreads threads,
+// including the calling thread. If some threads can't be started, the rest
+// of them just do more of the work.
+static void run_on_threads(void (*run)(void *job, size_t item), void *job, size_t count, DWORD numThreads)
+{
+	Work work;
+	work.run = run;
+	work.job = job;
+	work.count = count;
+	work.next = 0;
+
+	if (numThreads > count) {
+		numThreads = count > 0 ? (DWORD)count : 1;
+	}
+	Thread *threads = NULL;
+	DWORD numStarted = 0;
+	if (numThreads > 1) {
+		threads = (Thread *)malloc(sizeof(Thread) * (numThreads - 1));
+	}
+	while (threads && numStarted < numThreads - 1 && start_thread(&threads[numStarted], &work)) {
+		numStarted ++;
+	}
+
+	run_worker(&work);
+
+	for (DWORD i = 0; i < numStarted; i++) {
+		join_thread(threads[i]);
+	}
+	free(threads);
+}
+
+typedef struct
+{
+	const PCSTR *paths;
+	const GetExeIconPHashOptions *options;
+	GetExeIconPHashResult *results;
+} HashJob;
+
+static void hash_file(void *arg, size_t i)
+{
+	HashJob *job = (HashJob *)arg;
+	GetExeIconPHashResult *result = &job->results[i];
+	get_exe_icon_phash_from_file_utf8(job->paths[i], job->options, &result->hash);
+	result->error = get_exe_icon_last_error();
+}
+
+size_t get_exe_icon_phash_files(const PCSTR *paths, size_t count, const GetExeIconPHashOptions *options, GetExeIconPHashResult *results)
+{
+	if ((!paths || !results) && count > 0) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return 0;
+	}
+
+	HashJob job;
+	job.paths = paths;
+	job.options = options;
+	job.results = results;
+	run_on_threads(hash_file, &job, count, options && options->numThreads ? options->numThreads : num_cpus());
+
+	size_t hashed = 0;
+	for (size_t i = 0; i < count; i++) {
+		hashed += results[i].error == GET_EXE_ICON_OK;
+	}
+	get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+	return hashed;
+}
+
+struct GetExeIconPHashIndex
+{
+	uint64_t *codes;
+	size_t count;
+
+	// For each part, the codes whose part has the value v are those at
+	// ids[part][offsets[part][v]] up to ids[part][offsets[part][v + 1]]
+	uint32_t *offsets[NUM_PARTS];
+	uint32_t *ids[NUM_PARTS];
+};
+
+static DWORD code_part(uint64_t code, DWORD part)
+{
+	return (DWORD)(code >> (part * PART_BITS)) & (NUM_BUCKETS - 1);
+}
+
+typedef struct
+{
+	GetExeIconPHashIndex *index;
+	size_t chunkSize;
+
+	// For each chunk and part, the number of the chunk's codes in each
+	// bucket, and then where the next of them goes in ids
+	uint32_t *counts;
+
+	// 0 while counting, 1 while writing the ids
+	int pass;
+} BuildJob;
+
+static void build_chunk(void *arg, size_t chunk)
+{
+	BuildJob *job = (BuildJob *)arg;
+	GetExeIconPHashIndex *index = job->index;
+	size_t start = chunk * job->chunkSize;
+	size_t end = start + job->chunkSize < index->count ? start + job->chunkSize : index->count;
+	uint32_t *counts = job->counts + chunk * NUM_PARTS * NUM_BUCKETS;
+
+	for (size_t i = start; i < end; i++) {
+		uint64_t code = index->codes[i];
+		for (DWORD part = 0; part < NUM_PARTS; part++) {
+			uint32_t *count = &counts[part * NUM_BUCKETS + code_part(code, part)];
+			if (job->pass == 0) {
+				(*count) ++;
+			} else {
+				index->ids[part][(*count)++] = (uint32_t)i;
+			}
+		}
+	}
+}
+
+void get_exe_icon_phash_index_free(GetExeIconPHashIndex *index)
+{
+	if (!index) {
+		return;
+	}
+	for (DWORD part = 0; part < NUM_PARTS; part++) {
+		free(index->offsets[part]);
+		free(index->ids[part]);
+	}
+	free(index->codes);
+	free(index);
+}
+
+GetExeIconPHashIndex *get_exe_icon_phash_index_build(const uint64_t *codes, size_t count, DWORD numThreads)
+{
+	if ((!codes && count > 0) || (uint64_t)count >= ((uint64_t)1 << 32)) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return NULL;
+	}
+
+	GetExeIconPHashIndex *index = (GetExeIconPHashIndex *)calloc(1, sizeof(GetExeIconPHashIndex));
+	if (!index) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+		return NULL;
+	}
+	index->count = count;
+	index->codes = (uint64_t *)malloc(sizeof(uint64_t) * (count > 0 ? count : 1));
+	BOOL ok = index->codes != NULL;
+	for (DWORD part = 0; part < NUM_PARTS && ok; part++) {
+		index->offsets[part] = (uint32_t *)malloc(sizeof(uint32_t) * (NUM_BUCKETS + 1));
+		index->ids[part] = (uint32_t *)malloc(sizeof(uint32_t) * (count > 0 ? count : 1));
+		ok = index->offsets[part] && index->ids[part];
+	}
+
+	// A chunk for each thread, but none too small to be worth a thread
+	if (numThreads == 0) {
+		numThreads = num_cpus();
+	}
+	size_t numChunks = count / MIN_CODES_PER_CHUNK + 1;
+	if (numChunks > numThreads) {
+		numChunks = numThreads;
+	}
+	BuildJob job;
+	job.index = index;
+	job.chunkSize = (count + numChunks - 1) / numChunks;
+	job.counts = ok ? (uint32_t *)calloc(numChunks * NUM_PARTS, sizeof(uint32_t) * NUM_BUCKETS) : NULL;
+	if (!job.counts) {
+		get_exe_icon_phash_index_free(index);
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+		return NULL;
+	}
+	if (count > 0) {
+		memcpy(index->codes, codes, sizeof(uint64_t) * count);
+	}
+
+	job.pass = 0;
+	run_on_threads(build_chunk, &job, numChunks, numThreads);
+
+	// Each bucket holds the codes of chunk 0, then those of chunk 1, and so on
+	for (DWORD part = 0; part < NUM_PARTS; part++) {
+		uint32_t next = 0;
+		for (DWORD value = 0; value < NUM_BUCKETS; value++) {
+			index->offsets[part][value] = next;
+			for (size_t chunk = 0; chunk < numChunks; chunk++) {
+				uint32_t *counts = &job.counts[(chunk * NUM_PARTS + part) * NUM_BUCKETS + value];
+				uint32_t chunkCount = *counts;
+				*counts = next;
+				next += chunkCount;
+			}
+		}
+		index->offsets[part][NUM_BUCKETS] = next;
+	}
+
+	job.pass = 1;
+	run_on_threads(build_chunk, &job, numChunks, numThreads);
+
+	free(job.counts);
+	get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+	return index;
+}
+
+typedef struct Query Query;
+
+struct Query
+{
+	const GetExeIconPHashIndex *index;
+	uint64_t code;
+	DWORD maxDistance;
+	DWORD partDistance;  // maxDistance / NUM_PARTS
+	DWORD part;          // Whose table is being looked in
+	GetExeIconPHashMatch *matches;
+	size_t maxMatches;
+	size_t numFound;
+
+	void (*search_bucket)(Query *query, DWORD value);
+};
+
+static ALWAYS_INLINE void add_match(Query *query, size_t i, DWORD distance)
+{
+	if (query->numFound < query->maxMatches) {
+		query->matches[query->numFound].index = i;
+		query->matches[query->numFound].distance = distance;
+	}
+	query->numFound ++;
+}
+
+// Checks the codes in the bucket of 'value' in the table being looked in.
+// This and scan_codes() are inlined into a version built for the POPCNT
+// instruction and one that isn't, as counting bits is most of their work.
+static ALWAYS_INLINE void search_bucket(Query *query, DWORD value)
+{
+	const GetExeIconPHashIndex *index = query->index;
+	const uint32_t *ids = index->ids[query->part];
+	const uint32_t end = index->offsets[query->part][value + 1];
+	for (uint32_t k = index->offsets[query->part][value]; k < end; k++) {
+		uint64_t diff = index->codes[ids[k]] ^ query->code;
+		DWORD distance = popcount64(diff);
+		if (distance > query->maxDistance) {
+			continue;
+		}
+
+		// A code with an earlier part this close was found in that part's
+		// table
+		BOOL seen = FALSE;
+		for (DWORD part = 0; part < query->part && !seen; part++) {
+			seen = popcount64(diff & ((uint64_t)(NUM_BUCKETS - 1) << (part * PART_BITS))) <= query->partDistance;
+		}
+		if (!seen) {
+			add_match(query, ids[k], distance);
+		}
+	}
+}
+
+static ALWAYS_INLINE void scan_codes(Query *query)
+{
+	const GetExeIconPHashIndex *index = query->index;
+	for (size_t i = 0; i < index->count; i++) {
+		DWORD distance = popcount64(index->codes[i] ^ query->code);
+		if (distance <= query->maxDistance) {
+			add_match(query, i, distance);
+		}
+	}
+}
+
+static void search_bucket_plain(Query *query, DWORD value)
+{
+	search_bucket(query, value);
+}
+
+static void scan_codes_plain(Query *query)
+{
+	scan_codes(query);
+}
+
+#ifdef PHASH_POPCNT
+TARGET_POPCNT static void search_bucket_popcnt(Query *query, DWORD value)
+{
+	search_bucket(query, value);
+}
+
+TARGET_POPCNT static void scan_codes_popcnt(Query *query)
+{
+	scan_codes(query);
+}
+#endif
+
+// Searches the buckets of every value that differs from 'value' in exactly
+// 'flips' more bits, all at or above bit 'from'
+static void search_values(Query *query, DWORD value, DWORD from, DWORD flips)
+{
+	if (flips == 0) {
+		query->search_bucket(query, value);
+		return;
+	}
+	for (DWORD bit = from; bit + flips <= PART_BITS; bit++) {
+		search_values(query, value ^ (1u << bit), bit + 1, flips - 1);
+	}
+}
+
+size_t get_exe_icon_phash_index_query(const GetExeIconPHashIndex *index, uint64_t code, DWORD maxDistance, GetExeIconPHashMatch *matches, size_t maxMatches)
+{
+	if (!index || (!matches && maxMatches > 0)) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return 0;
+	}
+
+	Query query;
+	query.index = index;
+	query.code = code;
+	query.maxDistance = maxDistance;
+	query.partDistance = maxDistance / NUM_PARTS;
+	query.matches = matches;
+	query.maxMatches = maxMatches;
+	query.numFound = 0;
+	query.search_bucket = search_bucket_plain;
+	void (*scan)(Query *query) = scan_codes_plain;
+#ifdef PHASH_POPCNT
+	// Every CPU with AVX2 has POPCNT
+	if (get_exe_icon_cpu_isa() >= GET_EXE_ICON_ISA_AVX2) {
+		query.search_bucket = search_bucket_popcnt;
+		scan = scan_codes_popcnt;
+	}
+#endif
+
+	// The number of values within partDistance of a part
+	uint64_t numValues = 0, combinations = 1;
+	for (DWORD k = 0; k <= query.partDistance && k <= PART_BITS; k++) {
+		numValues += combinations;
+		combinations = combinations * (PART_BITS - k) / (k + 1);
+	}
+
+	if (numValues * NUM_PARTS * LINEAR_SCAN_SHARE >= NUM_BUCKETS) {
+		scan(&query);
+	} else {
+		for (query.part = 0; query.part < NUM_PARTS; query.part++) {
+			DWORD value = code_part(code, query.part);
+			for (DWORD flips = 0; flips <= query.partDistance; flips++) {
+				search_values(&query, value, 0, flips);
+			}
+		}
+	}
+
+	get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+	return query.numFound;
+}
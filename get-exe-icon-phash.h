@@ -0,0 +1,145 @@
+// Copyright (c) 2021 Aury Snow
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef GET_EXE_ICON_PHASH_H
+#define GET_EXE_ICON_PHASH_H
+
+#include "get-exe-icon-decode.h"
+
+// Perceptual hashes of icons, for finding icons that look alike even when
+// their bytes differ: re-encoded, resampled, with sizes added or removed, or
+// with small edits. Each icon is reduced to a 32x32 bitmap, and hashed as a
+// 64 bit code from its discrete cosine transform (pHash: one bit for each of
+// the 8x8 lowest frequencies, set if the coefficient is above their median)
+// plus a color histogram. Icons that look alike have codes a small Hamming
+// distance apart (a threshold of 10 to 12 bits suits most uses), while
+// unrelated icons are around 32 bits apart.
+//
+// The codes can be put in an index that finds every code within a Hamming
+// distance of a query, which answers typical queries over tens of millions of
+// codes in about a millisecond.
+
+// The number of color histogram bins: 4 levels of each of red, green and blue
+#define GET_EXE_ICON_PHASH_HISTOGRAM_BINS  64
+
+// The size of the bitmap that icons are hashed at
+#define GET_EXE_ICON_PHASH_SIZE  32
+
+typedef struct
+{
+	// The DCT hash. Compare with get_exe_icon_phash_distance().
+	uint64_t code;
+
+	// The share of the icon's opaque pixels in each color bin (bin
+	// r * 16 + g * 4 + b for the top 2 bits of each color), out of 255, so
+	// the bins add up to about 255 (or are all 0 for an icon with no opaque
+	// pixels). Compare with get_exe_icon_phash_histogram_distance().
+	BYTE histogram[GET_EXE_ICON_PHASH_HISTOGRAM_BINS];
+} GetExeIconPHash;
+
+// Options for hashing. Zero-initialize for the defaults.
+typedef struct
+{
+	// Number of threads to hash on in get_exe_icon_phash_files(), including
+	// the calling thread. 0 uses one thread per CPU.
+	DWORD numThreads;
+
+	// Same as in GetExeIconDecodeOptions. Every instruction set gives the
+	// same hashes.
+	GetExeIconIsa isa;
+} GetExeIconPHashOptions;
+
+// Hashes a premultiplied bitmap, e.g. from get_exe_icon_decode_dib(). It's
+// resampled to GET_EXE_ICON_PHASH_SIZE x GET_EXE_ICON_PHASH_SIZE first if
+// it's another size.
+//
+// options: May be NULL to use the defaults.
+//
+// Return Value: TRUE on success. On error FALSE is returned, and
+//               get_exe_icon_last_error() says why.
+BOOL get_exe_icon_phash_bitmap(const GetExeIconBitmap *bitmap, const GetExeIconPHashOptions *options, GetExeIconPHash *hash);
+
+// Hashes the primary icon of a file. Only the image that best suits
+// GET_EXE_ICON_PHASH_SIZE is read and decoded, as by
+// get_exe_icon_bitmap_from_file_utf8(), so the hash doesn't change when
+// sizes far from it are added to or removed from the icon. PNG images are
+// passed over, so an icon with nothing but PNG images can't be hashed
+// (GET_EXE_ICON_ERROR_NO_ICON).
+BOOL get_exe_icon_phash_from_file_utf8(PCSTR path, const GetExeIconPHashOptions *options, GetExeIconPHash *hash);
+
+// Same as get_exe_icon_phash_from_file_utf8() except the PE file is in memory.
+BOOL get_exe_icon_phash_from_memory(const void *data, size_t len, const GetExeIconPHashOptions *options, GetExeIconPHash *hash);
+
+// The outcome of hashing one file's icon in get_exe_icon_phash_files().
+typedef struct
+{
+	GetExeIconPHash hash;    // All 0 if error is not GET_EXE_ICON_OK
+	GetExeIconError error;
+} GetExeIconPHashResult;
+
+// Hashes the primary icons of many files at once, on a pool of threads, as
+// get_exe_icons_batch() extracts them. results[i] is the outcome for
+// paths[i]. Returns the number of files that were hashed.
+size_t get_exe_icon_phash_files(const PCSTR *paths, size_t count, const GetExeIconPHashOptions *options, GetExeIconPHashResult *results);
+
+// The number of bits that differ between two codes
+DWORD get_exe_icon_phash_distance(uint64_t a, uint64_t b);
+
+// The sum of the differences between two histograms' bins: 0 for the same
+// colors, up to 510 for no colors in common.
+DWORD get_exe_icon_phash_histogram_distance(const GetExeIconPHash *a, const GetExeIconPHash *b);
+
+// An index of codes, for finding all the codes near a query. It uses
+// multi-index hashing: each code is split into four 16 bit parts, each with a
+// table from its value to the codes that have it. Two codes within a distance
+// of r must have a part within r / 4 of each other, so a query only has to
+// look in the buckets of the values that close to its own parts. That takes
+// about 24 bytes per code.
+typedef struct GetExeIconPHashIndex GetExeIconPHashIndex;
+
+// Builds an index of 'count' codes (fewer than 2^32), which are copied. The
+// tables are built on 'numThreads' threads, including the calling thread, or
+// one per CPU if it's 0.
+//
+// Return Value: The index, to be freed with get_exe_icon_phash_index_free().
+//               If an error occurs, NULL is returned, and
+//               get_exe_icon_last_error() says why.
+GetExeIconPHashIndex *get_exe_icon_phash_index_build(const uint64_t *codes, size_t count, DWORD numThreads);
+
+void get_exe_icon_phash_index_free(GetExeIconPHashIndex *index);
+
+// A code found by get_exe_icon_phash_index_query()
+typedef struct
+{
+	size_t index;     // Of the code, in the array the index was built from
+	DWORD distance;
+} GetExeIconPHashMatch;
+
+// Finds every code in the index within maxDistance bits of 'code', in no
+// particular order. Safe to call from any number of threads at once.
+//
+// matches (OUT): Up to maxMatches of the codes found. May be NULL if
+//                maxMatches is 0.
+//
+// Return Value: The number of codes found, which may be more than
+//               maxMatches.
+size_t get_exe_icon_phash_index_query(const GetExeIconPHashIndex *index, uint64_t code, DWORD maxDistance, GetExeIconPHashMatch *matches, size_t maxMatches);
+
+#endif
@@ -0,0 +1,815 @@
+// Copyright (c) 2021 Aury Snow
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include "get-exe-icon-png.h"
+#include "get-exe-icon-deflate.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+// Notes about the code:
+//
+// A PNG file here is the signature and three chunks: IHDR, a single IDAT
+// holding all of the compressed image data, and IEND. Each row of the image
+// data starts with a filter type byte. The filter is chosen per row by
+// trying all five and keeping the one whose output bytes, taken as signed,
+// sum to the least, which is the usual heuristic (libpng's) and works well
+// on icons: transparent rows come out as zeros with no filter, and smooth
+// gradients as small differences with Up or Paeth. The filtering is done by
+// SSE2 code where the CPU has it, since trying every filter on every row
+// otherwise takes longer than the compression. All five filters work on 16
+// bytes at a time, as every byte's prediction comes from the unfiltered
+// pixels, not from the bytes filtered before it.
+//
+// To re-encode an ICO, each bitmap image is decoded with get-exe-icon-decode
+// and encoded on its own, with the images shared out between threads as
+// get-exe-icon-batch.c shares out files. Images are claimed largest first,
+// since the 256x256 image takes far longer than the rest put together. Once
+// they're all done, the new ICO is put together with the images in their
+// original order.
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PNG_X86
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define PNG_X86
+#define TARGET_SSE2
+#include <immintrin.h>
+#endif
+
+#define PNG_SIGNATURE       "\x89PNG\r\n\x1a\n"
+#define PNG_SIGNATURE_SIZE  8
+
+// Size of a chunk's length, type and CRC, and of IHDR's data
+#define CHUNK_OVERHEAD  12
+#define IHDR_SIZE       13
+
+#define ICO_HEADER_SIZE     6
+#define ICO_DIR_ENTRY_SIZE  16
+
+typedef struct
+{
+	// Makes the colors of fully transparent pixels in a row 0
+	void (*clear_transparent)(BYTE *pixels, DWORD width);
+
+	// Applies PNG filter 'type' (0 to 4) to a row of n bytes of RGBA
+	// pixels, given the row above, and returns the filtered bytes' sum
+	// taken as signed
+	uint64_t (*filter_row)(int type, const BYTE *row, const BYTE *prev, BYTE *out, size_t n);
+} FilterKernels;
+
+static uint16_t read_le16(const BYTE *p)
+{
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t read_le32(const BYTE *p)
+{
+	return (uint32_t)p[0]
+	       | ((uint32_t)p[1] << 8)
+	       | ((uint32_t)p[2] << 16)
+	       | ((uint32_t)p[3] << 24);
+}
+
+static void write_le32(BYTE *p, uint32_t v)
+{
+	p[0] = (BYTE)v;
+	p[1] = (BYTE)(v >> 8);
+	p[2] = (BYTE)(v >> 16);
+	p[3] = (BYTE)(v >> 24);
+}
+
+static void write_be32(BYTE *p, uint32_t v)
+{
+	p[0] = (BYTE)(v >> 24);
+	p[1] = (BYTE)(v >> 16);
+	p[2] = (BYTE)(v >> 8);
+	p[3] = (BYTE)v;
+}
+
+static int resolve_level(const GetExeIconPngOptions *options)
+{
+	return options && options->level > 0 ? options->level : GET_EXE_ICON_PNG_DEFAULT_LEVEL;
+}
+
+// Filtering
+
+// The Paeth predictor, with p - a, p - b and p - c (where p = a + b - c)
+// simplified
+static BYTE paeth(BYTE a, BYTE b, BYTE c)
+{
+	int pa = abs(b - c);
+	int pb = abs(a - c);
+	int pc = abs(a + b - 2 * c);
+	if (pa <= pb && pa <= pc) {
+		return a;
+	}
+	return pb <= pc ? b : c;
+}
+
+// Plain C kernels
+
+static void clear_transparent_scalar(BYTE *pixels, DWORD width)
+{
+	for (DWORD x = 0; x < width; x++, pixels += 4) {
+		if (pixels[3] == 0) {
+			memset(pixels, 0, 4);
+		}
+	}
+}
+
+// Filters bytes 'from' to 'n' of a row with PNG filter 'type', returning the
+// sum of the filtered bytes taken as signed (so that small differences either
+// way count as small)
+static uint64_t filter_bytes_scalar(int type, const BYTE *row, const BYTE *prev, BYTE *out, size_t from, size_t n)
+{
+	uint64_t cost = 0;
+	for (size_t i = from; i < n; i++) {
+		BYTE a = i >= 4 ? row[i - 4] : 0;
+		BYTE b = prev[i];
+		BYTE c = i >= 4 ? prev[i - 4] : 0;
+		BYTE pred;
+		switch (type) {
+		case 0:  pred = 0; break;
+		case 1:  pred = a; break;
+		case 2:  pred = b; break;
+		case 3:  pred = (BYTE)((a + b) >> 1); break;
+		default: pred = paeth(a, b, c); break;
+		}
+		BYTE v = (BYTE)(row[i] - pred);
+		out[i] = v;
+		cost += v < 128 ? v : 256 - v;
+	}
+	return cost;
+}
+
+static uint64_t filter_row_scalar(int type, const BYTE *row, const BYTE *prev, BYTE *out, size_t n)
+{
+	return filter_bytes_scalar(type, row, prev, out, 0, n);
+}
+
+static const FilterKernels scalarKernels = {
+	clear_transparent_scalar,
+	filter_row_scalar,
+};
+
+#ifdef PNG_X86
+// SSE2 kernels, 4 pixels at a time
+
+TARGET_SSE2 static void clear_transparent_sse2(BYTE *pixels, DWORD width)
+{
+	const __m128i zero = _mm_setzero_si128();
+	DWORD x = 0;
+	for (; x + 4 <= width; x += 4) {
+		__m128i *p = (__m128i *)(pixels + x * 4);
+		__m128i v = _mm_loadu_si128(p);
+		__m128i transparent = _mm_cmpeq_epi32(_mm_srli_epi32(v, 24), zero);
+		_mm_storeu_si128(p, _mm_andnot_si128(transparent, v));
+	}
+	clear_transparent_scalar(pixels + x * 4, width - x);
+}
+
+TARGET_SSE2 static __m128i abs_16_sse2(__m128i v)
+{
+	return _mm_max_epi16(v, _mm_sub_epi16(_mm_setzero_si128(), v));
+}
+
+// The Paeth predictor of 8 16 bit values
+TARGET_SSE2 static __m128i paeth_16_sse2(__m128i a, __m128i b, __m128i c)
+{
+	__m128i pa = abs_16_sse2(_mm_sub_epi16(b, c));
+	__m128i pb = abs_16_sse2(_mm_sub_epi16(a, c));
+	__m128i pc = abs_16_sse2(_mm_sub_epi16(_mm_add_epi16(a, b), _mm_add_epi16(c, c)));
+	__m128i useC = _mm_cmpgt_epi16(pb, pc);
+	__m128i bc = _mm_or_si128(_mm_and_si128(useC, c), _mm_andnot_si128(useC, b));
+	__m128i notA = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+	return _mm_or_si128(_mm_and_si128(notA, bc), _mm_andnot_si128(notA, a));
+}
+
+TARGET_SSE2 static uint64_t filter_row_sse2(int type, const BYTE *row, const BYTE *prev, BYTE *out, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi8(1);
+
+	// The first pixel has nothing to its left, which the loop below can't
+	// load
+	uint64_t cost = filter_bytes_scalar(type, row, prev, out, 0, 4);
+	__m128i sums = zero;
+	size_t i = 4;
+	for (; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(row + i));
+		__m128i a = _mm_loadu_si128((const __m128i *)(row + i - 4));
+		__m128i b = _mm_loadu_si128((const __m128i *)(prev + i));
+		__m128i pred;
+		switch (type) {
+		case 0:
+			pred = zero;
+			break;
+		case 1:
+			pred = a;
+			break;
+		case 2:
+			pred = b;
+			break;
+		case 3:
+			// _mm_avg_epu8 rounds up, and the filter rounds down
+			pred = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+			break;
+		default: {
+			__m128i c = _mm_loadu_si128((const __m128i *)(prev + i - 4));
+			__m128i lo = paeth_16_sse2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+			__m128i hi = paeth_16_sse2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+			pred = _mm_packus_epi16(lo, hi);
+			break;
+		}
+		}
+
+		__m128i v = _mm_sub_epi8(x, pred);
+		_mm_storeu_si128((__m128i *)(out + i), v);
+		sums = _mm_add_epi64(sums, _mm_sad_epu8(_mm_min_epu8(v, _mm_sub_epi8(zero, v)), zero));
+	}
+
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i *)lanes, sums);
+	return cost + lanes[0] + lanes[1] + filter_bytes_scalar(type, row, prev, out, i, n);
+}
+
+static const FilterKernels sse2Kernels = {
+	clear_transparent_sse2,
+	filter_row_sse2,
+};
+#endif
+
+static const FilterKernels *select_kernels(GetExeIconIsa isa)
+{
+#ifdef PNG_X86
+	GetExeIconIsa cpuIsa = get_exe_icon_cpu_isa();
+	if (isa == GET_EXE_ICON_ISA_AUTO || isa > cpuIsa) {
+		isa = cpuIsa;
+	}
+	if (isa >= GET_EXE_ICON_ISA_SSE2) {
+		return &sse2Kernels;
+	}
+#else
+	(void)isa;
+#endif
+	return &scalarKernels;
+}
+
+// Makes the PNG image data before compression: each row of the bitmap,
+// with fully transparent pixels made 0, filtered and preceded by its filter
+// type
+static PBYTE filter_image(const GetExeIconBitmap *bitmap, GetExeIconIsa isa, size_t *len)
+{
+	const FilterKernels *k = select_kernels(isa);
+	const size_t stride = (size_t)bitmap->width * 4;
+	*len = (stride + 1) * bitmap->height;
+	PBYTE out = (PBYTE)malloc(*len);
+
+	// The current and previous rows (cleaned of transparent colors), and
+	// the best and latest filtered versions of the current row
+	PBYTE rows = (PBYTE)calloc(4, stride);
+	if (!out || !rows) {
+		free(out);
+		free(rows);
+		return NULL;
+	}
+	PBYTE cur = rows, prev = rows + stride, best = rows + 2 * stride, next = rows + 3 * stride;
+
+	for (DWORD y = 0; y < bitmap->height; y++) {
+		memcpy(cur, bitmap->pixels + y * stride, stride);
+		k->clear_transparent(cur, bitmap->width);
+
+		int bestType = 0;
+		uint64_t bestCost = k->filter_row(0, cur, prev, best, stride);
+		for (int type = 1; type <= 4 && bestCost > 0; type++) {
+			uint64_t cost = k->filter_row(type, cur, prev, next, stride);
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestType = type;
+				PBYTE t = best;
+				best = next;
+				next = t;
+			}
+		}
+
+		BYTE *dst = out + y * (stride + 1);
+		dst[0] = (BYTE)bestType;
+		memcpy(dst + 1, best, stride);
+
+		PBYTE t = prev;
+		prev = cur;
+		cur = t;
+	}
+
+	free(rows);
+	return out;
+}
+
+// Writes a chunk at p, returning the end of it
+static PBYTE write_chunk(PBYTE p, const char *type, const BYTE *data, uint32_t len)
+{
+	write_be32(p, len);
+	memcpy(p + 4, type, 4);
+	if (len > 0) {
+		memcpy(p + 8, data, len);
+	}
+	write_be32(p + 8 + len, get_exe_icon_crc32(0, p + 4, (size_t)len + 4));
+	return p + CHUNK_OVERHEAD + len;
+}
+
+PBYTE get_exe_icon_encode_png(const GetExeIconBitmap *bitmap, const GetExeIconPngOptions *options, PDWORD bufLen)
+{
+	if (!bitmap || !bitmap->pixels || bitmap->width == 0 || bitmap->height == 0 || !bufLen
+		|| (options && (options->level < 0 || options->level > GET_EXE_ICON_DEFLATE_MAX_LEVEL)))
+	{
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return NULL;
+	}
+	if (bitmap->width > INT32_MAX / 4 || bitmap->height > INT32_MAX
+		|| ((uint64_t)bitmap->width * 4 + 1) * bitmap->height > INT32_MAX)
+	{
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_TOO_LARGE);
+		return NULL;
+	}
+
+	size_t filteredLen;
+	PBYTE filtered = filter_image(bitmap, options ? options->isa : GET_EXE_ICON_ISA_AUTO, &filteredLen);
+	if (!filtered) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+		return NULL;
+	}
+	size_t dataLen;
+	PBYTE data = get_exe_icon_zlib_compress(filtered, filteredLen, resolve_level(options), &dataLen);
+	free(filtered);
+	if (!data) {
+		return NULL;
+	}
+
+	uint64_t total = PNG_SIGNATURE_SIZE + 3 * CHUNK_OVERHEAD + IHDR_SIZE + (uint64_t)dataLen;
+	if (total > UINT32_MAX) {
+		free(data);
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_TOO_LARGE);
+		return NULL;
+	}
+	PBYTE png = (PBYTE)malloc((size_t)total);
+	if (!png) {
+		free(data);
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+		return NULL;
+	}
+
+	// 8 bits per channel, RGBA, deflate, adaptive filtering, not interlaced
+	BYTE ihdr[IHDR_SIZE] = { 0, 0, 0, 0, 0, 0, 0, 0, 8, 6, 0, 0, 0 };
+	write_be32(ihdr, bitmap->width);
+	write_be32(ihdr + 4, bitmap->height);
+
+	memcpy(png, PNG_SIGNATURE, PNG_SIGNATURE_SIZE);
+	PBYTE p = write_chunk(png + PNG_SIGNATURE_SIZE, "IHDR", ihdr, IHDR_SIZE);
+	p = write_chunk(p, "IDAT", data, (uint32_t)dataLen);
+	write_chunk(p, "IEND", NULL, 0);
+	free(data);
+
+	*bufLen = (DWORD)total;
+	get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+	return png;
+}
+
+// ICO re-encoding
+
+typedef struct
+{
+	const BYTE *data;   // The original image
+	DWORD len;
+	BOOL encode;        // Whether to try encoding it as PNG
+	PBYTE png;          // The PNG, if it's smaller than the original
+	DWORD pngLen;
+} IcoImage;
+
+typedef struct
+{
+	IcoImage *images;
+	DWORD *order;       // Indices into images, largest first
+	DWORD numImages;
+	GetExeIconPngOptions options;
+
+	// The next entry of order to be claimed by a thread. Only accessed
+	// atomically.
+	volatile int64_t next;
+
+	// Set if any image ran out of memory
+	volatile int32_t outOfMemory;
+} TranscodeJob;
+
+static DWORD claim_image(TranscodeJob *job)
+{
+#ifdef _WIN32
+	return (DWORD)InterlockedExchangeAdd64((volatile LONG64 *)&job->next, 1);
+#else
+	return (DWORD)__atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+static void encode_ico_image(TranscodeJob *job, IcoImage *image)
+{
+	GetExeIconDecodeOptions decodeOptions;
+	memset(&decodeOptions, 0, sizeof(decodeOptions));
+	GetExeIconBitmap bitmap;
+	DWORD pngLen = 0;
+	PBYTE png = NULL;
+	if (get_exe_icon_decode_dib(image->data, image->len, &decodeOptions, &bitmap)) {
+		png = get_exe_icon_encode_png(&bitmap, &job->options, &pngLen);
+		get_exe_icon_bitmap_free(&bitmap);
+	}
+
+	// Images that can't be decoded are kept as they are, but running out
+	// of memory fails the whole ICO
+	if (!png && get_exe_icon_last_error() == GET_EXE_ICON_ERROR_OUT_OF_MEMORY) {
+		job->outOfMemory = 1;
+	}
+	if (png && pngLen >= image->len) {
+		free(png);
+		png = NULL;
+	}
+	image->png = png;
+	image->pngLen = png ? pngLen : 0;
+}
+
+static void run_transcode_worker(TranscodeJob *job)
+{
+	for (;;) {
+		DWORD i = claim_image(job);
+		if (i >= job->numImages) {
+			break;
+		}
+		encode_ico_image(job, &job->images[job->order[i]]);
+	}
+}
+
+#ifdef _WIN32
+typedef HANDLE Thread;
+
+static DWORD WINAPI transcode_thread_main(LPVOID arg)
+{
+	run_transcode_worker((TranscodeJob *)arg);
+	return 0;
+}
+
+static BOOL start_thread(Thread *thread, TranscodeJob *job)
+{
+	*thread = CreateThread(NULL, 0, transcode_thread_main, job, 0, NULL);
+	return *thread != NULL;
+}
+
+static void join_thread(Thread thread)
+{
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+
+static DWORD num_cpus(void)
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+}
+#else
+typedef pthread_t Thread;
+
+static void *transcode_thread_main(void *arg)
+{
+	run_transcode_worker((TranscodeJob *)arg);
+	return NULL;
+}
+
+static BOOL start_thread(Thread *thread, TranscodeJob *job)
+{
+	return pthread_create(thread, NULL, transcode_thread_main, job) == 0;
+}
+
+static void join_thread(Thread thread)
+{
+	pthread_join(thread, NULL);
+}
+
+static DWORD num_cpus(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (DWORD)n : 1;
+}
+#endif
+
+// Encodes the images that job->order lists on up to numThreads threads,
+// including the calling thread
+static void run_transcode(TranscodeJob *job, DWORD numThreads)
+{
+	if (numThreads == 0) {
+		numThreads = num_cpus();
+	}
+	if (numThreads > job->numImages) {
+		numThreads = job->numImages;
+	}
+
+	Thread *threads = NULL;
+	DWORD numStarted = 0;
+	if (numThreads > 1) {
+		threads = (Thread *)malloc(sizeof(Thread) * (numThreads - 1));
+	}
+	while (threads && numStarted < numThreads - 1 && start_thread(&threads[numStarted], job)) {
+		numStarted ++;
+	}
+
+	run_transcode_worker(job);
+
+	for (DWORD i = 0; i < numStarted; i++) {
+		join_thread(threads[i]);
+	}
+	free(threads);
+}
+
+static BOOL is_png(const BYTE *data, DWORD len)
+{
+	return len >= PNG_SIGNATURE_SIZE && memcmp(data, PNG_SIGNATURE, PNG_SIGNATURE_SIZE) == 0;
+}
+
+// Pixels in an image, from its directory entry
+static DWORD entry_area(const BYTE *entry)
+{
+	DWORD width = entry[0] ? entry[0] : 256;
+	DWORD height = entry[1] ? entry[1] : 256;
+	return width * height;
+}
+
+PBYTE get_exe_icon_ico_to_png(const void *icoBuf, size_t bufLen, const GetExeIconPngOptions *options, PDWORD outLen)
+{
+	if (!icoBuf || !outLen
+		|| (options && (options->level < 0 || options->level > GET_EXE_ICON_DEFLATE_MAX_LEVEL)))
+	{
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return NULL;
+	}
+
+	const BYTE *ico = (const BYTE *)icoBuf;
+	if (bufLen < ICO_HEADER_SIZE || read_le16(ico + 2) != 1) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_NO_ICON);
+		return NULL;
+	}
+	const DWORD count = read_le16(ico + 4);
+	const size_t headerLen = ICO_HEADER_SIZE + (size_t)count * ICO_DIR_ENTRY_SIZE;
+	if (headerLen > bufLen) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_NO_ICON);
+		return NULL;
+	}
+
+	TranscodeJob job;
+	memset(&job, 0, sizeof(job));
+	if (options) {
+		job.options = *options;
+	}
+	job.images = (IcoImage *)calloc(count ? count : 1, sizeof(IcoImage));
+	job.order = (DWORD *)malloc(sizeof(DWORD) * (count ? count : 1));
+	if (!job.images || !job.order) {
+		free(job.images);
+		free(job.order);
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+		return NULL;
+	}
+
+	for (DWORD i = 0; i < count; i++) {
+		const BYTE *entry = ico + ICO_HEADER_SIZE + i * ICO_DIR_ENTRY_SIZE;
+		uint32_t len = read_le32(entry + 8);
+		uint32_t offset = read_le32(entry + 12);
+		if (offset > bufLen || len > bufLen - offset) {
+			free(job.images);
+			free(job.order);
+			get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_NO_ICON);
+			return NULL;
+		}
+
+		IcoImage *image = &job.images[i];
+		image->data = ico + offset;
+		image->len = len;
+		image->encode = !is_png(image->data, len) && (entry[0] ? entry[0] : 256) >= job.options.minWidth;
+		if (!image->encode) {
+			continue;
+		}
+
+		// Insert into order, largest first
+		DWORD j = job.numImages++;
+		for (; j > 0 && entry_area(ico + ICO_HEADER_SIZE + job.order[j - 1] * ICO_DIR_ENTRY_SIZE) < entry_area(entry); j--) {
+			job.order[j] = job.order[j - 1];
+		}
+		job.order[j] = i;
+	}
+
+	run_transcode(&job, job.options.numThreads);
+
+	uint64_t total = headerLen;
+	for (DWORD i = 0; i < count; i++) {
+		total += job.images[i].png ? job.images[i].pngLen : job.images[i].len;
+	}
+
+	PBYTE out = NULL;
+	if (job.outOfMemory) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+	} else if (total > UINT32_MAX) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_TOO_LARGE);
+	} else if (!(out = (PBYTE)malloc((size_t)total))) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+	} else {
+		memcpy(out, ico, headerLen);
+		DWORD offset = (DWORD)headerLen;
+		for (DWORD i = 0; i < count; i++) {
+			const IcoImage *image = &job.images[i];
+			const BYTE *data = image->png ? image->png : image->data;
+			DWORD len = image->png ? image->pngLen : image->len;
+			BYTE *entry = out + ICO_HEADER_SIZE + i * ICO_DIR_ENTRY_SIZE;
+			write_le32(entry + 8, len);
+			write_le32(entry + 12, offset);
+			memcpy(out + offset, data, len);
+			offset += len;
+		}
+		*outLen = (DWORD)total;
+		get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+	}
+
+	for (DWORD i = 0; i < count; i++) {
+		free(job.images[i].png);
+	}
+	free(job.images);
+	free(job.order);
+	return out;
+}
+
+// Re-encodes an extracted ICO, taking ownership of it
+static PBYTE ico_to_png_owned(PBYTE icoBuf, DWORD icoLen, const GetExeIconPngOptions *options, PDWORD bufLen)
+{
+	if (!icoBuf) {
+		return NULL;
+	}
+	PBYTE out = get_exe_icon_ico_to_png(icoBuf, icoLen, options, bufLen);
+	free(icoBuf);
+	return out;
+}
+
+PBYTE get_exe_icon_png_ico_from_file_utf8(PCSTR path, const GetExeIconPngOptions *options, PDWORD bufLen)
+{
+	DWORD icoLen;
+	PBYTE icoBuf = get_exe_icon_from_file_utf8(path, TRUE, &icoLen);
+	return ico_to_png_owned(icoBuf, icoLen, options, bufLen);
+}
+
+PBYTE get_exe_icon_png_ico_from_memory(const void *data, size_t len, const GetExeIconPngOptions *options, PDWORD bufLen)
+{
+	DWORD icoLen;
+	PBYTE icoBuf = get_exe_icon_from_memory(data, len, TRUE, &icoLen);
+	return ico_to_png_owned(icoBuf, icoLen, options, bufLen);
+}
+
+// Sets up the extraction of the largest image with the highest bit depth
+static void init_best_options(GetExeIconOptions *options, GetExeIconImageInfo *info)
+{
+	memset(options, 0, sizeof(GetExeIconOptions));
+	options->allowEmbeddedPNGs = TRUE;
+	options->targetWidth = 256;
+	options->sizePolicy = GET_EXE_ICON_SIZE_NEAREST_LARGER;
+	options->rawImage = TRUE;
+	options->imageInfo = info;
+}
+
+// Encodes an extracted image as PNG unless it is one already, taking
+// ownership of it
+static PBYTE image_to_png(PBYTE image, DWORD imageLen, const GetExeIconImageInfo *info, const GetExeIconPngOptions *options, PDWORD bufLen)
+{
+	if (!image || info->isPNG) {
+		*bufLen = image ? imageLen : 0;
+		return image;
+	}
+
+	GetExeIconDecodeOptions decodeOptions;
+	memset(&decodeOptions, 0, sizeof(decodeOptions));
+	GetExeIconBitmap bitmap;
+	BOOL ok = get_exe_icon_decode_dib(image, imageLen, &decodeOptions, &bitmap);
+	free(image);
+	if (!ok) {
+		return NULL;
+	}
+	PBYTE png = get_exe_icon_encode_png(&bitmap, options, bufLen);
+	get_exe_icon_bitmap_free(&bitmap);
+	return png;
+}
+
+PBYTE get_exe_icon_best_png_from_ico(const void *icoBuf, size_t bufLen, const GetExeIconPngOptions *options, PDWORD outLen)
+{
+	if (!icoBuf || !outLen) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return NULL;
+	}
+
+	const BYTE *ico = (const BYTE *)icoBuf;
+	if (bufLen < ICO_HEADER_SIZE || read_le16(ico + 2) != 1) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_NO_ICON);
+		return NULL;
+	}
+	const DWORD count = read_le16(ico + 4);
+	if (count == 0 || ICO_HEADER_SIZE + (size_t)count * ICO_DIR_ENTRY_SIZE > bufLen) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_NO_ICON);
+		return NULL;
+	}
+
+	// The largest image, and of those the one with the highest bit depth
+	DWORD best = 0;
+	for (DWORD i = 1; i < count; i++) {
+		const BYTE *entry = ico + ICO_HEADER_SIZE + i * ICO_DIR_ENTRY_SIZE;
+		const BYTE *bestEntry = ico + ICO_HEADER_SIZE + best * ICO_DIR_ENTRY_SIZE;
+		if (entry_area(entry) > entry_area(bestEntry)
+			|| (entry_area(entry) == entry_area(bestEntry) && read_le16(entry + 6) > read_le16(bestEntry + 6)))
+		{
+			best = i;
+		}
+	}
+
+	const BYTE *entry = ico + ICO_HEADER_SIZE + best * ICO_DIR_ENTRY_SIZE;
+	uint32_t len = read_le32(entry + 8);
+	uint32_t offset = read_le32(entry + 12);
+	if (offset > bufLen || len > bufLen - offset) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_NO_ICON);
+		return NULL;
+	}
+
+	if (is_png(ico + offset, len)) {
+		PBYTE png = (PBYTE)malloc(len ? len : 1);
+		if (!png) {
+			get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+			return NULL;
+		}
+		memcpy(png, ico + offset, len);
+		*outLen = len;
+		get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+		return png;
+	}
+
+	GetExeIconDecodeOptions decodeOptions;
+	memset(&decodeOptions, 0, sizeof(decodeOptions));
+	GetExeIconBitmap bitmap;
+	if (!get_exe_icon_decode_ico_image(icoBuf, bufLen, best, &decodeOptions, &bitmap)) {
+		return NULL;
+	}
+	PBYTE png = get_exe_icon_encode_png(&bitmap, options, outLen);
+	get_exe_icon_bitmap_free(&bitmap);
+	return png;
+}
+
+PBYTE get_exe_icon_best_png_from_file_utf8(PCSTR path, const GetExeIconPngOptions *options, PDWORD bufLen)
+{
+	if (!bufLen) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return NULL;
+	}
+	GetExeIconOptions extractOptions;
+	GetExeIconImageInfo info;
+	init_best_options(&extractOptions, &info);
+	DWORD imageLen;
+	PBYTE image = get_exe_icon_from_file_utf8_ex(path, &extractOptions, &imageLen);
+	return image_to_png(image, imageLen, &info, options, bufLen);
+}
+
+PBYTE get_exe_icon_best_png_from_memory(const void *data, size_t len, const GetExeIconPngOptions *options, PDWORD bufLen)
+{
+	if (!bufLen) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return NULL;
+	}
+	GetExeIconOptions extractOptions;
+	GetExeIconImageInfo info;
+	init_best_options(&extractOptions, &info);
+	DWORD imageLen;
+	PBYTE image = get_exe_icon_from_memory_ex(data, len, &extractOptions, &imageLen);
+	return image_to_png(image, imageLen, &info, options, bufLen);
+}
@@ -0,0 +1,101 @@
+// Copyright (c) 2021 Aury Snow
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef GET_EXE_ICON_PNG_H
+#define GET_EXE_ICON_PNG_H
+
+#include "get-exe-icon-decode.h"
+
+// Encodes icon images as PNG. The bitmap (DIB) images in icons are
+// uncompressed, so a 256x256 32 bit image takes 260 KB; as a PNG it is
+// usually several times smaller. This can re-encode an icon's bitmap images
+// as PNGs (which Windows Vista and later read in ICOs as well), or give the
+// icon's best image as a standalone PNG file.
+//
+// Images are written as 8 bit RGBA, each row with whichever PNG filter
+// gives the smallest sum of differences, and compressed with the deflate
+// compressor in get-exe-icon-deflate.c. The colors of fully transparent
+// pixels are written as 0, since they're never seen, which makes the
+// transparent areas around most icons compress to almost nothing.
+
+// Options for PNG encoding. Zero-initialize it and set the fields that are
+// needed.
+typedef struct
+{
+	// The deflate level, from 1 (fastest) to 9 (smallest). 0 means
+	// GET_EXE_ICON_PNG_DEFAULT_LEVEL.
+	int level;
+
+	// Number of threads to encode an ICO's images on, including the calling
+	// thread, with each image encoded on one thread. 0 uses one per CPU.
+	DWORD numThreads;
+
+	// For ICOs: bitmap images narrower than this are left as they are, e.g.
+	// 256 to only encode the largest images, as Windows XP can't read PNG
+	// images in ICOs at all. 0 encodes every bitmap image.
+	DWORD minWidth;
+
+	// Same as in GetExeIconDecodeOptions.
+	GetExeIconIsa isa;
+} GetExeIconPngOptions;
+
+#define GET_EXE_ICON_PNG_DEFAULT_LEVEL  2
+
+// Encodes an RGBA bitmap as a PNG file.
+//
+// bitmap: The image, which must not be premultiplied.
+//
+// options: May be NULL to use the defaults.
+//
+// Return Value: The PNG file, to be freed with free(3). On error NULL is
+//               returned, and get_exe_icon_last_error() says why.
+PBYTE get_exe_icon_encode_png(const GetExeIconBitmap *bitmap, const GetExeIconPngOptions *options, PDWORD bufLen);
+
+// Re-encodes the bitmap images of an ICO as PNGs, keeping each one's place
+// and directory entry (apart from its size and offset). PNG images are
+// copied as they are, and so are bitmap images that can't be decoded or
+// that wouldn't get any smaller.
+//
+// icoBuf, bufLen: The ICO, e.g. from get_exe_icon_from_file_utf8().
+//
+// options: May be NULL to use the defaults.
+//
+// Return Value: The new ICO, to be freed with free(3). On error NULL is
+//               returned, and get_exe_icon_last_error() says why.
+PBYTE get_exe_icon_ico_to_png(const void *icoBuf, size_t bufLen, const GetExeIconPngOptions *options, PDWORD outLen);
+
+// Gets the primary icon of a file with its bitmap images re-encoded as
+// PNGs, as get_exe_icon_ico_to_png() does. The icon's own PNG images are
+// always included.
+PBYTE get_exe_icon_png_ico_from_file_utf8(PCSTR path, const GetExeIconPngOptions *options, PDWORD bufLen);
+PBYTE get_exe_icon_png_ico_from_memory(const void *data, size_t len, const GetExeIconPngOptions *options, PDWORD bufLen);
+
+// Gets the best image of a file's primary icon as a PNG file: the largest,
+// and of those the one with the highest bit depth. If that image is already
+// a PNG, it is returned as it is.
+PBYTE get_exe_icon_best_png_from_file_utf8(PCSTR path, const GetExeIconPngOptions *options, PDWORD bufLen);
+PBYTE get_exe_icon_best_png_from_memory(const void *data, size_t len, const GetExeIconPngOptions *options, PDWORD bufLen);
+
+// Same as get_exe_icon_best_png_from_file_utf8() except the icon is an ICO
+// that was already extracted, e.g. by get_exe_icon_from_file_utf8(), so the
+// executable isn't read again.
+PBYTE get_exe_icon_best_png_from_ico(const void *icoBuf, size_t bufLen, const GetExeIconPngOptions *options, PDWORD outLen);
+
+#endif
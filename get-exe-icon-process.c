@@ -0,0 +1,878 @@
+// Copyright (c) 2021 Aury Snow
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include "get-exe-icon-process.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Notes about the code:
+//
+// There are two tables, both hash tables with chaining and a fixed number of
+// buckets: processes, keyed by PID, each pointing at the entry of its
+// executable, and executables, keyed by a hash of their path, size and
+// modification time, each holding a reference to its ICO (or the error its
+// extraction failed with). A lookup first checks the process's start time,
+// which is all it takes if its entry is still valid. Otherwise it finds the
+// process's executable and looks that up, and only if it's new is the icon
+// extracted, with the lock released in the meantime. Two threads that miss
+// on the same executable at once may both extract it; the second one to
+// finish finds the first one's entry and uses that.
+//
+// Processes are found through a handle that stops their PID from being
+// reused while it's open on Windows. On Linux there is no such handle, so
+// /proc/<pid>/exe is opened (which pins the executable's inode) and the start
+// time is checked again afterwards: if it's unchanged, the open file is the
+// executable of the process that was looked up, and the icon is extracted
+// from it through /proc/self/fd.
+//
+// When there are too many entries, the least recently used quarter of them
+// is dropped at once, found by sorting their last use ticks, so that
+// evictions cost O(log n) per insertion. An executable's entry is only
+// dropped once no process entry points at it. Failures to open or read a
+// file aren't cached, since they're usually fleeting (a process exiting
+// during the lookup).
+
+#define DEFAULT_MAX_PROCESSES  4096
+#define DEFAULT_MAX_IMAGES     1024
+#define MAX_ENTRIES            (1u << 24)
+
+// The refcounted ICO behind a GetExeIconSharedIco
+typedef struct
+{
+	GetExeIconSharedIco ico;  // First, so that a pointer to it points to this too
+	volatile int32_t refs;
+} SharedIco;
+
+// An executable's identity: its path (in UTF-8, or NULL-terminated UTF-16 on
+// Windows), size and modification time
+typedef struct
+{
+	BYTE *path;
+	size_t pathBytes;
+	uint64_t size;
+	uint64_t mtime;   // 100ns units on Windows, nanoseconds elsewhere
+} ImageKey;
+
+typedef struct ImageEntry
+{
+	struct ImageEntry *next;  // In its bucket
+	uint64_t hash;
+	ImageKey key;
+	SharedIco *ico;           // NULL if the extraction failed
+	GetExeIconError error;
+	DWORD numProcesses;       // Process entries pointing at it
+	uint64_t lastUsed;
+} ImageEntry;
+
+typedef struct ProcessEntry
+{
+	struct ProcessEntry *next;  // In its bucket
+	DWORD pid;
+	uint64_t startTime;
+	ImageEntry *image;
+	uint64_t lastUsed;
+} ProcessEntry;
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION Mutex;
+#else
+typedef pthread_mutex_t Mutex;
+#endif
+
+struct GetExeIconProcessCache
+{
+	Mutex lock;
+	BOOL allowEmbeddedPNGs;
+	DWORD maxProcesses;
+	DWORD maxImages;
+
+	ProcessEntry **processes;
+	DWORD processMask;     // Number of buckets - 1
+	ImageEntry **images;
+	DWORD imageMask;
+	DWORD numIdleImages;   // Images no process entry points at
+
+	// Incremented for every use of an entry, which records the value, to
+	// tell which entries were least recently used
+	uint64_t tick;
+
+	GetExeIconProcessCacheStats stats;
+};
+
+// A running process, while it's being looked up
+typedef struct
+{
+#ifdef _WIN32
+	HANDLE handle;
+#else
+	DWORD pid;
+	int exeFd;  // Of /proc/<pid>/exe, once the executable is resolved
+#endif
+	uint64_t startTime;
+} Process;
+
+// Platform wrappers for the few process, file, lock and atomic operations
+// needed below.
+
+#ifdef _WIN32
+static void init_mutex(Mutex *mutex) { InitializeCriticalSection(mutex); }
+static void destroy_mutex(Mutex *mutex) { DeleteCriticalSection(mutex); }
+static void lock_mutex(Mutex *mutex) { EnterCriticalSection(mutex); }
+static void unlock_mutex(Mutex *mutex) { LeaveCriticalSection(mutex); }
+
+static void add_ref(SharedIco *ico)
+{
+	InterlockedIncrement((volatile LONG *)&ico->refs);
+}
+
+// Returns TRUE if that was the last reference
+static BOOL drop_ref(SharedIco *ico)
+{
+	return InterlockedDecrement((volatile LONG *)&ico->refs) == 0;
+}
+
+static PWSTR utf8_to_wide(PCSTR str)
+{
+	int len = MultiByteToWideChar(CP_UTF8, 0, str, -1, NULL, 0);
+	if (len <= 0) {
+		return NULL;
+	}
+	PWSTR wStr = (PWSTR)malloc(sizeof(WCHAR) * len);
+	if (wStr && MultiByteToWideChar(CP_UTF8, 0, str, -1, wStr, len) <= 0) {
+		free(wStr);
+		return NULL;
+	}
+	return wStr;
+}
+
+// Long paths need the \\?\ prefix to be opened, which
+// get_exe_icon_from_file_utf16() adds, but GetFileAttributesExW() needs it
+// too. Same as to_long_path() in get-exe-icon.c: returns the prefixed path,
+// to be freed with free(3), or NULL if 'path' doesn't need it.
+static PWSTR to_long_path(PCWSTR path)
+{
+	size_t len = wcslen(path);
+	if (len < MAX_PATH || wcsncmp(path, L"\\\\?\\", 4) == 0) {
+		return NULL;
+	}
+
+	PCWSTR prefix;
+	if (((path[0] >= L'A' && path[0] <= L'Z') || (path[0] >= L'a' && path[0] <= L'z'))
+		&& path[1] == L':' && (path[2] == L'\\' || path[2] == L'/'))
+	{
+		prefix = L"\\\\?\\";
+	} else if ((path[0] == L'\\' || path[0] == L'/') && (path[1] == L'\\' || path[1] == L'/')) {
+		// \\server\share becomes \\?\UNC\server\share
+		prefix = L"\\\\?\\UNC";
+		path ++;
+		len --;
+	} else {
+		return NULL;
+	}
+
+	size_t prefixLen = wcslen(prefix);
+	PWSTR longPath = (PWSTR)malloc(sizeof(WCHAR) * (prefixLen + len + 1));
+	if (!longPath) {
+		return NULL;
+	}
+	memcpy(longPath, prefix, sizeof(WCHAR) * prefixLen);
+	for (size_t i = 0; i <= len; i++) {
+		longPath[prefixLen + i] = path[i] == L'/' ? L'\\' : path[i];
+	}
+	return longPath;
+}
+
+// Fills in the key of the executable at 'path' (taking ownership of it),
+// other than its hash
+static BOOL stat_image(PWSTR path, ImageKey *key)
+{
+	size_t len = wcslen(path);
+	PWSTR longPath = to_long_path(path);
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	BOOL ok = GetFileAttributesExW(longPath ? longPath : path, GetFileExInfoStandard, &data);
+	free(longPath);
+	if (!ok) {
+		free(path);
+		return FALSE;
+	}
+	key->path = (BYTE *)path;
+	key->pathBytes = sizeof(WCHAR) * (len + 1);
+	key->size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+	key->mtime = ((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+	return TRUE;
+}
+
+static BOOL open_process(DWORD pid, Process *process)
+{
+	// The handle keeps the PID from being reused until it's closed
+	process->handle = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+	if (!process->handle) {
+		return FALSE;
+	}
+	FILETIME creation, exit, kernel, user;
+	if (!GetProcessTimes(process->handle, &creation, &exit, &kernel, &user)) {
+		CloseHandle(process->handle);
+		return FALSE;
+	}
+	process->startTime = ((uint64_t)creation.dwHighDateTime << 32) | creation.dwLowDateTime;
+	return TRUE;
+}
+
+static void close_process(Process *process)
+{
+	CloseHandle(process->handle);
+}
+
+static BOOL resolve_process_image(Process *process, ImageKey *key)
+{
+	// Paths can be up to 32767 characters
+	for (DWORD cap = MAX_PATH; cap <= 4 * 32768; cap *= 4) {
+		PWSTR path = (PWSTR)malloc(sizeof(WCHAR) * cap);
+		if (!path) {
+			return FALSE;
+		}
+		DWORD len = cap;
+		if (QueryFullProcessImageNameW(process->handle, 0, path, &len)) {
+			return stat_image(path, key);
+		}
+		free(path);
+		if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+			return FALSE;
+		}
+	}
+	return FALSE;
+}
+
+static BOOL resolve_file_image(PCSTR path, ImageKey *key)
+{
+	PWSTR wPath = utf8_to_wide(path);
+	return wPath && stat_image(wPath, key);
+}
+
+static PBYTE extract_process_image(Process *process, const ImageKey *key, BOOL allowEmbeddedPNGs, PDWORD bufLen)
+{
+	(void)process;
+	return get_exe_icon_from_file_utf16((PCWSTR)key->path, allowEmbeddedPNGs, bufLen);
+}
+
+static PBYTE extract_file_image(PCSTR path, const ImageKey *key, BOOL allowEmbeddedPNGs, PDWORD bufLen)
+{
+	(void)path;
+	return get_exe_icon_from_file_utf16((PCWSTR)key->path, allowEmbeddedPNGs, bufLen);
+}
+#else
+static void init_mutex(Mutex *mutex) { pthread_mutex_init(mutex, NULL); }
+static void destroy_mutex(Mutex *mutex) { pthread_mutex_destroy(mutex); }
+static void lock_mutex(Mutex *mutex) { pthread_mutex_lock(mutex); }
+static void unlock_mutex(Mutex *mutex) { pthread_mutex_unlock(mutex); }
+
+static void add_ref(SharedIco *ico)
+{
+	__atomic_fetch_add(&ico->refs, 1, __ATOMIC_RELAXED);
+}
+
+// Returns TRUE if that was the last reference
+static BOOL drop_ref(SharedIco *ico)
+{
+	return __atomic_sub_fetch(&ico->refs, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+// Reads a process's start time, in clock ticks since boot, from
+// /proc/<pid>/stat. Since a process keeps its PID and start time through
+// execve(), a hash of its command name (which execve() changes to the new
+// executable's) goes in the top bits; the ticks take 40 bits in the first
+// 300 years of uptime.
+static BOOL read_start_time(DWORD pid, uint64_t *startTime)
+{
+	char path[32];
+	snprintf(path, sizeof(path), "/proc/%u/stat", (unsigned)pid);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return FALSE;
+	}
+	char buf[1024];
+	ssize_t len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0) {
+		return FALSE;
+	}
+	buf[len] = '\0';
+
+	// The start time is the 22nd field. The 2nd, the command name in
+	// parentheses, may contain spaces and parentheses itself, so count from
+	// the last ')'.
+	char *name = strchr(buf, '(');
+	char *p = strrchr(buf, ')');
+	if (!name || !p) {
+		return FALSE;
+	}
+	uint32_t nameHash = 2166136261u;
+	for (char *c = name + 1; c < p; c++) {
+		nameHash = (nameHash ^ (BYTE)*c) * 16777619u;
+	}
+	for (int field = 2; p && field < 22; field++) {
+		p = strchr(p + 1, ' ');
+	}
+	if (!p) {
+		return FALSE;
+	}
+	char *end;
+	uint64_t ticks = strtoull(p + 1, &end, 10);
+	*startTime = (ticks & 0xffffffffffull) ^ ((uint64_t)(nameHash >> 8) << 40);
+	return end != p + 1;
+}
+
+// Reads a symbolic link's target, however long it is
+static char *read_link(PCSTR path, size_t *len)
+{
+	for (size_t cap = 256; cap <= 65536; cap *= 4) {
+		char *target = (char *)malloc(cap);
+		if (!target) {
+			return NULL;
+		}
+		ssize_t n = readlink(path, target, cap);
+		if (n >= 0 && (size_t)n < cap) {
+			*len = (size_t)n;
+			return target;
+		}
+		free(target);
+		if (n < 0) {
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
+static void stat_to_key(const struct stat *st, ImageKey *key)
+{
+	key->size = (uint64_t)st->st_size;
+	key->mtime = (uint64_t)st->st_mtim.tv_sec * 1000000000 + (uint64_t)st->st_mtim.tv_nsec;
+}
+
+static BOOL open_process(DWORD pid, Process *process)
+{
+	process->pid = pid;
+	process->exeFd = -1;
+	return read_start_time(pid, &process->startTime);
+}
+
+static void close_process(Process *process)
+{
+	if (process->exeFd >= 0) {
+		close(process->exeFd);
+	}
+}
+
+static BOOL resolve_process_image(Process *process, ImageKey *key)
+{
+	char exePath[32];
+	snprintf(exePath, sizeof(exePath), "/proc/%u/exe", (unsigned)process->pid);
+	size_t len;
+	char *path = read_link(exePath, &len);
+	if (!path) {
+		return FALSE;
+	}
+	process->exeFd = open(exePath, O_RDONLY | O_CLOEXEC);
+
+	// If the process is still the one that was looked up, the link and the
+	// file were its executable
+	struct stat st;
+	uint64_t startTime;
+	if (process->exeFd < 0
+		|| fstat(process->exeFd, &st) != 0
+		|| !read_start_time(process->pid, &startTime)
+		|| startTime != process->startTime)
+	{
+		free(path);
+		return FALSE;
+	}
+	key->path = (BYTE *)path;
+	key->pathBytes = len;
+	stat_to_key(&st, key);
+	return TRUE;
+}
+
+static BOOL resolve_file_image(PCSTR path, ImageKey *key)
+{
+	struct stat st;
+	if (stat(path, &st) != 0) {
+		return FALSE;
+	}
+	size_t len = strlen(path);
+	key->path = (BYTE *)malloc(len ? len : 1);
+	if (!key->path) {
+		return FALSE;
+	}
+	memcpy(key->path, path, len);
+	key->pathBytes = len;
+	stat_to_key(&st, key);
+	return TRUE;
+}
+
+static PBYTE extract_process_image(Process *process, const ImageKey *key, BOOL allowEmbeddedPNGs, PDWORD bufLen)
+{
+	(void)key;
+	char fdPath[32];
+	snprintf(fdPath, sizeof(fdPath), "/proc/self/fd/%d", process->exeFd);
+	return get_exe_icon_from_file_utf8(fdPath, allowEmbeddedPNGs, bufLen);
+}
+
+static PBYTE extract_file_image(PCSTR path, const ImageKey *key, BOOL allowEmbeddedPNGs, PDWORD bufLen)
+{
+	(void)key;
+	return get_exe_icon_from_file_utf8(path, allowEmbeddedPNGs, bufLen);
+}
+#endif
+
+static uint64_t hash_key(const ImageKey *key)
+{
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (size_t i = 0; i < key->pathBytes; i++) {
+		hash = (hash ^ key->path[i]) * 0x100000001b3ull;
+	}
+	hash = (hash ^ key->size) * 0x100000001b3ull;
+	hash = (hash ^ key->mtime) * 0x100000001b3ull;
+	return hash ^ (hash >> 29);
+}
+
+static void release_ico(SharedIco *ico)
+{
+	if (ico && drop_ref(ico)) {
+		free((void *)ico->ico.icoBuf);
+		free(ico);
+	}
+}
+
+static ImageEntry *find_image(GetExeIconProcessCache *cache, const ImageKey *key, uint64_t hash)
+{
+	for (ImageEntry *e = cache->images[hash & cache->imageMask]; e; e = e->next) {
+		if (e->hash == hash
+			&& e->key.size == key->size
+			&& e->key.mtime == key->mtime
+			&& e->key.pathBytes == key->pathBytes
+			&& memcmp(e->key.path, key->path, key->pathBytes) == 0)
+		{
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static ProcessEntry *find_process(GetExeIconProcessCache *cache, DWORD pid)
+{
+	for (ProcessEntry *e = cache->processes[pid & cache->processMask]; e; e = e->next) {
+		if (e->pid == pid) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void attach_image(GetExeIconProcessCache *cache, ImageEntry *image)
+{
+	if (image->numProcesses++ == 0) {
+		cache->numIdleImages --;
+	}
+}
+
+static void detach_image(GetExeIconProcessCache *cache, ImageEntry *image)
+{
+	if (--image->numProcesses == 0) {
+		cache->numIdleImages ++;
+	}
+}
+
+static int compare_uint64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+// Finds the last use tick of the 'count'th least recently used of 'ticks'.
+// Every tick is different, so exactly 'count' entries have that tick or an
+// earlier one. Returns 0 (older than every entry) if out of memory.
+static uint64_t eviction_cutoff(uint64_t *ticks, size_t n, size_t count)
+{
+	if (!ticks) {
+		return 0;
+	}
+	qsort(ticks, n, sizeof(uint64_t), compare_uint64);
+	uint64_t cutoff = ticks[count - 1];
+	free(ticks);
+	return cutoff;
+}
+
+// Drops the least recently used quarter of the executables that no process
+// entry points at
+static void evict_images(GetExeIconProcessCache *cache)
+{
+	size_t n = cache->numIdleImages, count = n / 4 ? n / 4 : 1;
+	uint64_t *ticks = (uint64_t *)malloc(sizeof(uint64_t) * n);
+	size_t k = 0;
+	for (DWORD b = 0; ticks && b <= cache->imageMask; b++) {
+		for (ImageEntry *e = cache->images[b]; e; e = e->next) {
+			if (e->numProcesses == 0) {
+				ticks[k++] = e->lastUsed;
+			}
+		}
+	}
+
+	uint64_t cutoff = eviction_cutoff(ticks, n, count);
+	for (DWORD b = 0; b <= cache->imageMask; b++) {
+		ImageEntry **link = &cache->images[b];
+		while (*link) {
+			ImageEntry *e = *link;
+			if (e->numProcesses == 0 && e->lastUsed <= cutoff) {
+				*link = e->next;
+				release_ico(e->ico);
+				free(e->key.path);
+				free(e);
+				cache->numIdleImages --;
+				cache->stats.numImages --;
+				cache->stats.evictions ++;
+			} else {
+				link = &e->next;
+			}
+		}
+	}
+}
+
+// Drops the least recently used quarter of the processes
+static void evict_processes(GetExeIconProcessCache *cache)
+{
+	size_t n = cache->stats.numProcesses, count = n / 4 ? n / 4 : 1;
+	uint64_t *ticks = (uint64_t *)malloc(sizeof(uint64_t) * n);
+	size_t k = 0;
+	for (DWORD b = 0; ticks && b <= cache->processMask; b++) {
+		for (ProcessEntry *e = cache->processes[b]; e; e = e->next) {
+			ticks[k++] = e->lastUsed;
+		}
+	}
+
+	uint64_t cutoff = eviction_cutoff(ticks, n, count);
+	for (DWORD b = 0; b <= cache->processMask; b++) {
+		ProcessEntry **link = &cache->processes[b];
+		while (*link) {
+			ProcessEntry *e = *link;
+			if (e->lastUsed <= cutoff) {
+				*link = e->next;
+				detach_image(cache, e->image);
+				free(e);
+				cache->stats.numProcesses --;
+				cache->stats.evictions ++;
+			} else {
+				link = &e->next;
+			}
+		}
+	}
+}
+
+// Adds an executable's entry, taking ownership of its key's path and its ICO.
+// Returns NULL if out of memory.
+static ImageEntry *add_image(GetExeIconProcessCache *cache, ImageKey *key, uint64_t hash, PBYTE icoBuf, DWORD bufLen, GetExeIconError error)
+{
+	ImageEntry *e = (ImageEntry *)calloc(1, sizeof(ImageEntry));
+	SharedIco *ico = icoBuf ? (SharedIco *)malloc(sizeof(SharedIco)) : NULL;
+	if (!e || (icoBuf && !ico)) {
+		free(e);
+		free(ico);
+		free(icoBuf);
+		free(key->path);
+		return NULL;
+	}
+	if (ico) {
+		ico->ico.icoBuf = icoBuf;
+		ico->ico.bufLen = bufLen;
+		ico->refs = 1;
+	}
+
+	e->hash = hash;
+	e->key = *key;
+	e->ico = ico;
+	e->error = error;
+	e->lastUsed = ++cache->tick;
+	e->next = cache->images[hash & cache->imageMask];
+	cache->images[hash & cache->imageMask] = e;
+	cache->numIdleImages ++;
+	cache->stats.numImages ++;
+	cache->stats.extractions ++;
+	return e;
+}
+
+// Points the entry of a process at its executable's, adding it if needed.
+// Failing to add it only means the next lookup won't be a process hit.
+static void set_process_image(GetExeIconProcessCache *cache, DWORD pid, uint64_t startTime, ImageEntry *image)
+{
+	ProcessEntry *e = find_process(cache, pid);
+	if (!e) {
+		e = (ProcessEntry *)calloc(1, sizeof(ProcessEntry));
+		if (!e) {
+			return;
+		}
+		e->pid = pid;
+		e->next = cache->processes[pid & cache->processMask];
+		cache->processes[pid & cache->processMask] = e;
+		cache->stats.numProcesses ++;
+	} else {
+		detach_image(cache, e->image);
+	}
+	e->startTime = startTime;
+	e->image = image;
+	e->lastUsed = ++cache->tick;
+	attach_image(cache, image);
+
+	if (cache->stats.numProcesses > cache->maxProcesses) {
+		evict_processes(cache);
+	}
+}
+
+// Drops executables once a lookup is done with them, so that a new one isn't
+// dropped before the process running it points at it
+static void finish_lookup(GetExeIconProcessCache *cache)
+{
+	if (cache->numIdleImages > cache->maxImages) {
+		evict_images(cache);
+	}
+	unlock_mutex(&cache->lock);
+}
+
+// Hands out a reference to an executable's ICO, or records its error.
+// Called with the lock held.
+static const GetExeIconSharedIco *use_image(GetExeIconProcessCache *cache, ImageEntry *image, GetExeIconError *error)
+{
+	image->lastUsed = ++cache->tick;
+	*error = image->error;
+	if (!image->ico) {
+		return NULL;
+	}
+	add_ref(image->ico);
+	return &image->ico->ico;
+}
+
+// Whether an extraction failed in a way that's likely to be different next
+// time, and so shouldn't be cached
+static BOOL is_transient(GetExeIconError error)
+{
+	return error == GET_EXE_ICON_ERROR_OPEN_FAILED
+		|| error == GET_EXE_ICON_ERROR_READ_FAILED
+		|| error == GET_EXE_ICON_ERROR_OUT_OF_MEMORY;
+}
+
+// Looks up an executable, extracting its icon if it's new. Takes ownership
+// of the key's path. Returns with the lock held, and the entry, or NULL with
+// the error in 'error' if it couldn't be added.
+static ImageEntry *find_or_extract_image(GetExeIconProcessCache *cache, ImageKey *key, Process *process, PCSTR path, GetExeIconError *error)
+{
+	uint64_t hash = hash_key(key);
+	lock_mutex(&cache->lock);
+	ImageEntry *image = find_image(cache, key, hash);
+	if (image) {
+		cache->stats.imageHits ++;
+		free(key->path);
+		return image;
+	}
+	unlock_mutex(&cache->lock);
+
+	DWORD bufLen = 0;
+	PBYTE icoBuf = process
+		? extract_process_image(process, key, cache->allowEmbeddedPNGs, &bufLen)
+		: extract_file_image(path, key, cache->allowEmbeddedPNGs, &bufLen);
+	*error = get_exe_icon_last_error();
+
+	lock_mutex(&cache->lock);
+	image = find_image(cache, key, hash);
+	if (image || is_transient(*error)) {
+		free(icoBuf);
+		free(key->path);
+		return image;
+	}
+	image = add_image(cache, key, hash, icoBuf, bufLen, *error);
+	if (!image) {
+		*error = GET_EXE_ICON_ERROR_OUT_OF_MEMORY;
+	}
+	return image;
+}
+
+GetExeIconProcessCache *get_exe_icon_process_cache_open(const GetExeIconProcessCacheOptions *options)
+{
+	GetExeIconProcessCache *cache = (GetExeIconProcessCache *)calloc(1, sizeof(GetExeIconProcessCache));
+	if (!cache) {
+		return NULL;
+	}
+	cache->allowEmbeddedPNGs = options ? options->allowEmbeddedPNGs : FALSE;
+	cache->maxProcesses = options && options->maxProcesses ? options->maxProcesses : DEFAULT_MAX_PROCESSES;
+	cache->maxImages = options && options->maxImages ? options->maxImages : DEFAULT_MAX_IMAGES;
+	if (cache->maxProcesses > MAX_ENTRIES) {
+		cache->maxProcesses = MAX_ENTRIES;
+	}
+	if (cache->maxImages > MAX_ENTRIES) {
+		cache->maxImages = MAX_ENTRIES;
+	}
+
+	// About one entry per bucket when full
+	DWORD numProcessBuckets = 16, numImageBuckets = 16;
+	while (numProcessBuckets < cache->maxProcesses) {
+		numProcessBuckets *= 2;
+	}
+	while (numImageBuckets < cache->maxImages + cache->maxProcesses) {
+		numImageBuckets *= 2;
+	}
+	cache->processMask = numProcessBuckets - 1;
+	cache->imageMask = numImageBuckets - 1;
+	cache->processes = (ProcessEntry **)calloc(numProcessBuckets, sizeof(ProcessEntry *));
+	cache->images = (ImageEntry **)calloc(numImageBuckets, sizeof(ImageEntry *));
+	if (!cache->processes || !cache->images) {
+		free(cache->processes);
+		free(cache->images);
+		free(cache);
+		return NULL;
+	}
+	init_mutex(&cache->lock);
+	return cache;
+}
+
+void get_exe_icon_process_cache_close(GetExeIconProcessCache *cache)
+{
+	if (!cache) {
+		return;
+	}
+	for (DWORD b = 0; b <= cache->processMask; b++) {
+		for (ProcessEntry *e = cache->processes[b], *next; e; e = next) {
+			next = e->next;
+			free(e);
+		}
+	}
+	for (DWORD b = 0; b <= cache->imageMask; b++) {
+		for (ImageEntry *e = cache->images[b], *next; e; e = next) {
+			next = e->next;
+			release_ico(e->ico);
+			free(e->key.path);
+			free(e);
+		}
+	}
+	free(cache->processes);
+	free(cache->images);
+	destroy_mutex(&cache->lock);
+	free(cache);
+}
+
+const GetExeIconSharedIco *get_exe_icon_process_cached(GetExeIconProcessCache *cache, DWORD pid)
+{
+	if (!cache) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return NULL;
+	}
+
+	Process process;
+	if (!open_process(pid, &process)) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OPEN_FAILED);
+		return NULL;
+	}
+
+	GetExeIconError error = GET_EXE_ICON_OK;
+	const GetExeIconSharedIco *ico = NULL;
+	lock_mutex(&cache->lock);
+	ProcessEntry *entry = find_process(cache, pid);
+	if (entry && entry->startTime == process.startTime) {
+		cache->stats.processHits ++;
+		entry->lastUsed = ++cache->tick;
+		ico = use_image(cache, entry->image, &error);
+		unlock_mutex(&cache->lock);
+		close_process(&process);
+		get_exe_icon_set_last_error(error);
+		return ico;
+	}
+	unlock_mutex(&cache->lock);
+
+	ImageKey key;
+	if (!resolve_process_image(&process, &key)) {
+		close_process(&process);
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OPEN_FAILED);
+		return NULL;
+	}
+	ImageEntry *image = find_or_extract_image(cache, &key, &process, NULL, &error);
+	if (image) {
+		set_process_image(cache, pid, process.startTime, image);
+		ico = use_image(cache, image, &error);
+	}
+	finish_lookup(cache);
+	close_process(&process);
+	get_exe_icon_set_last_error(error);
+	return ico;
+}
+
+const GetExeIconSharedIco *get_exe_icon_process_cached_file_utf8(GetExeIconProcessCache *cache, PCSTR path)
+{
+	if (!cache || !path) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return NULL;
+	}
+
+	ImageKey key;
+	if (!resolve_file_image(path, &key)) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OPEN_FAILED);
+		return NULL;
+	}
+	GetExeIconError error = GET_EXE_ICON_OK;
+	const GetExeIconSharedIco *ico = NULL;
+	ImageEntry *image = find_or_extract_image(cache, &key, NULL, path, &error);
+	if (image) {
+		ico = use_image(cache, image, &error);
+	}
+	finish_lookup(cache);
+	get_exe_icon_set_last_error(error);
+	return ico;
+}
+
+void get_exe_icon_shared_ico_retain(const GetExeIconSharedIco *ico)
+{
+	if (ico) {
+		add_ref((SharedIco *)ico);
+	}
+}
+
+void get_exe_icon_shared_ico_release(const GetExeIconSharedIco *ico)
+{
+	release_ico((SharedIco *)ico);
+}
+
+void get_exe_icon_process_cache_stats(GetExeIconProcessCache *cache, GetExeIconProcessCacheStats *stats)
+{
+	if (!cache || !stats) {
+		return;
+	}
+	lock_mutex(&cache->lock);
+	*stats = cache->stats;
+	unlock_mutex(&cache->lock);
+}
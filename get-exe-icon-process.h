@@ -0,0 +1,113 @@
+// Copyright (c) 2021 Aury Snow
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef GET_EXE_ICON_PROCESS_H
+#define GET_EXE_ICON_PROCESS_H
+
+#include "get-exe-icon.h"
+
+// An in-memory cache for looking up the icons of running processes over and
+// over, as a process monitor does every time it refreshes, without
+// extracting the same icons again each time.
+//
+// Processes are keyed by PID and start time, so a PID that's been reused by
+// a new process is looked up afresh (on Linux, also by command name, which
+// changes when a process calls execve()). Their executables are keyed by
+// path, size and modification time, so any number of processes running the
+// same executable share one extraction, and an executable that's replaced on
+// disk is extracted again. A process whose entry is still valid costs one small
+// system call to check its start time: reading /proc/<pid>/stat on Linux
+// (where the executable is found through /proc/<pid>/exe, which works for
+// Wine processes and for executables that have since been deleted), or
+// OpenProcess and GetProcessTimes on Windows.
+//
+// ICOs are handed out as shared, reference counted buffers, so a hit copies
+// nothing. Failures are cached too, so a process without an icon isn't
+// parsed again at every refresh.
+//
+// One cache may be used by many threads at once. Extractions run outside the
+// cache's lock, so a slow one doesn't hold up lookups of other processes.
+typedef struct GetExeIconProcessCache GetExeIconProcessCache;
+
+// A shared ICO. Release each one returned by the functions below with
+// get_exe_icon_shared_ico_release(); it stays valid until then, even if the
+// cache drops it or is closed.
+typedef struct
+{
+	const BYTE *icoBuf;
+	DWORD bufLen;
+} GetExeIconSharedIco;
+
+// Options for get_exe_icon_process_cache_open(). Zero-initialize for the
+// defaults.
+typedef struct
+{
+	// Same as in get_exe_icon_from_file_utf16().
+	BOOL allowEmbeddedPNGs;
+
+	// The number of processes to remember. When there are more, the least
+	// recently looked up quarter of them is dropped. 0 means 4096.
+	DWORD maxProcesses;
+
+	// The number of executables to remember, not counting those of the
+	// processes that are remembered. 0 means 1024.
+	DWORD maxImages;
+} GetExeIconProcessCacheOptions;
+
+// Creates a cache. 'options' may be NULL to use the defaults. Returns NULL if
+// out of memory.
+GetExeIconProcessCache *get_exe_icon_process_cache_open(const GetExeIconProcessCacheOptions *options);
+
+// Frees the cache. ICOs that haven't been released yet stay valid.
+void get_exe_icon_process_cache_close(GetExeIconProcessCache *cache);
+
+// Gets the primary icon of the executable of process 'pid'.
+//
+// Return Value: The ICO, to be released with get_exe_icon_shared_ico_release().
+//               On error NULL is returned, and get_exe_icon_last_error() says
+//               why: GET_EXE_ICON_ERROR_OPEN_FAILED if there is no such
+//               process or it can't be queried, otherwise the error of the
+//               extraction (which may have been cached).
+const GetExeIconSharedIco *get_exe_icon_process_cached(GetExeIconProcessCache *cache, DWORD pid);
+
+// Same as get_exe_icon_process_cached(), for an executable given by its
+// UTF-8 path. Shares the executables' entries with the process lookups.
+const GetExeIconSharedIco *get_exe_icon_process_cached_file_utf8(GetExeIconProcessCache *cache, PCSTR path);
+
+// Adds a reference to a shared ICO, to be released separately.
+void get_exe_icon_shared_ico_retain(const GetExeIconSharedIco *ico);
+
+// Releases a reference to a shared ICO. Does nothing if 'ico' is NULL.
+void get_exe_icon_shared_ico_release(const GetExeIconSharedIco *ico);
+
+// Statistics about a cache since it was opened
+typedef struct
+{
+	uint64_t processHits;   // Processes whose entry was still valid
+	uint64_t imageHits;     // New processes running a known executable
+	uint64_t extractions;
+	uint64_t evictions;     // Of processes and executables
+	DWORD numProcesses;
+	DWORD numImages;
+} GetExeIconProcessCacheStats;
+
+void get_exe_icon_process_cache_stats(GetExeIconProcessCache *cache, GetExeIconProcessCacheStats *stats);
+
+#endif
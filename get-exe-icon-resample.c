@@ -0,0 +1,829 @@
+// Copyright (c) 2021 Aury Snow
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include "get-exe-icon-resample.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+// Notes about the code:
+//
+// Resampling is done in two passes, as usual for separable filters: the
+// horizontal pass resamples each source row to the output width, into a
+// temporary image with the source's height, and the vertical pass blends
+// the rows of that into each output row. A pass is skipped if its dimension
+// doesn't change. The filter weights for each output column and row are
+// computed once, in floating point, and then rounded to 14 bit fixed point
+// (adjusted so that they sum to exactly 1), so that the plain C and vector
+// kernels do identical integer arithmetic. The 8 bit intermediate image
+// loses a little precision, as in most fast resamplers.
+//
+// Filters with negative lobes (bicubic and Lanczos) can overshoot, giving a
+// color above its pixel's alpha, which isn't a valid premultiplied pixel.
+// Every pass clamps colors to alpha as it stores each pixel.
+//
+// In the horizontal pass, each output pixel sums a few neighbouring source
+// pixels, so the vector kernel works on one pixel's 4 channels at a time,
+// two source pixels per multiply-add. In the vertical pass, every pixel of a
+// row uses the same weights, so the vector kernels work across 4 (SSE2) or 8
+// (AVX2) pixels at a time. The horizontal pass uses the SSE2 kernel with
+// AVX2 as well, as its short sums leave little for wider vectors to gain.
+//
+// Threads split up the rows of each pass, claiming a few rows at a time as
+// get-exe-icon-batch.c claims files. Resampling a typical icon takes
+// microseconds, much less than starting a thread, so threads are only used
+// by default for large images.
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define RESAMPLE_X86
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define RESAMPLE_X86
+#define TARGET_SSE2
+#define TARGET_AVX2
+#include <immintrin.h>
+#endif
+
+#define WEIGHT_BITS  14
+
+#define PI  3.14159265358979323846
+
+// Rows are claimed by threads this many at a time
+#define ROWS_PER_CLAIM  16
+
+// With numThreads 0, a thread is used for each this many pixels the passes
+// produce
+#define PIXELS_PER_THREAD  (256 * 256)
+
+// The source pixels that contribute to an output pixel
+typedef struct
+{
+	DWORD first;
+	DWORD count;
+} Span;
+
+// The weights of one pass: for output pixel (or row) i, spans[i] and the
+// first spans[i].count of the maxTaps weights at weights + i * maxTaps.
+typedef struct
+{
+	Span     *spans;
+	int16_t  *weights;
+	DWORD     maxTaps;
+} Coeffs;
+
+typedef struct
+{
+	// Resamples a row of RGBA pixels to 'width' pixels
+	void (*resample_row)(const BYTE *src, BYTE *dst, DWORD width, const Coeffs *coeffs);
+
+	// Blends rows of 'width' RGBA pixels, 'stride' bytes apart, with the
+	// given weights into one row
+	void (*blend_rows)(const BYTE *src, size_t stride, const Span *span, const int16_t *weights, BYTE *dst, DWORD width);
+} ResampleKernels;
+
+static double filter_box(double x)
+{
+	return x > -0.5 && x <= 0.5 ? 1.0 : 0.0;
+}
+
+static double filter_bicubic(double x)
+{
+	const double a = -0.5;
+	x = fabs(x);
+	if (x < 1.0) {
+		return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0;
+	}
+	if (x < 2.0) {
+		return ((a * x - 5.0 * a) * x + 8.0 * a) * x - 4.0 * a;
+	}
+	return 0.0;
+}
+
+static double sinc(double x)
+{
+	if (x == 0.0) {
+		return 1.0;
+	}
+	x *= PI;
+	return sin(x) / x;
+}
+
+static double filter_lanczos3(double x)
+{
+	return x > -3.0 && x < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+}
+
+static void free_coeffs(Coeffs *coeffs)
+{
+	free(coeffs->spans);
+	free(coeffs->weights);
+	coeffs->spans = NULL;
+	coeffs->weights = NULL;
+}
+
+// Computes the weights for resampling 'inSize' pixels to 'outSize'. When
+// shrinking, the filter is stretched to cover all the source pixels under
+// each output pixel.
+static BOOL compute_coeffs(DWORD inSize, DWORD outSize, GetExeIconFilter filter, Coeffs *coeffs)
+{
+	double (*func)(double) = filter_lanczos3;
+	double support = 3.0;
+	if (filter == GET_EXE_ICON_FILTER_BOX
+		|| (filter == GET_EXE_ICON_FILTER_AUTO && outSize < inSize))
+	{
+		func = filter_box;
+		support = 0.5;
+	} else if (filter == GET_EXE_ICON_FILTER_BICUBIC) {
+		func = filter_bicubic;
+		support = 2.0;
+	}
+
+	const double scale = (double)inSize / outSize;
+	const double filterScale = scale > 1.0 ? scale : 1.0;
+	const double radius = support * filterScale;
+
+	coeffs->maxTaps = (DWORD)ceil(radius) * 2 + 1;
+	coeffs->spans = (Span *)malloc(sizeof(Span) * outSize);
+	coeffs->weights = (int16_t *)calloc((size_t)outSize * coeffs->maxTaps, sizeof(int16_t));
+	double *w = (double *)malloc(sizeof(double) * coeffs->maxTaps);
+	if (!coeffs->spans || !coeffs->weights || !w) {
+		free_coeffs(coeffs);
+		free(w);
+		return FALSE;
+	}
+
+	for (DWORD i = 0; i < outSize; i++) {
+		double center = (i + 0.5) * scale;
+		double first = floor(center - radius + 0.5);
+		double last = floor(center + radius + 0.5);
+		if (first < 0.0) {
+			first = 0.0;
+		}
+		if (last > inSize) {
+			last = inSize;
+		}
+		if (last - first > coeffs->maxTaps) {
+			last = first + coeffs->maxTaps;
+		}
+
+		Span *span = &coeffs->spans[i];
+		span->first = (DWORD)first;
+		span->count = last > first ? (DWORD)(last - first) : 0;
+
+		double sum = 0.0;
+		for (DWORD k = 0; k < span->count; k++) {
+			w[k] = func((span->first + k + 0.5 - center) / filterScale);
+			sum += w[k];
+		}
+
+		// A span that the filter misses entirely (which only rounding
+		// could cause) just takes the nearest pixel
+		if (sum == 0.0) {
+			span->first = (DWORD)center < inSize ? (DWORD)center : inSize - 1;
+			span->count = 1;
+			w[0] = sum = 1.0;
+		}
+
+		// Round to fixed point, giving any rounding error to the largest
+		// weight so that they add up to exactly 1
+		int16_t *iw = coeffs->weights + (size_t)i * coeffs->maxTaps;
+		int32_t total = 0;
+		DWORD largest = 0;
+		for (DWORD k = 0; k < span->count; k++) {
+			iw[k] = (int16_t)floor(w[k] / sum * (1 << WEIGHT_BITS) + 0.5);
+			total += iw[k];
+			if (iw[k] > iw[largest]) {
+				largest = k;
+			}
+		}
+		iw[largest] = (int16_t)(iw[largest] + (1 << WEIGHT_BITS) - total);
+	}
+
+	free(w);
+	return TRUE;
+}
+
+// Stores a pixel from fixed point sums, clamping each channel to 0-255 and
+// each color to the pixel's alpha
+static void store_pixel(const int32_t *sums, BYTE *dst)
+{
+	int32_t v[4];
+	for (int c = 0; c < 4; c++) {
+		v[c] = sums[c] < 0 ? 0 : sums[c] >> WEIGHT_BITS;
+		if (v[c] > 255) {
+			v[c] = 255;
+		}
+	}
+	for (int c = 0; c < 3; c++) {
+		dst[c] = (BYTE)(v[c] < v[3] ? v[c] : v[3]);
+	}
+	dst[3] = (BYTE)v[3];
+}
+
+// Plain C kernels
+
+static void resample_row_scalar(const BYTE *src, BYTE *dst, DWORD width, const Coeffs *coeffs)
+{
+	for (DWORD x = 0; x < width; x++, dst += 4) {
+		const Span *span = &coeffs->spans[x];
+		const int16_t *w = coeffs->weights + (size_t)x * coeffs->maxTaps;
+		const BYTE *p = src + (size_t)span->first * 4;
+
+		int32_t sums[4] = { 1 << (WEIGHT_BITS - 1), 1 << (WEIGHT_BITS - 1), 1 << (WEIGHT_BITS - 1), 1 << (WEIGHT_BITS - 1) };
+		for (DWORD k = 0; k < span->count; k++, p += 4) {
+			for (int c = 0; c < 4; c++) {
+				sums[c] += p[c] * w[k];
+			}
+		}
+		store_pixel(sums, dst);
+	}
+}
+
+static void blend_rows_scalar(const BYTE *src, size_t stride, const Span *span, const int16_t *weights, BYTE *dst, DWORD width)
+{
+	const BYTE *rows = src + span->first * stride;
+	for (DWORD x = 0; x < width; x++) {
+		int32_t sums[4] = { 1 << (WEIGHT_BITS - 1), 1 << (WEIGHT_BITS - 1), 1 << (WEIGHT_BITS - 1), 1 << (WEIGHT_BITS - 1) };
+		const BYTE *p = rows + (size_t)x * 4;
+		for (DWORD k = 0; k < span->count; k++, p += stride) {
+			for (int c = 0; c < 4; c++) {
+				sums[c] += p[c] * weights[k];
+			}
+		}
+		store_pixel(sums, dst + (size_t)x * 4);
+	}
+}
+
+static const ResampleKernels scalarKernels = {
+	resample_row_scalar,
+	blend_rows_scalar,
+};
+
+#ifdef RESAMPLE_X86
+// A pair of weights, for multiplying interleaved pairs of 16 bit values with
+// _mm_madd_epi16
+static int weight_pair(int16_t a, int16_t b)
+{
+	return (int)((uint32_t)(uint16_t)a | ((uint32_t)(uint16_t)b << 16));
+}
+
+// Clamps the colors of 4 pixels to their alpha
+TARGET_SSE2 static __m128i clamp_to_alpha_sse2(__m128i v)
+{
+	__m128i a = _mm_srli_epi32(v, 24);
+	a = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+	a = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+	return _mm_min_epu8(v, a);
+}
+
+// Shifts 4 sums of 32 bit fixed point values down and packs them to bytes
+// in the low 4 bytes, with saturation
+TARGET_SSE2 static __m128i pack_sums_sse2(__m128i sums)
+{
+	__m128i v = _mm_srai_epi32(sums, WEIGHT_BITS);
+	v = _mm_packs_epi32(v, v);
+	return _mm_packus_epi16(v, v);
+}
+
+TARGET_SSE2 static void resample_row_sse2(const BYTE *src, BYTE *dst, DWORD width, const Coeffs *coeffs)
+{
+	const __m128i zero = _mm_setzero_si128();
+	for (DWORD x = 0; x < width; x++, dst += 4) {
+		const Span *span = &coeffs->spans[x];
+		const int16_t *w = coeffs->weights + (size_t)x * coeffs->maxTaps;
+		const BYTE *p = src + (size_t)span->first * 4;
+
+		__m128i sums = _mm_set1_epi32(1 << (WEIGHT_BITS - 1));
+		DWORD k = 0;
+		for (; k + 2 <= span->count; k += 2) {
+			// Interleave the channels of 2 pixels: r0 r1 g0 g1 b0 b1 a0 a1
+			__m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(p + k * 4)), zero);
+			v = _mm_unpacklo_epi16(v, _mm_srli_si128(v, 8));
+			sums = _mm_add_epi32(sums, _mm_madd_epi16(v, _mm_set1_epi32(weight_pair(w[k], w[k + 1]))));
+		}
+		if (k < span->count) {
+			int32_t pixel;
+			memcpy(&pixel, p + k * 4, 4);
+			__m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(pixel), zero);
+			v = _mm_unpacklo_epi16(v, zero);
+			sums = _mm_add_epi32(sums, _mm_madd_epi16(v, _mm_set1_epi32(weight_pair(w[k], 0))));
+		}
+
+		int32_t pixel = _mm_cvtsi128_si32(clamp_to_alpha_sse2(pack_sums_sse2(sums)));
+		memcpy(dst, &pixel, 4);
+	}
+}
+
+TARGET_SSE2 static void blend_rows_sse2(const BYTE *src, size_t stride, const Span *span, const int16_t *weights, BYTE *dst, DWORD width)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi32(1 << (WEIGHT_BITS - 1));
+	const BYTE *rows = src + span->first * stride;
+	DWORD x = 0;
+	for (; x + 4 <= width; x += 4) {
+		__m128i sums0 = round, sums1 = round, sums2 = round, sums3 = round;
+		const BYTE *p = rows + (size_t)x * 4;
+		for (DWORD k = 0; k < span->count; k += 2, p += 2 * stride) {
+			// Interleave the bytes of 2 rows, so that each pair of 16 bit
+			// values is the same channel of both
+			__m128i a = _mm_loadu_si128((const __m128i *)p);
+			__m128i b = k + 1 < span->count ? _mm_loadu_si128((const __m128i *)(p + stride)) : zero;
+			__m128i w = _mm_set1_epi32(weight_pair(weights[k], k + 1 < span->count ? weights[k + 1] : 0));
+			__m128i lo = _mm_unpacklo_epi8(a, b);
+			__m128i hi = _mm_unpackhi_epi8(a, b);
+			sums0 = _mm_add_epi32(sums0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), w));
+			sums1 = _mm_add_epi32(sums1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), w));
+			sums2 = _mm_add_epi32(sums2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), w));
+			sums3 = _mm_add_epi32(sums3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), w));
+		}
+
+		__m128i v01 = _mm_packs_epi32(_mm_srai_epi32(sums0, WEIGHT_BITS), _mm_srai_epi32(sums1, WEIGHT_BITS));
+		__m128i v23 = _mm_packs_epi32(_mm_srai_epi32(sums2, WEIGHT_BITS), _mm_srai_epi32(sums3, WEIGHT_BITS));
+		_mm_storeu_si128((__m128i *)(dst + (size_t)x * 4), clamp_to_alpha_sse2(_mm_packus_epi16(v01, v23)));
+	}
+
+	blend_rows_scalar(src + (size_t)x * 4, stride, span, weights, dst + (size_t)x * 4, width - x);
+}
+
+static const ResampleKernels sse2Kernels = {
+	resample_row_sse2,
+	blend_rows_sse2,
+};
+
+TARGET_AVX2 static __m256i clamp_to_alpha_avx2(__m256i v)
+{
+	__m256i a = _mm256_srli_epi32(v, 24);
+	a = _mm256_or_si256(a, _mm256_slli_epi32(a, 8));
+	a = _mm256_or_si256(a, _mm256_slli_epi32(a, 16));
+	return _mm256_min_epu8(v, a);
+}
+
+TARGET_AVX2 static void blend_rows_avx2(const BYTE *src, size_t stride, const Span *span, const int16_t *weights, BYTE *dst, DWORD width)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i round = _mm256_set1_epi32(1 << (WEIGHT_BITS - 1));
+	const BYTE *rows = src + span->first * stride;
+	DWORD x = 0;
+	for (; x + 8 <= width; x += 8) {
+		// Unpacking and packing both work within 128 bit lanes, so the
+		// pixels come out in the order they went in
+		__m256i sums0 = round, sums1 = round, sums2 = round, sums3 = round;
+		const BYTE *p = rows + (size_t)x * 4;
+		for (DWORD k = 0; k < span->count; k += 2, p += 2 * stride) {
+			__m256i a = _mm256_loadu_si256((const __m256i *)p);
+			__m256i b = k + 1 < span->count ? _mm256_loadu_si256((const __m256i *)(p + stride)) : zero;
+			__m256i w = _mm256_set1_epi32(weight_pair(weights[k], k + 1 < span->count ? weights[k + 1] : 0));
+			__m256i lo = _mm256_unpacklo_epi8(a, b);
+			__m256i hi = _mm256_unpackhi_epi8(a, b);
+			sums0 = _mm256_add_epi32(sums0, _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, zero), w));
+			sums1 = _mm256_add_epi32(sums1, _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, zero), w));
+			sums2 = _mm256_add_epi32(sums2, _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, zero), w));
+			sums3 = _mm256_add_epi32(sums3, _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, zero), w));
+		}
+
+		__m256i v01 = _mm256_packs_epi32(_mm256_srai_epi32(sums0, WEIGHT_BITS), _mm256_srai_epi32(sums1, WEIGHT_BITS));
+		__m256i v23 = _mm256_packs_epi32(_mm256_srai_epi32(sums2, WEIGHT_BITS), _mm256_srai_epi32(sums3, WEIGHT_BITS));
+		_mm256_storeu_si256((__m256i *)(dst + (size_t)x * 4), clamp_to_alpha_avx2(_mm256_packus_epi16(v01, v23)));
+	}
+
+	// GCC leaves this out before the tail call below, and without it the
+	// SSE code that runs next (including libm's) runs many times slower
+	_mm256_zeroupper();
+	blend_rows_sse2(src + (size_t)x * 4, stride, span, weights, dst + (size_t)x * 4, width - x);
+}
+
+static const ResampleKernels avx2Kernels = {
+	resample_row_sse2,
+	blend_rows_avx2,
+};
+#endif
+
+static const ResampleKernels *select_kernels(GetExeIconIsa isa)
+{
+	GetExeIconIsa cpuIsa = get_exe_icon_cpu_isa();
+	if (isa == GET_EXE_ICON_ISA_AUTO || isa > cpuIsa) {
+		isa = cpuIsa;
+	}
+
+	switch (isa) {
+#ifdef RESAMPLE_X86
+	case GET_EXE_ICON_ISA_AVX2:
+		return &avx2Kernels;
+	case GET_EXE_ICON_ISA_SSE2:
+		return &sse2Kernels;
+#endif
+	default:
+		return &scalarKernels;
+	}
+}
+
+typedef struct
+{
+	const ResampleKernels *kernels;
+	const BYTE *src;
+	DWORD srcWidth;
+	BYTE *tmp;          // The output of the horizontal pass
+	BYTE *dst;
+	DWORD width;        // Of tmp and dst
+	Coeffs horizontal;
+	Coeffs vertical;
+
+	// The pass being run: 0 for horizontal, 1 for vertical
+	int pass;
+	DWORD numRows;
+
+	// The next row to be claimed by a thread. Only accessed atomically.
+	volatile int64_t next;
+} ResampleJob;
+
+static DWORD claim_rows(ResampleJob *job)
+{
+#ifdef _WIN32
+	return (DWORD)InterlockedExchangeAdd64((volatile LONG64 *)&job->next, ROWS_PER_CLAIM);
+#else
+	return (DWORD)__atomic_fetch_add(&job->next, ROWS_PER_CLAIM, __ATOMIC_RELAXED);
+#endif
+}
+
+static void run_resample_worker(ResampleJob *job)
+{
+	for (;;) {
+		DWORD first = claim_rows(job);
+		if (first >= job->numRows) {
+			break;
+		}
+
+		DWORD end = job->numRows - first < ROWS_PER_CLAIM ? job->numRows : first + ROWS_PER_CLAIM;
+		for (DWORD y = first; y < end; y++) {
+			if (job->pass == 0) {
+				job->kernels->resample_row(job->src + (size_t)y * job->srcWidth * 4,
+					job->tmp + (size_t)y * job->width * 4,
+					job->width,
+					&job->horizontal);
+			} else {
+				job->kernels->blend_rows(job->tmp,
+					(size_t)job->width * 4,
+					&job->vertical.spans[y],
+					job->vertical.weights + (size_t)y * job->vertical.maxTaps,
+					job->dst + (size_t)y * job->width * 4,
+					job->width);
+			}
+		}
+	}
+}
+
+#ifdef _WIN32
+typedef HANDLE Thread;
+
+static DWORD WINAPI resample_thread_main(LPVOID arg)
+{
+	run_resample_worker((ResampleJob *)arg);
+	return 0;
+}
+
+static BOOL start_thread(Thread *thread, ResampleJob *job)
+{
+	*thread = CreateThread(NULL, 0, resample_thread_main, job, 0, NULL);
+	return *thread != NULL;
+}
+
+static void join_thread(Thread thread)
+{
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+
+static DWORD num_cpus(void)
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+}
+#else
+typedef pthread_t Thread;
+
+static void *resample_thread_main(void *arg)
+{
+	run_resample_worker((ResampleJob *)arg);
+	return NULL;
+}
+
+static BOOL start_thread(Thread *thread, ResampleJob *job)
+{
+	return pthread_create(thread, NULL, resample_thread_main, job) == 0;
+}
+
+static void join_thread(Thread thread)
+{
+	pthread_join(thread, NULL);
+}
+
+static DWORD num_cpus(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (DWORD)n : 1;
+}
+#endif
+
+// Runs one pass over 'numRows' rows on 'numThreads' threads, including the
+// calling thread. If some threads can't be started, the rest of them just do
+// more of the work.
+static void run_pass(ResampleJob *job, int pass, DWORD numRows, DWORD numThreads)
+{
+	job->pass = pass;
+	job->numRows = numRows;
+	job->next = 0;
+
+	DWORD maxThreads = (numRows + ROWS_PER_CLAIM - 1) / ROWS_PER_CLAIM;
+	if (numThreads > maxThreads) {
+		numThreads = maxThreads;
+	}
+
+	Thread *threads = NULL;
+	DWORD numStarted = 0;
+	if (numThreads > 1) {
+		threads = (Thread *)malloc(sizeof(Thread) * (numThreads - 1));
+	}
+	while (threads && numStarted < numThreads - 1 && start_thread(&threads[numStarted], job)) {
+		numStarted ++;
+	}
+
+	run_resample_worker(job);
+
+	for (DWORD i = 0; i < numStarted; i++) {
+		join_thread(threads[i]);
+	}
+	free(threads);
+}
+
+BOOL get_exe_icon_resample(const GetExeIconBitmap *src, DWORD width, DWORD height, const GetExeIconResampleOptions *options, GetExeIconBitmap *dst)
+{
+	if (dst) {
+		memset(dst, 0, sizeof(GetExeIconBitmap));
+	}
+	if (!src || !src->pixels || src->width == 0 || src->height == 0 || width == 0 || height == 0 || !dst) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return FALSE;
+	}
+
+	GetExeIconResampleOptions defaults;
+	if (!options) {
+		memset(&defaults, 0, sizeof(defaults));
+		options = &defaults;
+	}
+
+	const BOOL horizontal = width != src->width;
+	const BOOL vertical = height != src->height;
+	if ((uint64_t)width * height > SIZE_MAX / 4
+		|| (uint64_t)width * src->height > SIZE_MAX / 4)
+	{
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_TOO_LARGE);
+		return FALSE;
+	}
+
+	ResampleJob job;
+	memset(&job, 0, sizeof(job));
+	job.kernels = select_kernels(options->isa);
+	job.src = src->pixels;
+	job.srcWidth = src->width;
+	job.width = width;
+	job.dst = (BYTE *)malloc((size_t)width * height * 4);
+
+	// Without a horizontal pass the vertical pass reads the source, and
+	// without a vertical pass the horizontal pass writes the output
+	BYTE *tmp = NULL;
+	if (horizontal && vertical) {
+		tmp = (BYTE *)malloc((size_t)width * src->height * 4);
+	}
+	job.tmp = !horizontal ? src->pixels : vertical ? tmp : job.dst;
+
+	if (!job.dst
+		|| (horizontal && vertical && !tmp)
+		|| (horizontal && !compute_coeffs(src->width, width, options->filter, &job.horizontal))
+		|| (vertical && !compute_coeffs(src->height, height, options->filter, &job.vertical)))
+	{
+		free(job.dst);
+		free(tmp);
+		free_coeffs(&job.horizontal);
+		free_coeffs(&job.vertical);
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+		return FALSE;
+	}
+
+	DWORD numThreads = options->numThreads;
+	if (numThreads == 0) {
+		uint64_t pixels = (horizontal ? (uint64_t)width * src->height : 0)
+		                  + (vertical ? (uint64_t)width * height : 0);
+		numThreads = (DWORD)(pixels / PIXELS_PER_THREAD) + 1;
+		if (numThreads > num_cpus()) {
+			numThreads = num_cpus();
+		}
+	}
+
+	if (horizontal) {
+		run_pass(&job, 0, src->height, numThreads);
+	}
+	if (vertical) {
+		run_pass(&job, 1, height, numThreads);
+	}
+	if (!horizontal && !vertical) {
+		memcpy(job.dst, src->pixels, (size_t)width * height * 4);
+	}
+
+	free(tmp);
+	free_coeffs(&job.horizontal);
+	free_coeffs(&job.vertical);
+
+	dst->width = width;
+	dst->height = height;
+	dst->pixels = job.dst;
+	get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+	return TRUE;
+}
+
+// Decodes the DIB of a size-targeted extraction, and resamples it to
+// width x height if needed
+static BOOL bitmap_from_dib(PBYTE dib, DWORD dibLen, DWORD width, DWORD height, const GetExeIconResampleOptions *options, GetExeIconBitmap *bitmap)
+{
+	if (!dib) {
+		return FALSE;
+	}
+
+	GetExeIconDecodeOptions decodeOptions;
+	memset(&decodeOptions, 0, sizeof(decodeOptions));
+	decodeOptions.premultiplied = TRUE;
+	decodeOptions.isa = options ? options->isa : GET_EXE_ICON_ISA_AUTO;
+
+	GetExeIconBitmap decoded;
+	BOOL ok = get_exe_icon_decode_dib(dib, dibLen, &decodeOptions, &decoded);
+	free(dib);
+	if (!ok) {
+		return FALSE;
+	}
+
+	if (decoded.width == width && decoded.height == height) {
+		*bitmap = decoded;
+		return TRUE;
+	}
+
+	ok = get_exe_icon_resample(&decoded, width, height, options, bitmap);
+	get_exe_icon_bitmap_free(&decoded);
+	return ok;
+}
+
+// Sets up the extraction of the one image that best suits width x height
+static void init_sized_options(GetExeIconOptions *options, DWORD width, DWORD height)
+{
+	memset(options, 0, sizeof(GetExeIconOptions));
+	options->targetWidth = width;
+	options->targetHeight = height;
+	options->sizePolicy = GET_EXE_ICON_SIZE_NEAREST_LARGER;
+	options->rawImage = TRUE;
+}
+
+BOOL get_exe_icon_bitmap_from_file_utf8(PCSTR path, DWORD width, DWORD height, const GetExeIconResampleOptions *options, GetExeIconBitmap *bitmap)
+{
+	if (bitmap) {
+		memset(bitmap, 0, sizeof(GetExeIconBitmap));
+	}
+	if (!path || width == 0 || height == 0 || !bitmap) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return FALSE;
+	}
+
+	GetExeIconOptions extractOptions;
+	init_sized_options(&extractOptions, width, height);
+	DWORD dibLen;
+	PBYTE dib = get_exe_icon_from_file_utf8_ex(path, &extractOptions, &dibLen);
+	return bitmap_from_dib(dib, dibLen, width, height, options, bitmap);
+}
+
+BOOL get_exe_icon_bitmap_from_memory(const void *data, size_t len, DWORD width, DWORD height, const GetExeIconResampleOptions *options, GetExeIconBitmap *bitmap)
+{
+	if (bitmap) {
+		memset(bitmap, 0, sizeof(GetExeIconBitmap));
+	}
+	if (!data || width == 0 || height == 0 || !bitmap) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return FALSE;
+	}
+
+	GetExeIconOptions extractOptions;
+	init_sized_options(&extractOptions, width, height);
+	DWORD dibLen;
+	PBYTE dib = get_exe_icon_from_memory_ex(data, len, &extractOptions, &dibLen);
+	return bitmap_from_dib(dib, dibLen, width, height, options, bitmap);
+}
+
+static void write_le16(BYTE *p, uint16_t v)
+{
+	p[0] = (BYTE)v;
+	p[1] = (BYTE)(v >> 8);
+}
+
+static void write_le32(BYTE *p, uint32_t v)
+{
+	p[0] = (BYTE)v;
+	p[1] = (BYTE)(v >> 8);
+	p[2] = (BYTE)(v >> 16);
+	p[3] = (BYTE)(v >> 24);
+}
+
+PBYTE get_exe_icon_bitmap_to_ico(const GetExeIconBitmap *bitmap, BOOL premultiplied, PDWORD bufLen)
+{
+	if (!bitmap || !bitmap->pixels || bitmap->width == 0 || bitmap->height == 0 || !bufLen) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return NULL;
+	}
+
+	const DWORD width = bitmap->width;
+	const DWORD height = bitmap->height;
+	const uint64_t maskStride = ((uint64_t)width + 31) / 32 * 4;
+	const uint64_t imageLen = 40 + ((uint64_t)width * 4 + maskStride) * height;
+	if (imageLen > UINT32_MAX - 6 - 16 || height > INT32_MAX / 2) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_TOO_LARGE);
+		return NULL;
+	}
+
+	*bufLen = (DWORD)(6 + 16 + imageLen);
+	PBYTE icoBuf = (PBYTE)calloc(1, *bufLen);
+	if (!icoBuf) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+		return NULL;
+	}
+
+	// Header and directory entry. A size of 0 means 256 or more.
+	write_le16(icoBuf + 2, 1);
+	write_le16(icoBuf + 4, 1);
+	icoBuf[6] = width < 256 ? (BYTE)width : 0;
+	icoBuf[7] = height < 256 ? (BYTE)height : 0;
+	write_le16(icoBuf + 10, 1);
+	write_le16(icoBuf + 12, 32);
+	write_le32(icoBuf + 14, (uint32_t)imageLen);
+	write_le32(icoBuf + 18, 6 + 16);
+
+	// BITMAPINFOHEADER, whose height covers the image and the mask
+	BYTE *dib = icoBuf + 6 + 16;
+	write_le32(dib, 40);
+	write_le32(dib + 4, width);
+	write_le32(dib + 8, height * 2);
+	write_le16(dib + 12, 1);
+	write_le16(dib + 14, 32);
+	write_le32(dib + 20, (uint32_t)(imageLen - 40));
+
+	// Bottom-up BGRA pixels, then the mask of fully transparent pixels
+	BYTE *pixels = dib + 40;
+	BYTE *mask = pixels + (size_t)width * 4 * height;
+	for (DWORD y = 0; y < height; y++) {
+		const BYTE *src = bitmap->pixels + (size_t)(height - 1 - y) * width * 4;
+		BYTE *dst = pixels + (size_t)y * width * 4;
+		for (DWORD x = 0; x < width; x++, src += 4, dst += 4) {
+			BYTE a = src[3];
+			for (int c = 0; c < 3; c++) {
+				uint32_t v = src[2 - c];
+				if (premultiplied && a > 0 && a < 255) {
+					v = (v * 255 + a / 2) / a;
+					if (v > 255) {
+						v = 255;
+					}
+				}
+				dst[c] = (BYTE)v;
+			}
+			dst[3] = a;
+			if (a == 0) {
+				mask[y * maskStride + (x >> 3)] |= (BYTE)(0x80 >> (x & 7));
+			}
+		}
+	}
+
+	get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+	return icoBuf;
+}
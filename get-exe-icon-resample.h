@@ -0,0 +1,95 @@
+// Copyright (c) 2021 Aury Snow
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef GET_EXE_ICON_RESAMPLE_H
+#define GET_EXE_ICON_RESAMPLE_H
+
+#include "get-exe-icon-decode.h"
+
+// Resizes decoded icon images to any size, for when the icon has no image of
+// the size that's needed. This does what SHDefExtractIconW does on Windows,
+// but on any platform, and gives RGBA pixels or an ICO instead of an HICON.
+//
+// The filters are separable: each row is resampled horizontally, then each
+// column vertically, with weights in 14 bit fixed point. Pixels must be
+// premultiplied (see GetExeIconDecodeOptions.premultiplied), so that the
+// colors of transparent pixels don't bleed into their neighbours. The
+// filtering is done with SSE2 or AVX2 when the CPU supports it, and large
+// images are split across threads. The results are the same either way.
+
+typedef enum
+{
+	// A box filter when shrinking (averaging all the pixels that each
+	// output pixel covers), Lanczos when enlarging
+	GET_EXE_ICON_FILTER_AUTO = 0,
+	GET_EXE_ICON_FILTER_BOX,
+	GET_EXE_ICON_FILTER_BICUBIC,   // Keys' cubic, a = -0.5
+	GET_EXE_ICON_FILTER_LANCZOS3,
+} GetExeIconFilter;
+
+// Options for resampling. Zero-initialize it and set the fields that are
+// needed.
+typedef struct
+{
+	GetExeIconFilter filter;
+
+	// Number of threads to resample on, including the calling thread. 0
+	// uses one thread per CPU for images large enough to benefit, which
+	// typical icons are not.
+	DWORD numThreads;
+
+	// Same as in GetExeIconDecodeOptions.
+	GetExeIconIsa isa;
+} GetExeIconResampleOptions;
+
+// Resamples a premultiplied bitmap to width x height pixels.
+//
+// src: The bitmap to resample, e.g. from get_exe_icon_decode_dib().
+//
+// options: May be NULL to use the defaults.
+//
+// dst (OUT): The resampled bitmap, also premultiplied. Free its pixels with
+//            get_exe_icon_bitmap_free().
+//
+// Return Value: TRUE on success. On error FALSE is returned, and
+//               get_exe_icon_last_error() says why.
+BOOL get_exe_icon_resample(const GetExeIconBitmap *src, DWORD width, DWORD height, const GetExeIconResampleOptions *options, GetExeIconBitmap *dst);
+
+// Gets the primary icon of a file as a premultiplied bitmap of exactly
+// width x height pixels. The image that best suits the size (see
+// GET_EXE_ICON_SIZE_NEAREST_LARGER) is the only one read from the file, and
+// it's decoded and resampled if it isn't that size already. PNG images are
+// passed over, since they can't be decoded.
+BOOL get_exe_icon_bitmap_from_file_utf8(PCSTR path, DWORD width, DWORD height, const GetExeIconResampleOptions *options, GetExeIconBitmap *bitmap);
+
+// Same as get_exe_icon_bitmap_from_file_utf8() except the PE file is in
+// memory.
+BOOL get_exe_icon_bitmap_from_memory(const void *data, size_t len, DWORD width, DWORD height, const GetExeIconResampleOptions *options, GetExeIconBitmap *bitmap);
+
+// Makes an ICO holding just the given bitmap, as a 32 bit image.
+//
+// premultiplied: Whether the bitmap's pixels are premultiplied. ICOs aren't,
+//                so premultiplied pixels are converted back.
+//
+// Return Value: The ICO, to be freed with free(3). On error NULL is returned,
+//               and get_exe_icon_last_error() says why.
+PBYTE get_exe_icon_bitmap_to_ico(const GetExeIconBitmap *bitmap, BOOL premultiplied, PDWORD bufLen);
+
+#endif
@@ -0,0 +1,700 @@
+// Copyright (c) 2021 Aury Snow
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE // For d_type in struct dirent
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include "get-exe-icon-scan.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+// Notes about the code:
+//
+// There are two bounded queues: paths of files found by the walking thread,
+// waiting for a worker, and results waiting for the consumer. Each side
+// blocks on a condition variable when its queue is full (or empty), which is
+// all the flow control there is: a consumer that stops calling
+// get_exe_icon_scan_next() fills the result queue, which stalls the workers,
+// which fills the path queue, which stalls the walk. Only the stack of
+// directories still to be walked isn't bounded, but it holds one path per
+// directory rather than per file.
+//
+// The workers are done once the walk is over and the path queue is empty, and
+// the scan is done once every worker is and the result queue is empty. So
+// knowing how many workers are still running is enough to tell.
+
+#define PATH_QUEUE_SIZE  256
+
+#ifdef _WIN32
+#define PATH_SEPARATOR '\\'
+#else
+#define PATH_SEPARATOR '/'
+#endif
+
+#ifdef _WIN32
+typedef HANDLE Thread;
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE Cond;
+#else
+typedef pthread_t Thread;
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Cond;
+#endif
+
+struct GetExeIconScan
+{
+	Mutex  lock;
+	Cond   pathReady;     // A path was queued, or the walk is over
+	Cond   pathSpace;     // A path was taken from the queue
+	Cond   resultReady;   // A result was queued, or a worker exited
+	Cond   resultSpace;   // A result was taken from the queue
+
+	char *root;
+	BOOL  allowEmbeddedPNGs;
+	BOOL  includeFailures;
+	BOOL  pathsOnly;
+
+	// All of the below are protected by lock
+
+	BOOL   walking;
+	BOOL   cancelled;
+	DWORD  activeWorkers;
+
+	// Ring buffers
+	char  *paths[PATH_QUEUE_SIZE];
+	size_t pathHead;
+	size_t pathCount;
+	GetExeIconScanResult *results;
+	size_t resultCapacity;
+	size_t resultHead;
+	size_t resultCount;
+
+	Thread  walker;
+	Thread *workers;
+	DWORD   numWorkers;
+};
+
+typedef enum
+{
+	ENTRY_OTHER,
+	ENTRY_FILE,
+	ENTRY_DIR,
+} EntryType;
+
+// Platform wrappers for threads, locks and directory listing
+
+#ifdef _WIN32
+static void init_sync(GetExeIconScan *scan)
+{
+	InitializeCriticalSection(&scan->lock);
+	InitializeConditionVariable(&scan->pathReady);
+	InitializeConditionVariable(&scan->pathSpace);
+	InitializeConditionVariable(&scan->resultReady);
+	InitializeConditionVariable(&scan->resultSpace);
+}
+
+static void destroy_sync(GetExeIconScan *scan)
+{
+	DeleteCriticalSection(&scan->lock);
+}
+
+static void lock_mutex(Mutex *mutex) { EnterCriticalSection(mutex); }
+static void unlock_mutex(Mutex *mutex) { LeaveCriticalSection(mutex); }
+static void wait_cond(Cond *cond, Mutex *mutex) { SleepConditionVariableCS(cond, mutex, INFINITE); }
+static void signal_cond(Cond *cond) { WakeConditionVariable(cond); }
+static void broadcast_cond(Cond *cond) { WakeAllConditionVariable(cond); }
+
+static void walk_tree(GetExeIconScan *scan);
+static void run_scan_worker(GetExeIconScan *scan);
+
+static DWORD WINAPI walker_thread_main(LPVOID arg)
+{
+	walk_tree((GetExeIconScan *)arg);
+	return 0;
+}
+
+static DWORD WINAPI worker_thread_main(LPVOID arg)
+{
+	run_scan_worker((GetExeIconScan *)arg);
+	return 0;
+}
+
+static BOOL start_thread(Thread *thread, BOOL walker, GetExeIconScan *scan)
+{
+	*thread = CreateThread(NULL, 0, walker ? walker_thread_main : worker_thread_main, scan, 0, NULL);
+	return *thread != NULL;
+}
+
+static void join_thread(Thread thread)
+{
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+
+static DWORD num_cpus(void)
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+}
+
+static PWSTR utf8_to_wide(PCSTR str)
+{
+	int len = MultiByteToWideChar(CP_UTF8, 0, str, -1, NULL, 0);
+	if (len <= 0) {
+		return NULL;
+	}
+	PWSTR wStr = (PWSTR)malloc(sizeof(WCHAR) * len);
+	if (wStr && MultiByteToWideChar(CP_UTF8, 0, str, -1, wStr, len) <= 0) {
+		free(wStr);
+		return NULL;
+	}
+	return wStr;
+}
+
+static BOOL is_directory(PCSTR path)
+{
+	PWSTR wPath = utf8_to_wide(path);
+	if (!wPath) {
+		return FALSE;
+	}
+	DWORD attributes = GetFileAttributesW(wPath);
+	free(wPath);
+	return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+static BOOL has_mz_signature(PCSTR path)
+{
+	PWSTR wPath = utf8_to_wide(path);
+	if (!wPath) {
+		return FALSE;
+	}
+	HANDLE file = CreateFileW(wPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	free(wPath);
+	if (file == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+	char sig[2];
+	DWORD numRead = 0;
+	BOOL ret = ReadFile(file, sig, 2, &numRead, NULL) && numRead == 2 && sig[0] == 'M' && sig[1] == 'Z';
+	CloseHandle(file);
+	return ret;
+}
+
+typedef struct
+{
+	HANDLE find;
+	BOOL haveEntry;
+	WIN32_FIND_DATAW data;
+	char name[MAX_PATH * 3];
+} DirReader;
+
+static BOOL open_dir(DirReader *reader, PCSTR path)
+{
+	size_t len = strlen(path);
+	char *pattern = (char *)malloc(len + 3);
+	if (!pattern) {
+		return FALSE;
+	}
+	memcpy(pattern, path, len);
+	memcpy(pattern + len, "\\*", 3);
+	PWSTR wPattern = utf8_to_wide(pattern);
+	free(pattern);
+	if (!wPattern) {
+		return FALSE;
+	}
+	reader->find = FindFirstFileExW(wPattern, FindExInfoBasic, &reader->data,
+		FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+	free(wPattern);
+	reader->haveEntry = TRUE;
+	return reader->find != INVALID_HANDLE_VALUE;
+}
+
+static BOOL read_dir(DirReader *reader, PCSTR *name, EntryType *type)
+{
+	if (!reader->haveEntry) {
+		if (!FindNextFileW(reader->find, &reader->data)) {
+			return FALSE;
+		}
+	}
+	reader->haveEntry = FALSE;
+
+	if (WideCharToMultiByte(CP_UTF8, 0, reader->data.cFileName, -1, reader->name, sizeof(reader->name), NULL, NULL) <= 0) {
+		reader->name[0] = '\0';
+	}
+	*name = reader->name;
+
+	DWORD attributes = reader->data.dwFileAttributes;
+	if (attributes & FILE_ATTRIBUTE_REPARSE_POINT) {
+		*type = ENTRY_OTHER;
+	} else if (attributes & FILE_ATTRIBUTE_DIRECTORY) {
+		*type = ENTRY_DIR;
+	} else {
+		*type = ENTRY_FILE;
+	}
+	return TRUE;
+}
+
+static void close_dir(DirReader *reader)
+{
+	FindClose(reader->find);
+}
+#else
+static void init_sync(GetExeIconScan *scan)
+{
+	pthread_mutex_init(&scan->lock, NULL);
+	pthread_cond_init(&scan->pathReady, NULL);
+	pthread_cond_init(&scan->pathSpace, NULL);
+	pthread_cond_init(&scan->resultReady, NULL);
+	pthread_cond_init(&scan->resultSpace, NULL);
+}
+
+static void destroy_sync(GetExeIconScan *scan)
+{
+	pthread_mutex_destroy(&scan->lock);
+	pthread_cond_destroy(&scan->pathReady);
+	pthread_cond_destroy(&scan->pathSpace);
+	pthread_cond_destroy(&scan->resultReady);
+	pthread_cond_destroy(&scan->resultSpace);
+}
+
+static void lock_mutex(Mutex *mutex) { pthread_mutex_lock(mutex); }
+static void unlock_mutex(Mutex *mutex) { pthread_mutex_unlock(mutex); }
+static void wait_cond(Cond *cond, Mutex *mutex) { pthread_cond_wait(cond, mutex); }
+static void signal_cond(Cond *cond) { pthread_cond_signal(cond); }
+static void broadcast_cond(Cond *cond) { pthread_cond_broadcast(cond); }
+
+static void walk_tree(GetExeIconScan *scan);
+static void run_scan_worker(GetExeIconScan *scan);
+
+static void *walker_thread_main(void *arg)
+{
+	walk_tree((GetExeIconScan *)arg);
+	return NULL;
+}
+
+static void *worker_thread_main(void *arg)
+{
+	run_scan_worker((GetExeIconScan *)arg);
+	return NULL;
+}
+
+static BOOL start_thread(Thread *thread, BOOL walker, GetExeIconScan *scan)
+{
+	return pthread_create(thread, NULL, walker ? walker_thread_main : worker_thread_main, scan) == 0;
+}
+
+static void join_thread(Thread thread)
+{
+	pthread_join(thread, NULL);
+}
+
+static DWORD num_cpus(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (DWORD)n : 1;
+}
+
+static BOOL is_directory(PCSTR path)
+{
+	struct stat st;
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static BOOL has_mz_signature(PCSTR path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return FALSE;
+	}
+	char sig[2];
+	BOOL ret = read(fd, sig, 2) == 2 && sig[0] == 'M' && sig[1] == 'Z';
+	close(fd);
+	return ret;
+}
+
+typedef struct
+{
+	DIR *dir;
+} DirReader;
+
+static BOOL open_dir(DirReader *reader, PCSTR path)
+{
+	reader->dir = opendir(path);
+	return reader->dir != NULL;
+}
+
+static BOOL read_dir(DirReader *reader, PCSTR *name, EntryType *type)
+{
+	struct dirent *entry = readdir(reader->dir);
+	if (!entry) {
+		return FALSE;
+	}
+	*name = entry->d_name;
+
+	// Most filesystems say what the entry is, saving a stat() call
+	unsigned char dType = DT_UNKNOWN;
+#ifdef _DIRENT_HAVE_D_TYPE
+	dType = entry->d_type;
+#endif
+	if (dType == DT_UNKNOWN) {
+		struct stat st;
+		if (fstatat(dirfd(reader->dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+			dType = DT_UNKNOWN;
+		} else if (S_ISREG(st.st_mode)) {
+			dType = DT_REG;
+		} else if (S_ISDIR(st.st_mode)) {
+			dType = DT_DIR;
+		}
+	}
+
+	*type = dType == DT_REG ? ENTRY_FILE : dType == DT_DIR ? ENTRY_DIR : ENTRY_OTHER;
+	return TRUE;
+}
+
+static void close_dir(DirReader *reader)
+{
+	closedir(reader->dir);
+}
+#endif
+
+static char *join_path(PCSTR dir, PCSTR name)
+{
+	size_t dirLen = strlen(dir), nameLen = strlen(name);
+	BOOL addSeparator = dirLen > 0 && dir[dirLen - 1] != PATH_SEPARATOR && dir[dirLen - 1] != '/';
+	char *path = (char *)malloc(dirLen + addSeparator + nameLen + 1);
+	if (!path) {
+		return NULL;
+	}
+	memcpy(path, dir, dirLen);
+	if (addSeparator) {
+		path[dirLen] = PATH_SEPARATOR;
+	}
+	memcpy(path + dirLen + addSeparator, name, nameLen + 1);
+	return path;
+}
+
+// Queues a file for the workers, waiting for room if needed. Returns FALSE if
+// the scan was cancelled, in which case the caller still owns the path.
+static BOOL push_path(GetExeIconScan *scan, char *path)
+{
+	lock_mutex(&scan->lock);
+	while (scan->pathCount == PATH_QUEUE_SIZE && !scan->cancelled) {
+		wait_cond(&scan->pathSpace, &scan->lock);
+	}
+	BOOL ret = !scan->cancelled;
+	if (ret) {
+		scan->paths[(scan->pathHead + scan->pathCount) % PATH_QUEUE_SIZE] = path;
+		scan->pathCount ++;
+		signal_cond(&scan->pathReady);
+	}
+	unlock_mutex(&scan->lock);
+	return ret;
+}
+
+// Same as push_path() but for results, which the consumer waits for
+static BOOL push_result(GetExeIconScan *scan, const GetExeIconScanResult *result)
+{
+	lock_mutex(&scan->lock);
+	while (scan->resultCount == scan->resultCapacity && !scan->cancelled) {
+		wait_cond(&scan->resultSpace, &scan->lock);
+	}
+	BOOL ret = !scan->cancelled;
+	if (ret) {
+		scan->results[(scan->resultHead + scan->resultCount) % scan->resultCapacity] = *result;
+		scan->resultCount ++;
+		signal_cond(&scan->resultReady);
+	}
+	unlock_mutex(&scan->lock);
+	return ret;
+}
+
+static BOOL is_cancelled(GetExeIconScan *scan)
+{
+	lock_mutex(&scan->lock);
+	BOOL cancelled = scan->cancelled;
+	unlock_mutex(&scan->lock);
+	return cancelled;
+}
+
+static void walk_tree(GetExeIconScan *scan)
+{
+	// Directories still to be listed, walked depth first
+	char **dirs = (char **)malloc(sizeof(char *) * 16);
+	size_t numDirs = 0, dirCapacity = 16;
+	if (dirs) {
+		dirs[0] = scan->root;
+		numDirs = 1;
+	}
+
+	BOOL stop = FALSE;
+	while (numDirs > 0 && !stop && !is_cancelled(scan)) {
+		char *dir = dirs[--numDirs];
+		DirReader reader;
+		PCSTR name;
+		EntryType type;
+
+		if (open_dir(&reader, dir)) {
+			while (read_dir(&reader, &name, &type)) {
+				if (type == ENTRY_OTHER || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+					continue;
+				}
+
+				char *path = join_path(dir, name);
+				if (!path) {
+					continue;
+				}
+
+				if (type == ENTRY_FILE) {
+					if (!push_path(scan, path)) {
+						free(path);
+						stop = TRUE;
+						break;
+					}
+					continue;
+				}
+
+				if (numDirs == dirCapacity) {
+					char **newDirs = (char **)realloc(dirs, sizeof(char *) * dirCapacity * 2);
+					if (!newDirs) {
+						free(path);
+						continue;
+					}
+					dirs = newDirs;
+					dirCapacity *= 2;
+				}
+				dirs[numDirs++] = path;
+			}
+			close_dir(&reader);
+		}
+
+		if (dir != scan->root) {
+			free(dir);
+		}
+	}
+
+	while (numDirs > 0) {
+		char *dir = dirs[--numDirs];
+		if (dir != scan->root) {
+			free(dir);
+		}
+	}
+	free(dirs);
+
+	lock_mutex(&scan->lock);
+	scan->walking = FALSE;
+	broadcast_cond(&scan->pathReady);
+	unlock_mutex(&scan->lock);
+}
+
+// Extracts the icon of one file found by the walk, taking ownership of path
+static void scan_file(GetExeIconScan *scan, char *path)
+{
+	if (!has_mz_signature(path)) {
+		free(path);
+		return;
+	}
+
+	GetExeIconScanResult result;
+	result.path = path;
+	result.bufLen = 0;
+	result.icoBuf = NULL;
+	result.error = GET_EXE_ICON_OK;
+	if (!scan->pathsOnly) {
+		result.icoBuf = get_exe_icon_from_file_utf8(path, scan->allowEmbeddedPNGs, &result.bufLen);
+		result.error = result.icoBuf ? GET_EXE_ICON_OK : get_exe_icon_last_error();
+	}
+
+	if ((result.error != GET_EXE_ICON_OK && !scan->includeFailures) || !push_result(scan, &result)) {
+		free(result.icoBuf);
+		free(path);
+	}
+}
+
+static void run_scan_worker(GetExeIconScan *scan)
+{
+	lock_mutex(&scan->lock);
+	for (;;) {
+		while (scan->pathCount == 0 && scan->walking && !scan->cancelled) {
+			wait_cond(&scan->pathReady, &scan->lock);
+		}
+		if (scan->cancelled || scan->pathCount == 0) {
+			break;
+		}
+
+		char *path = scan->paths[scan->pathHead];
+		scan->pathHead = (scan->pathHead + 1) % PATH_QUEUE_SIZE;
+		scan->pathCount --;
+		signal_cond(&scan->pathSpace);
+		unlock_mutex(&scan->lock);
+
+		scan_file(scan, path);
+
+		lock_mutex(&scan->lock);
+	}
+
+	scan->activeWorkers --;
+	broadcast_cond(&scan->resultReady);
+	unlock_mutex(&scan->lock);
+}
+
+GetExeIconScan *get_exe_icon_scan_open(PCSTR root, const GetExeIconScanOptions *options)
+{
+	if (!root) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return NULL;
+	}
+	if (!is_directory(root)) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OPEN_FAILED);
+		return NULL;
+	}
+
+	GetExeIconScan *scan = (GetExeIconScan *)calloc(1, sizeof(GetExeIconScan));
+	if (!scan) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+		return NULL;
+	}
+
+	DWORD numThreads = options && options->numThreads ? options->numThreads : num_cpus();
+	scan->resultCapacity = options && options->maxPending ? options->maxPending : GET_EXE_ICON_SCAN_DEFAULT_MAX_PENDING;
+	scan->allowEmbeddedPNGs = options ? options->allowEmbeddedPNGs : FALSE;
+	scan->includeFailures = options ? options->includeFailures : FALSE;
+	scan->pathsOnly = options ? options->pathsOnly : FALSE;
+	scan->root = (char *)malloc(strlen(root) + 1);
+	scan->results = (GetExeIconScanResult *)malloc(sizeof(GetExeIconScanResult) * scan->resultCapacity);
+	scan->workers = (Thread *)malloc(sizeof(Thread) * numThreads);
+	if (!scan->root || !scan->results || !scan->workers) {
+		free(scan->root);
+		free(scan->results);
+		free(scan->workers);
+		free(scan);
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+		return NULL;
+	}
+	strcpy(scan->root, root);
+	init_sync(scan);
+
+	// The lock keeps the workers from seeing walking == FALSE before the
+	// walker has started
+	lock_mutex(&scan->lock);
+	scan->walking = TRUE;
+	while (scan->numWorkers < numThreads && start_thread(&scan->workers[scan->numWorkers], FALSE, scan)) {
+		scan->numWorkers ++;
+		scan->activeWorkers ++;
+	}
+	BOOL started = scan->numWorkers > 0 && start_thread(&scan->walker, TRUE, scan);
+	if (!started) {
+		scan->walking = FALSE;
+		scan->cancelled = TRUE;
+		broadcast_cond(&scan->pathReady);
+	}
+	unlock_mutex(&scan->lock);
+
+	if (!started) {
+		for (DWORD i = 0; i < scan->numWorkers; i++) {
+			join_thread(scan->workers[i]);
+		}
+		destroy_sync(scan);
+		free(scan->root);
+		free(scan->results);
+		free(scan->workers);
+		free(scan);
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+		return NULL;
+	}
+
+	get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+	return scan;
+}
+
+BOOL get_exe_icon_scan_next(GetExeIconScan *scan, GetExeIconScanResult *result)
+{
+	if (!scan || !result) {
+		return FALSE;
+	}
+
+	lock_mutex(&scan->lock);
+	while (scan->resultCount == 0 && scan->activeWorkers > 0 && !scan->cancelled) {
+		wait_cond(&scan->resultReady, &scan->lock);
+	}
+	BOOL ret = scan->resultCount > 0 && !scan->cancelled;
+	if (ret) {
+		*result = scan->results[scan->resultHead];
+		scan->resultHead = (scan->resultHead + 1) % scan->resultCapacity;
+		scan->resultCount --;
+		signal_cond(&scan->resultSpace);
+	}
+	unlock_mutex(&scan->lock);
+	return ret;
+}
+
+void get_exe_icon_scan_cancel(GetExeIconScan *scan)
+{
+	if (!scan) {
+		return;
+	}
+
+	lock_mutex(&scan->lock);
+	scan->cancelled = TRUE;
+	broadcast_cond(&scan->pathReady);
+	broadcast_cond(&scan->pathSpace);
+	broadcast_cond(&scan->resultReady);
+	broadcast_cond(&scan->resultSpace);
+	unlock_mutex(&scan->lock);
+}
+
+void get_exe_icon_scan_close(GetExeIconScan *scan)
+{
+	if (!scan) {
+		return;
+	}
+
+	get_exe_icon_scan_cancel(scan);
+	join_thread(scan->walker);
+	for (DWORD i = 0; i < scan->numWorkers; i++) {
+		join_thread(scan->workers[i]);
+	}
+
+	for (size_t i = 0; i < scan->pathCount; i++) {
+		free(scan->paths[(scan->pathHead + i) % PATH_QUEUE_SIZE]);
+	}
+	for (size_t i = 0; i < scan->resultCount; i++) {
+		GetExeIconScanResult *result = &scan->results[(scan->resultHead + i) % scan->resultCapacity];
+		free(result->path);
+		free(result->icoBuf);
+	}
+
+	destroy_sync(scan);
+	free(scan->root);
+	free(scan->results);
+	free(scan->workers);
+	free(scan);
+}
@@ -0,0 +1,104 @@
+// Copyright (c) 2021 Aury Snow
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef GET_EXE_ICON_SCAN_H
+#define GET_EXE_ICON_SCAN_H
+
+#include "get-exe-icon.h"
+
+// A recursive scan of a directory tree for executables, which hands out their
+// icons as they are extracted rather than once the whole tree is done.
+//
+// One thread walks the tree while a pool of others checks each file for the
+// "MZ" signature (so that only files that can be PEs are ever parsed) and
+// extracts the icons. Results wait in a queue of limited size until they are
+// taken with get_exe_icon_scan_next(); when it's full, the threads stop and
+// wait too. So a consumer that's slower than the scan just slows it down, and
+// memory use stays bounded however big the tree is.
+//
+// Symbolic links (and on Windows, other reparse points) are not followed, and
+// subdirectories that can't be read are skipped.
+typedef struct GetExeIconScan GetExeIconScan;
+
+// Options for get_exe_icon_scan_open(). Zero-initialize it and set the fields
+// that are needed.
+typedef struct
+{
+	// Number of threads extracting icons, besides the one walking the tree.
+	// 0 uses one per CPU.
+	DWORD numThreads;
+
+	// Same as in get_exe_icon_from_file_utf16().
+	BOOL allowEmbeddedPNGs;
+
+	// Maximum number of results waiting to be taken. 0 uses
+	// GET_EXE_ICON_SCAN_DEFAULT_MAX_PENDING.
+	DWORD maxPending;
+
+	// Also return a result (with a NULL icoBuf) for each file that starts
+	// like a PE but that no icon could be extracted from.
+	BOOL includeFailures;
+
+	// Only find the files that start like PEs, without extracting their
+	// icons: each result has just a path, with a NULL icoBuf and error
+	// GET_EXE_ICON_OK. For callers that extract the icons their own way.
+	BOOL pathsOnly;
+} GetExeIconScanOptions;
+
+#define GET_EXE_ICON_SCAN_DEFAULT_MAX_PENDING  64
+
+typedef struct
+{
+	// UTF-8 path of the file: the root as given to get_exe_icon_scan_open(),
+	// then the names of the directories below it, separated by '/' (or '\'
+	// on Windows). Free with free(3).
+	char *path;
+
+	// The ICO file, or NULL if error is not GET_EXE_ICON_OK or the scan is
+	// pathsOnly. Free with free(3).
+	PBYTE icoBuf;
+	DWORD bufLen;
+	GetExeIconError error;
+} GetExeIconScanResult;
+
+// Starts scanning the directory 'root', given as a UTF-8 string. Returns NULL
+// on error, e.g. GET_EXE_ICON_ERROR_OPEN_FAILED if root is not a directory.
+//
+// options: May be NULL to use the defaults.
+GetExeIconScan *get_exe_icon_scan_open(PCSTR root, const GetExeIconScanOptions *options);
+
+// Waits for the next result. Results come in no particular order.
+//
+// Return Value: FALSE once the whole tree has been scanned and every result
+//               has been taken, or the scan was cancelled. Otherwise TRUE,
+//               and the caller owns the buffers in 'result'.
+BOOL get_exe_icon_scan_next(GetExeIconScan *scan, GetExeIconScanResult *result);
+
+// Stops the scan early. Any get_exe_icon_scan_next() waiting on another
+// thread returns FALSE, as do all later ones. Unlike get_exe_icon_scan_close(),
+// may be called from any thread at any time.
+void get_exe_icon_scan_cancel(GetExeIconScan *scan);
+
+// Cancels the scan if it's not done, waits for its threads to exit and frees
+// it, along with any results not taken. No get_exe_icon_scan_next() may be
+// running.
+void get_exe_icon_scan_close(GetExeIconScan *scan);
+
+#endif
@@ -0,0 +1,562 @@
+// Copyright (c) 2021 Aury Snow
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include "get-exe-icon-store.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+// Notes about the code:
+//
+// Which hashes the store holds is remembered in memory (a hash set that
+// starts empty and fills as icons are added or found on disk), so adding an
+// icon that was already added through the same GetExeIconStore costs no
+// filesystem access at all. Otherwise the icon's file is looked for, and
+// only written if missing. Two threads or processes adding the same new icon
+// at once both write it, and the second rename just replaces the first
+// file with an identical one.
+
+#define INITIAL_SET_CAPACITY  1024
+
+typedef struct
+{
+	GetExeIconHash  hash;
+	BOOL            used;
+} HashSlot;
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION Mutex;
+#else
+typedef pthread_mutex_t Mutex;
+#endif
+
+struct GetExeIconStore
+{
+	Mutex      lock;
+	char      *dirPath;
+	HashSlot  *slots;
+	size_t     capacity;      // A power of 2
+	size_t     numHashes;
+	uint64_t   tmpCounter;    // Makes temporary file names unique
+	GetExeIconStoreStats stats;
+};
+
+// Platform wrappers for the few file operations needed below
+
+#ifdef _WIN32
+typedef HANDLE FileHandle;
+#define INVALID_FILE INVALID_HANDLE_VALUE
+
+static PWSTR utf8_to_wide(PCSTR str)
+{
+	int len = MultiByteToWideChar(CP_UTF8, 0, str, -1, NULL, 0);
+	if (len <= 0) {
+		return NULL;
+	}
+	PWSTR wStr = (PWSTR)malloc(sizeof(WCHAR) * len);
+	if (wStr && MultiByteToWideChar(CP_UTF8, 0, str, -1, wStr, len) <= 0) {
+		free(wStr);
+		return NULL;
+	}
+	return wStr;
+}
+
+// Succeeds if the directory exists afterwards
+static BOOL make_dir(PCSTR path)
+{
+	PWSTR wPath = utf8_to_wide(path);
+	if (!wPath) {
+		return FALSE;
+	}
+	BOOL ret = CreateDirectoryW(wPath, NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+	free(wPath);
+	return ret;
+}
+
+static BOOL get_path_size(PCSTR path, uint64_t *size)
+{
+	PWSTR wPath = utf8_to_wide(path);
+	if (!wPath) {
+		return FALSE;
+	}
+	WIN32_FILE_ATTRIBUTE_DATA info;
+	BOOL ret = GetFileAttributesExW(wPath, GetFileExInfoStandard, &info);
+	free(wPath);
+	if (!ret || (info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+		return FALSE;
+	}
+	*size = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+	return TRUE;
+}
+
+static FileHandle open_file(PCSTR path, BOOL write)
+{
+	PWSTR wPath = utf8_to_wide(path);
+	if (!wPath) {
+		return INVALID_FILE;
+	}
+	HANDLE file = CreateFileW(wPath,
+		write ? GENERIC_WRITE : GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_DELETE,
+		NULL,
+		write ? CREATE_NEW : OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL);
+	free(wPath);
+	return file;
+}
+
+static void close_file(FileHandle file)
+{
+	CloseHandle(file);
+}
+
+static BOOL read_all(FileHandle file, void *buf, DWORD len)
+{
+	DWORD numRead = 0;
+	return ReadFile(file, buf, len, &numRead, NULL) && numRead == len;
+}
+
+static BOOL write_all(FileHandle file, const void *buf, DWORD len)
+{
+	DWORD numWritten = 0;
+	return WriteFile(file, buf, len, &numWritten, NULL) && numWritten == len;
+}
+
+static BOOL replace_file(PCSTR from, PCSTR to)
+{
+	PWSTR wFrom = utf8_to_wide(from);
+	PWSTR wTo = utf8_to_wide(to);
+	BOOL ret = wFrom && wTo && MoveFileExW(wFrom, wTo, MOVEFILE_REPLACE_EXISTING);
+	free(wFrom);
+	free(wTo);
+	return ret;
+}
+
+static void remove_file(PCSTR path)
+{
+	PWSTR wPath = utf8_to_wide(path);
+	if (wPath) {
+		DeleteFileW(wPath);
+		free(wPath);
+	}
+}
+
+static unsigned long process_id(void)
+{
+	return GetCurrentProcessId();
+}
+
+static void init_mutex(Mutex *mutex) { InitializeCriticalSection(mutex); }
+static void destroy_mutex(Mutex *mutex) { DeleteCriticalSection(mutex); }
+static void lock_mutex(Mutex *mutex) { EnterCriticalSection(mutex); }
+static void unlock_mutex(Mutex *mutex) { LeaveCriticalSection(mutex); }
+#else
+typedef int FileHandle;
+#define INVALID_FILE (-1)
+
+// Succeeds if the directory exists afterwards
+static BOOL make_dir(PCSTR path)
+{
+	return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+static BOOL get_path_size(PCSTR path, uint64_t *size)
+{
+	struct stat st;
+	if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+		return FALSE;
+	}
+	*size = (uint64_t)st.st_size;
+	return TRUE;
+}
+
+static FileHandle open_file(PCSTR path, BOOL write)
+{
+	if (write) {
+		return open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	}
+	return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+static void close_file(FileHandle file)
+{
+	close(file);
+}
+
+static BOOL read_all(FileHandle file, void *buf, DWORD len)
+{
+	BYTE *p = (BYTE *)buf;
+	while (len > 0) {
+		ssize_t n = read(file, p, len);
+		if (n <= 0) {
+			return FALSE;
+		}
+		p += n;
+		len -= (DWORD)n;
+	}
+	return TRUE;
+}
+
+static BOOL write_all(FileHandle file, const void *buf, DWORD len)
+{
+	const BYTE *p = (const BYTE *)buf;
+	while (len > 0) {
+		ssize_t n = write(file, p, len);
+		if (n <= 0) {
+			return FALSE;
+		}
+		p += n;
+		len -= (DWORD)n;
+	}
+	return TRUE;
+}
+
+static BOOL replace_file(PCSTR from, PCSTR to)
+{
+	return rename(from, to) == 0;
+}
+
+static void remove_file(PCSTR path)
+{
+	unlink(path);
+}
+
+static unsigned long process_id(void)
+{
+	return (unsigned long)getpid();
+}
+
+static void init_mutex(Mutex *mutex) { pthread_mutex_init(mutex, NULL); }
+static void destroy_mutex(Mutex *mutex) { pthread_mutex_destroy(mutex); }
+static void lock_mutex(Mutex *mutex) { pthread_mutex_lock(mutex); }
+static void unlock_mutex(Mutex *mutex) { pthread_mutex_unlock(mutex); }
+#endif
+
+void get_exe_icon_hash_to_string(const GetExeIconHash *hash, char str[33])
+{
+	static const char digits[] = "0123456789abcdef";
+	for (int i = 0; i < 16; i++) {
+		str[2 * i] = digits[hash->bytes[i] >> 4];
+		str[2 * i + 1] = digits[hash->bytes[i] & 0xf];
+	}
+	str[32] = '\0';
+}
+
+// Gets the path of the ICO with the given hash, and optionally of the
+// subdirectory it's in. Free both with free().
+static char *icon_path(const GetExeIconStore *store, const GetExeIconHash *hash, char **subdirPath)
+{
+	char hex[33];
+	get_exe_icon_hash_to_string(hash, hex);
+
+	size_t dirLen = strlen(store->dirPath);
+	char *path = (char *)malloc(dirLen + 1 + 2 + 1 + 32 + 4 + 1);
+	if (!path) {
+		return NULL;
+	}
+	sprintf(path, "%s/%.2s/%s.ico", store->dirPath, hex, hex);
+
+	if (subdirPath) {
+		*subdirPath = (char *)malloc(dirLen + 1 + 2 + 1);
+		if (!*subdirPath) {
+			free(path);
+			return NULL;
+		}
+		sprintf(*subdirPath, "%s/%.2s", store->dirPath, hex);
+	}
+	return path;
+}
+
+// The hashes are already uniformly distributed, so any 8 bytes of one make a
+// fine index into the set
+static size_t slot_index(const GetExeIconHash *hash, size_t capacity)
+{
+	uint64_t bits;
+	memcpy(&bits, hash->bytes, sizeof(bits));
+	return (size_t)bits & (capacity - 1);
+}
+
+// Finds the hash's slot in the set, or the empty slot it would go in. Called
+// with the lock held.
+static HashSlot *find_hash(const GetExeIconStore *store, const GetExeIconHash *hash)
+{
+	size_t i = slot_index(hash, store->capacity);
+	while (store->slots[i].used
+		&& memcmp(&store->slots[i].hash, hash, sizeof(GetExeIconHash)) != 0)
+	{
+		i = (i + 1) & (store->capacity - 1);
+	}
+	return &store->slots[i];
+}
+
+// Adds a hash to the set, growing it once it's half full. Failing to grow
+// only means the hash may be looked for on disk again. Called with the lock
+// held.
+static void remember_hash(GetExeIconStore *store, const GetExeIconHash *hash)
+{
+	if (store->numHashes + 1 > store->capacity / 2) {
+		HashSlot *slots = (HashSlot *)calloc(store->capacity * 2, sizeof(HashSlot));
+		if (!slots) {
+			return;
+		}
+		HashSlot *oldSlots = store->slots;
+		size_t oldCapacity = store->capacity;
+		store->slots = slots;
+		store->capacity *= 2;
+		for (size_t i = 0; i < oldCapacity; i++) {
+			if (oldSlots[i].used) {
+				*find_hash(store, &oldSlots[i].hash) = oldSlots[i];
+			}
+		}
+		free(oldSlots);
+	}
+
+	HashSlot *slot = find_hash(store, hash);
+	if (!slot->used) {
+		slot->hash = *hash;
+		slot->used = TRUE;
+		store->numHashes ++;
+	}
+}
+
+// Writes an ICO to a temporary file next to 'path' and renames it into place
+static BOOL write_icon(GetExeIconStore *store, PCSTR path, const void *icoBuf, DWORD bufLen)
+{
+	lock_mutex(&store->lock);
+	uint64_t counter = ++store->tmpCounter;
+	unlock_mutex(&store->lock);
+
+	size_t pathLen = strlen(path);
+	char *tmpPath = (char *)malloc(pathLen + 64);
+	if (!tmpPath) {
+		return FALSE;
+	}
+	sprintf(tmpPath, "%s.%lu-%llu.tmp", path, process_id(), (unsigned long long)counter);
+
+	FileHandle file = open_file(tmpPath, TRUE);
+	if (file == INVALID_FILE) {
+		free(tmpPath);
+		return FALSE;
+	}
+	BOOL ret = write_all(file, icoBuf, bufLen);
+	close_file(file);
+
+	if (!ret || !replace_file(tmpPath, path)) {
+		remove_file(tmpPath);
+		ret = FALSE;
+	}
+	free(tmpPath);
+	return ret;
+}
+
+// Adds an ICO whose hash is already known
+static BOOL add_hashed(GetExeIconStore *store, const void *icoBuf, DWORD bufLen, const GetExeIconHash *hash, BOOL *isNew)
+{
+	if (isNew) {
+		*isNew = FALSE;
+	}
+
+	lock_mutex(&store->lock);
+	BOOL known = find_hash(store, hash)->used;
+	if (known) {
+		store->stats.duplicates ++;
+	}
+	unlock_mutex(&store->lock);
+	if (known) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+		return TRUE;
+	}
+
+	char *subdirPath;
+	char *path = icon_path(store, hash, &subdirPath);
+	if (!path) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+		return FALSE;
+	}
+
+	// Stored by an earlier run or another process. Files only ever appear
+	// complete, so matching the size is enough.
+	uint64_t size;
+	BOOL exists = get_path_size(path, &size) && size == bufLen;
+	BOOL ret = exists || (make_dir(subdirPath) && write_icon(store, path, icoBuf, bufLen));
+	free(subdirPath);
+	free(path);
+	if (!ret) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OPEN_FAILED);
+		return FALSE;
+	}
+
+	lock_mutex(&store->lock);
+	remember_hash(store, hash);
+	if (exists) {
+		store->stats.duplicates ++;
+	} else {
+		store->stats.added ++;
+		store->stats.bytesWritten += bufLen;
+	}
+	unlock_mutex(&store->lock);
+
+	if (isNew) {
+		*isNew = !exists;
+	}
+	get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+	return TRUE;
+}
+
+GetExeIconStore *get_exe_icon_store_open(PCSTR dirPath)
+{
+	if (!dirPath || !make_dir(dirPath)) {
+		return NULL;
+	}
+
+	GetExeIconStore *store = (GetExeIconStore *)calloc(1, sizeof(GetExeIconStore));
+	if (!store) {
+		return NULL;
+	}
+	store->dirPath = (char *)malloc(strlen(dirPath) + 1);
+	store->capacity = INITIAL_SET_CAPACITY;
+	store->slots = (HashSlot *)calloc(store->capacity, sizeof(HashSlot));
+	if (!store->dirPath || !store->slots) {
+		free(store->dirPath);
+		free(store->slots);
+		free(store);
+		return NULL;
+	}
+	strcpy(store->dirPath, dirPath);
+
+	init_mutex(&store->lock);
+	return store;
+}
+
+void get_exe_icon_store_close(GetExeIconStore *store)
+{
+	if (!store) {
+		return;
+	}
+	destroy_mutex(&store->lock);
+	free(store->dirPath);
+	free(store->slots);
+	free(store);
+}
+
+BOOL get_exe_icon_store_add_file(GetExeIconStore *store, PCSTR path, BOOL allowEmbeddedPNGs, GetExeIconHash *hash, BOOL *isNew)
+{
+	if (!store || !path || !hash) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return FALSE;
+	}
+
+	GetExeIconOptions options;
+	memset(&options, 0, sizeof(options));
+	options.allowEmbeddedPNGs = allowEmbeddedPNGs;
+	options.hash = hash;
+
+	DWORD bufLen;
+	PBYTE icoBuf = get_exe_icon_from_file_utf8_ex(path, &options, &bufLen);
+	if (!icoBuf) {
+		return FALSE;
+	}
+
+	BOOL ret = add_hashed(store, icoBuf, bufLen, hash, isNew);
+	free(icoBuf);
+	return ret;
+}
+
+BOOL get_exe_icon_store_add(GetExeIconStore *store, const void *icoBuf, DWORD bufLen, GetExeIconHash *hash, BOOL *isNew)
+{
+	if (!store || !icoBuf || bufLen == 0 || !hash) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return FALSE;
+	}
+
+	get_exe_icon_hash(icoBuf, bufLen, hash);
+	return add_hashed(store, icoBuf, bufLen, hash, isNew);
+}
+
+PBYTE get_exe_icon_store_get(GetExeIconStore *store, const GetExeIconHash *hash, PDWORD bufLen)
+{
+	if (!store || !hash || !bufLen) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return NULL;
+	}
+
+	char *path = icon_path(store, hash, NULL);
+	if (!path) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+		return NULL;
+	}
+
+	uint64_t size;
+	FileHandle file = INVALID_FILE;
+	if (get_path_size(path, &size) && size > 0 && size <= UINT32_MAX) {
+		file = open_file(path, FALSE);
+	}
+	free(path);
+	if (file == INVALID_FILE) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OPEN_FAILED);
+		return NULL;
+	}
+
+	PBYTE icoBuf = (PBYTE)malloc((size_t)size);
+	if (!icoBuf) {
+		close_file(file);
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+		return NULL;
+	}
+	BOOL ret = read_all(file, icoBuf, (DWORD)size);
+	close_file(file);
+
+	GetExeIconHash actual;
+	if (ret) {
+		get_exe_icon_hash(icoBuf, (size_t)size, &actual);
+	}
+	if (!ret || memcmp(&actual, hash, sizeof(GetExeIconHash)) != 0) {
+		free(icoBuf);
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_READ_FAILED);
+		return NULL;
+	}
+
+	*bufLen = (DWORD)size;
+	get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+	return icoBuf;
+}
+
+void get_exe_icon_store_stats(GetExeIconStore *store, GetExeIconStoreStats *stats)
+{
+	if (!store || !stats) {
+		return;
+	}
+	lock_mutex(&store->lock);
+	*stats = store->stats;
+	unlock_mutex(&store->lock);
+}
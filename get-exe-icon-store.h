@@ -0,0 +1,81 @@
+// Copyright (c) 2021 Aury Snow
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef GET_EXE_ICON_STORE_H
+#define GET_EXE_ICON_STORE_H
+
+#include "get-exe-icon.h"
+
+// A content-addressed store of extracted icons. Each distinct ICO is stored
+// once, under its GetExeIconHash, however many files it was extracted from;
+// many executables (e.g. every program built from one installer framework)
+// share an icon, so a store of icons for a large file tree is typically much
+// smaller than one ICO per file.
+//
+// The store is a directory in which each ICO is the file
+// "<first 2 hex digits>/<32 hex digits>.ico" named by its hash. ICOs are
+// written to a temporary file and renamed into place, so a store can be
+// shared by several processes and is never left holding a partial ICO.
+//
+// One store may be used by many threads at once.
+typedef struct GetExeIconStore GetExeIconStore;
+
+// Opens the store in directory 'dirPath', given as a UTF-8 string. The
+// directory is created if it doesn't exist, but its parent must. Returns NULL
+// on error.
+GetExeIconStore *get_exe_icon_store_open(PCSTR dirPath);
+
+void get_exe_icon_store_close(GetExeIconStore *store);
+
+// Extracts the icon of a file (see get_exe_icon_from_file_utf8()) and adds it
+// to the store, unless the store already has it. The hash is computed while
+// the ICO is assembled, so nothing is hashed twice.
+//
+// hash (OUT): The hash that identifies the icon in the store.
+//
+// isNew (OUT, optional): Set to TRUE if the icon was not already stored.
+//
+// Return Value: FALSE if the icon could not be extracted or stored, in which
+//               case get_exe_icon_last_error() says why.
+BOOL get_exe_icon_store_add_file(GetExeIconStore *store, PCSTR path, BOOL allowEmbeddedPNGs, GetExeIconHash *hash, BOOL *isNew);
+
+// Same as get_exe_icon_store_add_file() except the ICO is given in memory.
+BOOL get_exe_icon_store_add(GetExeIconStore *store, const void *icoBuf, DWORD bufLen, GetExeIconHash *hash, BOOL *isNew);
+
+// Reads the ICO with the given hash from the store. The ICO is checked
+// against the hash before it's returned. Free it with free(3). Returns NULL
+// (with GET_EXE_ICON_ERROR_OPEN_FAILED) if the store doesn't have it.
+PBYTE get_exe_icon_store_get(GetExeIconStore *store, const GetExeIconHash *hash, PDWORD bufLen);
+
+// Formats a hash as 32 lowercase hex digits plus a terminating NUL, the way
+// it appears in the store's file names.
+void get_exe_icon_hash_to_string(const GetExeIconHash *hash, char str[33]);
+
+// Statistics about a store since it was opened
+typedef struct
+{
+	uint64_t added;         // Icons written to the store
+	uint64_t duplicates;    // Icons that were already stored
+	uint64_t bytesWritten;
+} GetExeIconStoreStats;
+
+void get_exe_icon_store_stats(GetExeIconStore *store, GetExeIconStoreStats *stats);
+
+#endif
@@ -0,0 +1,695 @@
+// Copyright (c) 2021 Aury Snow
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include "get-exe-icon-zip.h"
+#include "get-exe-icon-deflate.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Notes about the code:
+//
+// The archive is mapped and only its central directory is parsed up front:
+// the end of central directory record is found by scanning back over the
+// archive comment, and then each central header gives an entry's name,
+// sizes, CRC and the offset of its local header. Local headers are only
+// looked at for the entries that are extracted, and only for the size of
+// their name and extra field (their sizes are often zero, with the real
+// ones in a data descriptor after the data, so the central directory's are
+// used).
+//
+// A stored entry is handed to the extractor as a pointer into the mapping,
+// so only the few pages of it that the extractor reads are ever read from
+// disk. That also means its CRC-32 isn't checked, as that would read all of
+// it. A deflated entry has to be decompressed whole before its resources can
+// be found, into a per-thread buffer of the entry's declared size, which the
+// decompressor never writes past; its CRC-32 is checked since every byte of
+// it is at hand anyway.
+//
+// Entries are spread over threads as in get-exe-icon-batch.c, by claiming
+// the next index with an atomic increment, since one large deflated DLL can
+// take as long as hundreds of small stored ones.
+
+#define LOCAL_HEADER_SIG    0x04034b50
+#define CENTRAL_HEADER_SIG  0x02014b50
+#define EOCD_SIG            0x06054b50
+#define ZIP64_LOCATOR_SIG   0x07064b50
+#define ZIP64_EOCD_SIG      0x06064b50
+
+#define LOCAL_HEADER_SIZE    30
+#define CENTRAL_HEADER_SIZE  46
+#define EOCD_SIZE            22
+#define ZIP64_LOCATOR_SIZE   20
+#define ZIP64_EOCD_SIZE      56
+#define MAX_COMMENT_SIZE     65535
+
+#define ZIP64_EXTRA_ID  0x0001
+
+#define FLAG_ENCRYPTED  0x0001
+
+#define METHOD_STORED   0
+#define METHOD_DEFLATE  8
+
+// An entry to be extracted, from its central header
+typedef struct
+{
+	uint64_t localOffset;     // Of its local header, in the mapping
+	uint64_t compressedSize;
+	uint64_t size;
+	uint32_t crc;
+	uint16_t flags;
+	uint16_t method;
+} Entry;
+
+// A central header, as far as it's needed
+typedef struct
+{
+	Entry entry;
+	const char *name;
+	DWORD nameLen;
+	DWORD totalSize;  // Of the header with its name, extra field and comment
+} CentralHeader;
+
+typedef struct
+{
+	const BYTE *data;
+	size_t len;
+	const Entry *entries;
+	size_t count;
+	BOOL allowEmbeddedPNGs;
+	uint64_t maxEntrySize;
+	GetExeIconZipResult *results;
+
+	// Index of the next entry to be claimed by a thread. Only accessed
+	// atomically.
+	volatile int64_t next;
+} ZipJob;
+
+static uint16_t read16(const BYTE *p)
+{
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t read32(const BYTE *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t read64(const BYTE *p)
+{
+	return (uint64_t)read32(p) | ((uint64_t)read32(p + 4) << 32);
+}
+
+// Finds the central directory from the end of central directory record (and
+// its ZIP64 counterpart, if it has one). Returns FALSE if there is none.
+//
+// cdStart (OUT): The central directory's offset in the data.
+//
+// shift (OUT): How far everything in the archive is from where its offsets
+//              say, i.e. the size of what's prepended to it (like the
+//              program of a self-extracting archive).
+static BOOL find_central_directory(const BYTE *data, size_t len, uint64_t *cdStart, uint64_t *cdSize, uint64_t *shift)
+{
+	if (len < EOCD_SIZE) {
+		return FALSE;
+	}
+
+	// The record is followed by a comment of up to 64 KB, which could
+	// contain the signature too, so take the last one whose comment ends
+	// where the data does. Failing that (if something was appended to the
+	// archive), the last one whose comment fits.
+	const size_t last = len - EOCD_SIZE;
+	const size_t lowest = last > MAX_COMMENT_SIZE ? last - MAX_COMMENT_SIZE : 0;
+	size_t pos = SIZE_MAX, fallback = SIZE_MAX;
+	for (size_t i = last + 1; i-- > lowest; ) {
+		if (read32(data + i) != EOCD_SIG) {
+			continue;
+		}
+		size_t end = i + EOCD_SIZE + read16(data + i + 20);
+		if (end == len) {
+			pos = i;
+			break;
+		}
+		if (end < len && fallback == SIZE_MAX) {
+			fallback = i;
+		}
+	}
+	if (pos == SIZE_MAX) {
+		pos = fallback;
+	}
+	if (pos == SIZE_MAX) {
+		return FALSE;
+	}
+
+	const BYTE *eocd = data + pos;
+	uint64_t end = pos;
+	uint64_t size = read32(eocd + 12);
+	uint64_t offset = read32(eocd + 16);
+
+	// A ZIP64 record, if there is one, comes before a locator right before
+	// this record, and supersedes it. The locator gives the ZIP64 record's
+	// offset, which is off by the shift too; without an extensible data
+	// sector (which nothing writes), the record is right before the locator.
+	if (pos >= ZIP64_LOCATOR_SIZE + ZIP64_EOCD_SIZE && read32(eocd - ZIP64_LOCATOR_SIZE) == ZIP64_LOCATOR_SIG) {
+		const uint64_t locatorPos = pos - ZIP64_LOCATOR_SIZE;
+		uint64_t recordPos = read64(data + locatorPos + 8);
+		if (recordPos > locatorPos - ZIP64_EOCD_SIZE || read32(data + recordPos) != ZIP64_EOCD_SIG) {
+			recordPos = locatorPos - ZIP64_EOCD_SIZE;
+		}
+		if (read32(data + recordPos) == ZIP64_EOCD_SIG) {
+			end = recordPos;
+			size = read64(data + recordPos + 40);
+			offset = read64(data + recordPos + 48);
+		}
+	}
+
+	// Normally the central directory is where the record says. If it isn't,
+	// it's assumed to end right before the record, as it does unless the
+	// archive is signed, and everything is shifted by the difference.
+	if (offset <= end && size <= end - offset
+		&& (size == 0 || read32(data + offset) == CENTRAL_HEADER_SIG))
+	{
+		*cdStart = offset;
+		*shift = 0;
+	} else if (size <= end && offset <= end - size) {
+		*cdStart = end - size;
+		*shift = end - size - offset;
+	} else {
+		return FALSE;
+	}
+	*cdSize = size;
+	return TRUE;
+}
+
+// Parses the central header at 'p', with 'left' bytes of the central
+// directory from there on. Returns FALSE if it's corrupt.
+static BOOL parse_central_header(const BYTE *p, uint64_t left, uint64_t shift, CentralHeader *header)
+{
+	if (left < CENTRAL_HEADER_SIZE || read32(p) != CENTRAL_HEADER_SIG) {
+		return FALSE;
+	}
+	DWORD nameLen = read16(p + 28);
+	DWORD extraLen = read16(p + 30);
+	DWORD commentLen = read16(p + 32);
+	header->totalSize = CENTRAL_HEADER_SIZE + nameLen + extraLen + commentLen;
+	if (left < header->totalSize) {
+		return FALSE;
+	}
+
+	Entry *entry = &header->entry;
+	entry->flags = read16(p + 8);
+	entry->method = read16(p + 10);
+	entry->crc = read32(p + 16);
+	entry->compressedSize = read32(p + 20);
+	entry->size = read32(p + 24);
+	entry->localOffset = read32(p + 42);
+	header->name = (const char *)p + CENTRAL_HEADER_SIZE;
+	header->nameLen = nameLen;
+
+	// Sizes and offsets that don't fit in 32 bits are all-ones, with the
+	// real values, in this order, in a ZIP64 extra field
+	const BYTE *extra = p + CENTRAL_HEADER_SIZE + nameLen;
+	const BYTE *extraEnd = extra + extraLen;
+	while (extraEnd - extra >= 4) {
+		DWORD id = read16(extra);
+		DWORD fieldLen = read16(extra + 2);
+		const BYTE *field = extra + 4;
+		if (fieldLen > (size_t)(extraEnd - field)) {
+			break;
+		}
+		if (id == ZIP64_EXTRA_ID) {
+			uint64_t *values[] = { &entry->size, &entry->compressedSize, &entry->localOffset };
+			const BYTE *fieldEnd = field + fieldLen;
+			for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+				if (*values[i] != 0xffffffff) {
+					continue;
+				}
+				if (fieldEnd - field < 8) {
+					return FALSE;
+				}
+				*values[i] = read64(field);
+				field += 8;
+			}
+			break;
+		}
+		extra = field + fieldLen;
+	}
+
+	if (entry->localOffset > UINT64_MAX - shift) {
+		return FALSE;
+	}
+	entry->localOffset += shift;
+	return TRUE;
+}
+
+// Whether an entry is one to get the icon of: a file (not a directory) that
+// ends in .exe or .dll, in any case
+static BOOL is_executable_name(const char *name, DWORD nameLen)
+{
+	if (nameLen < 5 || name[nameLen - 5] == '/' || name[nameLen - 4] != '.') {
+		return FALSE;
+	}
+	char ext[3];
+	for (int i = 0; i < 3; i++) {
+		char c = name[nameLen - 3 + i];
+		ext[i] = c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+	}
+	return memcmp(ext, "exe", 3) == 0 || memcmp(ext, "dll", 3) == 0;
+}
+
+// Reads the central directory, and allocates the results and entries for the
+// executables in it
+static GetExeIconError read_central_directory(const BYTE *data, size_t len, GetExeIconZipResult **resultsOut, Entry **entriesOut, size_t *countOut)
+{
+	uint64_t cdStart, cdSize, shift;
+	if (!find_central_directory(data, len, &cdStart, &cdSize, &shift)) {
+		return GET_EXE_ICON_ERROR_BAD_ARCHIVE;
+	}
+
+	// Count the executables and the size of their names first, so the
+	// results and names can be allocated as one block
+	size_t count = 0, namesSize = 0;
+	CentralHeader header;
+	for (uint64_t pos = 0; pos < cdSize; pos += header.totalSize) {
+		if (!parse_central_header(data + cdStart + pos, cdSize - pos, shift, &header)) {
+			return GET_EXE_ICON_ERROR_BAD_ARCHIVE;
+		}
+		if (is_executable_name(header.name, header.nameLen)) {
+			count ++;
+			namesSize += header.nameLen + 1;
+		}
+	}
+
+	GetExeIconZipResult *results = (GetExeIconZipResult *)malloc(sizeof(GetExeIconZipResult) * count + namesSize + 1);
+	Entry *entries = (Entry *)malloc(sizeof(Entry) * (count ? count : 1));
+	if (!results || !entries) {
+		free(results);
+		free(entries);
+		return GET_EXE_ICON_ERROR_OUT_OF_MEMORY;
+	}
+
+	char *names = (char *)(results + count);
+	size_t i = 0;
+	for (uint64_t pos = 0; pos < cdSize; pos += header.totalSize) {
+		parse_central_header(data + cdStart + pos, cdSize - pos, shift, &header);
+		if (!is_executable_name(header.name, header.nameLen)) {
+			continue;
+		}
+		memcpy(names, header.name, header.nameLen);
+		names[header.nameLen] = '\0';
+
+		entries[i] = header.entry;
+		results[i].name = names;
+		results[i].size = header.entry.size;
+		results[i].icoBuf = NULL;
+		results[i].bufLen = 0;
+		results[i].error = GET_EXE_ICON_OK;
+		names += header.nameLen + 1;
+		i ++;
+	}
+
+	*resultsOut = results;
+	*entriesOut = entries;
+	*countOut = count;
+	return GET_EXE_ICON_OK;
+}
+
+// Finds an entry's data from its local header
+static GetExeIconError locate_entry_data(const ZipJob *job, const Entry *entry, const BYTE **data)
+{
+	const uint64_t len = job->len;
+	if (entry->localOffset > len || len - entry->localOffset < LOCAL_HEADER_SIZE) {
+		return GET_EXE_ICON_ERROR_BAD_ARCHIVE;
+	}
+	const BYTE *header = job->data + entry->localOffset;
+	if (read32(header) != LOCAL_HEADER_SIG) {
+		return GET_EXE_ICON_ERROR_BAD_ARCHIVE;
+	}
+
+	uint64_t offset = entry->localOffset + LOCAL_HEADER_SIZE + read16(header + 26) + read16(header + 28);
+	if (offset > len || len - offset < entry->compressedSize) {
+		return GET_EXE_ICON_ERROR_BAD_ARCHIVE;
+	}
+	*data = job->data + offset;
+	return GET_EXE_ICON_OK;
+}
+
+// Decompresses a deflated entry into the thread's buffer, growing it if
+// needed
+static GetExeIconError inflate_entry(const ZipJob *job, const Entry *entry, const BYTE *data, PBYTE *buf, size_t *bufSize)
+{
+	if (entry->size > job->maxEntrySize || entry->size > SIZE_MAX) {
+		return GET_EXE_ICON_ERROR_TOO_LARGE;
+	}
+	if (*bufSize < entry->size) {
+		free(*buf);
+		*bufSize = 0;
+		*buf = (PBYTE)malloc((size_t)entry->size);
+		if (!*buf) {
+			return GET_EXE_ICON_ERROR_OUT_OF_MEMORY;
+		}
+		*bufSize = (size_t)entry->size;
+	}
+
+	size_t outLen;
+	if (!get_exe_icon_inflate(data, (size_t)entry->compressedSize, *buf, (size_t)entry->size, &outLen)) {
+		// More data than the entry declares is as corrupt as bad data
+		GetExeIconError error = get_exe_icon_last_error();
+		return error == GET_EXE_ICON_ERROR_TOO_LARGE ? GET_EXE_ICON_ERROR_BAD_ARCHIVE : error;
+	}
+	if (outLen != entry->size || get_exe_icon_crc32(0, *buf, outLen) != entry->crc) {
+		return GET_EXE_ICON_ERROR_BAD_ARCHIVE;
+	}
+	return GET_EXE_ICON_OK;
+}
+
+static void extract_entry(const ZipJob *job, size_t index, PBYTE *buf, size_t *bufSize)
+{
+	const Entry *entry = &job->entries[index];
+	GetExeIconZipResult *result = &job->results[index];
+
+	const BYTE *data = NULL;
+	GetExeIconError error = GET_EXE_ICON_OK;
+	if ((entry->flags & FLAG_ENCRYPTED)
+		|| (entry->method != METHOD_STORED && entry->method != METHOD_DEFLATE))
+	{
+		error = GET_EXE_ICON_ERROR_UNSUPPORTED;
+	} else {
+		error = locate_entry_data(job, entry, &data);
+	}
+	if (error == GET_EXE_ICON_OK) {
+		if (entry->method == METHOD_DEFLATE) {
+			error = inflate_entry(job, entry, data, buf, bufSize);
+			data = *buf;
+		} else if (entry->compressedSize != entry->size) {
+			error = GET_EXE_ICON_ERROR_BAD_ARCHIVE;
+		}
+	}
+	if (error != GET_EXE_ICON_OK) {
+		result->error = error;
+		return;
+	}
+
+	GetExeIconOptions options;
+	memset(&options, 0, sizeof(options));
+	options.allowEmbeddedPNGs = job->allowEmbeddedPNGs;
+	result->icoBuf = get_exe_icon_from_memory_ex(data, (size_t)entry->size, &options, &result->bufLen);
+	result->error = get_exe_icon_last_error();
+}
+
+static size_t claim_next_index(ZipJob *job)
+{
+#ifdef _WIN32
+	return (size_t)InterlockedExchangeAdd64((volatile LONG64 *)&job->next, 1);
+#else
+	return (size_t)__atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+static void run_zip_worker(ZipJob *job)
+{
+	PBYTE buf = NULL;
+	size_t bufSize = 0;
+	for (;;) {
+		size_t i = claim_next_index(job);
+		if (i >= job->count) {
+			break;
+		}
+		extract_entry(job, i, &buf, &bufSize);
+	}
+	free(buf);
+}
+
+// Platform wrappers for mapping the archive and running the threads
+
+// A file mapped read-only into memory. An empty file has no mapping.
+typedef struct {
+	const BYTE *data;
+	size_t size;
+} MappedFile;
+
+#ifdef _WIN32
+typedef HANDLE Thread;
+
+static PWSTR utf8_to_wide(PCSTR str)
+{
+	int len = MultiByteToWideChar(CP_UTF8, 0, str, -1, NULL, 0);
+	if (len <= 0) {
+		return NULL;
+	}
+	PWSTR wStr = (PWSTR)malloc(sizeof(WCHAR) * len);
+	if (wStr && MultiByteToWideChar(CP_UTF8, 0, str, -1, wStr, len) <= 0) {
+		free(wStr);
+		return NULL;
+	}
+	return wStr;
+}
+
+static BOOL map_file(PCSTR path, MappedFile *file)
+{
+	PWSTR wPath = utf8_to_wide(path);
+	if (!wPath) {
+		return FALSE;
+	}
+	HANDLE handle = CreateFileW(wPath,
+		GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS,
+		NULL);
+	free(wPath);
+	if (handle == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(handle, &size) || (uint64_t)size.QuadPart > SIZE_MAX) {
+		CloseHandle(handle);
+		return FALSE;
+	}
+	file->data = NULL;
+	file->size = (size_t)size.QuadPart;
+	if (file->size == 0) {
+		CloseHandle(handle);
+		return TRUE;
+	}
+
+	HANDLE mapping = CreateFileMappingW(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(handle);
+	if (!mapping) {
+		return FALSE;
+	}
+
+	// The view keeps the mapping object alive
+	file->data = (const BYTE *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	return file->data != NULL;
+}
+
+static void unmap_file(MappedFile *file)
+{
+	if (file->data) {
+		UnmapViewOfFile(file->data);
+	}
+}
+
+static DWORD WINAPI zip_thread_main(LPVOID arg)
+{
+	run_zip_worker((ZipJob *)arg);
+	return 0;
+}
+
+static BOOL start_thread(Thread *thread, ZipJob *job)
+{
+	*thread = CreateThread(NULL, 0, zip_thread_main, job, 0, NULL);
+	return *thread != NULL;
+}
+
+static void join_thread(Thread thread)
+{
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+
+static DWORD num_cpus(void)
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+}
+#else
+typedef pthread_t Thread;
+
+static BOOL map_file(PCSTR path, MappedFile *file)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return FALSE;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0
+		|| !S_ISREG(st.st_mode)
+		|| (uint64_t)st.st_size > SIZE_MAX)
+	{
+		close(fd);
+		return FALSE;
+	}
+	file->data = NULL;
+	file->size = (size_t)st.st_size;
+	if (file->size == 0) {
+		close(fd);
+		return TRUE;
+	}
+
+	void *data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return FALSE;
+	}
+	file->data = (const BYTE *)data;
+	return TRUE;
+}
+
+static void unmap_file(MappedFile *file)
+{
+	if (file->data) {
+		munmap((void *)file->data, file->size);
+	}
+}
+
+static void *zip_thread_main(void *arg)
+{
+	run_zip_worker((ZipJob *)arg);
+	return NULL;
+}
+
+static BOOL start_thread(Thread *thread, ZipJob *job)
+{
+	return pthread_create(thread, NULL, zip_thread_main, job) == 0;
+}
+
+static void join_thread(Thread thread)
+{
+	pthread_join(thread, NULL);
+}
+
+static DWORD num_cpus(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (DWORD)n : 1;
+}
+#endif
+
+BOOL get_exe_icons_from_zip_memory(const void *data, size_t len, const GetExeIconZipOptions *options, GetExeIconZipResult **results, size_t *count)
+{
+	if ((!data && len > 0) || !results || !count) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return FALSE;
+	}
+	*results = NULL;
+	*count = 0;
+
+	ZipJob job;
+	memset(&job, 0, sizeof(job));
+	job.data = (const BYTE *)data;
+	job.len = len;
+	job.allowEmbeddedPNGs = options ? options->allowEmbeddedPNGs : FALSE;
+	job.maxEntrySize = options && options->maxEntrySize ? options->maxEntrySize : GET_EXE_ICON_ZIP_DEFAULT_MAX_ENTRY_SIZE;
+
+	Entry *entries = NULL;
+	GetExeIconError error = read_central_directory(job.data, len, &job.results, &entries, &job.count);
+	if (error != GET_EXE_ICON_OK) {
+		get_exe_icon_set_last_error(error);
+		return FALSE;
+	}
+	job.entries = entries;
+
+	DWORD numThreads = options && options->numThreads ? options->numThreads : num_cpus();
+	if (numThreads > job.count) {
+		numThreads = job.count > 0 ? (DWORD)job.count : 1;
+	}
+
+	// The calling thread is one of the workers. If some threads can't be
+	// started, the rest of them just do more of the work.
+	Thread *threads = NULL;
+	DWORD numStarted = 0;
+	if (numThreads > 1) {
+		threads = (Thread *)malloc(sizeof(Thread) * (numThreads - 1));
+	}
+	while (threads && numStarted < numThreads - 1 && start_thread(&threads[numStarted], &job)) {
+		numStarted ++;
+	}
+
+	run_zip_worker(&job);
+
+	for (DWORD i = 0; i < numStarted; i++) {
+		join_thread(threads[i]);
+	}
+	free(threads);
+	free(entries);
+
+	*results = job.results;
+	*count = job.count;
+	get_exe_icon_set_last_error(GET_EXE_ICON_OK);
+	return TRUE;
+}
+
+BOOL get_exe_icons_from_zip_utf8(PCSTR path, const GetExeIconZipOptions *options, GetExeIconZipResult **results, size_t *count)
+{
+	if (!path || !results || !count) {
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+		return FALSE;
+	}
+
+	MappedFile file;
+	if (!map_file(path, &file)) {
+		*results = NULL;
+		*count = 0;
+		get_exe_icon_set_last_error(GET_EXE_ICON_ERROR_OPEN_FAILED);
+		return FALSE;
+	}
+	BOOL ret = get_exe_icons_from_zip_memory(file.data, file.size, options, results, count);
+	unmap_file(&file);
+	return ret;
+}
+
+void get_exe_icon_free_zip_results(GetExeIconZipResult *results, size_t count)
+{
+	if (!results) {
+		return;
+	}
+	for (size_t i = 0; i < count; i++) {
+		free(results[i].icoBuf);
+	}
+	free(results);
+}
@@ -0,0 +1,101 @@
+// Copyright (c) 2021 Aury Snow
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef GET_EXE_ICON_ZIP_H
+#define GET_EXE_ICON_ZIP_H
+
+#include "get-exe-icon.h"
+
+// Gets the icons of the executables inside ZIP archives (including ZIP64
+// ones, and self-extracting archives with the ZIP appended to a program)
+// without unpacking them to disk. The archive's central directory is read to
+// find the .exe and .dll entries, which are then extracted in parallel, as by
+// get_exe_icons_batch(): stored entries straight from the mapped archive,
+// without copying them, and deflated ones after decompressing them into a
+// buffer of their declared size.
+
+// The largest entry that's decompressed when GetExeIconZipOptions.maxEntrySize
+// is 0.
+#define GET_EXE_ICON_ZIP_DEFAULT_MAX_ENTRY_SIZE  (256u * 1024 * 1024)
+
+// Options for get_exe_icons_from_zip_utf8(). Zero-initialize for the defaults.
+typedef struct
+{
+	// Number of threads to extract icons on, including the calling thread.
+	// 0 uses one thread per CPU.
+	DWORD numThreads;
+
+	// Same as in get_exe_icon_from_file_utf16().
+	BOOL allowEmbeddedPNGs;
+
+	// Deflated entries that are larger than this once decompressed fail
+	// with GET_EXE_ICON_ERROR_TOO_LARGE instead of being decompressed, since
+	// a few KB of deflate data can declare gigabytes. Stored entries are
+	// never copied, so they have no limit.
+	uint64_t maxEntrySize;
+} GetExeIconZipOptions;
+
+// The outcome for one .exe or .dll entry of an archive
+typedef struct
+{
+	// The entry's path in the archive, NULL-terminated, as stored: UTF-8 in
+	// most archives, but code page 437 in old ones.
+	char *name;
+
+	// The entry's size once decompressed
+	uint64_t size;
+
+	// The ICO file, or NULL if error is not GET_EXE_ICON_OK. Corrupt
+	// compressed data, or data that doesn't match the entry's CRC-32, fails
+	// with GET_EXE_ICON_ERROR_BAD_ARCHIVE; encrypted entries and compression
+	// methods other than stored and deflate with
+	// GET_EXE_ICON_ERROR_UNSUPPORTED.
+	PBYTE icoBuf;
+	DWORD bufLen;
+	GetExeIconError error;
+} GetExeIconZipResult;
+
+// Gets the primary icons of the .exe and .dll entries of a ZIP archive.
+//
+// path: UTF-8 path of the archive.
+//
+// options: May be NULL to use the defaults.
+//
+// results (OUT): An array of results, one per .exe or .dll entry in the
+//                order of the central directory, to be freed with
+//                get_exe_icon_free_zip_results().
+//
+// count (OUT): The number of results.
+//
+// Return Value: TRUE if the archive could be read, even if no icon could be
+//               extracted from it (see each result's error). If it couldn't,
+//               FALSE is returned and get_exe_icon_last_error() says why:
+//               GET_EXE_ICON_ERROR_BAD_ARCHIVE if it isn't a ZIP archive or
+//               its central directory is corrupt.
+BOOL get_exe_icons_from_zip_utf8(PCSTR path, const GetExeIconZipOptions *options, GetExeIconZipResult **results, size_t *count);
+
+// Same as get_exe_icons_from_zip_utf8(), with the archive in memory. The
+// memory must stay valid until the call returns.
+BOOL get_exe_icons_from_zip_memory(const void *data, size_t len, const GetExeIconZipOptions *options, GetExeIconZipResult **results, size_t *count);
+
+// Frees the results of get_exe_icons_from_zip_utf8(), including their ICOs.
+void get_exe_icon_free_zip_results(GetExeIconZipResult *results, size_t count);
+
+#endif
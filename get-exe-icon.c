@@ -18,10 +18,22 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
 #define WIN32_LEAN_AND_MEAN
 #include "get-exe-icon.h"
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 // Notes about the code:
 //
@@ -48,8 +60,23 @@
 // enumerated RT_GROUP_ICON resource, rebuilding the .ICO file header
 // and directory structure from it, and then copying the contents of
 // each RT_ICON resource it references verbatim into the output .ICO
-// file. Some links to information on the topic:
+// file.
+//
+// The resources are read straight out of the PE file rather than through
+// LoadLibraryExW/FindResource. The file is mapped read-only, and only the
+// DOS/PE headers, the section table, the few .rsrc directory nodes on the
+// path to each wanted resource, and the resource data itself are touched.
+// The .rsrc section is a three level tree (type -> name/ID -> language)
+// whose leaves point (by RVA) at the raw resource bytes. The tree is only
+// ever walked down from the root, exactly three levels deep, so directory
+// offsets that point back up the tree can't make it loop. The work done is
+// still bounded: each of a group's (up to 65535) images is found by a linear
+// scan of a directory of up to 131070 entries, so every directory node and
+// entry visited is charged to a budget (GetExeIconOptions.maxNodes), and the
+// ICO's size is checked against a limit before it's allocated. Some links to
+// information on the topic:
 //
+// https://docs.microsoft.com/en-us/windows/win32/debug/pe-format
 // https://stackoverflow.com/questions/3270757/in-resources-of-a-executable-file-how-does-one-find-the-default-icon
 // https://stackoverflow.com/questions/20729156/find-out-number-of-icons-in-an-icon-resource-using-win32-api
 // https://devblogs.microsoft.com/oldnewthing/?p=7083
@@ -130,311 +157,2645 @@ typedef struct
 } ResIcoDirEntry;
 #pragma pack( pop )
 
-// Finds, loads, and "locks" (gets a pointer to) a resource
-// The returned resource pointer does not need to be freed,
-// it will be released when the module is unloaded/freed.
-static LPCVOID get_resource(HMODULE module, LPCSTR name, LPCSTR type, DWORD *len)
+// Resource type IDs (the values of RT_ICON and RT_GROUP_ICON)
+#define RES_TYPE_ICON        3
+#define RES_TYPE_GROUP_ICON  14
+
+// Sizes of the fixed PE structures that are read below. Fields are read
+// out of them by byte offset (see the PE format specification) rather
+// than through structs, so that nothing depends on host alignment or
+// byte order.
+#define PE_DOS_HEADER_SIZE      64
+#define PE_FILE_HEADER_SIZE     24   // "PE\0\0" signature + IMAGE_FILE_HEADER
+#define PE_SECTION_HEADER_SIZE  40
+#define PE_RES_DIR_SIZE         16   // IMAGE_RESOURCE_DIRECTORY
+#define PE_RES_DIR_ENTRY_SIZE   8    // IMAGE_RESOURCE_DIRECTORY_ENTRY
+#define PE_RES_DATA_ENTRY_SIZE  16   // IMAGE_RESOURCE_DATA_ENTRY
+
+// High bit of a resource directory entry's name (name is a string) or
+// value (value is the offset of a subdirectory rather than a data entry).
+#define PE_RES_HIGH_BIT  0x80000000u
+
+// Reads through a GetExeIconReader are done in blocks of this size, and the
+// most recently used blocks are kept. Nearly all small reads (headers, the
+// section table and resource directories) hit the same few blocks.
+#define READ_CACHE_BLOCK_SIZE  4096
+#define READ_CACHE_BLOCKS      8
+
+typedef struct
 {
-	HRSRC resInfo = FindResourceA(module, name, type);
-	if (!resInfo) {
-		return NULL;
-	}
+	uint64_t  offset;     // File offset of the block, or UINT64_MAX if unused
+	uint32_t  len;        // Less than the block size only at end of file
+	uint32_t  lastUse;
+	BYTE      data[READ_CACHE_BLOCK_SIZE];
+} ReadCacheBlock;
 
-	DWORD dataLen = SizeofResource(module, resInfo);
-	if (dataLen == 0) {
-		return NULL;
-	}
+typedef struct
+{
+	GetExeIconReader *reader;
+	BOOL              readFailed;  // Set once the reader has returned FALSE
+	uint32_t          useCounter;
+	ReadCacheBlock    blocks[READ_CACHE_BLOCKS];
+} ReadCache;
 
-	if (len) {
-		*len = dataLen;
-	}
+// What's left of the work one call may do (see GetExeIconOptions.maxNodes).
+// Every resource directory node and entry visited costs one.
+typedef struct
+{
+	uint32_t  nodesLeft;
+	BOOL      exceeded;   // Set once a visit was refused
+} WorkBudget;
 
-	HGLOBAL res = LoadResource(module, resInfo);
-	if (!res) {
-		return NULL;
-	}
+// The state of one public call: its budget, and what it has done so far
+typedef struct
+{
+	WorkBudget       budget;
+	GetExeIconStats  stats;
+	BOOL             timed;       // Only if someone looks at the stats
+	uint64_t         phaseStart;  // When the phase in progress began
+} CallState;
+
+// A PE file image whose resources are being read. The file is either
+// entirely in memory at 'data' (usually a read-only mapping of the file on
+// disk), or 'data' is NULL and it is read on demand through 'cache'.
+typedef struct
+{
+	const BYTE *data;
+	ReadCache  *cache;
+	CallState  *call;            // The public call it's being read for
+	uint64_t    size;
+	uint64_t    sectionsOffset;  // File offset of the section table
+	uint16_t    numSections;
+	uint32_t    fileAlignment;
+	uint64_t    rsrcOffset;      // File offset of the root resource directory
+	uint32_t    rsrcSize;        // Bytes of the resource section in the file
+} PeModule;
 
-	return LockResource(res);
+static uint16_t read_le16(const BYTE *p)
+{
+	return (uint16_t)(p[0] | (p[1] << 8));
 }
 
-static BOOL is_png(const BYTE *data, DWORD len) {
-	return len >= 8
-	    && data[0] == 137
-	    && data[1] == 80
-	    && data[2] == 78
-	    && data[3] == 71
-	    && data[4] == 13
-	    && data[5] == 10
-	    && data[6] == 26
-	    && data[7] == 10;
+static uint32_t read_le32(const BYTE *p)
+{
+	return (uint32_t)p[0]
+	     | ((uint32_t)p[1] << 8)
+	     | ((uint32_t)p[2] << 16)
+	     | ((uint32_t)p[3] << 24);
 }
 
-// Takes a module and a RT_GROUP_ICON resource identifier name that it contains
-// and converts it into an .ICO file, stored in a byte buffer. This buffer could
-// be written directly to disk and opened as an .ICO. If an error occurs, the NULL
-// is returned and an error message is printed to stderr.
-// Free the returned buffer with free().
-// ICOs may use PNGs instead of bitmaps for individual image entries, however
-// not all programs support this. Use 'allowEmbeddedPNGs' to enable or disable
-// including PNGs in the ICO output.
-static PBYTE extract_ico_from_module(HMODULE module, PCSTR name, BOOL allowEmbeddedPNGs, PDWORD bufLen)
+static uint64_t read_le64(const BYTE *p)
 {
-	const IcoHeader *header = (const IcoHeader *)get_resource(module,
-		name,
-		(LPSTR)RT_GROUP_ICON,
-		NULL);
-	if (!header) {
-		return NULL;
-	}
+	return (uint64_t)read_le32(p) | ((uint64_t)read_le32(p + 4) << 32);
+}
 
-	// ICO directory entries in the module's resources (directly follows
-	// the RT_GROUP_ICON resource header)
-	const ResIcoDirEntry *resDirEntries
-		= (ResIcoDirEntry *)((const BYTE *)header + sizeof(IcoHeader));
+// Streaming MurmurHash3 (x64, 128-bit) for GetExeIconHash. Data can be fed in
+// pieces of any size; whole 16-byte blocks are mixed as they arrive and the
+// remainder is held in 'tail' until more data comes.
+typedef struct
+{
+	uint64_t  h1, h2;
+	uint64_t  totalLen;
+	BYTE      tail[16];
+	uint32_t  tailLen;
+} IcoHasher;
+
+#define HASH_C1  0x87c37b91114253d5ull
+#define HASH_C2  0x4cf5ad432745937full
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
 
-	const BYTE **imgDatas = (const BYTE **)calloc(sizeof(BYTE *), header->count);
-	DWORD *imgDataLens = (DWORD *)calloc(sizeof(DWORD), header->count);
+static uint64_t fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdull;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ull;
+	k ^= k >> 33;
+	return k;
+}
 
-	*bufLen = sizeof(IcoHeader);
-	uint16_t imgs = 0; // Num images in output ICO <= header->count
+static void hasher_init(IcoHasher *hasher)
+{
+	memset(hasher, 0, sizeof(IcoHasher));
+}
 
-	// Determine the output ICO (icoBuf) size, while throwing
-	// out undesired images (optionally PNGs)
-	for (uint16_t i = 0; i < header->count; i++) {
-		DWORD imgDataLen;
-		const BYTE *imgData = (const BYTE *)get_resource(module,
-			MAKEINTRESOURCEA(resDirEntries[i].resId),
-			(PSTR)RT_ICON,
-			&imgDataLen);
-		if (!imgData) {
-			continue;
+static void hash_block(IcoHasher *hasher, uint64_t k1, uint64_t k2)
+{
+	k1 *= HASH_C1; k1 = rotl64(k1, 31); k1 *= HASH_C2; hasher->h1 ^= k1;
+	hasher->h1 = rotl64(hasher->h1, 27); hasher->h1 += hasher->h2;
+	hasher->h1 = hasher->h1 * 5 + 0x52dce729;
+
+	k2 *= HASH_C2; k2 = rotl64(k2, 33); k2 *= HASH_C1; hasher->h2 ^= k2;
+	hasher->h2 = rotl64(hasher->h2, 31); hasher->h2 += hasher->h1;
+	hasher->h2 = hasher->h2 * 5 + 0x38495ab5;
+}
+
+// Hashes 'len' bytes at 'src' and, if 'dst' is not NULL, copies them to 'dst'
+// in the same pass, so that image data only goes through the cache once.
+static void hasher_copy_update(IcoHasher *hasher, BYTE *dst, const BYTE *src, size_t len)
+{
+	hasher->totalLen += len;
+
+	// Top up a partial block left over from the last call
+	while (hasher->tailLen > 0 && len > 0) {
+		if (dst) {
+			*dst++ = *src;
+		}
+		hasher->tail[hasher->tailLen++] = *src++;
+		len--;
+		if (hasher->tailLen == 16) {
+			hash_block(hasher, read_le64(hasher->tail), read_le64(hasher->tail + 8));
+			hasher->tailLen = 0;
 		}
+	}
 
-		if (!allowEmbeddedPNGs && is_png(imgData, imgDataLen)) {
-			continue;
+	for (; len >= 16; len -= 16, src += 16) {
+		uint64_t k1 = read_le64(src);
+		uint64_t k2 = read_le64(src + 8);
+		if (dst) {
+			memcpy(dst, src, 16);
+			dst += 16;
 		}
+		hash_block(hasher, k1, k2);
+	}
 
-		*bufLen += sizeof(DiskIcoDirEntry);
-		*bufLen += imgDataLen;
+	if (len > 0) {
+		if (dst) {
+			memcpy(dst, src, len);
+		}
+		memcpy(hasher->tail, src, len);
+		hasher->tailLen = (uint32_t)len;
+	}
+}
 
-		imgDatas[i] = imgData;
-		imgDataLens[i] = imgDataLen;
-		imgs ++;
+static void hasher_final(IcoHasher *hasher, GetExeIconHash *hash)
+{
+	uint64_t h1 = hasher->h1, h2 = hasher->h2;
+	uint64_t k1 = 0, k2 = 0;
+	const BYTE *tail = hasher->tail;
+	switch (hasher->tailLen) {
+	case 15: k2 ^= (uint64_t)tail[14] << 48; // fall through
+	case 14: k2 ^= (uint64_t)tail[13] << 40; // fall through
+	case 13: k2 ^= (uint64_t)tail[12] << 32; // fall through
+	case 12: k2 ^= (uint64_t)tail[11] << 24; // fall through
+	case 11: k2 ^= (uint64_t)tail[10] << 16; // fall through
+	case 10: k2 ^= (uint64_t)tail[9] << 8;   // fall through
+	case 9:
+		k2 ^= (uint64_t)tail[8];
+		k2 *= HASH_C2; k2 = rotl64(k2, 33); k2 *= HASH_C1; h2 ^= k2;
+		// fall through
+	case 8: k1 ^= (uint64_t)tail[7] << 56;   // fall through
+	case 7: k1 ^= (uint64_t)tail[6] << 48;   // fall through
+	case 6: k1 ^= (uint64_t)tail[5] << 40;   // fall through
+	case 5: k1 ^= (uint64_t)tail[4] << 32;   // fall through
+	case 4: k1 ^= (uint64_t)tail[3] << 24;   // fall through
+	case 3: k1 ^= (uint64_t)tail[2] << 16;   // fall through
+	case 2: k1 ^= (uint64_t)tail[1] << 8;    // fall through
+	case 1:
+		k1 ^= (uint64_t)tail[0];
+		k1 *= HASH_C1; k1 = rotl64(k1, 31); k1 *= HASH_C2; h1 ^= k1;
 	}
 
-	if (imgs == 0) {
-		free((void *)imgDatas);
-		free(imgDataLens);
-		return NULL;
+	h1 ^= hasher->totalLen;
+	h2 ^= hasher->totalLen;
+	h1 += h2;
+	h2 += h1;
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+	h1 += h2;
+	h2 += h1;
+
+	for (int i = 0; i < 8; i++) {
+		hash->bytes[i] = (BYTE)(h1 >> (8 * i));
+		hash->bytes[8 + i] = (BYTE)(h2 >> (8 * i));
 	}
+}
 
-	PBYTE icoBuf = (PBYTE)malloc(*bufLen);
-	if (!icoBuf) {
-		free((void *)imgDatas);
-		free(imgDataLens);
-		return NULL;
+// Reads directly from the reader, bypassing the cache
+static BOOL read_from_reader(ReadCache *cache, uint64_t offset, uint32_t len, void *dst)
+{
+	GetExeIconReader *reader = cache->reader;
+	if (!reader->readAt(reader->ctx, offset, len, dst)) {
+		cache->readFailed = TRUE;
+		return FALSE;
 	}
+	reader->bytesRead += len;
+	reader->numReads ++;
+	return TRUE;
+}
 
-	IcoHeader mHeader;
-	memcpy(&mHeader, header, sizeof(IcoHeader));
-	mHeader.count = imgs;
+// Reads through the block cache. The caller has checked that the range lies
+// within the file.
+static BOOL read_cached(ReadCache *cache, uint64_t offset, uint32_t len, BYTE *dst)
+{
+	while (len > 0) {
+		uint64_t blockOffset = offset - offset % READ_CACHE_BLOCK_SIZE;
 
-	// The beginning of a RT_GROUP_ICON resource is exactly equivalent to
-	// the contents of an ICO header on disk. Write it out verbatim (with
-	// the updated 'count' field).
-	memcpy(&icoBuf[0], &mHeader, sizeof(IcoHeader));
+		ReadCacheBlock *block = NULL;
+		ReadCacheBlock *lru = &cache->blocks[0];
+		for (int i = 0; i < READ_CACHE_BLOCKS; i++) {
+			if (cache->blocks[i].offset == blockOffset) {
+				block = &cache->blocks[i];
+				break;
+			}
+			if (cache->blocks[i].lastUse < lru->lastUse) {
+				lru = &cache->blocks[i];
+			}
+		}
 
-	// ICO directory entries 'on disk' (in the icoBuf)
-	DiskIcoDirEntry *diskDirEntries
-		= (DiskIcoDirEntry *)((BYTE *)icoBuf + sizeof(IcoHeader));
+		if (!block) {
+			uint64_t remaining = cache->reader->size - blockOffset;
+			block = lru;
+			block->offset = UINT64_MAX;
+			block->len = remaining < READ_CACHE_BLOCK_SIZE
+				? (uint32_t)remaining
+				: READ_CACHE_BLOCK_SIZE;
+			if (!read_from_reader(cache, blockOffset, block->len, block->data)) {
+				return FALSE;
+			}
+			block->offset = blockOffset;
+		}
+		block->lastUse = ++cache->useCounter;
 
-	uint32_t imgOffset = sizeof(IcoHeader)
-	                     + (mHeader.count * sizeof(DiskIcoDirEntry));
+		uint32_t within = (uint32_t)(offset - blockOffset);
+		if (within >= block->len) {
+			return FALSE;
+		}
+		uint32_t n = block->len - within < len ? block->len - within : len;
+		memcpy(dst, block->data + within, n);
+		dst += n;
+		offset += n;
+		len -= n;
+	}
+	return TRUE;
+}
 
-	uint16_t resIdx = 0;
-	for (uint16_t i = 0; i < mHeader.count; i++, resIdx++) {
-		// Skip over excluded entries
-		// (e.g. PNGs when allowEmbeddedPNGs is set)
-		if (imgDatas[resIdx] == NULL || imgDataLens[resIdx] == 0) {
-			i--;
-			continue;
+// Copies 'len' bytes at file offset 'offset' of the module into 'dst'.
+// Fails if any part of that range lies outside of the file.
+static BOOL read_bytes(const PeModule *module, uint64_t offset, uint32_t len, void *dst)
+{
+	if (offset > module->size || len > module->size - offset) {
+		return FALSE;
+	}
+	if (module->data) {
+		memcpy(dst, module->data + offset, len);
+		return TRUE;
+	}
+	return read_cached(module->cache, offset, len, (BYTE *)dst);
+}
+
+// Same as read_bytes() except the data is not cached. Used for image data,
+// which is only read once and would just evict directory blocks.
+static BOOL read_bytes_uncached(const PeModule *module, uint64_t offset, uint32_t len, void *dst)
+{
+	if (offset > module->size || len > module->size - offset) {
+		return FALSE;
+	}
+	if (module->data) {
+		memcpy(dst, module->data + offset, len);
+		return TRUE;
+	}
+	return read_from_reader(module->cache, offset, len, dst);
+}
+
+// Copies a run of image data into the output ICO, feeding it to 'hasher' (if
+// not NULL) on the way. From memory, copying and hashing is a single pass.
+static BOOL copy_image_run(const PeModule *module, uint64_t offset, uint32_t len, BYTE *dst, IcoHasher *hasher)
+{
+	if (!hasher) {
+		return read_bytes_uncached(module, offset, len, dst);
+	}
+	if (module->data) {
+		if (offset > module->size || len > module->size - offset) {
+			return FALSE;
 		}
+		hasher_copy_update(hasher, dst, module->data + offset, len);
+		return TRUE;
+	}
+	if (!read_bytes_uncached(module, offset, len, dst)) {
+		return FALSE;
+	}
+	hasher_copy_update(hasher, NULL, dst, len);
+	return TRUE;
+}
 
-		// ResIcoDirEntry is smaller than DiskIcoDirEntry
-		// Just copy the entire structure over, and then change
-		// the last member which is the only differing part.
-		memcpy(&diskDirEntries[i],
-		       &resDirEntries[resIdx],
-		       sizeof(ResIcoDirEntry));
-		diskDirEntries[i].offset = imgOffset;
+static void init_budget(WorkBudget *budget, DWORD maxNodes)
+{
+	budget->nodesLeft = maxNodes ? maxNodes : GET_EXE_ICON_DEFAULT_MAX_NODES;
+	budget->exceeded = FALSE;
+}
 
-		// Occasionally, the icon directory entry's size field does not
-		// match the resource's actual size. In at least once case
-		// (Postman's exe ICO, 128x128) it was because the bitmap was >
-		// 65536 bytes and it seems that even though the icon directory
-		// entry has a 32 bit size field, it can only store 16 bits (it
-		// comes out as 2088 instead of 67624). So, always use the
-		// resource size, as it is correct.
-		diskDirEntries[i].sizeBytes = imgDataLens[resIdx];
+// See get_exe_icon_set_stats_hook()
+static GetExeIconStatsHook statsHook = NULL;
+static void *statsHookCtx = NULL;
+
+void get_exe_icon_set_stats_hook(GetExeIconStatsHook hook, void *ctx)
+{
+	statsHook = hook;
+	statsHookCtx = ctx;
+}
 
-		// Copy image data from resource
-		memcpy((BYTE *)icoBuf + imgOffset, imgDatas[resIdx], imgDataLens[resIdx]);
+static uint64_t now_ns(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000000u
+	       + (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000000u / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// Starts a public call with the limits of 'options', timing its phases if
+// its stats are wanted. Its first phase is opening the file.
+static void begin_call(CallState *call, const GetExeIconOptions *options)
+{
+	init_budget(&call->budget, options->maxNodes);
+	memset(&call->stats, 0, sizeof(GetExeIconStats));
+	call->timed = options->stats || statsHook;
+	call->phaseStart = call->timed ? now_ns() : 0;
+}
 
-		imgOffset += imgDataLens[resIdx];
+// Ends the phase in progress, adding its time to 'phaseNs', and starts the
+// next one.
+static void end_phase(CallState *call, uint64_t *phaseNs)
+{
+	if (call->timed) {
+		uint64_t now = now_ns();
+		*phaseNs += now - call->phaseStart;
+		call->phaseStart = now;
 	}
+}
 
-	free((void *)imgDatas);
-	free(imgDataLens);
-	return icoBuf;
+// Reports the stats of a call that's ending with 'error' to its caller and
+// to the hook.
+static void end_call(CallState *call, const GetExeIconOptions *options, GetExeIconError error)
+{
+	call->stats.error = error;
+	if (options->stats) {
+		*options->stats = call->stats;
+	}
+	if (statsHook) {
+		statsHook(&call->stats, statsHookCtx);
+	}
 }
 
-typedef struct {
-	PBYTE icoBuf;
-	DWORD bufLen;
-	BOOL allowEmbeddedPNGs;
-} EnumIconsData;
+// Charges a visit to a resource directory node or entry to the call's
+// budget. Once it's spent, every visit fails, and so does the call (with
+// GET_EXE_ICON_ERROR_LIMIT_EXCEEDED, whatever else the failed visit caused).
+static BOOL spend_budget(const PeModule *module)
+{
+	WorkBudget *budget = &module->call->budget;
+	if (budget->nodesLeft == 0) {
+		budget->exceeded = TRUE;
+		return FALSE;
+	}
+	budget->nodesLeft --;
+	module->call->stats.nodesVisited ++;
+	return TRUE;
+}
+
+static DWORD max_output_bytes(const GetExeIconOptions *options)
+{
+	return options->maxOutputBytes ? options->maxOutputBytes : GET_EXE_ICON_DEFAULT_MAX_OUTPUT_BYTES;
+}
 
-// Callback to enumerate RT_GROUP_ICON resources.
-// Only the first one (the primary icon) is desired.
-static BOOL CALLBACK enum_group_icons_callback(
-	HMODULE  module,
-	LPCSTR   type,
-	LPSTR    name,
-	LONG_PTR lpUserdata)
+// Same as read_bytes() except 'offset' is relative to the start of the
+// resource section, and the range must lie within the resource section.
+static BOOL read_res_bytes(const PeModule *module, uint32_t offset, uint32_t len, void *dst)
 {
-	if (lpUserdata) {
-		EnumIconsData *data = (EnumIconsData *)lpUserdata;
-		data->icoBuf = extract_ico_from_module(module, name, data->allowEmbeddedPNGs, &data->bufLen);
+	if (offset > module->rsrcSize || len > module->rsrcSize - offset) {
+		return FALSE;
 	}
+	return read_bytes(module, module->rsrcOffset + offset, len, dst);
+}
+
+// Converts a relative virtual address into a file offset using the section
+// table. The number of bytes from there to the end of the section's raw data
+// is written to 'avail'. Fails if the RVA is not backed by file data.
+static BOOL rva_to_offset(const PeModule *module, uint32_t rva, uint64_t *offset, uint32_t *avail)
+{
+	for (uint16_t i = 0; i < module->numSections; i++) {
+		BYTE section[PE_SECTION_HEADER_SIZE];
+		if (!read_bytes(module,
+			module->sectionsOffset + (uint64_t)i * PE_SECTION_HEADER_SIZE,
+			PE_SECTION_HEADER_SIZE,
+			section))
+		{
+			return FALSE;
+		}
 
-	// Stop enumeration; only get the first ICO
+		uint32_t virtualAddress = read_le32(section + 12);
+		uint32_t rawSize = read_le32(section + 16);
+		uint32_t rawPointer = read_le32(section + 20);
+
+		// The loader rounds section file offsets down to 512 bytes (the
+		// smallest legal file alignment), regardless of what is written.
+		if (module->fileAlignment >= 0x200) {
+			rawPointer &= ~(uint32_t)0x1ff;
+		}
+
+		if (rva >= virtualAddress && rva - virtualAddress < rawSize) {
+			*offset = (uint64_t)rawPointer + (rva - virtualAddress);
+			*avail = rawSize - (rva - virtualAddress);
+			return TRUE;
+		}
+	}
 	return FALSE;
 }
 
-PBYTE get_exe_icon_from_file_utf16(PCWSTR path, BOOL allowEmbeddedPNGs, PDWORD bufLen)
+// Parses the DOS and PE headers and the section table of a PE32 or PE32+
+// file, and locates its resource section. The file is either in memory at
+// 'data', or read through 'cache', for the public call 'call'.
+static GetExeIconError open_pe_module(PeModule *module, const BYTE *data, ReadCache *cache, CallState *call, uint64_t size)
 {
-	if (!path || !bufLen) {
-		return NULL;
+	memset(module, 0, sizeof(PeModule));
+	module->data = data;
+	module->cache = cache;
+	module->call = call;
+	module->size = size;
+
+	BYTE dosHeader[PE_DOS_HEADER_SIZE];
+	if (!read_bytes(module, 0, sizeof(dosHeader), dosHeader)
+		|| dosHeader[0] != 'M' || dosHeader[1] != 'Z')
+	{
+		return GET_EXE_ICON_ERROR_NOT_PE;
 	}
 
-	HMODULE module = LoadLibraryExW(path,
-		NULL,
-		LOAD_LIBRARY_AS_IMAGE_RESOURCE | LOAD_LIBRARY_AS_DATAFILE);
-	if (!module) {
-		return NULL;
+	uint32_t peOffset = read_le32(dosHeader + 0x3c);
+	BYTE fileHeader[PE_FILE_HEADER_SIZE];
+	if (!read_bytes(module, peOffset, sizeof(fileHeader), fileHeader)
+		|| memcmp(fileHeader, "PE\0\0", 4) != 0)
+	{
+		return GET_EXE_ICON_ERROR_NOT_PE;
+	}
+
+	uint16_t numSections = read_le16(fileHeader + 6);
+	uint16_t optHeaderSize = read_le16(fileHeader + 20);
+	uint64_t optHeaderOffset = (uint64_t)peOffset + sizeof(fileHeader);
+
+	// The optional header differs between PE32 and PE32+ only in the
+	// width of a few fields before the data directories.
+	BYTE magic[2];
+	if (!read_bytes(module, optHeaderOffset, sizeof(magic), magic)) {
+		return GET_EXE_ICON_ERROR_NOT_PE;
 	}
 
-	EnumIconsData data;
-	data.icoBuf = NULL;
-	data.bufLen = 0;
-	data.allowEmbeddedPNGs = allowEmbeddedPNGs;
+	uint32_t numDirsOffset;
+	switch (read_le16(magic)) {
+	case 0x10b: // PE32
+		numDirsOffset = 92;
+		break;
+	case 0x20b: // PE32+
+		numDirsOffset = 108;
+		break;
+	default:
+		return GET_EXE_ICON_ERROR_NOT_PE;
+	}
 
-	if (!EnumResourceNamesA(module,
-		(LPSTR)RT_GROUP_ICON,
-		enum_group_icons_callback,
-		(LONG_PTR)&data))
+	// NumberOfRvaAndSizes, followed by the data directories, of which the
+	// resource directory is the third.
+	const uint32_t rsrcDirOffset = numDirsOffset + 4 + 2 * 8;
+	BYTE optHeader[108 + 4 + 3 * 8];
+	if (optHeaderSize < numDirsOffset + 4
+		|| !read_bytes(module, optHeaderOffset, numDirsOffset + 4, optHeader))
 	{
-		// Error 1813 is for when there are no RT_GROUP_ICONs.
-		// Error 15106 is for "User stopped resource enumeration.",
-		// which is expected behavior.
-		if (GetLastError() != 15106) {
-			return NULL;
-		}
+		return GET_EXE_ICON_ERROR_NOT_PE;
+	}
+	if (read_le32(optHeader + numDirsOffset) < 3
+		|| optHeaderSize < rsrcDirOffset + 8
+		|| !read_bytes(module,
+			optHeaderOffset + numDirsOffset + 4,
+			rsrcDirOffset + 8 - (numDirsOffset + 4),
+			optHeader + numDirsOffset + 4))
+	{
+		return GET_EXE_ICON_ERROR_NO_ICON;
 	}
 
-	FreeLibrary(module);
+	uint32_t rsrcRva = read_le32(optHeader + rsrcDirOffset);
+	uint32_t rsrcSize = read_le32(optHeader + rsrcDirOffset + 4);
+	if (rsrcRva == 0 || rsrcSize == 0) {
+		return GET_EXE_ICON_ERROR_NO_ICON;
+	}
 
-	*bufLen = data.bufLen;
-	return data.icoBuf;
-}
+	module->fileAlignment = read_le32(optHeader + 36);
+	module->sectionsOffset = optHeaderOffset + optHeaderSize;
+	module->numSections = numSections;
 
-PBYTE get_exe_icon_from_file_utf8(PCSTR path, BOOL allowEmbeddedPNGs, PDWORD bufLen)
-{
-	if (!path || !bufLen) {
-		return NULL;
+	uint32_t avail;
+	if (!rva_to_offset(module, rsrcRva, &module->rsrcOffset, &avail)) {
+		return GET_EXE_ICON_ERROR_NO_ICON;
 	}
 
-	int pathBufLen = MultiByteToWideChar(CP_UTF8, 0, path, -1, NULL, 0);
-	if (pathBufLen <= 0) {
-		return NULL;
+	// Never trust the directory size past the end of the section or file
+	module->rsrcSize = rsrcSize < avail ? rsrcSize : avail;
+	if (module->rsrcOffset > size) {
+		return GET_EXE_ICON_ERROR_NO_ICON;
+	}
+	if (module->rsrcSize > size - module->rsrcOffset) {
+		module->rsrcSize = (uint32_t)(size - module->rsrcOffset);
 	}
+	return GET_EXE_ICON_OK;
+}
 
-	PWSTR wPath = (PWSTR)malloc(sizeof(WCHAR) * pathBufLen);
-	pathBufLen = MultiByteToWideChar(CP_UTF8, 0, path, -1, wPath, pathBufLen);
-	if (pathBufLen <= 0) {
-		free(wPath);
-		return NULL;
+// Gets the number of entries in the resource directory at 'dirOffset'
+// (relative to the start of the resource section).
+static BOOL read_res_dir(const PeModule *module, uint32_t dirOffset, uint32_t *numEntries)
+{
+	BYTE dir[PE_RES_DIR_SIZE];
+	if (!spend_budget(module) || !read_res_bytes(module, dirOffset, sizeof(dir), dir)) {
+		return FALSE;
 	}
 
-	PBYTE icoBuf = get_exe_icon_from_file_utf16(wPath, allowEmbeddedPNGs, bufLen);
+	// Named entries come first, followed by entries with integer IDs
+	*numEntries = (uint32_t)read_le16(dir + 12) + read_le16(dir + 14);
+	return TRUE;
+}
 
-	free(wPath);
+// Reads the name (or ID) and value of entry 'index' of the resource directory
+// at 'dirOffset'.
+static BOOL read_res_dir_entry(const PeModule *module, uint32_t dirOffset, uint32_t index, uint32_t *name, uint32_t *value)
+{
+	uint64_t entryOffset = (uint64_t)dirOffset + PE_RES_DIR_SIZE
+	                       + (uint64_t)index * PE_RES_DIR_ENTRY_SIZE;
+	BYTE entry[PE_RES_DIR_ENTRY_SIZE];
+	if (entryOffset > UINT32_MAX
+		|| !spend_budget(module)
+		|| !read_res_bytes(module, (uint32_t)entryOffset, sizeof(entry), entry))
+	{
+		return FALSE;
+	}
 
-	return icoBuf;
+	*name = read_le32(entry);
+	*value = read_le32(entry + 4);
+	return TRUE;
 }
 
-PBYTE get_exe_icon_from_handle(HANDLE process, BOOL allowEmbeddedPNGs, PDWORD bufLen)
+// Finds the entry with integer ID 'id' in the resource directory at
+// 'dirOffset' and gets its value.
+static BOOL find_res_dir_id(const PeModule *module, uint32_t dirOffset, uint16_t id, uint32_t *value)
 {
-	if (!process || !bufLen) {
-		return NULL;
+	uint32_t numEntries;
+	if (!read_res_dir(module, dirOffset, &numEntries)) {
+		return FALSE;
 	}
 
-	WCHAR exeNameBuf[512];
-	DWORD exeNameBufLen = sizeof(exeNameBuf) / sizeof(exeNameBuf[0]);
-	BOOL ret = QueryFullProcessImageNameW(process,
-		0,
-		exeNameBuf,
-		&exeNameBufLen);
-	if (!ret) {
-		return NULL;
+	for (uint32_t i = 0; i < numEntries; i++) {
+		uint32_t name;
+		if (!read_res_dir_entry(module, dirOffset, i, &name, value)) {
+			return FALSE;
+		}
+		if (name == id) {
+			return TRUE;
+		}
 	}
+	return FALSE;
+}
 
-	return get_exe_icon_from_file_utf16(exeNameBuf, allowEmbeddedPNGs, bufLen);
+// Finds the subdirectory of resource type 'type' (e.g. RES_TYPE_ICON) in the
+// root resource directory, and writes its offset to 'dirOffset'.
+static BOOL find_res_type_dir(const PeModule *module, uint16_t type, uint32_t *dirOffset)
+{
+	uint32_t value;
+	if (!find_res_dir_id(module, 0, type, &value) || !(value & PE_RES_HIGH_BIT)) {
+		return FALSE;
+	}
+	*dirOffset = value & ~PE_RES_HIGH_BIT;
+	return TRUE;
 }
 
-PBYTE get_exe_icon_from_pid(DWORD pid, BOOL allowEmbeddedPNGs, PDWORD bufLen)
+// Location of a resource's data within the file
+typedef struct
 {
-	if (!bufLen) {
-		return NULL;
+	uint64_t  offset;
+	DWORD     len;
+} ResLocation;
+
+// Locates the data of a resource given the value of its entry in the type's
+// directory (i.e. its language directory). Like FindResource, the
+// language-neutral version is preferred, then US English, then whichever
+// language comes first.
+static BOOL locate_resource_data(const PeModule *module, uint32_t value, ResLocation *loc)
+{
+	if (!(value & PE_RES_HIGH_BIT)) {
+		return FALSE;
 	}
 
-	HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
-	if (!process) {
-		return NULL;
+	uint32_t langDirOffset = value & ~PE_RES_HIGH_BIT;
+	uint32_t dataEntryOffset;
+	if (!find_res_dir_id(module, langDirOffset, 0x0000, &dataEntryOffset)
+		&& !find_res_dir_id(module, langDirOffset, 0x0409, &dataEntryOffset))
+	{
+		uint32_t name;
+		if (!read_res_dir_entry(module, langDirOffset, 0, &name, &dataEntryOffset)) {
+			return FALSE;
+		}
 	}
 
-	PBYTE icoBuf = get_exe_icon_from_handle(process, allowEmbeddedPNGs, bufLen);
+	BYTE dataEntry[PE_RES_DATA_ENTRY_SIZE];
+	if ((dataEntryOffset & PE_RES_HIGH_BIT)
+		|| !read_res_bytes(module, dataEntryOffset, sizeof(dataEntry), dataEntry))
+	{
+		return FALSE;
+	}
 
-	CloseHandle(process);
+	// Unlike directory offsets, the data is located by RVA
+	uint32_t dataRva = read_le32(dataEntry);
+	uint32_t dataLen = read_le32(dataEntry + 4);
+	if (dataLen == 0) {
+		return FALSE;
+	}
 
-	return icoBuf;
+	uint64_t dataOffset;
+	uint32_t avail;
+	if (!rva_to_offset(module, dataRva, &dataOffset, &avail)
+		|| dataLen > avail
+		|| dataOffset > module->size
+		|| dataLen > module->size - dataOffset)
+	{
+		return FALSE;
+	}
+
+	loc->offset = dataOffset;
+	loc->len = dataLen;
+	return TRUE;
 }
 
-PBYTE get_default_exe_icon(BOOL allowEmbeddedPNGs, PDWORD bufLen)
+// Finds the first resource of the given type and locates its data. This is
+// the first in the order that EnumResourceNames would enumerate them (named
+// resources in alphabetical order, then IDs in ascending order).
+static BOOL locate_first_resource(const PeModule *module, uint16_t type, ResLocation *loc)
 {
-	if (!bufLen) {
-		return NULL;
+	uint32_t typeDirOffset, name, value;
+	if (!find_res_type_dir(module, type, &typeDirOffset)
+		|| !read_res_dir_entry(module, typeDirOffset, 0, &name, &value))
+	{
+		return FALSE;
 	}
+	return locate_resource_data(module, value, loc);
+}
 
-	HMODULE module = LoadLibraryExA("imageres.dll",
-		NULL,
-		LOAD_LIBRARY_SEARCH_SYSTEM32 | LOAD_LIBRARY_AS_IMAGE_RESOURCE | LOAD_LIBRARY_AS_DATAFILE);
+static BOOL is_png(const BYTE *data, DWORD len) {
+	return len >= 8
+	    && data[0] == 137
+	    && data[1] == 80
+	    && data[2] == 78
+	    && data[3] == 71
+	    && data[4] == 13
+	    && data[5] == 10
+	    && data[6] == 26
+	    && data[7] == 10;
+}
+
+// Icon groups with up to this many images (nearly all of them) are extracted
+// without allocating any scratch memory on the heap.
+#define INLINE_IMAGE_ENTRIES  16
 
-	if (module) {
-		PBYTE icoBuf = extract_ico_from_module(module, MAKEINTRESOURCEA(15), allowEmbeddedPNGs, bufLen);
-		FreeLibrary(module);
-		return icoBuf;
+static void free_image_locs(ResLocation *imgLocs, const ResLocation *inlineLocs)
+{
+	if (imgLocs != inlineLocs) {
+		free(imgLocs);
 	}
+}
 
-	module = LoadLibraryExA("shell32.dll",
-		NULL,
-		LOAD_LIBRARY_SEARCH_SYSTEM32 | LOAD_LIBRARY_AS_IMAGE_RESOURCE | LOAD_LIBRARY_AS_DATAFILE);
-	
-	if (module) {
-		PBYTE icoBuf = extract_ico_from_module(module, MAKEINTRESOURCEA(3), allowEmbeddedPNGs, bufLen);
-		FreeLibrary(module);
-		return icoBuf;
+// Outputs a run of image data: copies it to 'dst', or, when building a
+// layout, appends it to 'segments' as a reference into the file.
+static BOOL emit_image_run(const PeModule *module, uint64_t offset, uint32_t len, BYTE *dst, IcoHasher *hasher, GetExeIconSegment *segments, DWORD *numSegments)
+{
+	if (!segments) {
+		module->call->stats.bytesCopied += len;
+		return copy_image_run(module, offset, len, dst, hasher);
 	}
 
-	return NULL;
+	if (offset > module->size || len > module->size - offset) {
+		return FALSE;
+	}
+	GetExeIconSegment *segment = &segments[(*numSegments)++];
+	segment->data = module->data ? module->data + offset : NULL;
+	segment->offset = offset;
+	segment->len = len;
+	if (hasher) {
+		hasher_copy_update(hasher, NULL, segment->data, len);
+	}
+	return TRUE;
+}
+
+// Finds the images referenced by an icon group's 'count' directory entries,
+// writing the location of each image to be included to 'imgLocs' (at the
+// same index as its entry) and leaving the others zeroed. The number of
+// images and the space their entries and data take in the ICO are added to
+// 'imgs' and 'bufLen'.
+static GetExeIconError locate_group_images(const PeModule *module, uint64_t resDirEntriesOffset, uint16_t count, uint32_t iconDirOffset, const GetExeIconOptions *options, ResLocation *imgLocs, uint16_t *imgs, PDWORD bufLen)
+{
+	// Determine the output ICO (icoBuf) size, while throwing
+	// out undesired images (optionally PNGs)
+	for (uint16_t i = 0; i < count; i++) {
+		ResIcoDirEntry resDirEntry;
+		if (!read_bytes(module,
+			resDirEntriesOffset + i * sizeof(ResIcoDirEntry),
+			sizeof(ResIcoDirEntry),
+			&resDirEntry))
+		{
+			break;
+		}
+
+		uint32_t value;
+		ResLocation imgLoc;
+		if (!find_res_dir_id(module, iconDirOffset, resDirEntry.resId, &value)
+			|| !locate_resource_data(module, value, &imgLoc))
+		{
+			continue;
+		}
+
+		if (!options->allowEmbeddedPNGs) {
+			BYTE signature[8];
+			if (imgLoc.len >= sizeof(signature)
+				&& read_bytes_uncached(module, imgLoc.offset, sizeof(signature), signature)
+				&& is_png(signature, sizeof(signature)))
+			{
+				continue;
+			}
+		}
+
+		// Several entries may reference the same (large) image, so a small
+		// file can describe a huge ICO
+		if ((uint64_t)*bufLen + sizeof(DiskIcoDirEntry) + imgLoc.len > max_output_bytes(options)) {
+			return GET_EXE_ICON_ERROR_TOO_LARGE;
+		}
+
+		*bufLen += sizeof(DiskIcoDirEntry);
+		*bufLen += imgLoc.len;
+
+		imgLocs[i] = imgLoc;
+		(*imgs) ++;
+	}
+
+	module->call->stats.entriesSkipped += count - *imgs;
+	return *imgs > 0 ? GET_EXE_ICON_OK : GET_EXE_ICON_ERROR_NO_ICON;
+}
+
+// What size-targeted extraction knows about an image before reading it:
+// only what its directory entry says.
+typedef struct
+{
+	uint32_t  width;
+	uint32_t  height;
+	uint32_t  bitDepth;
+	uint16_t  index;      // Of its directory entry
+	uint16_t  resId;
+} ImageCandidate;
+
+// Size-targeted extraction gives up after rejecting this many candidates
+// (images that turn out to be PNGs when those aren't allowed, or that can't
+// be located), so that a malformed group can't make it quadratic.
+#define MAX_REJECTED_CANDIDATES  16
+
+static void get_image_candidate(const ResIcoDirEntry *entry, uint16_t index, ImageCandidate *candidate)
+{
+	// 0 means 256 (or more, for PNGs)
+	candidate->width = entry->width ? entry->width : 256;
+	candidate->height = entry->height ? entry->height : 256;
+
+	// Some entries (mostly PNGs) only give a color count, or nothing
+	candidate->bitDepth = entry->bitCount;
+	if (candidate->bitDepth == 0) {
+		candidate->bitDepth = 32;
+		for (uint32_t bits = 1; bits <= 8; bits++) {
+			if (entry->colorCount == (1u << bits)) {
+				candidate->bitDepth = bits;
+			}
+		}
+	}
+
+	candidate->index = index;
+	candidate->resId = entry->resId;
+}
+
+// Orders two candidates by how far their size is from the target, as for
+// GET_EXE_ICON_SIZE_NEAREST_LARGER: < 0 if 'a' is nearer, > 0 if 'b' is.
+static int compare_candidate_sizes(const ImageCandidate *a, const ImageCandidate *b, uint32_t width, uint32_t height)
+{
+	BOOL aFits = a->width >= width && a->height >= height;
+	BOOL bFits = b->width >= width && b->height >= height;
+	if (aFits != bFits) {
+		return aFits ? -1 : 1;
+	}
+
+	// The smallest image that fits, or the largest that doesn't
+	uint64_t aArea = (uint64_t)a->width * a->height;
+	uint64_t bArea = (uint64_t)b->width * b->height;
+	if (aArea != bArea) {
+		return (aFits ? aArea < bArea : aArea > bArea) ? -1 : 1;
+	}
+	return 0;
+}
+
+// Orders two candidates by how well they match the target under 'policy':
+// < 0 if 'a' is better, > 0 if 'b' is. No two distinct candidates are equal:
+// ties go to the earlier directory entry.
+static int compare_candidates(const ImageCandidate *a, const ImageCandidate *b, uint32_t width, uint32_t height, GetExeIconSizePolicy policy)
+{
+	int sizeOrder = compare_candidate_sizes(a, b, width, height);
+	if (policy != GET_EXE_ICON_SIZE_BEST_DEPTH && sizeOrder != 0) {
+		return sizeOrder;
+	}
+	if (a->bitDepth != b->bitDepth) {
+		return a->bitDepth > b->bitDepth ? -1 : 1;
+	}
+	if (sizeOrder != 0) {
+		return sizeOrder;
+	}
+	return (int)a->index - (int)b->index;
+}
+
+// Same as locate_group_images() except only the one image that best matches
+// options->targetWidth/targetHeight is located. It's chosen using only the
+// group's directory; the image itself is only read to check whether it's a
+// PNG, and only if that matters.
+static GetExeIconError locate_sized_image(const PeModule *module, uint64_t resDirEntriesOffset, uint16_t count, uint32_t iconDirOffset, const GetExeIconOptions *options, ResLocation *imgLocs, uint16_t *imgs, PDWORD bufLen)
+{
+	const uint32_t width = options->targetWidth;
+	const uint32_t height = options->targetHeight ? options->targetHeight : options->targetWidth;
+	const GetExeIconSizePolicy policy = options->sizePolicy;
+
+	// Candidates are tried from best to worst. Every candidate that's been
+	// rejected ranks above those still to be tried, so only the last one
+	// needs remembering.
+	ImageCandidate rejected;
+	memset(&rejected, 0, sizeof(rejected));
+	for (int numRejected = 0; numRejected < MAX_REJECTED_CANDIDATES; numRejected++) {
+		ImageCandidate best;
+		BOOL haveBest = FALSE;
+		for (uint16_t i = 0; i < count; i++) {
+			ResIcoDirEntry resDirEntry;
+			if (!read_bytes(module,
+				resDirEntriesOffset + i * sizeof(ResIcoDirEntry),
+				sizeof(ResIcoDirEntry),
+				&resDirEntry))
+			{
+				break;
+			}
+
+			ImageCandidate candidate;
+			get_image_candidate(&resDirEntry, i, &candidate);
+			if (policy == GET_EXE_ICON_SIZE_EXACT
+				&& (candidate.width != width || candidate.height != height))
+			{
+				continue;
+			}
+			if (numRejected > 0
+				&& compare_candidates(&candidate, &rejected, width, height, policy) <= 0)
+			{
+				continue;
+			}
+			if (!haveBest || compare_candidates(&candidate, &best, width, height, policy) < 0) {
+				best = candidate;
+				haveBest = TRUE;
+			}
+		}
+		if (!haveBest) {
+			break;
+		}
+
+		uint32_t value;
+		ResLocation imgLoc;
+		BYTE signature[8];
+		BOOL located = find_res_dir_id(module, iconDirOffset, best.resId, &value)
+		               && locate_resource_data(module, value, &imgLoc);
+		BOOL isPNG = located
+		             && (!options->allowEmbeddedPNGs || options->imageInfo)
+		             && imgLoc.len >= sizeof(signature)
+		             && read_bytes_uncached(module, imgLoc.offset, sizeof(signature), signature)
+		             && is_png(signature, sizeof(signature));
+		if (!located || (isPNG && !options->allowEmbeddedPNGs)) {
+			module->call->stats.entriesSkipped ++;
+			rejected = best;
+			continue;
+		}
+
+		uint64_t len = (uint64_t)*bufLen + imgLoc.len;
+		if (!options->rawImage) {
+			len += sizeof(DiskIcoDirEntry);
+		}
+		if (len > max_output_bytes(options)) {
+			return GET_EXE_ICON_ERROR_TOO_LARGE;
+		}
+		*bufLen = (DWORD)len;
+
+		imgLocs[best.index] = imgLoc;
+		*imgs = 1;
+
+		if (options->imageInfo) {
+			options->imageInfo->width = best.width;
+			options->imageInfo->height = best.height;
+			options->imageInfo->bitDepth = best.bitDepth;
+			options->imageInfo->isPNG = isPNG;
+		}
+		return GET_EXE_ICON_OK;
+	}
+	return GET_EXE_ICON_ERROR_NO_ICON;
+}
+
+// Writes the ICO header and the directory entries of the 'imgs' images in
+// 'imgLocs' to the start of 'icoBuf', each entry pointing at where its image
+// will go after the directory.
+static BOOL write_ico_directory(const PeModule *module, const IcoHeader *header, uint16_t imgs, uint64_t resDirEntriesOffset, const ResLocation *imgLocs, PBYTE icoBuf)
+{
+	IcoHeader mHeader = *header;
+	mHeader.count = imgs;
+
+	// The beginning of a RT_GROUP_ICON resource is exactly equivalent to
+	// the contents of an ICO header on disk. Write it out verbatim (with
+	// the updated 'count' field).
+	memcpy(&icoBuf[0], &mHeader, sizeof(IcoHeader));
+
+	// ICO directory entries 'on disk' (in the icoBuf)
+	DiskIcoDirEntry *diskDirEntries
+		= (DiskIcoDirEntry *)((BYTE *)icoBuf + sizeof(IcoHeader));
+
+	uint32_t imgOffset = sizeof(IcoHeader)
+	                     + (mHeader.count * sizeof(DiskIcoDirEntry));
+
+	uint16_t resIdx = 0;
+	for (uint16_t i = 0; i < mHeader.count; i++, resIdx++) {
+		// Skip over excluded entries
+		// (e.g. PNGs when allowEmbeddedPNGs is not set)
+		if (imgLocs[resIdx].len == 0) {
+			i--;
+			continue;
+		}
+
+		// ResIcoDirEntry is smaller than DiskIcoDirEntry
+		// Just copy the entire structure over, and then change
+		// the last member which is the only differing part.
+		if (!read_bytes(module,
+			resDirEntriesOffset + resIdx * sizeof(ResIcoDirEntry),
+			sizeof(ResIcoDirEntry),
+			&diskDirEntries[i]))
+		{
+			return FALSE;
+		}
+		diskDirEntries[i].offset = imgOffset;
+
+		// Occasionally, the icon directory entry's size field does not
+		// match the resource's actual size. In at least once case
+		// (Postman's exe ICO, 128x128) it was because the bitmap was >
+		// 65536 bytes and it seems that even though the icon directory
+		// entry has a 32 bit size field, it can only store 16 bits (it
+		// comes out as 2088 instead of 67624). So, always use the
+		// resource size, as it is correct.
+		diskDirEntries[i].sizeBytes = imgLocs[resIdx].len;
+
+		imgOffset += imgLocs[resIdx].len;
+	}
+	return TRUE;
+}
+
+// Reads the header of the RT_GROUP_ICON resource at 'group', and gets the
+// number of directory entries that follow it. Entries past the end of the
+// resource are never counted, whatever the header claims.
+static BOOL read_group_header(const PeModule *module, const ResLocation *group, IcoHeader *header, uint16_t *count)
+{
+	if (group->len < sizeof(IcoHeader)
+		|| !read_bytes(module, group->offset, sizeof(IcoHeader), header))
+	{
+		return FALSE;
+	}
+
+	*count = header->count;
+	if (*count > (group->len - sizeof(IcoHeader)) / sizeof(ResIcoDirEntry)) {
+		*count = (uint16_t)((group->len - sizeof(IcoHeader)) / sizeof(ResIcoDirEntry));
+	}
+	return TRUE;
+}
+
+// Where extract_ico_from_module() puts the ICO it builds:
+// - If 'icoBuf' is not NULL, a buffer is allocated for it and returned there.
+//   Free it with free().
+// - If 'layout' is not NULL, only the header and directory are built, and
+//   the images are described as segments of the file (see GetExeIconLayout).
+// - Otherwise it's written to the caller's buffer 'dst' of 'dstSize' bytes.
+typedef struct
+{
+	PBYTE             *icoBuf;
+	GetExeIconLayout  *layout;
+	PBYTE              dst;
+	DWORD              dstSize;
+} IcoOutput;
+
+// Takes a module and the location of a RT_GROUP_ICON resource that it contains
+// and converts it into an .ICO file, stored in a byte buffer. This buffer could
+// be written directly to disk and opened as an .ICO. If an error occurs, the
+// buffer is set to NULL and the error is returned. See IcoOutput for where the
+// buffer goes; if it's the caller's buffer and the ICO doesn't fit,
+// GET_EXE_ICON_ERROR_BUFFER_TOO_SMALL is returned. Either way, the ICO's size
+// is written to 'bufLen'.
+// ICOs may use PNGs instead of bitmaps for individual image entries, however
+// not all programs support this. Use options->allowEmbeddedPNGs to enable or
+// disable including PNGs in the ICO output.
+static GetExeIconError extract_ico_from_module(const PeModule *module, const ResLocation *group, const GetExeIconOptions *options, const IcoOutput *out, PDWORD bufLen)
+{
+	if (out->icoBuf) {
+		*out->icoBuf = NULL;
+	}
+
+	// A layout copies nothing, so its images can only be hashed where they
+	// lie in memory
+	if (options->hash && out->layout && !module->data) {
+		return GET_EXE_ICON_ERROR_INVALID_ARGUMENT;
+	}
+
+	CallState *call = module->call;
+	IcoHeader header;
+	uint16_t count;
+	if (!read_group_header(module, group, &header, &count) || count == 0) {
+		end_phase(call, &call->stats.locateNs);
+		return GET_EXE_ICON_ERROR_NO_ICON;
+	}
+	call->stats.entriesSeen = count;
+
+	// ICO directory entries in the module's resources (directly follows
+	// the RT_GROUP_ICON resource header)
+	const uint64_t resDirEntriesOffset = group->offset + sizeof(IcoHeader);
+
+	ResLocation inlineLocs[INLINE_IMAGE_ENTRIES];
+	ResLocation *imgLocs = inlineLocs;
+	if (count > INLINE_IMAGE_ENTRIES) {
+		imgLocs = (ResLocation *)calloc(sizeof(ResLocation), count);
+		call->stats.allocations ++;
+		if (!imgLocs) {
+			end_phase(call, &call->stats.locateNs);
+			return GET_EXE_ICON_ERROR_OUT_OF_MEMORY;
+		}
+	} else {
+		memset(inlineLocs, 0, sizeof(ResLocation) * count);
+	}
+
+	uint32_t iconDirOffset;
+	BOOL haveIcons = find_res_type_dir(module, RES_TYPE_ICON, &iconDirOffset);
+
+	// A raw image is output by itself, without an ICO header and directory
+	const BOOL raw = options->targetWidth > 0 && options->rawImage;
+
+	*bufLen = raw ? 0 : sizeof(IcoHeader);
+	uint16_t imgs = 0; // Num images in output ICO <= header.count
+
+	GetExeIconError error = GET_EXE_ICON_ERROR_NO_ICON;
+	if (haveIcons && options->targetWidth > 0) {
+		error = locate_sized_image(module, resDirEntriesOffset, count, iconDirOffset, options, imgLocs, &imgs, bufLen);
+	} else if (haveIcons) {
+		error = locate_group_images(module, resDirEntriesOffset, count, iconDirOffset, options, imgLocs, &imgs, bufLen);
+	}
+	if (call->budget.exceeded) {
+		// Don't return an ICO missing the images that weren't looked up
+		error = GET_EXE_ICON_ERROR_LIMIT_EXCEEDED;
+	}
+	end_phase(call, &call->stats.locateNs);
+	if (error != GET_EXE_ICON_OK) {
+		free_image_locs(imgLocs, inlineLocs);
+		return error;
+	}
+
+	const uint32_t dataOffset = raw ? 0 : sizeof(IcoHeader) + (imgs * sizeof(DiskIcoDirEntry));
+	BOOL allocated = out->icoBuf || out->layout;
+
+	PBYTE icoBuf = out->dst;
+	GetExeIconSegment *segments = NULL;
+	DWORD numSegments = 0;
+	if (out->layout) {
+		// One allocation holds the segments (at most one per image)
+		// followed by the header and directory
+		segments = (GetExeIconSegment *)malloc(sizeof(GetExeIconSegment) * imgs + dataOffset);
+		call->stats.allocations ++;
+		if (!segments) {
+			free_image_locs(imgLocs, inlineLocs);
+			return GET_EXE_ICON_ERROR_OUT_OF_MEMORY;
+		}
+		icoBuf = (PBYTE)(segments + imgs);
+	} else if (out->icoBuf) {
+		icoBuf = (PBYTE)malloc(*bufLen);
+		call->stats.allocations ++;
+		if (!icoBuf) {
+			free_image_locs(imgLocs, inlineLocs);
+			return GET_EXE_ICON_ERROR_OUT_OF_MEMORY;
+		}
+	} else if (*bufLen > out->dstSize || !icoBuf) {
+		free_image_locs(imgLocs, inlineLocs);
+		return GET_EXE_ICON_ERROR_BUFFER_TOO_SMALL;
+	}
+
+	if (!raw && !write_ico_directory(module, &header, imgs, resDirEntriesOffset, imgLocs, icoBuf)) {
+		if (allocated) {
+			free(segments ? (void *)segments : icoBuf);
+		}
+		free_image_locs(imgLocs, inlineLocs);
+		return GET_EXE_ICON_ERROR_READ_FAILED;
+	}
+
+	// The header and directory precede all image data in the ICO, so they
+	// are hashed first, and the images are hashed as they're copied.
+	IcoHasher hasher;
+	IcoHasher *pHasher = NULL;
+	if (options->hash) {
+		pHasher = &hasher;
+		hasher_init(pHasher);
+		hasher_copy_update(pHasher, NULL, icoBuf, dataOffset);
+	}
+
+	// Copy image data from resources. Images are copied in runs: images
+	// which directly follow each other in the file (as they usually do)
+	// are read all at once.
+	uint64_t runFileOffset = 0;
+	uint32_t runImgOffset = 0;
+	uint32_t runLen = 0;
+
+	uint32_t imgOffset = dataOffset;
+	for (uint16_t resIdx = 0; resIdx < count; resIdx++) {
+		if (imgLocs[resIdx].len == 0) {
+			continue;
+		}
+
+		if (runLen > 0 && runFileOffset + runLen == imgLocs[resIdx].offset) {
+			runLen += imgLocs[resIdx].len;
+		} else {
+			if (runLen > 0 && !emit_image_run(module, runFileOffset, runLen, icoBuf + runImgOffset, pHasher, segments, &numSegments)) {
+				if (allocated) {
+					free(segments ? (void *)segments : icoBuf);
+				}
+				free_image_locs(imgLocs, inlineLocs);
+				return GET_EXE_ICON_ERROR_READ_FAILED;
+			}
+			runFileOffset = imgLocs[resIdx].offset;
+			runImgOffset = imgOffset;
+			runLen = imgLocs[resIdx].len;
+		}
+
+		imgOffset += imgLocs[resIdx].len;
+	}
+
+	free_image_locs(imgLocs, inlineLocs);
+
+	if (!emit_image_run(module, runFileOffset, runLen, icoBuf + runImgOffset, pHasher, segments, &numSegments)) {
+		if (allocated) {
+			free(segments ? (void *)segments : icoBuf);
+		}
+		return GET_EXE_ICON_ERROR_READ_FAILED;
+	}
+
+	if (pHasher) {
+		hasher_final(pHasher, options->hash);
+	}
+
+	if (out->layout) {
+		out->layout->header = icoBuf;
+		out->layout->headerLen = dataOffset;
+		out->layout->segments = segments;
+		out->layout->numSegments = numSegments;
+		out->layout->totalLen = *bufLen;
+	} else if (out->icoBuf) {
+		*out->icoBuf = icoBuf;
+	}
+	return GET_EXE_ICON_OK;
+}
+
+// Extracts the primary icon (the first RT_GROUP_ICON) from a PE file, which
+// is either in memory at 'data' or read through 'cache', for the public call
+// 'call', which was begun by the caller. The ICO is returned the same way as
+// by extract_ico_from_module().
+static GetExeIconError extract_primary_icon(const BYTE *data, ReadCache *cache, uint64_t size, const GetExeIconOptions *options, CallState *call, const IcoOutput *out, PDWORD bufLen)
+{
+	if (out->icoBuf) {
+		*out->icoBuf = NULL;
+	}
+	*bufLen = 0;
+
+	PeModule module;
+	GetExeIconError error = open_pe_module(&module, data, cache, call, size);
+	end_phase(call, &call->stats.openNs);
+	if (error == GET_EXE_ICON_OK) {
+		ResLocation group;
+		BOOL located = locate_first_resource(&module, RES_TYPE_GROUP_ICON, &group);
+		end_phase(call, &call->stats.enumerateNs);
+		if (located) {
+			error = extract_ico_from_module(&module, &group, options, out, bufLen);
+			end_phase(call, &call->stats.assembleNs);
+		} else {
+			error = GET_EXE_ICON_ERROR_NO_ICON;
+		}
+	}
+
+	// The required size is the point of a BUFFER_TOO_SMALL error
+	if (error != GET_EXE_ICON_OK && error != GET_EXE_ICON_ERROR_BUFFER_TOO_SMALL) {
+		*bufLen = 0;
+
+		// Whatever parse error a refused lookup or a failed read caused,
+		// report that instead
+		if (call->budget.exceeded) {
+			error = GET_EXE_ICON_ERROR_LIMIT_EXCEEDED;
+		}
+		if (cache && cache->readFailed) {
+			error = GET_EXE_ICON_ERROR_READ_FAILED;
+		}
+	}
+	return error;
+}
+
+// A file mapped read-only into memory
+typedef struct {
+	const BYTE *data;
+	size_t size;
+} MappedFile;
+
+#ifdef _WIN32
+// Unless the application is marked as long path aware, paths of MAX_PATH
+// characters or more can only be opened with the \\?\ prefix, such as the
+// ones QueryFullProcessImageNameW() returns for executables deep in a
+// directory tree. Returns the prefixed path, to be freed with free(3), or
+// NULL if 'path' doesn't need it (or isn't absolute, since the prefix turns
+// off the expansion of relative paths).
+static PWSTR to_long_path(PCWSTR path)
+{
+	size_t len = wcslen(path);
+	if (len < MAX_PATH || wcsncmp(path, L"\\\\?\\", 4) == 0) {
+		return NULL;
+	}
+
+	PCWSTR prefix;
+	if (((path[0] >= L'A' && path[0] <= L'Z') || (path[0] >= L'a' && path[0] <= L'z'))
+		&& path[1] == L':' && (path[2] == L'\\' || path[2] == L'/'))
+	{
+		prefix = L"\\\\?\\";
+	} else if ((path[0] == L'\\' || path[0] == L'/') && (path[1] == L'\\' || path[1] == L'/')) {
+		// \\server\share becomes \\?\UNC\server\share
+		prefix = L"\\\\?\\UNC";
+		path ++;
+		len --;
+	} else {
+		return NULL;
+	}
+
+	size_t prefixLen = wcslen(prefix);
+	PWSTR longPath = (PWSTR)malloc(sizeof(WCHAR) * (prefixLen + len + 1));
+	if (!longPath) {
+		return NULL;
+	}
+	memcpy(longPath, prefix, sizeof(WCHAR) * prefixLen);
+	for (size_t i = 0; i <= len; i++) {
+		// Nothing is normalized after the prefix, not even slashes
+		longPath[prefixLen + i] = path[i] == L'/' ? L'\\' : path[i];
+	}
+	return longPath;
+}
+
+static BOOL map_file(PCWSTR path, MappedFile *file)
+{
+	PWSTR longPath = to_long_path(path);
+	HANDLE handle = CreateFileW(longPath ? longPath : path,
+		GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS,
+		NULL);
+	free(longPath);
+	if (handle == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(handle, &size)
+		|| size.QuadPart <= 0
+		|| (uint64_t)size.QuadPart > SIZE_MAX)
+	{
+		CloseHandle(handle);
+		return FALSE;
+	}
+
+	HANDLE mapping = CreateFileMappingW(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(handle);
+	if (!mapping) {
+		return FALSE;
+	}
+
+	// The view keeps the mapping object alive
+	file->data = (const BYTE *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	file->size = (size_t)size.QuadPart;
+	CloseHandle(mapping);
+	return file->data != NULL;
+}
+
+static void unmap_file(MappedFile *file)
+{
+	UnmapViewOfFile(file->data);
+}
+#else
+static BOOL map_file(PCSTR path, MappedFile *file)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return FALSE;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0
+		|| !S_ISREG(st.st_mode)
+		|| st.st_size <= 0
+		|| (uint64_t)st.st_size > SIZE_MAX)
+	{
+		close(fd);
+		return FALSE;
+	}
+
+	void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return FALSE;
+	}
+
+	// Only a few scattered pages of the file are needed, so don't let
+	// readahead fault in the rest of it.
+	posix_madvise(data, (size_t)st.st_size, POSIX_MADV_RANDOM);
+
+	file->data = (const BYTE *)data;
+	file->size = (size_t)st.st_size;
+	return TRUE;
+}
+
+static void unmap_file(MappedFile *file)
+{
+	munmap((void *)file->data, file->size);
+}
+
+// Converts a NULL-terminated UTF-16 string to a newly allocated UTF-8 string.
+// Returns NULL if the string is not valid UTF-16.
+static char *utf16_to_utf8(PCWSTR str)
+{
+	size_t len = 0;
+	while (str[len]) {
+		len++;
+	}
+
+	// At most 3 UTF-8 bytes per UTF-16 code unit
+	char *out = (char *)malloc(len * 3 + 1);
+	if (!out) {
+		return NULL;
+	}
+
+	char *o = out;
+	for (size_t i = 0; i < len; i++) {
+		uint32_t c = str[i];
+		if (c >= 0xd800 && c <= 0xdbff) {
+			if (i + 1 >= len || str[i + 1] < 0xdc00 || str[i + 1] > 0xdfff) {
+				free(out);
+				return NULL;
+			}
+			c = 0x10000 + ((c - 0xd800) << 10) + (str[++i] - 0xdc00);
+		} else if (c >= 0xdc00 && c <= 0xdfff) {
+			free(out);
+			return NULL;
+		}
+
+		if (c < 0x80) {
+			*o++ = (char)c;
+		} else if (c < 0x800) {
+			*o++ = (char)(0xc0 | (c >> 6));
+			*o++ = (char)(0x80 | (c & 0x3f));
+		} else if (c < 0x10000) {
+			*o++ = (char)(0xe0 | (c >> 12));
+			*o++ = (char)(0x80 | ((c >> 6) & 0x3f));
+			*o++ = (char)(0x80 | (c & 0x3f));
+		} else {
+			*o++ = (char)(0xf0 | (c >> 18));
+			*o++ = (char)(0x80 | ((c >> 12) & 0x3f));
+			*o++ = (char)(0x80 | ((c >> 6) & 0x3f));
+			*o++ = (char)(0x80 | (c & 0x3f));
+		}
+	}
+	*o = '\0';
+	return out;
+}
+#endif
+
+// The outcome of the last public call on each thread, for
+// get_exe_icon_last_error()
+#ifdef _MSC_VER
+static __declspec(thread) GetExeIconError lastError = GET_EXE_ICON_OK;
+#else
+static _Thread_local GetExeIconError lastError = GET_EXE_ICON_OK;
+#endif
+
+// Records the outcome of a public call and passes its return value through
+static PBYTE set_last_error(GetExeIconError error, PBYTE icoBuf)
+{
+	lastError = error;
+	return icoBuf;
+}
+
+GetExeIconError get_exe_icon_last_error(void)
+{
+	return lastError;
+}
+
+void get_exe_icon_set_last_error(GetExeIconError error)
+{
+	lastError = error;
+}
+
+// Same as set_last_error() for public calls that return a BOOL
+static BOOL set_last_error_bool(GetExeIconError error)
+{
+	lastError = error;
+	return error == GET_EXE_ICON_OK;
+}
+
+// Maps the file at 'path' and extracts its primary icon, which is returned
+// the same way as by extract_ico_from_module().
+#ifdef _WIN32
+static GetExeIconError extract_from_native_path(PCWSTR path, const GetExeIconOptions *options, const IcoOutput *out, PDWORD bufLen)
+#else
+static GetExeIconError extract_from_native_path(PCSTR path, const GetExeIconOptions *options, const IcoOutput *out, PDWORD bufLen)
+#endif
+{
+	CallState call;
+	begin_call(&call, options);
+
+	MappedFile file;
+	if (!map_file(path, &file)) {
+		end_call(&call, options, GET_EXE_ICON_ERROR_OPEN_FAILED);
+		return GET_EXE_ICON_ERROR_OPEN_FAILED;
+	}
+	call.stats.bytesMapped = file.size;
+
+	GetExeIconError error = extract_primary_icon(file.data, NULL, file.size, options, &call, out, bufLen);
+
+	// Don't leave the segments pointing into the mapping
+	if (error == GET_EXE_ICON_OK && out->layout) {
+		for (DWORD i = 0; i < out->layout->numSegments; i++) {
+			out->layout->segments[i].data = NULL;
+		}
+	}
+
+	unmap_file(&file);
+	end_call(&call, options, error);
+	return error;
+}
+
+// Extracts the primary icon of the PE file in memory at 'data', which is
+// returned the same way as by extract_ico_from_module().
+static GetExeIconError extract_from_memory(const void *data, size_t len, const GetExeIconOptions *options, const IcoOutput *out, PDWORD bufLen)
+{
+	CallState call;
+	begin_call(&call, options);
+	GetExeIconError error = extract_primary_icon((const BYTE *)data, NULL, len, options, &call, out, bufLen);
+	end_call(&call, options, error);
+	return error;
+}
+
+#ifdef _WIN32
+static PBYTE get_exe_icon_from_native_path(PCWSTR path, const GetExeIconOptions *options, PDWORD bufLen)
+#else
+static PBYTE get_exe_icon_from_native_path(PCSTR path, const GetExeIconOptions *options, PDWORD bufLen)
+#endif
+{
+	PBYTE icoBuf = NULL;
+	IcoOutput out = { &icoBuf, NULL, NULL, 0 };
+	GetExeIconError error = extract_from_native_path(path, options, &out, bufLen);
+	return set_last_error(error, icoBuf);
+}
+
+PBYTE get_exe_icon_from_file_utf16_ex(PCWSTR path, const GetExeIconOptions *options, PDWORD bufLen)
+{
+	if (!path || !options || !bufLen) {
+		return set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT, NULL);
+	}
+
+#ifdef _WIN32
+	return get_exe_icon_from_native_path(path, options, bufLen);
+#else
+	char *u8Path = utf16_to_utf8(path);
+	if (!u8Path) {
+		return set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT, NULL);
+	}
+
+	PBYTE icoBuf = get_exe_icon_from_native_path(u8Path, options, bufLen);
+
+	free(u8Path);
+
+	return icoBuf;
+#endif
+}
+
+PBYTE get_exe_icon_from_file_utf8_ex(PCSTR path, const GetExeIconOptions *options, PDWORD bufLen)
+{
+	if (!path || !options || !bufLen) {
+		return set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT, NULL);
+	}
+
+#ifdef _WIN32
+	int pathBufLen = MultiByteToWideChar(CP_UTF8, 0, path, -1, NULL, 0);
+	if (pathBufLen <= 0) {
+		return set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT, NULL);
+	}
+
+	PWSTR wPath = (PWSTR)malloc(sizeof(WCHAR) * pathBufLen);
+	if (!wPath) {
+		return set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY, NULL);
+	}
+	pathBufLen = MultiByteToWideChar(CP_UTF8, 0, path, -1, wPath, pathBufLen);
+	if (pathBufLen <= 0) {
+		free(wPath);
+		return set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT, NULL);
+	}
+
+	PBYTE icoBuf = get_exe_icon_from_file_utf16_ex(wPath, options, bufLen);
+
+	free(wPath);
+
+	return icoBuf;
+#else
+	return get_exe_icon_from_native_path(path, options, bufLen);
+#endif
+}
+
+PBYTE get_exe_icon_from_memory_ex(const void *data, size_t len, const GetExeIconOptions *options, PDWORD bufLen)
+{
+	if (!data || !options || !bufLen) {
+		return set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT, NULL);
+	}
+
+	PBYTE icoBuf;
+	IcoOutput out = { &icoBuf, NULL, NULL, 0 };
+	GetExeIconError error = extract_from_memory(data, len, options, &out, bufLen);
+	return set_last_error(error, icoBuf);
+}
+
+// Allocates an empty cache of blocks read through 'reader'. Free it with
+// free().
+static ReadCache *new_read_cache(GetExeIconReader *reader)
+{
+	ReadCache *cache = (ReadCache *)malloc(sizeof(ReadCache));
+	if (!cache) {
+		return NULL;
+	}
+	cache->reader = reader;
+	cache->readFailed = FALSE;
+	cache->useCounter = 0;
+	for (int i = 0; i < READ_CACHE_BLOCKS; i++) {
+		cache->blocks[i].offset = UINT64_MAX;
+		cache->blocks[i].lastUse = 0;
+	}
+	return cache;
+}
+
+// Extracts the primary icon of the PE file read through 'reader', which is
+// returned the same way as by extract_ico_from_module().
+static GetExeIconError extract_from_reader(GetExeIconReader *reader, const GetExeIconOptions *options, const IcoOutput *out, PDWORD bufLen)
+{
+	reader->bytesRead = 0;
+	reader->numReads = 0;
+
+	CallState call;
+	begin_call(&call, options);
+
+	ReadCache *cache = new_read_cache(reader);
+	call.stats.allocations ++;
+	if (!cache) {
+		end_call(&call, options, GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+		return GET_EXE_ICON_ERROR_OUT_OF_MEMORY;
+	}
+
+	GetExeIconError error = extract_primary_icon(NULL, cache, reader->size, options, &call, out, bufLen);
+
+	free(cache);
+	call.stats.bytesRead = reader->bytesRead;
+	call.stats.numReads = reader->numReads;
+	end_call(&call, options, error);
+	return error;
+}
+
+PBYTE get_exe_icon_from_reader_ex(GetExeIconReader *reader, const GetExeIconOptions *options, PDWORD bufLen)
+{
+	if (!reader || !reader->readAt || !options || !bufLen) {
+		return set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT, NULL);
+	}
+
+	PBYTE icoBuf = NULL;
+	IcoOutput out = { &icoBuf, NULL, NULL, 0 };
+	GetExeIconError error = extract_from_reader(reader, options, &out, bufLen);
+	return set_last_error(error, icoBuf);
+}
+
+PBYTE get_exe_icon_from_file_utf16(PCWSTR path, BOOL allowEmbeddedPNGs, PDWORD bufLen)
+{
+	GetExeIconOptions options = { allowEmbeddedPNGs, NULL };
+	return get_exe_icon_from_file_utf16_ex(path, &options, bufLen);
+}
+
+PBYTE get_exe_icon_from_file_utf8(PCSTR path, BOOL allowEmbeddedPNGs, PDWORD bufLen)
+{
+	GetExeIconOptions options = { allowEmbeddedPNGs, NULL };
+	return get_exe_icon_from_file_utf8_ex(path, &options, bufLen);
+}
+
+PBYTE get_exe_icon_from_memory(const void *data, size_t len, BOOL allowEmbeddedPNGs, PDWORD bufLen)
+{
+	GetExeIconOptions options = { allowEmbeddedPNGs, NULL };
+	return get_exe_icon_from_memory_ex(data, len, &options, bufLen);
+}
+
+PBYTE get_exe_icon_from_reader(GetExeIconReader *reader, BOOL allowEmbeddedPNGs, PDWORD bufLen)
+{
+	GetExeIconOptions options = { allowEmbeddedPNGs, NULL };
+	return get_exe_icon_from_reader_ex(reader, &options, bufLen);
+}
+
+BOOL get_exe_icon_from_file_utf16_into(PCWSTR path, const GetExeIconOptions *options, PBYTE buf, DWORD bufSize, PDWORD bufLen)
+{
+	if (!path || !options || !bufLen) {
+		return set_last_error_bool(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+	}
+
+	IcoOutput out = { NULL, NULL, buf, bufSize };
+
+#ifdef _WIN32
+	return set_last_error_bool(extract_from_native_path(path, options, &out, bufLen));
+#else
+	char *u8Path = utf16_to_utf8(path);
+	if (!u8Path) {
+		return set_last_error_bool(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+	}
+
+	GetExeIconError error = extract_from_native_path(u8Path, options, &out, bufLen);
+
+	free(u8Path);
+
+	return set_last_error_bool(error);
+#endif
+}
+
+BOOL get_exe_icon_from_file_utf8_into(PCSTR path, const GetExeIconOptions *options, PBYTE buf, DWORD bufSize, PDWORD bufLen)
+{
+	if (!path || !options || !bufLen) {
+		return set_last_error_bool(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+	}
+
+	IcoOutput out = { NULL, NULL, buf, bufSize };
+
+#ifdef _WIN32
+	int pathBufLen = MultiByteToWideChar(CP_UTF8, 0, path, -1, NULL, 0);
+	if (pathBufLen <= 0) {
+		return set_last_error_bool(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+	}
+
+	// Only unusually long paths need converting on the heap
+	WCHAR stackPath[MAX_PATH];
+	PWSTR wPath = stackPath;
+	if (pathBufLen > MAX_PATH) {
+		wPath = (PWSTR)malloc(sizeof(WCHAR) * pathBufLen);
+		if (!wPath) {
+			return set_last_error_bool(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+		}
+	}
+
+	GetExeIconError error = GET_EXE_ICON_ERROR_INVALID_ARGUMENT;
+	if (MultiByteToWideChar(CP_UTF8, 0, path, -1, wPath, pathBufLen) > 0) {
+		error = extract_from_native_path(wPath, options, &out, bufLen);
+	}
+
+	if (wPath != stackPath) {
+		free(wPath);
+	}
+
+	return set_last_error_bool(error);
+#else
+	return set_last_error_bool(extract_from_native_path(path, options, &out, bufLen));
+#endif
+}
+
+BOOL get_exe_icon_from_memory_into(const void *data, size_t len, const GetExeIconOptions *options, PBYTE buf, DWORD bufSize, PDWORD bufLen)
+{
+	if (!data || !options || !bufLen) {
+		return set_last_error_bool(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+	}
+
+	IcoOutput out = { NULL, NULL, buf, bufSize };
+	return set_last_error_bool(extract_from_memory(data, len, options, &out, bufLen));
+}
+
+BOOL get_exe_icon_layout_from_file_utf16(PCWSTR path, const GetExeIconOptions *options, GetExeIconLayout *layout)
+{
+	if (!path || !options || !layout) {
+		return set_last_error_bool(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+	}
+
+	DWORD bufLen;
+	IcoOutput out = { NULL, layout, NULL, 0 };
+
+#ifdef _WIN32
+	return set_last_error_bool(extract_from_native_path(path, options, &out, &bufLen));
+#else
+	char *u8Path = utf16_to_utf8(path);
+	if (!u8Path) {
+		return set_last_error_bool(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+	}
+
+	GetExeIconError error = extract_from_native_path(u8Path, options, &out, &bufLen);
+
+	free(u8Path);
+
+	return set_last_error_bool(error);
+#endif
+}
+
+BOOL get_exe_icon_layout_from_file_utf8(PCSTR path, const GetExeIconOptions *options, GetExeIconLayout *layout)
+{
+	if (!path || !options || !layout) {
+		return set_last_error_bool(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+	}
+
+#ifdef _WIN32
+	int pathBufLen = MultiByteToWideChar(CP_UTF8, 0, path, -1, NULL, 0);
+	if (pathBufLen <= 0) {
+		return set_last_error_bool(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+	}
+
+	PWSTR wPath = (PWSTR)malloc(sizeof(WCHAR) * pathBufLen);
+	if (!wPath) {
+		return set_last_error_bool(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+	}
+	pathBufLen = MultiByteToWideChar(CP_UTF8, 0, path, -1, wPath, pathBufLen);
+	if (pathBufLen <= 0) {
+		free(wPath);
+		return set_last_error_bool(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+	}
+
+	BOOL ret = get_exe_icon_layout_from_file_utf16(wPath, options, layout);
+
+	free(wPath);
+
+	return ret;
+#else
+	DWORD bufLen;
+	IcoOutput out = { NULL, layout, NULL, 0 };
+	return set_last_error_bool(extract_from_native_path(path, options, &out, &bufLen));
+#endif
+}
+
+BOOL get_exe_icon_layout_from_memory(const void *data, size_t len, const GetExeIconOptions *options, GetExeIconLayout *layout)
+{
+	if (!data || !options || !layout) {
+		return set_last_error_bool(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+	}
+
+	DWORD bufLen;
+	IcoOutput out = { NULL, layout, NULL, 0 };
+	return set_last_error_bool(extract_from_memory(data, len, options, &out, &bufLen));
+}
+
+BOOL get_exe_icon_layout_from_reader(GetExeIconReader *reader, const GetExeIconOptions *options, GetExeIconLayout *layout)
+{
+	if (!reader || !reader->readAt || !options || !layout) {
+		return set_last_error_bool(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+	}
+
+	DWORD bufLen;
+	IcoOutput out = { NULL, layout, NULL, 0 };
+	return set_last_error_bool(extract_from_reader(reader, options, &out, &bufLen));
+}
+
+void get_exe_icon_layout_free(GetExeIconLayout *layout)
+{
+	if (!layout) {
+		return;
+	}
+
+	// The header shares the segments' allocation
+	free(layout->segments);
+	memset(layout, 0, sizeof(GetExeIconLayout));
+}
+
+void get_exe_icon_hash(const void *data, size_t len, GetExeIconHash *hash)
+{
+	IcoHasher hasher;
+	hasher_init(&hasher);
+	hasher_copy_update(&hasher, NULL, (const BYTE *)data, len);
+	hasher_final(&hasher, hash);
+}
+
+// An opened PE file, for the get_exe_icon_module_* functions
+struct GetExeIconModule
+{
+	PeModule     pe;
+	MappedFile   file;            // If opened from a path, otherwise data is NULL
+	ReadCache   *cache;           // If opened from a reader
+	uint32_t     groupDirOffset;  // Of the RT_GROUP_ICON directory
+	uint32_t     numNamed;        // Named groups, which come before the IDs
+	uint32_t     numGroups;
+};
+
+// Finishes opening a module whose file is in memory at 'data' or read
+// through module->cache: parses the headers and finds the groups.
+static GetExeIconError open_module(GetExeIconModule *module, const BYTE *data, uint64_t size)
+{
+	static const GetExeIconOptions defaultOptions;
+	CallState call;
+	begin_call(&call, &defaultOptions);
+	GetExeIconError error = open_pe_module(&module->pe, data, module->cache, &call, size);
+	if (error == GET_EXE_ICON_ERROR_NO_ICON) {
+		// A file without resources simply has no groups
+		error = GET_EXE_ICON_OK;
+	} else if (error == GET_EXE_ICON_OK
+		&& find_res_type_dir(&module->pe, RES_TYPE_GROUP_ICON, &module->groupDirOffset))
+	{
+		BYTE dir[PE_RES_DIR_SIZE];
+		if (read_res_bytes(&module->pe, module->groupDirOffset, sizeof(dir), dir)) {
+			module->numNamed = read_le16(dir + 12);
+			module->numGroups = module->numNamed + read_le16(dir + 14);
+
+			// Don't count entries past the end of the resource section
+			uint32_t maxGroups = (module->pe.rsrcSize - module->groupDirOffset - PE_RES_DIR_SIZE) / PE_RES_DIR_ENTRY_SIZE;
+			if (module->numGroups > maxGroups) {
+				module->numGroups = maxGroups;
+			}
+			if (module->numNamed > module->numGroups) {
+				module->numNamed = module->numGroups;
+			}
+		}
+	}
+
+	// Each call on the module brings its own state
+	module->pe.call = NULL;
+
+	if (call.budget.exceeded) {
+		error = GET_EXE_ICON_ERROR_LIMIT_EXCEEDED;
+	}
+	if (module->cache && module->cache->readFailed) {
+		error = GET_EXE_ICON_ERROR_READ_FAILED;
+	}
+	return error;
+}
+
+// Allocates a module for a file in memory at 'data' (which may be NULL if
+// it's read through 'cache'), and opens it. On error, NULL is returned and
+// the error is written to 'error'. 'cache' is freed if the module isn't
+// returned.
+static GetExeIconModule *new_module(const BYTE *data, ReadCache *cache, uint64_t size, GetExeIconError *error)
+{
+	GetExeIconModule *module = (GetExeIconModule *)calloc(1, sizeof(GetExeIconModule));
+	if (!module) {
+		free(cache);
+		*error = GET_EXE_ICON_ERROR_OUT_OF_MEMORY;
+		return NULL;
+	}
+	module->cache = cache;
+
+	*error = open_module(module, data, size);
+	if (*error != GET_EXE_ICON_OK) {
+		free(cache);
+		free(module);
+		return NULL;
+	}
+	return module;
+}
+
+#ifdef _WIN32
+static GetExeIconModule *open_module_from_native_path(PCWSTR path)
+#else
+static GetExeIconModule *open_module_from_native_path(PCSTR path)
+#endif
+{
+	MappedFile file;
+	if (!map_file(path, &file)) {
+		lastError = GET_EXE_ICON_ERROR_OPEN_FAILED;
+		return NULL;
+	}
+
+	GetExeIconError error;
+	GetExeIconModule *module = new_module(file.data, NULL, file.size, &error);
+	if (!module) {
+		unmap_file(&file);
+		lastError = error;
+		return NULL;
+	}
+	module->file = file;
+	lastError = GET_EXE_ICON_OK;
+	return module;
+}
+
+GetExeIconModule *get_exe_icon_module_open_utf16(PCWSTR path)
+{
+	if (!path) {
+		lastError = GET_EXE_ICON_ERROR_INVALID_ARGUMENT;
+		return NULL;
+	}
+
+#ifdef _WIN32
+	return open_module_from_native_path(path);
+#else
+	char *u8Path = utf16_to_utf8(path);
+	if (!u8Path) {
+		lastError = GET_EXE_ICON_ERROR_INVALID_ARGUMENT;
+		return NULL;
+	}
+
+	GetExeIconModule *module = open_module_from_native_path(u8Path);
+
+	free(u8Path);
+
+	return module;
+#endif
+}
+
+GetExeIconModule *get_exe_icon_module_open_utf8(PCSTR path)
+{
+	if (!path) {
+		lastError = GET_EXE_ICON_ERROR_INVALID_ARGUMENT;
+		return NULL;
+	}
+
+#ifdef _WIN32
+	int pathBufLen = MultiByteToWideChar(CP_UTF8, 0, path, -1, NULL, 0);
+	if (pathBufLen <= 0) {
+		lastError = GET_EXE_ICON_ERROR_INVALID_ARGUMENT;
+		return NULL;
+	}
+
+	PWSTR wPath = (PWSTR)malloc(sizeof(WCHAR) * pathBufLen);
+	if (!wPath) {
+		lastError = GET_EXE_ICON_ERROR_OUT_OF_MEMORY;
+		return NULL;
+	}
+	pathBufLen = MultiByteToWideChar(CP_UTF8, 0, path, -1, wPath, pathBufLen);
+	if (pathBufLen <= 0) {
+		free(wPath);
+		lastError = GET_EXE_ICON_ERROR_INVALID_ARGUMENT;
+		return NULL;
+	}
+
+	GetExeIconModule *module = open_module_from_native_path(wPath);
+
+	free(wPath);
+
+	return module;
+#else
+	return open_module_from_native_path(path);
+#endif
+}
+
+GetExeIconModule *get_exe_icon_module_open_memory(const void *data, size_t len)
+{
+	if (!data) {
+		lastError = GET_EXE_ICON_ERROR_INVALID_ARGUMENT;
+		return NULL;
+	}
+
+	GetExeIconError error;
+	GetExeIconModule *module = new_module((const BYTE *)data, NULL, len, &error);
+	lastError = error;
+	return module;
+}
+
+GetExeIconModule *get_exe_icon_module_open_reader(GetExeIconReader *reader)
+{
+	if (!reader || !reader->readAt) {
+		lastError = GET_EXE_ICON_ERROR_INVALID_ARGUMENT;
+		return NULL;
+	}
+
+	reader->bytesRead = 0;
+	reader->numReads = 0;
+
+	ReadCache *cache = new_read_cache(reader);
+	if (!cache) {
+		lastError = GET_EXE_ICON_ERROR_OUT_OF_MEMORY;
+		return NULL;
+	}
+
+	GetExeIconError error;
+	GetExeIconModule *module = new_module(NULL, cache, reader->size, &error);
+	lastError = error;
+	return module;
+}
+
+void get_exe_icon_module_close(GetExeIconModule *module)
+{
+	if (!module) {
+		return;
+	}
+
+	if (module->file.data) {
+		unmap_file(&module->file);
+	}
+	free(module->cache);
+	free(module);
+}
+
+DWORD get_exe_icon_module_num_groups(const GetExeIconModule *module)
+{
+	return module ? module->numGroups : 0;
+}
+
+// A public call on a module. It works on its own copy of the module's
+// PeModule, with its own state, since calls may be made from several threads
+// at once.
+typedef struct
+{
+	PeModule   pe;
+	CallState  state;
+} ModuleCall;
+
+// Starts a public call on 'module' with the limits and stats of 'options'
+// (NULL for the defaults), and forgets any failed read of a module that's
+// read through a reader.
+static void begin_module_call(GetExeIconModule *module, const GetExeIconOptions *options, ModuleCall *call)
+{
+	static const GetExeIconOptions defaultOptions;
+	if (module->cache) {
+		module->cache->readFailed = FALSE;
+	}
+	call->pe = module->pe;
+	begin_call(&call->state, options ? options : &defaultOptions);
+	call->pe.call = &call->state;
+}
+
+// Whatever error a refused lookup or a failed read caused during a call on
+// a module, reports that instead.
+static GetExeIconError module_call_error(const GetExeIconModule *module, const ModuleCall *call, GetExeIconError error)
+{
+	if (error == GET_EXE_ICON_OK) {
+		return error;
+	}
+	if (call->state.budget.exceeded) {
+		error = GET_EXE_ICON_ERROR_LIMIT_EXCEEDED;
+	}
+	if (module->cache && module->cache->readFailed) {
+		error = GET_EXE_ICON_ERROR_READ_FAILED;
+	}
+	return error;
+}
+
+// Reads the directory entry of group 'index'. A failed read or a refused
+// lookup is reported as such.
+static GetExeIconError read_group_entry(const GetExeIconModule *module, const ModuleCall *call, DWORD index, uint32_t *name, uint32_t *value)
+{
+	if (index >= module->numGroups) {
+		return GET_EXE_ICON_ERROR_INVALID_ARGUMENT;
+	}
+	if (!read_res_dir_entry(&call->pe, module->groupDirOffset, index, name, value)) {
+		return module_call_error(module, call, GET_EXE_ICON_ERROR_NO_ICON);
+	}
+	return GET_EXE_ICON_OK;
+}
+
+// Same as set_last_error_bool(), except a failed read or a refused lookup is
+// reported as such
+static BOOL set_module_error(const GetExeIconModule *module, const ModuleCall *call, GetExeIconError error)
+{
+	return set_last_error_bool(module_call_error(module, call, error));
+}
+
+// Gets the length of the resource name whose directory entry has the name
+// field 'name', and the offset of its first character.
+static BOOL read_res_name_len(const PeModule *module, uint32_t name, uint32_t *nameOffset, DWORD *nameLen)
+{
+	BYTE len[2];
+	uint32_t offset = name & ~PE_RES_HIGH_BIT;
+	if (!(name & PE_RES_HIGH_BIT)
+		|| offset > UINT32_MAX - sizeof(len)
+		|| !read_res_bytes(module, offset, sizeof(len), len))
+	{
+		return FALSE;
+	}
+	*nameOffset = offset + sizeof(len);
+	*nameLen = read_le16(len);
+	return TRUE;
+}
+
+BOOL get_exe_icon_module_group(GetExeIconModule *module, DWORD index, GetExeIconGroupInfo *info)
+{
+	if (!module || !info) {
+		return set_last_error_bool(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+	}
+
+	ModuleCall call;
+	begin_module_call(module, NULL, &call);
+
+	memset(info, 0, sizeof(GetExeIconGroupInfo));
+	uint32_t name, value, nameOffset;
+	GetExeIconError error = read_group_entry(module, &call, index, &name, &value);
+	if (error != GET_EXE_ICON_OK) {
+		return set_module_error(module, &call, error);
+	}
+
+	if (index < module->numNamed) {
+		info->named = TRUE;
+		if (!read_res_name_len(&call.pe, name, &nameOffset, &info->nameLen)) {
+			return set_module_error(module, &call, GET_EXE_ICON_ERROR_NO_ICON);
+		}
+	} else {
+		info->id = (uint16_t)name;
+	}
+	return set_last_error_bool(GET_EXE_ICON_OK);
+}
+
+BOOL get_exe_icon_module_group_name(GetExeIconModule *module, DWORD index, WCHAR *name, DWORD nameSize)
+{
+	if (!module || (!name && nameSize > 0)) {
+		return set_last_error_bool(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+	}
+
+	ModuleCall call;
+	begin_module_call(module, NULL, &call);
+
+	uint32_t resName, value, nameOffset;
+	DWORD nameLen;
+	GetExeIconError error = read_group_entry(module, &call, index, &resName, &value);
+	if (error != GET_EXE_ICON_OK) {
+		return set_module_error(module, &call, error);
+	}
+	if (index >= module->numNamed) {
+		return set_last_error_bool(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+	}
+	if (!read_res_name_len(&call.pe, resName, &nameOffset, &nameLen)) {
+		return set_module_error(module, &call, GET_EXE_ICON_ERROR_NO_ICON);
+	}
+	if (nameLen >= nameSize) {
+		return set_last_error_bool(GET_EXE_ICON_ERROR_BUFFER_TOO_SMALL);
+	}
+
+	// The name is little-endian UTF-16, and not necessarily aligned
+	if (!read_res_bytes(&call.pe, nameOffset, nameLen * sizeof(WCHAR), name)) {
+		return set_module_error(module, &call, GET_EXE_ICON_ERROR_NO_ICON);
+	}
+	for (DWORD i = 0; i < nameLen; i++) {
+		name[i] = read_le16((const BYTE *)&name[i]);
+	}
+	name[nameLen] = 0;
+	return set_last_error_bool(GET_EXE_ICON_OK);
+}
+
+BOOL get_exe_icon_module_find_group_id(GetExeIconModule *module, uint16_t id, PDWORD index)
+{
+	if (!module || !index) {
+		return set_last_error_bool(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+	}
+
+	ModuleCall call;
+	begin_module_call(module, NULL, &call);
+
+	// IDs are sorted in ascending order, so do a binary search, like the
+	// Windows loader does
+	uint32_t lo = module->numNamed;
+	uint32_t hi = module->numGroups;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		uint32_t name, value;
+		GetExeIconError error = read_group_entry(module, &call, mid, &name, &value);
+		if (error != GET_EXE_ICON_OK) {
+			return set_module_error(module, &call, error);
+		}
+		if (name == id) {
+			*index = mid;
+			return set_last_error_bool(GET_EXE_ICON_OK);
+		}
+		if (name < id) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return set_last_error_bool(GET_EXE_ICON_ERROR_NO_ICON);
+}
+
+static WCHAR upcase_ascii(WCHAR c)
+{
+	return c >= 'a' && c <= 'z' ? (WCHAR)(c - 'a' + 'A') : c;
+}
+
+BOOL get_exe_icon_module_find_group_name(GetExeIconModule *module, PCWSTR name, PDWORD index)
+{
+	if (!module || !name || !index) {
+		return set_last_error_bool(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+	}
+
+	ModuleCall call;
+	begin_module_call(module, NULL, &call);
+
+	size_t len = 0;
+	while (name[len]) {
+		len++;
+	}
+
+	for (uint32_t i = 0; i < module->numNamed; i++) {
+		uint32_t resName, value, nameOffset;
+		DWORD nameLen;
+		GetExeIconError error = read_group_entry(module, &call, i, &resName, &value);
+		if (error != GET_EXE_ICON_OK) {
+			return set_module_error(module, &call, error);
+		}
+		if (!read_res_name_len(&call.pe, resName, &nameOffset, &nameLen) || nameLen != len) {
+			continue;
+		}
+
+		// Compare a chunk of the name at a time. Every group may share one
+		// long name, so each chunk costs a node.
+		BOOL match = TRUE;
+		for (DWORD pos = 0; match && pos < nameLen; pos += 32) {
+			BYTE chunk[32 * sizeof(WCHAR)];
+			DWORD chunkLen = nameLen - pos < 32 ? nameLen - pos : 32;
+			if (!spend_budget(&call.pe) || !read_res_bytes(&call.pe, nameOffset + pos * sizeof(WCHAR), chunkLen * sizeof(WCHAR), chunk)) {
+				match = FALSE;
+				break;
+			}
+			for (DWORD j = 0; j < chunkLen; j++) {
+				if (upcase_ascii(read_le16(chunk + j * sizeof(WCHAR))) != upcase_ascii(name[pos + j])) {
+					match = FALSE;
+					break;
+				}
+			}
+		}
+		if (match) {
+			*index = i;
+			return set_last_error_bool(GET_EXE_ICON_OK);
+		}
+	}
+	return set_module_error(module, &call, GET_EXE_ICON_ERROR_NO_ICON);
+}
+
+BOOL get_exe_icon_module_group_entries(GetExeIconModule *module, DWORD index, GetExeIconEntryInfo *entries, DWORD maxEntries, PDWORD numEntries)
+{
+	if (!module || (!entries && maxEntries > 0) || !numEntries) {
+		return set_last_error_bool(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+	}
+
+	ModuleCall call;
+	begin_module_call(module, NULL, &call);
+
+	*numEntries = 0;
+	uint32_t name, value;
+	GetExeIconError error = read_group_entry(module, &call, index, &name, &value);
+	if (error != GET_EXE_ICON_OK) {
+		return set_module_error(module, &call, error);
+	}
+
+	ResLocation group;
+	IcoHeader header;
+	uint16_t count;
+	if (!locate_resource_data(&call.pe, value, &group)
+		|| !read_group_header(&call.pe, &group, &header, &count))
+	{
+		return set_module_error(module, &call, GET_EXE_ICON_ERROR_NO_ICON);
+	}
+
+	const uint64_t resDirEntriesOffset = group.offset + sizeof(IcoHeader);
+	for (uint16_t i = 0; i < count && i < maxEntries; i++) {
+		ResIcoDirEntry resDirEntry;
+		if (!read_bytes(&call.pe,
+			resDirEntriesOffset + i * sizeof(ResIcoDirEntry),
+			sizeof(ResIcoDirEntry),
+			&resDirEntry))
+		{
+			return set_module_error(module, &call, GET_EXE_ICON_ERROR_NO_ICON);
+		}
+
+		ImageCandidate candidate;
+		get_image_candidate(&resDirEntry, i, &candidate);
+		entries[i].width = candidate.width;
+		entries[i].height = candidate.height;
+		entries[i].bitDepth = candidate.bitDepth;
+		entries[i].resId = resDirEntry.resId;
+		entries[i].size = resDirEntry.sizeBytes;
+	}
+
+	*numEntries = count;
+	return set_last_error_bool(GET_EXE_ICON_OK);
+}
+
+PBYTE get_exe_icon_module_extract_group(GetExeIconModule *module, DWORD index, const GetExeIconOptions *options, PDWORD bufLen)
+{
+	if (!module || !options || !bufLen) {
+		return set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT, NULL);
+	}
+
+	ModuleCall call;
+	begin_module_call(module, options, &call);
+	GetExeIconReader *reader = module->cache ? module->cache->reader : NULL;
+	const uint64_t bytesRead = reader ? reader->bytesRead : 0;
+	const DWORD numReads = reader ? reader->numReads : 0;
+
+	// The module is already open, so the first phase is finding the group
+	*bufLen = 0;
+	PBYTE icoBuf = NULL;
+	IcoOutput out = { &icoBuf, NULL, NULL, 0 };
+	ResLocation group;
+	uint32_t name, value;
+	GetExeIconError error = read_group_entry(module, &call, index, &name, &value);
+	if (error == GET_EXE_ICON_OK) {
+		BOOL located = locate_resource_data(&call.pe, value, &group);
+		end_phase(&call.state, &call.state.stats.enumerateNs);
+		if (located) {
+			error = extract_ico_from_module(&call.pe, &group, options, &out, bufLen);
+			end_phase(&call.state, &call.state.stats.assembleNs);
+		} else {
+			error = GET_EXE_ICON_ERROR_NO_ICON;
+		}
+		error = module_call_error(module, &call, error);
+	}
+	if (error != GET_EXE_ICON_OK) {
+		*bufLen = 0;
+	}
+
+	if (reader) {
+		call.state.stats.bytesRead = reader->bytesRead - bytesRead;
+		call.state.stats.numReads = reader->numReads - numReads;
+	}
+	end_call(&call.state, options, error);
+	return set_last_error(error, icoBuf);
+}
+
+#ifdef _WIN32
+PBYTE get_exe_icon_from_handle(HANDLE process, BOOL allowEmbeddedPNGs, PDWORD bufLen)
+{
+	if (!process || !bufLen) {
+		return set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT, NULL);
+	}
+
+	// Paths can be up to 32767 characters. Try a buffer that fits almost
+	// all of them before growing it.
+	WCHAR exeNameBuf[MAX_PATH];
+	PWSTR exeName = exeNameBuf;
+	DWORD exeNameCap = MAX_PATH;
+	for (;;) {
+		DWORD exeNameLen = exeNameCap;
+		if (QueryFullProcessImageNameW(process, 0, exeName, &exeNameLen)) {
+			break;
+		}
+		if (exeName != exeNameBuf) {
+			free(exeName);
+		}
+		if (GetLastError() != ERROR_INSUFFICIENT_BUFFER || exeNameCap >= 32768) {
+			return set_last_error(GET_EXE_ICON_ERROR_OPEN_FAILED, NULL);
+		}
+		exeNameCap *= 4;
+		exeName = (PWSTR)malloc(sizeof(WCHAR) * exeNameCap);
+		if (!exeName) {
+			return set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY, NULL);
+		}
+	}
+
+	PBYTE icoBuf = get_exe_icon_from_file_utf16(exeName, allowEmbeddedPNGs, bufLen);
+	if (exeName != exeNameBuf) {
+		free(exeName);
+	}
+	return icoBuf;
+}
+
+PBYTE get_exe_icon_from_pid(DWORD pid, BOOL allowEmbeddedPNGs, PDWORD bufLen)
+{
+	if (!bufLen) {
+		return set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT, NULL);
+	}
+
+	HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+	if (!process) {
+		return set_last_error(GET_EXE_ICON_ERROR_OPEN_FAILED, NULL);
+	}
+
+	PBYTE icoBuf = get_exe_icon_from_handle(process, allowEmbeddedPNGs, bufLen);
+
+	CloseHandle(process);
+
+	return icoBuf;
+}
+#endif
+
+// Extracts the RT_GROUP_ICON resource with ID 'groupId' from 'module' (if it
+// could be opened), and closes the module.
+static GetExeIconError extract_group_id(GetExeIconModule *module, uint16_t groupId, BOOL allowEmbeddedPNGs, PBYTE *icoBuf, PDWORD bufLen)
+{
+	*icoBuf = NULL;
+	if (!module) {
+		return lastError;
+	}
+
+	GetExeIconOptions options = { allowEmbeddedPNGs, NULL };
+	DWORD index;
+	if (get_exe_icon_module_find_group_id(module, groupId, &index)) {
+		*icoBuf = get_exe_icon_module_extract_group(module, index, &options, bufLen);
+	}
+	GetExeIconError error = lastError;
+
+	get_exe_icon_module_close(module);
+	return error;
+}
+
+#ifdef _WIN32
+// Extracts the RT_GROUP_ICON resource with ID 'groupId' from the file 'name'
+// within the directory 'dir'.
+static GetExeIconError extract_system_icon(PCWSTR dir, PCWSTR name, uint16_t groupId, BOOL allowEmbeddedPNGs, PBYTE *icoBuf, PDWORD bufLen)
+{
+	*icoBuf = NULL;
+
+	WCHAR path[MAX_PATH * 2];
+	size_t dirLen = wcslen(dir);
+	size_t nameLen = wcslen(name);
+	if (dirLen == 0 || dirLen + 1 + nameLen >= sizeof(path) / sizeof(path[0])) {
+		return GET_EXE_ICON_ERROR_INVALID_ARGUMENT;
+	}
+	memcpy(path, dir, dirLen * sizeof(WCHAR));
+	path[dirLen] = L'\\';
+	memcpy(path + dirLen + 1, name, (nameLen + 1) * sizeof(WCHAR));
+
+	return extract_group_id(get_exe_icon_module_open_utf16(path), groupId, allowEmbeddedPNGs, icoBuf, bufLen);
+}
+
+// Extracts the default executable icon from the first of the system's DLLs
+// that has it
+static GetExeIconError extract_system_default_icon(BOOL allowEmbeddedPNGs, PBYTE *icoBuf, PDWORD bufLen)
+{
+	WCHAR windowsDir[MAX_PATH];
+	WCHAR systemDir[MAX_PATH];
+	UINT windowsDirLen = GetWindowsDirectoryW(windowsDir, MAX_PATH);
+	UINT systemDirLen = GetSystemDirectoryW(systemDir, MAX_PATH);
+
+	*icoBuf = NULL;
+	GetExeIconError error = GET_EXE_ICON_ERROR_OPEN_FAILED;
+	if (windowsDirLen > 0 && windowsDirLen < MAX_PATH) {
+		error = extract_system_icon(windowsDir, L"SystemResources\\imageres.dll.mun", 15, allowEmbeddedPNGs, icoBuf, bufLen);
+	}
+
+	if (!*icoBuf && systemDirLen > 0 && systemDirLen < MAX_PATH) {
+		error = extract_system_icon(systemDir, L"imageres.dll", 15, allowEmbeddedPNGs, icoBuf, bufLen);
+	}
+
+	if (!*icoBuf && systemDirLen > 0 && systemDirLen < MAX_PATH) {
+		error = extract_system_icon(systemDir, L"shell32.dll", 3, allowEmbeddedPNGs, icoBuf, bufLen);
+	}
+
+	return error;
+}
+#endif
+
+// The default icon's source and its two ICOs are each set once and then only
+// read, without a lock: whoever makes one publishes it with a
+// compare-and-swap, and a thread that loses the race frees its copy.
+#ifdef _WIN32
+static void *load_shared(void *volatile *p)
+{
+	return InterlockedCompareExchangePointer((PVOID volatile *)p, NULL, NULL);
+}
+
+static BOOL publish_shared(void *volatile *p, void *value)
+{
+	return InterlockedCompareExchangePointer((PVOID volatile *)p, value, NULL) == NULL;
+}
+#else
+static void *load_shared(void *volatile *p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static BOOL publish_shared(void *volatile *p, void *value)
+{
+	void *expected = NULL;
+	return __atomic_compare_exchange_n(p, &expected, value, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+#endif
+
+// The path set with get_default_exe_icon_set_source_utf8(), or (on Windows)
+// &systemIconSource once the system's DLLs have been used instead, which
+// fixes the source for good.
+#ifdef _WIN32
+static char systemIconSource;
+#endif
+static void *volatile defaultIconSource = NULL;
+
+// The shared ICOs without and with embedded PNGs
+typedef struct
+{
+	PBYTE icoBuf;
+	DWORD bufLen;
+} DefaultIcon;
+
+static void *volatile defaultIcons[2] = { NULL, NULL };
+
+// shell32.dll has the default executable icon as group 3, and imageres.dll
+// (and imageres.dll.mun) as group 15
+static uint16_t default_icon_group_id(PCSTR path)
+{
+	const char *name = path;
+	for (const char *c = path; *c; c++) {
+		if (*c == '/' || *c == '\\') {
+			name = c + 1;
+		}
+	}
+
+	const char *shell32 = "shell32.dll";
+	size_t i = 0;
+	while (name[i] && shell32[i] && (name[i] | 0x20) == shell32[i]) {
+		i++;
+	}
+	return name[i] == '\0' && shell32[i] == '\0' ? 3 : 15;
+}
+
+static GetExeIconError extract_default_icon(BOOL allowEmbeddedPNGs, PBYTE *icoBuf, PDWORD bufLen)
+{
+	const char *source = (const char *)load_shared(&defaultIconSource);
+#ifdef _WIN32
+	if (!source) {
+		publish_shared(&defaultIconSource, &systemIconSource);
+		source = (const char *)load_shared(&defaultIconSource);
+	}
+	if (source == &systemIconSource) {
+		return extract_system_default_icon(allowEmbeddedPNGs, icoBuf, bufLen);
+	}
+#else
+	if (!source) {
+		*icoBuf = NULL;
+		return GET_EXE_ICON_ERROR_OPEN_FAILED;
+	}
+#endif
+	return extract_group_id(get_exe_icon_module_open_utf8(source), default_icon_group_id(source), allowEmbeddedPNGs, icoBuf, bufLen);
+}
+
+BOOL get_default_exe_icon_set_source_utf8(PCSTR path)
+{
+	if (!path || !*path) {
+		return set_last_error_bool(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+	}
+
+	// Kept until the program exits, like the ICOs made from it
+	size_t len = strlen(path);
+	char *source = (char *)malloc(len + 1);
+	if (!source) {
+		return set_last_error_bool(GET_EXE_ICON_ERROR_OUT_OF_MEMORY);
+	}
+	memcpy(source, path, len + 1);
+
+	if (!publish_shared(&defaultIconSource, source)) {
+		free(source);
+		return set_last_error_bool(GET_EXE_ICON_ERROR_INVALID_ARGUMENT);
+	}
+	return set_last_error_bool(GET_EXE_ICON_OK);
+}
+
+const BYTE *get_default_exe_icon_shared(BOOL allowEmbeddedPNGs, PDWORD bufLen)
+{
+	if (!bufLen) {
+		return set_last_error(GET_EXE_ICON_ERROR_INVALID_ARGUMENT, NULL);
+	}
+
+	void *volatile *slot = &defaultIcons[allowEmbeddedPNGs ? 1 : 0];
+	DefaultIcon *icon = (DefaultIcon *)load_shared(slot);
+	if (!icon) {
+		PBYTE icoBuf;
+		DWORD icoLen = 0;
+		GetExeIconError error = extract_default_icon(allowEmbeddedPNGs, &icoBuf, &icoLen);
+		if (error == GET_EXE_ICON_OK) {
+			icon = (DefaultIcon *)malloc(sizeof(DefaultIcon));
+			if (!icon) {
+				free(icoBuf);
+				error = GET_EXE_ICON_ERROR_OUT_OF_MEMORY;
+			}
+		}
+		if (error != GET_EXE_ICON_OK) {
+			*bufLen = 0;
+			return set_last_error(error, NULL);
+		}
+
+		icon->icoBuf = icoBuf;
+		icon->bufLen = icoLen;
+		if (!publish_shared(slot, icon)) {
+			free(icon->icoBuf);
+			free(icon);
+			icon = (DefaultIcon *)load_shared(slot);
+		}
+	}
+
+	*bufLen = icon->bufLen;
+	return set_last_error(GET_EXE_ICON_OK, icon->icoBuf);
+}
+
+PBYTE get_default_exe_icon(BOOL allowEmbeddedPNGs, PDWORD bufLen)
+{
+	const BYTE *shared = get_default_exe_icon_shared(allowEmbeddedPNGs, bufLen);
+	if (!shared) {
+		return NULL;
+	}
+
+	PBYTE icoBuf = (PBYTE)malloc(*bufLen);
+	if (!icoBuf) {
+		*bufLen = 0;
+		return set_last_error(GET_EXE_ICON_ERROR_OUT_OF_MEMORY, NULL);
+	}
+	memcpy(icoBuf, shared, *bufLen);
+	return set_last_error(GET_EXE_ICON_OK, icoBuf);
 }
@@ -18,13 +18,66 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#ifndef GET_EXE_ICON_H
+#define GET_EXE_ICON_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
 #include <windows.h>
+#else
+// The library parses PE files itself and does not depend on the Windows API,
+// so on other platforms only the handful of Windows types used in the
+// declarations below are needed. WCHAR is always a UTF-16 code unit.
+typedef int BOOL;
+typedef uint8_t BYTE, *PBYTE;
+typedef uint32_t DWORD, *PDWORD;
+typedef uint16_t WCHAR;
+typedef const char *PCSTR;
+typedef const WCHAR *PCWSTR;
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+#endif
+
+// Why a call failed. Every function below that returns NULL on error records
+// the reason, which can be retrieved on the same thread with
+// get_exe_icon_last_error().
+typedef enum
+{
+	GET_EXE_ICON_OK = 0,
+	GET_EXE_ICON_ERROR_INVALID_ARGUMENT,  // e.g. a NULL path or bufLen
+	GET_EXE_ICON_ERROR_OPEN_FAILED,       // The file or process could not be opened
+	GET_EXE_ICON_ERROR_READ_FAILED,       // A GetExeIconReader read failed
+	GET_EXE_ICON_ERROR_NOT_PE,            // The file is not a PE file
+	GET_EXE_ICON_ERROR_NO_ICON,           // The file has no (usable) icon
+	GET_EXE_ICON_ERROR_TOO_LARGE,         // The ICO would exceed the output limit
+	GET_EXE_ICON_ERROR_OUT_OF_MEMORY,
+	GET_EXE_ICON_ERROR_BUFFER_TOO_SMALL,  // See get_exe_icon_from_file_utf16_into()
+	GET_EXE_ICON_ERROR_UNSUPPORTED,       // An image format that can't be decoded, or a ZIP
+	                                      // entry's encryption or compression method
+	GET_EXE_ICON_ERROR_LIMIT_EXCEEDED,    // The file needed more work than allowed
+	GET_EXE_ICON_ERROR_BAD_ARCHIVE,       // A ZIP archive, an icon pack (get-exe-icon-pack.h)
+	                                      // or compressed data is corrupt
+} GetExeIconError;
+
+// Gets the outcome of the last get_exe_icon_* call made on this thread.
+GetExeIconError get_exe_icon_last_error(void);
+
+// Sets the value returned by get_exe_icon_last_error() on this thread. For use
+// by code that wraps the functions below, such as get-exe-icon-cache.c.
+void get_exe_icon_set_last_error(GetExeIconError error);
 
-// Gets the primary icon associated with an executable, DLL, or any other file
-// that LoadLibraryExW can open. The primary icon is defined by the first
-// RT_GROUP_ICON resource, and is the icon shown by Explorer for executables.
-// If the exe has no icon, NULL is returned. You can use get_default_exe_icon()
-// to show a default icon in this case.
+// Gets the primary icon associated with an executable, DLL, or any other PE
+// file (32 or 64 bit). The file is memory-mapped read-only and its resource
+// section is parsed directly; it is never loaded with LoadLibrary. The primary
+// icon is defined by the first RT_GROUP_ICON resource, and is the icon shown
+// by Explorer for executables. If the exe has no icon, NULL is returned. You
+// can use get_default_exe_icon() to show a default icon in this case.
 //
 // path: A NULL-terminated UTF-16 string specifying the path of the file
 //       to extract the icon from.
@@ -37,12 +90,353 @@
 //               This  must not be NULL.
 //
 // Return Value: An ICO file contained in a byte buffer. Free with free(3).
-//               If an error occurs, NULL is returned.
+//               If an error occurs, NULL is returned, and
+//               get_exe_icon_last_error() says why.
 PBYTE get_exe_icon_from_file_utf16(PCWSTR path, BOOL allowEmbeddedPNGs, PDWORD bufLen);
 
 // Same as get_icon_from_file_utf16() except path is a UTF-8 string.
 PBYTE get_exe_icon_from_file_utf8(PCSTR path, BOOL allowEmbeddedPNGs, PDWORD bufLen);
 
+// Same as get_icon_from_file_utf16() except the PE file is given as a buffer
+// in memory (e.g. a file that was downloaded or decompressed and never written
+// to disk). Every offset read from the file is bounds-checked against len, so
+// the buffer may come from an untrusted source. The buffer is only read, and
+// is not referenced after this returns.
+//
+// data: The contents of the PE file.
+//
+// len: The size of data in bytes.
+PBYTE get_exe_icon_from_memory(const void *data, size_t len, BOOL allowEmbeddedPNGs, PDWORD bufLen);
+
+// A source of PE file data for get_exe_icon_from_reader(), such as a file on
+// a network filesystem or an object in a store that supports range reads.
+typedef struct
+{
+	// Reads exactly 'len' bytes at byte 'offset' of the file into 'dst'.
+	// Returns FALSE on failure. It is never asked to read past 'size'.
+	BOOL (*readAt)(void *ctx, uint64_t offset, DWORD len, void *dst);
+
+	// Passed to readAt.
+	void *ctx;
+
+	// The size of the file in bytes.
+	uint64_t size;
+
+	// (OUT) The total number of bytes read and the number of readAt calls
+	// made by the last get_exe_icon_from_reader() call.
+	uint64_t bytesRead;
+	DWORD numReads;
+} GetExeIconReader;
+
+// Same as get_icon_from_file_utf16() except the PE file is read through a
+// callback. Only the PE headers, section table, the resource directory nodes
+// leading to the icon, and the icon's images are read, so a typical call
+// reads tens of KB however large the file is. Small reads are served from
+// 4KB blocks, and images that are adjacent in the file are read at once.
+PBYTE get_exe_icon_from_reader(GetExeIconReader *reader, BOOL allowEmbeddedPNGs, PDWORD bufLen);
+
+// A 128-bit hash of an ICO file's bytes (MurmurHash3, x64 128-bit variant,
+// seed 0), stored little-endian. It is not cryptographic, but is stable across
+// platforms and suitable for content-addressing identical icons.
+typedef struct
+{
+	BYTE bytes[16];
+} GetExeIconHash;
+
+// Computes the same hash as GetExeIconOptions.hash for an ICO already in
+// memory, e.g. one produced by an older version or read back from disk.
+void get_exe_icon_hash(const void *data, size_t len, GetExeIconHash *hash);
+
+// How GetExeIconOptions.targetWidth/targetHeight pick an image from the icon
+typedef enum
+{
+	// The smallest image at least as large as the target, or failing that
+	// the largest image. Among images of the same size, the one with the
+	// highest bit depth.
+	GET_EXE_ICON_SIZE_NEAREST_LARGER = 0,
+
+	// Only an image of exactly the target size, with the highest bit depth
+	// available. GET_EXE_ICON_ERROR_NO_ICON if there is none.
+	GET_EXE_ICON_SIZE_EXACT,
+
+	// The image with the highest bit depth, choosing between images of that
+	// depth as GET_EXE_ICON_SIZE_NEAREST_LARGER does.
+	GET_EXE_ICON_SIZE_BEST_DEPTH,
+} GetExeIconSizePolicy;
+
+// The image chosen by a size-targeted extraction, as described by the icon's
+// directory.
+typedef struct
+{
+	DWORD width;     // In pixels. 256 for images of 256 pixels or more.
+	DWORD height;
+	DWORD bitDepth;
+	BOOL isPNG;      // Otherwise the image is a DIB
+} GetExeIconImageInfo;
+
+// What one extraction did, for finding out where the time of a slow call
+// went. Times are wall-clock nanoseconds, and are only measured when the
+// stats are asked for (see GetExeIconOptions.stats and
+// get_exe_icon_set_stats_hook()); the counters cost next to nothing.
+typedef struct
+{
+	GetExeIconError error;     // The outcome of the call
+
+	uint64_t bytesMapped;      // The size of the file, if it was mapped
+	uint64_t bytesRead;        // Through a GetExeIconReader
+	DWORD    numReads;         // readAt calls
+	DWORD    nodesVisited;     // Resource directory nodes and entries
+	DWORD    entriesSeen;      // In the icon group's directory
+	DWORD    entriesSkipped;   // PNGs left out, and images that weren't found
+	uint64_t bytesCopied;      // Image data copied into the ICO
+	DWORD    allocations;      // Heap allocations made by the extraction
+
+	uint64_t openNs;           // Mapping the file and parsing its headers
+	uint64_t enumerateNs;      // Finding the icon group
+	uint64_t locateNs;         // Finding the group's images
+	uint64_t assembleNs;       // Building the ICO, copying and hashing images
+} GetExeIconStats;
+
+// Extended options for the get_exe_icon_*_ex() functions. Zero-initialize
+// it and set the fields that are needed.
+typedef struct
+{
+	// Same as the allowEmbeddedPNGs parameter of the functions above.
+	BOOL allowEmbeddedPNGs;
+
+	// (OUT, optional) If not NULL, receives the hash of the returned ICO. It
+	// is computed while the ICO is assembled, in the same pass that copies
+	// the images, so it costs no additional pass over the output.
+	GetExeIconHash *hash;
+
+	// If not 0, only the single image that best matches this size (in
+	// pixels) is extracted, and the result is an ICO holding just that
+	// image. The image is chosen by 'sizePolicy' from the icon's directory
+	// alone, so no other image is read at all. targetHeight 0 means the same
+	// as targetWidth.
+	DWORD targetWidth;
+	DWORD targetHeight;
+	GetExeIconSizePolicy sizePolicy;
+
+	// With targetWidth, return the chosen image by itself instead of in an
+	// ICO: either a PNG file, or a DIB as stored in ICO files (a
+	// BITMAPINFOHEADER with twice the image's height, the color table and
+	// pixels, then the 1 bit AND mask).
+	BOOL rawImage;
+
+	// (OUT, optional) With targetWidth, receives details of the chosen image.
+	GetExeIconImageInfo *imageInfo;
+
+	// Limits on the work done for one file, so that a malformed or hostile
+	// file can't take unbounded time or memory. 0 means the default.
+	//
+	// maxNodes: The number of resource directory nodes and entries that may
+	// be visited, beyond which the call fails with
+	// GET_EXE_ICON_ERROR_LIMIT_EXCEEDED. A typical file needs well under a
+	// thousand; without a limit, a few hundred KB of directory entries can
+	// take billions of lookups.
+	//
+	// maxOutputBytes: The largest ICO (or raw image) that's returned; a
+	// larger one fails with GET_EXE_ICON_ERROR_TOO_LARGE before anything is
+	// allocated. Since many entries may reference the same image, a small
+	// file can otherwise describe an ICO of up to 4 GB.
+	//
+	// The resource tree is always walked exactly three levels deep (type,
+	// name, language), and only downwards, so the depth needs no limit and
+	// cyclic directory offsets can't loop.
+	DWORD maxNodes;
+	DWORD maxOutputBytes;
+
+	// (OUT, optional) If not NULL, receives what the call did, whether or
+	// not it succeeded.
+	GetExeIconStats *stats;
+} GetExeIconOptions;
+
+// The limits used when GetExeIconOptions.maxNodes/maxOutputBytes are 0, and by
+// the functions without options.
+#define GET_EXE_ICON_DEFAULT_MAX_NODES         4000000
+#define GET_EXE_ICON_DEFAULT_MAX_OUTPUT_BYTES  (64u * 1024 * 1024)
+
+// Called with the stats of every extraction: every call that extracts a
+// primary icon (or its layout), and get_exe_icon_module_extract_group(). It's
+// called on the thread that made the call, just before the call returns, and
+// may be called from several threads at once.
+typedef void (*GetExeIconStatsHook)(const GetExeIconStats *stats, void *ctx);
+
+// Sets the function that's called with the stats of every extraction, e.g. to
+// export histograms of them without changing every call site, or removes it
+// if 'hook' is NULL. 'ctx' is passed to it. While a hook is set, the phases
+// of every extraction are timed. Set it while no extraction is running, such
+// as at startup.
+void get_exe_icon_set_stats_hook(GetExeIconStatsHook hook, void *ctx);
+
+// Same as the functions above, except with extended options.
+PBYTE get_exe_icon_from_file_utf16_ex(PCWSTR path, const GetExeIconOptions *options, PDWORD bufLen);
+PBYTE get_exe_icon_from_file_utf8_ex(PCSTR path, const GetExeIconOptions *options, PDWORD bufLen);
+PBYTE get_exe_icon_from_memory_ex(const void *data, size_t len, const GetExeIconOptions *options, PDWORD bufLen);
+PBYTE get_exe_icon_from_reader_ex(GetExeIconReader *reader, const GetExeIconOptions *options, PDWORD bufLen);
+
+// Same as get_exe_icon_from_file_utf16_ex() except the ICO is written to the
+// caller's buffer instead of one allocated for it. Call it with buf NULL and
+// bufSize 0 to get the required size in bufLen, then again with a buffer at
+// least that large; or just call it once with a buffer that is usually large
+// enough. Nothing is allocated on the heap for icons of up to 16 images, so
+// concurrent calls don't contend on the allocator (except, outside of
+// Windows, to convert the UTF-16 path).
+//
+// buf: Where to write the ICO. May be NULL if bufSize is 0.
+//
+// bufSize: The size of buf in bytes.
+//
+// bufLen (OUT): The size of the ICO. This is written on success and when the
+//               call fails with GET_EXE_ICON_ERROR_BUFFER_TOO_SMALL.
+//
+// Return Value: TRUE on success. If the ICO doesn't fit in buf, FALSE is
+//               returned and get_exe_icon_last_error() is
+//               GET_EXE_ICON_ERROR_BUFFER_TOO_SMALL.
+BOOL get_exe_icon_from_file_utf16_into(PCWSTR path, const GetExeIconOptions *options, PBYTE buf, DWORD bufSize, PDWORD bufLen);
+BOOL get_exe_icon_from_file_utf8_into(PCSTR path, const GetExeIconOptions *options, PBYTE buf, DWORD bufSize, PDWORD bufLen);
+BOOL get_exe_icon_from_memory_into(const void *data, size_t len, const GetExeIconOptions *options, PBYTE buf, DWORD bufSize, PDWORD bufLen);
+
+// A piece of a GetExeIconLayout: a range of the PE file that is copied
+// verbatim into the ICO.
+typedef struct
+{
+	// The segment's bytes, when the PE file is in memory (within the
+	// buffer given to get_exe_icon_layout_from_memory()), otherwise NULL.
+	const BYTE *data;
+
+	// The segment's offset within the PE file, e.g. for sendfile(2) or
+	// TransmitFile.
+	uint64_t offset;
+
+	DWORD len;
+} GetExeIconSegment;
+
+// An ICO described without copying its images: the ICO is 'header' followed
+// by each segment in order. 'header' holds the ICO header and directory,
+// which are all that is built; the images are referenced where they lie in
+// the PE file. This is for writing the ICO straight from the file or its
+// mapping with writev(2) or sendfile(2), without ever materializing it.
+typedef struct
+{
+	PBYTE header;
+	DWORD headerLen;
+	GetExeIconSegment *segments;
+	DWORD numSegments;  // Adjacent images share a segment
+	DWORD totalLen;     // The size of the whole ICO
+} GetExeIconLayout;
+
+// Same as get_exe_icon_from_file_utf16_ex() except the ICO's layout is
+// returned instead of the ICO. The segments refer to the file by offset
+// only, since the file is unmapped before this returns, so they're only valid
+// as long as the file is unchanged; open the file before calling this if it
+// might be replaced. options->hash is supported by all but
+// get_exe_icon_layout_from_reader(), which never reads the image data.
+// Free the layout with get_exe_icon_layout_free().
+//
+// Return Value: TRUE on success. On error FALSE is returned, and
+//               get_exe_icon_last_error() says why.
+BOOL get_exe_icon_layout_from_file_utf16(PCWSTR path, const GetExeIconOptions *options, GetExeIconLayout *layout);
+BOOL get_exe_icon_layout_from_file_utf8(PCSTR path, const GetExeIconOptions *options, GetExeIconLayout *layout);
+
+// Same as get_exe_icon_layout_from_file_utf16() except the PE file is in
+// memory, and each segment's data points into it.
+BOOL get_exe_icon_layout_from_memory(const void *data, size_t len, const GetExeIconOptions *options, GetExeIconLayout *layout);
+
+// Same as get_exe_icon_layout_from_file_utf16() except the PE file is read
+// through a callback. Only the headers and directories are read.
+BOOL get_exe_icon_layout_from_reader(GetExeIconReader *reader, const GetExeIconOptions *options, GetExeIconLayout *layout);
+
+// Frees the memory of a layout and zeroes it.
+void get_exe_icon_layout_free(GetExeIconLayout *layout);
+
+// A PE file opened for listing and extracting all of its icons, not only the
+// primary one (e.g. the icons of file types, or those used in the tray).
+// Opening it parses the headers and finds the RT_GROUP_ICON directory once;
+// after that, a group is only read when it's asked about, so listing even
+// hundreds of groups reads just one 8 byte directory entry per group. A
+// module opened from a file or memory may be used from several threads at
+// once; one opened from a reader may only be used by one thread at a time.
+// Each call has its own limit on the work done (see GetExeIconOptions): the
+// default one, or for get_exe_icon_module_extract_group() that of its options.
+typedef struct GetExeIconModule GetExeIconModule;
+
+// Opens a PE file for the get_exe_icon_module_* functions. A file without
+// icons (or without resources) opens with no groups.
+//
+// Return Value: The module, to be closed with get_exe_icon_module_close(). If
+//               an error occurs, NULL is returned, and
+//               get_exe_icon_last_error() says why.
+GetExeIconModule *get_exe_icon_module_open_utf16(PCWSTR path);
+GetExeIconModule *get_exe_icon_module_open_utf8(PCSTR path);
+
+// Same as get_exe_icon_module_open_utf16() except the PE file is in memory.
+// The buffer is referenced, not copied, so it must stay valid until the
+// module is closed.
+GetExeIconModule *get_exe_icon_module_open_memory(const void *data, size_t len);
+
+// Same as get_exe_icon_module_open_utf16() except the PE file is read through
+// a callback. The reader must stay valid until the module is closed. Its
+// bytesRead and numReads count every read since the module was opened.
+GetExeIconModule *get_exe_icon_module_open_reader(GetExeIconReader *reader);
+
+void get_exe_icon_module_close(GetExeIconModule *module);
+
+// Gets the number of icon groups in the module. Groups are numbered from 0 in
+// the order EnumResourceNames would enumerate them (named groups in
+// alphabetical order, then IDs in ascending order), so group 0 is the
+// primary icon.
+DWORD get_exe_icon_module_num_groups(const GetExeIconModule *module);
+
+// How an icon group is identified in the module's resources
+typedef struct
+{
+	BOOL named;       // The group has a name rather than an integer ID
+	uint16_t id;      // The integer ID, if not named
+	DWORD nameLen;    // The name's length in UTF-16 code units, if named
+} GetExeIconGroupInfo;
+
+// Gets the ID or name of group 'index'. Only its directory entry (and the
+// length of its name) is read.
+//
+// Return Value: TRUE on success. On error FALSE is returned, and
+//               get_exe_icon_last_error() says why.
+BOOL get_exe_icon_module_group(GetExeIconModule *module, DWORD index, GetExeIconGroupInfo *info);
+
+// Gets the name of a named group as a NULL-terminated UTF-16 string. nameSize
+// is the size of 'name' in code units, and must be at least nameLen + 1, or
+// the call fails with GET_EXE_ICON_ERROR_BUFFER_TOO_SMALL.
+BOOL get_exe_icon_module_group_name(GetExeIconModule *module, DWORD index, WCHAR *name, DWORD nameSize);
+
+// Finds the group with the integer ID 'id' (e.g. one passed to LoadIcon as
+// MAKEINTRESOURCE(id)), or with the name 'name', and writes its index to
+// 'index'. Names are compared case-insensitively, as by FindResource. If
+// there's no such group, FALSE is returned, and get_exe_icon_last_error() is
+// GET_EXE_ICON_ERROR_NO_ICON.
+BOOL get_exe_icon_module_find_group_id(GetExeIconModule *module, uint16_t id, PDWORD index);
+BOOL get_exe_icon_module_find_group_name(GetExeIconModule *module, PCWSTR name, PDWORD index);
+
+// An image of an icon group, as described by the group's directory
+typedef struct
+{
+	DWORD width;     // In pixels. 256 for images of 256 pixels or more.
+	DWORD height;
+	DWORD bitDepth;
+	uint16_t resId;  // The RT_ICON resource holding the image
+	DWORD size;      // As stated by the directory, which is not always right
+} GetExeIconEntryInfo;
+
+// Reads the directory of group 'index', writing up to maxEntries of its
+// entries to 'entries' and the number of entries it has to 'numEntries'.
+// entries may be NULL if maxEntries is 0. No image is read.
+BOOL get_exe_icon_module_group_entries(GetExeIconModule *module, DWORD index, GetExeIconEntryInfo *entries, DWORD maxEntries, PDWORD numEntries);
+
+// Same as get_exe_icon_from_file_utf16_ex() except the icon is group 'index'
+// of the module.
+PBYTE get_exe_icon_module_extract_group(GetExeIconModule *module, DWORD index, const GetExeIconOptions *options, PDWORD bufLen);
+
+#ifdef _WIN32
 // Same as get_icon_from_file_utf16() except the icon is retrieved from an
 // active process specified by its handle (e.g. acquired with OpenProcess).
 // This simply gets the process path using QueryFullProcessImageNameW and
@@ -51,9 +445,32 @@ PBYTE get_exe_icon_from_handle(HANDLE process, BOOL allowEmbeddedPNGs, PDWORD bu
 
 // Same as get_icon_from_handle() except uses PID to specify a process.
 PBYTE get_exe_icon_from_pid(DWORD pid, BOOL allowEmbeddedPNGs, PDWORD bufLen);
+#endif
 
 // Gets the system default executable icon from imageres.dll (Vista and up) or
-// shell32.dll (XP and below). This always returns the same value, so you may
-// wish to just call it once and cache the result if it's needed often. The
+// shell32.dll (XP and below). On Windows 10 and up, the icon resources of
+// imageres.dll live in SystemResources\imageres.dll.mun, so that is tried
+// first. Elsewhere, the file to read it from has to be set with
+// get_default_exe_icon_set_source_utf8(), or the call fails with
+// GET_EXE_ICON_ERROR_OPEN_FAILED. The DLL is only read once per value of
+// allowEmbeddedPNGs; this returns a copy of get_default_exe_icon_shared(). The
 // parameters and return value are the same as in get_icon_from_file_utf16().
 PBYTE get_default_exe_icon(BOOL allowEmbeddedPNGs, PDWORD bufLen);
+
+// Same as get_default_exe_icon() except the ICO isn't copied: it's extracted
+// on the first call for each value of allowEmbeddedPNGs and then shared by
+// every caller. It must not be modified or freed, and stays valid until the
+// program exits. Safe to call from any number of threads. A failed extraction
+// isn't remembered, so the next call tries again.
+const BYTE *get_default_exe_icon_shared(BOOL allowEmbeddedPNGs, PDWORD bufLen);
+
+// Makes the default icon functions read the icon from the file at 'path'
+// instead of from the system's DLLs, e.g. the imageres.dll of a Wine prefix or
+// of an extracted Windows image. That's the only way to get it outside of
+// Windows. Group 3 is used if the file is named shell32.dll, and group 15
+// otherwise. The source can only be set once, and only before the default icon
+// is first asked for (on Windows; elsewhere, before it's first extracted);
+// after that the call fails with GET_EXE_ICON_ERROR_INVALID_ARGUMENT.
+BOOL get_default_exe_icon_set_source_utf8(PCSTR path);
+
+#endif
@@ -9,6 +9,8 @@
       "target_name": "getexeicon",
       "sources": [ 
          "../get-exe-icon.c",
+         "../get-exe-icon-batch.c",
+         "../get-exe-icon-scan.c",
          "node-get-exe-icon.cpp",
       ],
       'defines': [ 'NAPI_DISABLE_CPP_EXCEPTIONS' ]
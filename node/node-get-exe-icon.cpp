@@ -1,14 +1,33 @@
 #include <napi.h>
 
+#include <string>
+#include <vector>
+
 extern "C" {
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "../get-exe-icon.h"
+#include "../get-exe-icon-batch.h"
+#include "../get-exe-icon-scan.h"
 }
 
 namespace getexeicon {
 	Napi::Buffer<char> IconFromFileWrapped(const Napi::CallbackInfo& info);
+	Napi::Buffer<char> IconFromBufferWrapped(const Napi::CallbackInfo& info);
+#ifdef _WIN32
 	Napi::Buffer<char> IconFromPidWrapped(const Napi::CallbackInfo& info);
+#endif
 	Napi::Buffer<char> DefaultExeIconWrapped(const Napi::CallbackInfo& info);
+	Napi::Value SetDefaultExeIconSourceWrapped(const Napi::CallbackInfo& info);
+	Napi::Value IconFromFileAsyncWrapped(const Napi::CallbackInfo& info);
+	Napi::Value IconFromBufferAsyncWrapped(const Napi::CallbackInfo& info);
+	Napi::Value IconsFromFilesAsyncWrapped(const Napi::CallbackInfo& info);
+	Napi::Value ScanDirectoryWrapped(const Napi::CallbackInfo& info);
+#ifdef _WIN32
+	Napi::Value IconFromPidAsyncWrapped(const Napi::CallbackInfo& info);
+#endif
+	Napi::Value DefaultExeIconAsyncWrapped(const Napi::CallbackInfo& info);
 	Napi::Object Init(Napi::Env env, Napi::Object exports);
 }
 
@@ -19,6 +38,374 @@ struct IcoBufFinalizer
 	}
 };
 
+static const char *ErrorCode(GetExeIconError error)
+{
+	// No default, so that -Wswitch points out codes added to the enum
+	switch (error) {
+	case GET_EXE_ICON_OK:                     return "OK";
+	case GET_EXE_ICON_ERROR_INVALID_ARGUMENT: return "INVALID_ARGUMENT";
+	case GET_EXE_ICON_ERROR_OPEN_FAILED:      return "OPEN_FAILED";
+	case GET_EXE_ICON_ERROR_READ_FAILED:      return "READ_FAILED";
+	case GET_EXE_ICON_ERROR_NOT_PE:           return "NOT_PE";
+	case GET_EXE_ICON_ERROR_NO_ICON:          return "NO_ICON";
+	case GET_EXE_ICON_ERROR_TOO_LARGE:        return "TOO_LARGE";
+	case GET_EXE_ICON_ERROR_OUT_OF_MEMORY:    return "OUT_OF_MEMORY";
+	case GET_EXE_ICON_ERROR_BUFFER_TOO_SMALL: return "BUFFER_TOO_SMALL";
+	case GET_EXE_ICON_ERROR_UNSUPPORTED:      return "UNSUPPORTED";
+	case GET_EXE_ICON_ERROR_LIMIT_EXCEEDED:   return "LIMIT_EXCEEDED";
+	case GET_EXE_ICON_ERROR_BAD_ARCHIVE:      return "BAD_ARCHIVE";
+	}
+	return "UNKNOWN";
+}
+
+// Runs an extraction on the libuv thread pool, and settles a promise with its
+// ICO (handed to a Buffer without copying, as the synchronous functions do)
+// or an Error whose 'code' says why it failed.
+class IconWorker : public Napi::AsyncWorker
+{
+public:
+	IconWorker(Napi::Env env, const char *errorMessage)
+		: Napi::AsyncWorker(env, errorMessage),
+		  deferred(Napi::Promise::Deferred::New(env)),
+		  errorMessage(errorMessage) {}
+
+	~IconWorker() {
+		free(icoBuf);
+	}
+
+	Napi::Promise Promise() {
+		return deferred.Promise();
+	}
+
+protected:
+	// Does the extraction, on a thread pool thread
+	virtual PBYTE Extract(PDWORD bufLen) = 0;
+
+	void Execute() override {
+		icoBuf = Extract(&icoBufLen);
+		error = get_exe_icon_last_error();
+	}
+
+	void OnOK() override {
+		if (!icoBuf) {
+			Napi::Error e = Napi::Error::New(Env(), errorMessage);
+			e.Set("code", Napi::String::New(Env(), ErrorCode(error)));
+			deferred.Reject(e.Value());
+			return;
+		}
+
+		PBYTE buf = icoBuf;
+		icoBuf = NULL;
+		IcoBufFinalizer f;
+		deferred.Resolve(Napi::Buffer<char>::New<IcoBufFinalizer, void>(Env(), (char *)buf, (size_t)icoBufLen, f, NULL));
+	}
+
+	void OnError(const Napi::Error& e) override {
+		deferred.Reject(e.Value());
+	}
+
+private:
+	Napi::Promise::Deferred deferred;
+	const char *errorMessage;
+	PBYTE icoBuf = NULL;
+	DWORD icoBufLen = 0;
+	GetExeIconError error = GET_EXE_ICON_OK;
+};
+
+class FileIconWorker : public IconWorker
+{
+public:
+	FileIconWorker(Napi::Env env, std::u16string path, bool allowEmbeddedPNGs)
+		: IconWorker(env, "iconFromFile failed"), path(path), allowEmbeddedPNGs(allowEmbeddedPNGs) {}
+
+protected:
+	PBYTE Extract(PDWORD bufLen) override {
+		return get_exe_icon_from_file_utf16((PCWSTR)path.c_str(), allowEmbeddedPNGs, bufLen);
+	}
+
+private:
+	std::u16string path;
+	bool allowEmbeddedPNGs;
+};
+
+// Holds a reference to the buffer until the extraction is done, so that it
+// isn't collected while the thread pool reads it
+class BufferIconWorker : public IconWorker
+{
+public:
+	BufferIconWorker(Napi::Env env, Napi::Buffer<char> exeBuf, bool allowEmbeddedPNGs)
+		: IconWorker(env, "iconFromBuffer failed"),
+		  exeBufRef(Napi::Persistent(exeBuf)),
+		  data(exeBuf.Data()),
+		  len(exeBuf.Length()),
+		  allowEmbeddedPNGs(allowEmbeddedPNGs) {}
+
+protected:
+	PBYTE Extract(PDWORD bufLen) override {
+		return get_exe_icon_from_memory(data, len, allowEmbeddedPNGs, bufLen);
+	}
+
+private:
+	Napi::Reference<Napi::Buffer<char>> exeBufRef;
+	const char *data;
+	size_t len;
+	bool allowEmbeddedPNGs;
+};
+
+#ifdef _WIN32
+class PidIconWorker : public IconWorker
+{
+public:
+	PidIconWorker(Napi::Env env, int pid, bool allowEmbeddedPNGs)
+		: IconWorker(env, "iconFromPid failed"), pid(pid), allowEmbeddedPNGs(allowEmbeddedPNGs) {}
+
+protected:
+	PBYTE Extract(PDWORD bufLen) override {
+		return get_exe_icon_from_pid(pid, allowEmbeddedPNGs, bufLen);
+	}
+
+private:
+	int pid;
+	bool allowEmbeddedPNGs;
+};
+#endif
+
+class DefaultIconWorker : public IconWorker
+{
+public:
+	DefaultIconWorker(Napi::Env env, bool allowEmbeddedPNGs)
+		: IconWorker(env, "defaultExeIcon failed"), allowEmbeddedPNGs(allowEmbeddedPNGs) {}
+
+protected:
+	PBYTE Extract(PDWORD bufLen) override {
+		return get_default_exe_icon(allowEmbeddedPNGs, bufLen);
+	}
+
+private:
+	bool allowEmbeddedPNGs;
+};
+
+// Extracts the icons of many files with get_exe_icons_batch(), whose own
+// threads do the work while this worker's thread pool thread waits for them
+// (and does its share). The promise resolves to an array with a Buffer for
+// each file, or null for files whose icon couldn't be extracted.
+class BatchIconWorker : public Napi::AsyncWorker
+{
+public:
+	BatchIconWorker(Napi::Env env, std::vector<std::string> paths, const GetExeIconBatchOptions& options)
+		: Napi::AsyncWorker(env, "iconsFromFiles"),
+		  deferred(Napi::Promise::Deferred::New(env)),
+		  paths(paths),
+		  options(options),
+		  results(paths.size()) {}
+
+	~BatchIconWorker() {
+		for (GetExeIconBatchResult& result : results) {
+			free(result.icoBuf);
+		}
+	}
+
+	Napi::Promise Promise() {
+		return deferred.Promise();
+	}
+
+protected:
+	void Execute() override {
+		std::vector<PCSTR> pathPtrs;
+		for (const std::string& path : paths) {
+			pathPtrs.push_back(path.c_str());
+		}
+		get_exe_icons_batch(pathPtrs.data(), pathPtrs.size(), &options, results.data());
+	}
+
+	void OnOK() override {
+		Napi::Array icons = Napi::Array::New(Env(), results.size());
+		for (uint32_t i = 0; i < (uint32_t)results.size(); i++) {
+			GetExeIconBatchResult& result = results[i];
+			if (!result.icoBuf) {
+				icons.Set(i, Env().Null());
+				continue;
+			}
+
+			PBYTE buf = result.icoBuf;
+			result.icoBuf = NULL;
+			IcoBufFinalizer f;
+			icons.Set(i, Napi::Buffer<char>::New<IcoBufFinalizer, void>(Env(), (char *)buf, (size_t)result.bufLen, f, NULL));
+		}
+		deferred.Resolve(icons);
+	}
+
+	void OnError(const Napi::Error& e) override {
+		deferred.Reject(e.Value());
+	}
+
+private:
+	Napi::Promise::Deferred deferred;
+	std::vector<std::string> paths;
+	GetExeIconBatchOptions options;
+	std::vector<GetExeIconBatchResult> results;
+};
+
+// The async iterator returned by scanDirectory(). Each next() waits for a
+// result of the GetExeIconScan on the thread pool. Since the scan's threads
+// stop when results aren't being taken, a consumer that awaits each result
+// before asking for the next one (as for-await does) gets backpressure for
+// free.
+class DirectoryScan : public Napi::ObjectWrap<DirectoryScan>
+{
+public:
+	static void Define(Napi::Env env) {
+		Napi::Function ctor = DefineClass(env, "DirectoryScan", {
+			InstanceMethod("next", &DirectoryScan::Next),
+			InstanceMethod("return", &DirectoryScan::Return),
+			InstanceMethod(Napi::Symbol::WellKnown(env, "asyncIterator"), &DirectoryScan::Iterator),
+		});
+		env.SetInstanceData(new Napi::FunctionReference(Napi::Persistent(ctor)));
+	}
+
+	static Napi::Object New(Napi::Env env, GetExeIconScan *scan) {
+		Napi::FunctionReference *ctor = env.GetInstanceData<Napi::FunctionReference>();
+		return ctor->New({ Napi::External<GetExeIconScan>::New(env, scan) });
+	}
+
+	DirectoryScan(const Napi::CallbackInfo& info) : Napi::ObjectWrap<DirectoryScan>(info) {
+		if (info.Length() >= 1 && info[0].IsExternal()) {
+			scan = info[0].As<Napi::External<GetExeIconScan>>().Data();
+		}
+	}
+
+	~DirectoryScan() {
+		get_exe_icon_scan_close(scan);
+	}
+
+	// Called by a ScanNextWorker when its next() has settled
+	void NextDone(bool gotResult) {
+		pending--;
+		if (!gotResult) {
+			finished = true;
+		}
+		CloseIfIdle();
+	}
+
+	GetExeIconScan *scan = NULL;
+
+private:
+	Napi::Value Next(const Napi::CallbackInfo& info);
+
+	Napi::Value Return(const Napi::CallbackInfo& info) {
+		finished = true;
+		get_exe_icon_scan_cancel(scan);
+		CloseIfIdle();
+		return DoneResult(info.Env());
+	}
+
+	Napi::Value Iterator(const Napi::CallbackInfo& info) {
+		return info.This();
+	}
+
+	// Frees the scan and its threads as soon as it's over, rather than when
+	// the iterator is collected. It can't go while a next() is using it.
+	void CloseIfIdle() {
+		if (finished && pending == 0 && scan) {
+			get_exe_icon_scan_close(scan);
+			scan = NULL;
+		}
+	}
+
+	static Napi::Promise DoneResult(Napi::Env env) {
+		Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
+		Napi::Object iterResult = Napi::Object::New(env);
+		iterResult.Set("done", Napi::Boolean::New(env, true));
+		iterResult.Set("value", env.Undefined());
+		deferred.Resolve(iterResult);
+		return deferred.Promise();
+	}
+
+	unsigned pending = 0;
+	bool finished = false;
+};
+
+// Waits for one result of a DirectoryScan, and settles the promise returned
+// by its next() with { done, value: { path, icon } }. The icon is handed to
+// a Buffer without being copied. It's null for files that no icon could be
+// extracted from (with options.includeFailures), and 'error' says why.
+class ScanNextWorker : public Napi::AsyncWorker
+{
+public:
+	ScanNextWorker(Napi::Env env, DirectoryScan *owner, Napi::Object ownerObj)
+		: Napi::AsyncWorker(env, "scanDirectory"),
+		  deferred(Napi::Promise::Deferred::New(env)),
+		  owner(owner),
+		  ownerRef(Napi::Persistent(ownerObj)) {
+		memset(&result, 0, sizeof(result));
+	}
+
+	~ScanNextWorker() {
+		free(result.path);
+		free(result.icoBuf);
+	}
+
+	Napi::Promise Promise() {
+		return deferred.Promise();
+	}
+
+protected:
+	void Execute() override {
+		gotResult = get_exe_icon_scan_next(owner->scan, &result);
+	}
+
+	void OnOK() override {
+		Napi::Env env = Env();
+		Napi::Object iterResult = Napi::Object::New(env);
+		iterResult.Set("done", Napi::Boolean::New(env, !gotResult));
+
+		if (!gotResult) {
+			iterResult.Set("value", env.Undefined());
+		} else {
+			Napi::Object value = Napi::Object::New(env);
+			value.Set("path", Napi::String::New(env, result.path));
+			if (result.icoBuf) {
+				PBYTE buf = result.icoBuf;
+				result.icoBuf = NULL;
+				IcoBufFinalizer f;
+				value.Set("icon", Napi::Buffer<char>::New<IcoBufFinalizer, void>(env, (char *)buf, (size_t)result.bufLen, f, NULL));
+			} else {
+				value.Set("icon", env.Null());
+				value.Set("error", Napi::String::New(env, ErrorCode(result.error)));
+			}
+			iterResult.Set("value", value);
+		}
+
+		owner->NextDone(gotResult);
+		deferred.Resolve(iterResult);
+	}
+
+	void OnError(const Napi::Error& e) override {
+		owner->NextDone(false);
+		deferred.Reject(e.Value());
+	}
+
+private:
+	Napi::Promise::Deferred deferred;
+	DirectoryScan *owner;
+	Napi::ObjectReference ownerRef; // Keeps the owner from being collected
+	GetExeIconScanResult result;
+	bool gotResult = false;
+};
+
+Napi::Value DirectoryScan::Next(const Napi::CallbackInfo& info)
+{
+	if (finished || !scan) {
+		return DoneResult(info.Env());
+	}
+
+	pending++;
+	ScanNextWorker *worker = new ScanNextWorker(info.Env(), this, info.This().As<Napi::Object>());
+	Napi::Promise promise = worker->Promise();
+	worker->Queue();
+	return promise;
+}
+
 Napi::Buffer<char> getexeicon::IconFromFileWrapped(const Napi::CallbackInfo& info) 
 {
 	if (info.Length() < 1 || !info[0].IsString()) {
@@ -33,7 +420,7 @@ Napi::Buffer<char> getexeicon::IconFromFileWrapped(const Napi::CallbackInfo& inf
 	}
 
 	DWORD icoBufLen = 0;
-	PBYTE icoBuf = get_exe_icon_from_file_utf16((wchar_t *)path.c_str(), allowEmbeddedPNGs, &icoBufLen);
+	PBYTE icoBuf = get_exe_icon_from_file_utf16((PCWSTR)path.c_str(), allowEmbeddedPNGs, &icoBufLen);
 
 	if (!icoBuf) {
 		Napi::Error::New(info.Env(), "iconFromFile failed").ThrowAsJavaScriptException();
@@ -44,6 +431,32 @@ Napi::Buffer<char> getexeicon::IconFromFileWrapped(const Napi::CallbackInfo& inf
 	return Napi::Buffer<char>::New<IcoBufFinalizer, void>(info.Env(), (char *)icoBuf, (size_t)icoBufLen, f, NULL);
 }
 
+Napi::Buffer<char> getexeicon::IconFromBufferWrapped(const Napi::CallbackInfo& info) 
+{
+	if (info.Length() < 1 || !info[0].IsBuffer()) {
+		Napi::TypeError::New(info.Env(), "buffer expected").ThrowAsJavaScriptException();
+		return Napi::Buffer<char>::New(info.Env(), 0);
+	}
+	Napi::Buffer<char> exeBuf = info[0].As<Napi::Buffer<char>>();
+
+	bool allowEmbeddedPNGs = true;
+	if (info.Length() >= 2 && info[1].IsBoolean()) {
+		allowEmbeddedPNGs = info[1].As<Napi::Boolean>().Value();
+	}
+
+	DWORD icoBufLen = 0;
+	PBYTE icoBuf = get_exe_icon_from_memory(exeBuf.Data(), exeBuf.Length(), allowEmbeddedPNGs, &icoBufLen);
+
+	if (!icoBuf) {
+		Napi::Error::New(info.Env(), "iconFromBuffer failed").ThrowAsJavaScriptException();
+		return Napi::Buffer<char>::New(info.Env(), 0);
+	}
+
+	IcoBufFinalizer f;
+	return Napi::Buffer<char>::New<IcoBufFinalizer, void>(info.Env(), (char *)icoBuf, (size_t)icoBufLen, f, NULL);
+}
+
+#ifdef _WIN32
 Napi::Buffer<char> getexeicon::IconFromPidWrapped(const Napi::CallbackInfo& info) 
 {
 	if (info.Length() < 1 || !info[0].IsNumber()) {
@@ -68,6 +481,7 @@ Napi::Buffer<char> getexeicon::IconFromPidWrapped(const Napi::CallbackInfo& info
 	IcoBufFinalizer f;
 	return Napi::Buffer<char>::New<IcoBufFinalizer, void>(info.Env(), (char *)icoBuf, (size_t)icoBufLen, f, NULL);
 }
+#endif
 
 Napi::Buffer<char> getexeicon::DefaultExeIconWrapped(const Napi::CallbackInfo& info) 
 {
@@ -76,22 +490,209 @@ Napi::Buffer<char> getexeicon::DefaultExeIconWrapped(const Napi::CallbackInfo& i
 		allowEmbeddedPNGs = info[0].As<Napi::Boolean>().Value();
 	}
 
+	// The shared ICO is copied, since a Buffer can be written to
 	DWORD icoBufLen = 0;
-	PBYTE icoBuf = get_default_exe_icon(allowEmbeddedPNGs, &icoBufLen);
+	const BYTE *icoBuf = get_default_exe_icon_shared(allowEmbeddedPNGs, &icoBufLen);
 
 	if (!icoBuf) {
 		Napi::Error::New(info.Env(), "defaultExeIcon failed").ThrowAsJavaScriptException();
 		return Napi::Buffer<char>::New(info.Env(), 0);
 	}
 
-	IcoBufFinalizer f;
-	return Napi::Buffer<char>::New<IcoBufFinalizer, void>(info.Env(), (char *)icoBuf, (size_t)icoBufLen, f, NULL);
+	return Napi::Buffer<char>::Copy(info.Env(), (const char *)icoBuf, (size_t)icoBufLen);
+}
+
+Napi::Value getexeicon::SetDefaultExeIconSourceWrapped(const Napi::CallbackInfo& info)
+{
+	if (info.Length() < 1 || !info[0].IsString()) {
+		Napi::TypeError::New(info.Env(), "string file path expected").ThrowAsJavaScriptException();
+		return info.Env().Undefined();
+	}
+	std::string path = info[0].As<Napi::String>().Utf8Value();
+
+	if (!get_default_exe_icon_set_source_utf8(path.c_str())) {
+		Napi::Error e = Napi::Error::New(info.Env(), "setDefaultExeIconSource failed");
+		e.Set("code", Napi::String::New(info.Env(), ErrorCode(get_exe_icon_last_error())));
+		e.ThrowAsJavaScriptException();
+	}
+	return info.Env().Undefined();
+}
+
+Napi::Value getexeicon::IconFromFileAsyncWrapped(const Napi::CallbackInfo& info)
+{
+	if (info.Length() < 1 || !info[0].IsString()) {
+		Napi::TypeError::New(info.Env(), "string file path expected").ThrowAsJavaScriptException();
+		return info.Env().Undefined();
+	}
+	std::u16string path = info[0].As<Napi::String>().Utf16Value();
+
+	bool allowEmbeddedPNGs = true;
+	if (info.Length() >= 2 && info[1].IsBoolean()) {
+		allowEmbeddedPNGs = info[1].As<Napi::Boolean>().Value();
+	}
+
+	FileIconWorker *worker = new FileIconWorker(info.Env(), path, allowEmbeddedPNGs);
+	Napi::Promise promise = worker->Promise();
+	worker->Queue();
+	return promise;
+}
+
+Napi::Value getexeicon::IconFromBufferAsyncWrapped(const Napi::CallbackInfo& info)
+{
+	if (info.Length() < 1 || !info[0].IsBuffer()) {
+		Napi::TypeError::New(info.Env(), "buffer expected").ThrowAsJavaScriptException();
+		return info.Env().Undefined();
+	}
+	Napi::Buffer<char> exeBuf = info[0].As<Napi::Buffer<char>>();
+
+	bool allowEmbeddedPNGs = true;
+	if (info.Length() >= 2 && info[1].IsBoolean()) {
+		allowEmbeddedPNGs = info[1].As<Napi::Boolean>().Value();
+	}
+
+	BufferIconWorker *worker = new BufferIconWorker(info.Env(), exeBuf, allowEmbeddedPNGs);
+	Napi::Promise promise = worker->Promise();
+	worker->Queue();
+	return promise;
+}
+
+Napi::Value getexeicon::IconsFromFilesAsyncWrapped(const Napi::CallbackInfo& info)
+{
+	if (info.Length() < 1 || !info[0].IsArray()) {
+		Napi::TypeError::New(info.Env(), "array of file paths expected").ThrowAsJavaScriptException();
+		return info.Env().Undefined();
+	}
+	Napi::Array pathArray = info[0].As<Napi::Array>();
+	std::vector<std::string> paths;
+	for (uint32_t i = 0; i < pathArray.Length(); i++) {
+		Napi::Value path = pathArray.Get(i);
+		if (!path.IsString()) {
+			Napi::TypeError::New(info.Env(), "array of file paths expected").ThrowAsJavaScriptException();
+			return info.Env().Undefined();
+		}
+		paths.push_back(path.As<Napi::String>().Utf8Value());
+	}
+
+	// { concurrency, allowEmbeddedPNGs }. A concurrency of 0 (the default)
+	// uses one thread per CPU.
+	GetExeIconBatchOptions options;
+	memset(&options, 0, sizeof(options));
+	options.allowEmbeddedPNGs = TRUE;
+	if (info.Length() >= 2 && info[1].IsObject()) {
+		Napi::Object optionsObj = info[1].As<Napi::Object>();
+		Napi::Value concurrency = optionsObj.Get("concurrency");
+		if (concurrency.IsNumber()) {
+			int n = concurrency.As<Napi::Number>().Int32Value();
+			options.numThreads = n > 0 ? (DWORD)n : 0;
+		}
+		Napi::Value allowEmbeddedPNGs = optionsObj.Get("allowEmbeddedPNGs");
+		if (allowEmbeddedPNGs.IsBoolean()) {
+			options.allowEmbeddedPNGs = allowEmbeddedPNGs.As<Napi::Boolean>().Value();
+		}
+	}
+
+	BatchIconWorker *worker = new BatchIconWorker(info.Env(), paths, options);
+	Napi::Promise promise = worker->Promise();
+	worker->Queue();
+	return promise;
+}
+
+#ifdef _WIN32
+Napi::Value getexeicon::IconFromPidAsyncWrapped(const Napi::CallbackInfo& info)
+{
+	if (info.Length() < 1 || !info[0].IsNumber()) {
+		Napi::TypeError::New(info.Env(), "int pid expected").ThrowAsJavaScriptException();
+		return info.Env().Undefined();
+	}
+	int pid = info[0].As<Napi::Number>().Int32Value();
+
+	bool allowEmbeddedPNGs = true;
+	if (info.Length() >= 2 && info[1].IsBoolean()) {
+		allowEmbeddedPNGs = info[1].As<Napi::Boolean>().Value();
+	}
+
+	PidIconWorker *worker = new PidIconWorker(info.Env(), pid, allowEmbeddedPNGs);
+	Napi::Promise promise = worker->Promise();
+	worker->Queue();
+	return promise;
+}
+#endif
+
+Napi::Value getexeicon::DefaultExeIconAsyncWrapped(const Napi::CallbackInfo& info)
+{
+	bool allowEmbeddedPNGs = true;
+	if (info.Length() >= 1 && info[0].IsBoolean()) {
+		allowEmbeddedPNGs = info[0].As<Napi::Boolean>().Value();
+	}
+
+	DefaultIconWorker *worker = new DefaultIconWorker(info.Env(), allowEmbeddedPNGs);
+	Napi::Promise promise = worker->Promise();
+	worker->Queue();
+	return promise;
+}
+
+Napi::Value getexeicon::ScanDirectoryWrapped(const Napi::CallbackInfo& info)
+{
+	if (info.Length() < 1 || !info[0].IsString()) {
+		Napi::TypeError::New(info.Env(), "string directory path expected").ThrowAsJavaScriptException();
+		return info.Env().Undefined();
+	}
+	std::string root = info[0].As<Napi::String>().Utf8Value();
+
+	// { concurrency, allowEmbeddedPNGs, maxPending, includeFailures }
+	GetExeIconScanOptions options;
+	memset(&options, 0, sizeof(options));
+	options.allowEmbeddedPNGs = TRUE;
+	if (info.Length() >= 2 && info[1].IsObject()) {
+		Napi::Object optionsObj = info[1].As<Napi::Object>();
+		Napi::Value concurrency = optionsObj.Get("concurrency");
+		if (concurrency.IsNumber()) {
+			int n = concurrency.As<Napi::Number>().Int32Value();
+			options.numThreads = n > 0 ? (DWORD)n : 0;
+		}
+		Napi::Value maxPending = optionsObj.Get("maxPending");
+		if (maxPending.IsNumber()) {
+			int n = maxPending.As<Napi::Number>().Int32Value();
+			options.maxPending = n > 0 ? (DWORD)n : 0;
+		}
+		Napi::Value allowEmbeddedPNGs = optionsObj.Get("allowEmbeddedPNGs");
+		if (allowEmbeddedPNGs.IsBoolean()) {
+			options.allowEmbeddedPNGs = allowEmbeddedPNGs.As<Napi::Boolean>().Value();
+		}
+		Napi::Value includeFailures = optionsObj.Get("includeFailures");
+		if (includeFailures.IsBoolean()) {
+			options.includeFailures = includeFailures.As<Napi::Boolean>().Value();
+		}
+	}
+
+	GetExeIconScan *scan = get_exe_icon_scan_open(root.c_str(), &options);
+	if (!scan) {
+		Napi::Error e = Napi::Error::New(info.Env(), "scanDirectory failed");
+		e.Set("code", Napi::String::New(info.Env(), ErrorCode(get_exe_icon_last_error())));
+		e.ThrowAsJavaScriptException();
+		return info.Env().Undefined();
+	}
+
+	return DirectoryScan::New(info.Env(), scan);
 }
 
 Napi::Object Init(Napi::Env env, Napi::Object exports) {
+	DirectoryScan::Define(env);
 	exports.Set("getIconFromFile", Napi::Function::New(env, getexeicon::IconFromFileWrapped));
+	exports.Set("getIconFromBuffer", Napi::Function::New(env, getexeicon::IconFromBufferWrapped));
+#ifdef _WIN32
 	exports.Set("getIconFromPid", Napi::Function::New(env, getexeicon::IconFromPidWrapped));
+#endif
 	exports.Set("getDefaultExeIcon", Napi::Function::New(env, getexeicon::DefaultExeIconWrapped));
+	exports.Set("setDefaultExeIconSource", Napi::Function::New(env, getexeicon::SetDefaultExeIconSourceWrapped));
+	exports.Set("getIconFromFileAsync", Napi::Function::New(env, getexeicon::IconFromFileAsyncWrapped));
+	exports.Set("getIconFromBufferAsync", Napi::Function::New(env, getexeicon::IconFromBufferAsyncWrapped));
+	exports.Set("getIconsFromFilesAsync", Napi::Function::New(env, getexeicon::IconsFromFilesAsyncWrapped));
+	exports.Set("scanDirectory", Napi::Function::New(env, getexeicon::ScanDirectoryWrapped));
+#ifdef _WIN32
+	exports.Set("getIconFromPidAsync", Napi::Function::New(env, getexeicon::IconFromPidAsyncWrapped));
+#endif
+	exports.Set("getDefaultExeIconAsync", Napi::Function::New(env, getexeicon::DefaultExeIconAsyncWrapped));
 	return exports;
 }
 
@@ -2,11 +2,13 @@ const geticon = require('./build/Release/getexeicon');
 const fs = require('fs');
 
 const icoByFile = geticon.getIconFromFile("C:\\Windows\\explorer.exe");
+const icoByBuffer = geticon.getIconFromBuffer(fs.readFileSync("C:\\Windows\\explorer.exe"));
 //const icoByPid = geticon.getIconFromPid(8764);
 //const icoByPidNoPNG = geticon.getIconFromPid(8764, false);
 //const icoDefault = geticon.getDefaultExeIcon();
 
 console.log(icoByFile);
+console.log(icoByBuffer);
 //console.log(icoByPid);
 //console.log(icoByPidNoPNG);
 //console.log(icoDefault);
@@ -15,6 +17,10 @@ fs.writeFile("build\\out_file.ico", icoByFile, function(err) {
 	console.log("Saving byFile to build\\out_file.ico. Error:", err);
 });
 
+fs.writeFile("build\\out_buffer.ico", icoByBuffer, function(err) {
+	console.log("Saving byBuffer to build\\out_buffer.ico. Error:", err);
+});
+
 //fs.writeFile("build\\out_pid.ico", icoByPid, function(err) {
 //	console.log("Saving byPid to build\\out_pid.ico. Error:", err);
 //});
@@ -26,3 +32,27 @@ fs.writeFile("build\\out_file.ico", icoByFile, function(err) {
 //fs.writeFile("build\\default.ico", icoDefault, function(err) {
 //	console.log("Saving default to build\\default.ico. Error:", err);
 //});
+
+geticon.getIconFromFileAsync("C:\\Windows\\explorer.exe").then(function(ico) {
+	console.log("Async byFile:", ico);
+}, function(err) {
+	console.log("Async byFile failed:", err.message, err.code);
+});
+
+geticon.getIconsFromFilesAsync([
+	"C:\\Windows\\explorer.exe",
+	"C:\\Windows\\write.exe",
+	"C:\\Windows\\does-not-exist.exe",
+], { concurrency: 2 }).then(function(icos) {
+	console.log("Async batch:", icos);
+});
+
+(async function() {
+	let count = 0;
+	for await (const { path, icon } of geticon.scanDirectory("C:\\Windows", { maxPending: 16 })) {
+		console.log("Scan:", path, icon.length);
+		if (++count == 20) {
+			break;
+		}
+	}
+})();
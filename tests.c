@@ -1,59 +1,115 @@
-﻿#define WIN32_LEAN_AND_MEAN
+﻿#define _CRT_SECURE_NO_WARNINGS
+#define WIN32_LEAN_AND_MEAN
 #include "get-exe-icon.h"
+#include "get-exe-icon-batch.h"
+#include "get-exe-icon-cache.h"
+#include "get-exe-icon-decode.h"
+#include "get-exe-icon-resample.h"
+#include "get-exe-icon-png.h"
+#include "get-exe-icon-deflate.h"
+#include "get-exe-icon-store.h"
+#include "get-exe-icon-scan.h"
+#include "get-exe-icon-zip.h"
+#include "get-exe-icon-process.h"
+#include "get-exe-icon-phash.h"
+#include "get-exe-icon-pack.h"
+#include "gen-pe.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define U16(str) L##str
+#define last_error() ((int)GetLastError())
+#define current_pid() GetCurrentProcessId()
+#define make_dir(path) _mkdir(path)
+#else
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define U16(str) u##str
+#define last_error() errno
+#define current_pid() ((DWORD)getpid())
+#define make_dir(path) mkdir(path, 0755)
+#endif
 
 #define fatal(format, ...) do { \
 	fprintf(stderr, format, ##__VA_ARGS__); \
 	exit(1); \
 } while (0)
 
-void write_file(const wchar_t *path, char *buf, size_t len)
+// fopen() with a UTF-8 path
+FILE * open_file(const char *path, const char *mode)
+{
+#ifdef _WIN32
+	wchar_t wPath[1024], wMode[8];
+	if (MultiByteToWideChar(CP_UTF8, 0, path, -1, wPath, 1024) <= 0
+		|| MultiByteToWideChar(CP_UTF8, 0, mode, -1, wMode, 8) <= 0)
+	{
+		return NULL;
+	}
+	return _wfopen(wPath, wMode);
+#else
+	return fopen(path, mode);
+#endif
+}
+
+void write_file(const char *path, char *buf, size_t len)
 {
-	FILE *f = NULL;
-	if (_wfopen_s(&f, path, L"wb") || !f) {
-		fatal("Cannot open file '%S'.\n", path);
+	FILE *f = open_file(path, "wb");
+	if (!f) {
+		fatal("Cannot open file '%s'.\n", path);
 	}
 	if (fwrite(buf, len, 1, f) != 1) {
-		fatal("Failed to write file '%S'.\n", path);
+		fatal("Failed to write file '%s'.\n", path);
 	}
 	fclose(f);
 }
 
-char * read_file(const wchar_t *path, size_t *len)
+char * read_file(const char *path, size_t *len)
 {
-	FILE *f = NULL;
-	if (_wfopen_s(&f, path, L"rb") || !f) {
-		fatal("Cannot open file '%S'.\n", path);
+	FILE *f = open_file(path, "rb");
+	if (!f) {
+		fatal("Cannot open file '%s'.\n", path);
 	}
 
 	if (fseek(f, 0, SEEK_END)) {
-		fatal("Cannot read file '%S'. (1)\n", path);
+		fatal("Cannot read file '%s'. (1)\n", path);
 	}
 
 	long llen = ftell(f);
 	if (llen < 0) {
-		fatal("Cannot read file '%S'. (2)\n", path);
+		fatal("Cannot read file '%s'. (2)\n", path);
 	}
 
 	if (fseek(f, 0, SEEK_SET)) {
-		fatal("Cannot read file '%S'. (3)\n", path);
+		fatal("Cannot read file '%s'. (3)\n", path);
 	}
 
 	if (llen == 0) {
+		fclose(f);
 		*len = 0;
 		return NULL;
 	}
 
 	char *buf = (char *)malloc(llen);
 	if (fread(buf, llen, 1, f) != 1) {
-		fatal("Cannot read file '%S'. (4)\n", path);
+		fatal("Cannot read file '%s'. (4)\n", path);
 	}
+	fclose(f);
 
 	*len = llen;
 	return buf;
 }
 
+// GetExeIconReader callback reading from a FILE *
+BOOL file_read_at(void *ctx, uint64_t offset, DWORD len, void *dst)
+{
+	FILE *f = (FILE *)ctx;
+	return fseek(f, (long)offset, SEEK_SET) == 0 && fread(dst, len, 1, f) == 1;
+}
+
 void assert_bufs_equal(char *a, size_t alen, char *b, size_t blen)
 {
 	if (alen != blen) {
@@ -70,7 +126,7 @@ void assert_bufs_equal(char *a, size_t alen, char *b, size_t blen)
 void assert_out_nonnull(char *outBuf, size_t outLen)
 {
 	if (outBuf == NULL || outLen == 0) {
-		fatal("Failed to get icon (last error: %d)\n", GetLastError());
+		fatal("Failed to get icon (last error: %d)\n", last_error());
 	}
 }
 
@@ -83,6 +139,215 @@ void free_s(char **p)
 	*p = NULL;
 }
 
+uint32_t read_le32(const void *p)
+{
+	const BYTE *b = (const BYTE *)p;
+	return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+// Builds a DIB as stored in an ICO, with pseudo-random pixels, palette and
+// mask. Free it with free().
+char * make_dib(DWORD width, DWORD height, DWORD bitCount, size_t *len)
+{
+	DWORD numColors = bitCount <= 8 ? 1u << bitCount : 0;
+	size_t stride = (width * bitCount + 31) / 32 * 4;
+	size_t maskStride = (width + 31) / 32 * 4;
+	*len = 40 + numColors * 4 + (stride + maskStride) * height;
+
+	BYTE *dib = (BYTE *)calloc(1, *len);
+	DWORD header[] = { 40, width, height * 2, 1 | (bitCount << 16) };
+	for (int i = 0; i < 16; i++) {
+		dib[i] = (BYTE)(header[i / 4] >> (8 * (i % 4)));
+	}
+
+	uint32_t seed = width * 2654435761u + bitCount;
+	for (size_t i = 40; i < *len; i++) {
+		seed = seed * 1103515245 + 12345;
+		dib[i] = (BYTE)(seed >> 16);
+	}
+	return (char *)dib;
+}
+
+void write_le16(void *p, uint32_t v)
+{
+	BYTE *b = (BYTE *)p;
+	b[0] = (BYTE)v;
+	b[1] = (BYTE)(v >> 8);
+}
+
+void write_le32(void *p, uint32_t v)
+{
+	write_le16(p, v);
+	write_le16((BYTE *)p + 2, v >> 16);
+}
+
+// Stats hook counting the extractions that succeeded (ctx[0]) and failed
+// (ctx[1])
+void count_extractions(const GetExeIconStats *stats, void *ctx)
+{
+	DWORD *counts = (DWORD *)ctx;
+	counts[stats->error == GET_EXE_ICON_OK ? 0 : 1] ++;
+}
+
+// Builds a PE32 file whose only resources are 'numGroups' icon groups, with
+// groupSizes[g] images each. Group g is named groupNames[g] (uppercase ASCII),
+// or has the ID 100 + g if that's NULL; named groups are listed first, by
+// name. Image i of the file (counting across groups) is
+// make_dib(icon_dim(i), icon_dim(i), 32), with the ID i + 1. Free it with
+// free().
+#define icon_dim(i) (16 + ((i) % 16) * 2)
+
+char * make_pe(const DWORD *groupSizes, const char *const *groupNames, DWORD numGroups, size_t *len)
+{
+	DWORD numIcons = 0;
+	for (DWORD g = 0; g < numGroups; g++) {
+		numIcons += groupSizes[g];
+	}
+
+	ResourceType types[2];
+	types[0].type = 3;
+	types[0].count = (int)numIcons;
+	types[0].items = (Resource *)calloc(numIcons ? numIcons : 1, sizeof(Resource));
+	types[1].type = 14;
+	types[1].count = (int)numGroups;
+	types[1].items = (Resource *)calloc(numGroups ? numGroups : 1, sizeof(Resource));
+
+	DWORD icon = 0;
+	for (DWORD g = 0; g < numGroups; g++) {
+		Resource *group = &types[1].items[g];
+		group->id = 100 + g;
+		if (groupNames[g]) {
+			snprintf(group->name, sizeof(group->name), "%s", groupNames[g]);
+		}
+		group->size = 6 + 14 * groupSizes[g];
+		group->data = (uint8_t *)calloc(1, group->size);
+		write_le16(group->data + 2, 1);
+		write_le16(group->data + 4, groupSizes[g]);
+		for (DWORD e = 0; e < groupSizes[g]; e++, icon++) {
+			size_t dibLen;
+			Resource *image = &types[0].items[icon];
+			image->id = icon + 1;
+			image->data = (uint8_t *)make_dib(icon_dim(icon), icon_dim(icon), 32, &dibLen);
+			image->size = (uint32_t)dibLen;
+
+			BYTE *groupEntry = group->data + 6 + 14 * e;
+			groupEntry[0] = groupEntry[1] = (BYTE)icon_dim(icon);
+			write_le16(groupEntry + 4, 1);
+			write_le16(groupEntry + 6, 32);
+			write_le32(groupEntry + 8, image->size);
+			write_le16(groupEntry + 12, icon + 1);
+		}
+	}
+	qsort(types[1].items, numGroups, sizeof(Resource), compare_resources);
+
+	uint32_t rsrcLen, rawSize;
+	uint8_t *rsrc = build_rsrc(types, 2, 1, PE_RSRC_RVA, &rsrcLen);
+	uint8_t headers[PE_HEADERS_SIZE];
+	uint32_t rawPointer = build_pe_headers(headers, 0, rsrcLen, 0, &rawSize);
+	*len = (size_t)rawPointer + rawSize;
+	char *pe = (char *)calloc(1, *len);
+	memcpy(pe, headers, sizeof(headers));
+	memcpy(pe + rawPointer, rsrc, rsrcLen);
+
+	for (int t = 0; t < 2; t++) {
+		for (int k = 0; k < types[t].count; k++) {
+			free(types[t].items[k].data);
+		}
+		free(types[t].items);
+	}
+	free(rsrc);
+	return pe;
+}
+
+// An entry for make_zip(). Deflated entries are compressed with
+// get_exe_icon_zlib_compress(). 'flags' is the general purpose bit flag, and
+// crcXor is XORed into the CRC-32 that's recorded, to corrupt it.
+typedef struct
+{
+	const char *name;
+	const char *data;
+	size_t len;
+	BOOL deflate;
+	DWORD flags;
+	uint32_t crcXor;
+} ZipEntry;
+
+// Builds a ZIP archive of 'count' entries, after 'prefixLen' bytes of junk
+// (like the program of a self-extracting archive). Free it with free().
+char * make_zip(const ZipEntry *entries, DWORD count, size_t prefixLen, size_t *len)
+{
+	char **zlibBufs = (char **)calloc(count, sizeof(char *));
+	size_t *zlibLens = (size_t *)calloc(count, sizeof(size_t));
+	size_t total = prefixLen + 22;
+	for (DWORD i = 0; i < count; i++) {
+		if (entries[i].deflate) {
+			zlibBufs[i] = (char *)get_exe_icon_zlib_compress(entries[i].data, entries[i].len, 6, &zlibLens[i]);
+		}
+		size_t dataLen = entries[i].deflate ? zlibLens[i] - 6 : entries[i].len;
+		total += 30 + 46 + 2 * strlen(entries[i].name) + dataLen;
+	}
+
+	BYTE *zip = (BYTE *)calloc(1, total);
+	memset(zip, 'x', prefixLen);
+	size_t pos = prefixLen;
+	size_t *localOffsets = (size_t *)calloc(count, sizeof(size_t));
+	for (int central = 0; central <= 1; central++) {
+		size_t cdStart = pos;
+		for (DWORD i = 0; i < count; i++) {
+			const ZipEntry *e = &entries[i];
+			size_t nameLen = strlen(e->name);
+
+			// Deflated data is the zlib stream without its 2 byte header
+			// and Adler-32
+			const char *data = e->deflate ? zlibBufs[i] + 2 : e->data;
+			size_t dataLen = e->deflate ? zlibLens[i] - 6 : e->len;
+
+			BYTE *h = zip + pos;
+			size_t fields = central ? 16 : 14;
+			if (central) {
+				write_le32(h, 0x02014b50);
+				write_le16(h + 4, 20);
+				write_le32(h + 42, (uint32_t)(localOffsets[i] - prefixLen));
+			} else {
+				write_le32(h, 0x04034b50);
+				localOffsets[i] = pos;
+			}
+			BYTE *f = h + fields - 14;
+			write_le16(f + 4, 20);
+			write_le16(f + 6, e->flags);
+			write_le16(f + 8, e->deflate ? 8 : 0);
+			write_le32(f + 14, get_exe_icon_crc32(0, e->data, e->len) ^ e->crcXor);
+			write_le32(f + 18, (uint32_t)dataLen);
+			write_le32(f + 22, (uint32_t)e->len);
+			write_le16(f + 26, (uint32_t)nameLen);
+			pos += central ? 46 : 30;
+			memcpy(zip + pos, e->name, nameLen);
+			pos += nameLen;
+			if (!central) {
+				memcpy(zip + pos, data, dataLen);
+				pos += dataLen;
+			}
+		}
+		if (central) {
+			BYTE *eocd = zip + pos;
+			write_le32(eocd, 0x06054b50);
+			write_le16(eocd + 8, count);
+			write_le16(eocd + 10, count);
+			write_le32(eocd + 12, (uint32_t)(pos - cdStart));
+			write_le32(eocd + 16, (uint32_t)(cdStart - prefixLen));
+		}
+	}
+
+	for (DWORD i = 0; i < count; i++) {
+		free(zlibBufs[i]);
+	}
+	free(zlibBufs);
+	free(zlibLens);
+	free(localOffsets);
+	*len = total;
+	return (char *)zip;
+}
+
 int main(int argc, char **argv)
 {
 	size_t expLen = 0;
@@ -92,22 +357,34 @@ int main(int argc, char **argv)
 	// Dummy exe paths. The path contains some non-ASCII characters to test
 	// UTF-8 / Unicode path lookups. These exes do nothing when executed;
 	// they're just there to have an icon within them.
-	const char *dummyExplorerPath = "testdata\\dummyexes_\xf0\x9f\x98\xba\\dummy_exe_with_explorer_icon.exe";
-	const wchar_t *dummyExplorerPathW = L"testdata\\dummyexes_\U0001f63a\\dummy_exe_with_explorer_icon.exe";
-	const char *dummyWritePath = "testdata\\dummyexes_\xf0\x9f\x98\xba\\dummy_exe_with_write_icon.exe";
-		
+	const char *dummyExplorerPath = "testdata/dummyexes_\xf0\x9f\x98\xba/dummy_exe_with_explorer_icon.exe";
+	const WCHAR *dummyExplorerPathW = (const WCHAR *)U16("testdata/dummyexes_\U0001f63a/dummy_exe_with_explorer_icon.exe");
+	const char *dummyWritePath = "testdata/dummyexes_\xf0\x9f\x98\xba/dummy_exe_with_write_icon.exe";
+
+	// ---------------
+	printf("Test: get_icon_from_file_utf16\n");
+
+	outBuf = (char *)get_exe_icon_from_file_utf16(dummyExplorerPathW, TRUE, &outLen);
+	assert_out_nonnull(outBuf, outLen);
+
+	expBuf = read_file("testdata/explorer_expected.ico", &expLen);
+	assert_bufs_equal(expBuf, expLen, outBuf, outLen);
+
+	free_s(&outBuf);
+	free_s(&expBuf);
+
 	printf("Implicitly testing get_icon_from_file_utf16 via utf8...\n");
 
 	// ---------------
 	printf("Test: get_icon_from_file_utf8 with invalid path\n");
-	outBuf = get_exe_icon_from_file_utf8(NULL, TRUE, &outLen);
+	outBuf = (char *)get_exe_icon_from_file_utf8(NULL, TRUE, &outLen);
 	if (outBuf != NULL) {
 		fatal("Expected null return value.\n");
 	}
 
 	// ---------------
 	printf("Test: get_icon_from_file_utf8 with invalid len\n");
-	outBuf = get_exe_icon_from_file_utf8(dummyExplorerPath, TRUE, NULL);
+	outBuf = (char *)get_exe_icon_from_file_utf8(dummyExplorerPath, TRUE, NULL);
 	if (outBuf != NULL) {
 		fatal("Expected null return value.\n");
 	}
@@ -115,11 +392,11 @@ int main(int argc, char **argv)
 	// ---------------
 	printf("Test: get_icon_from_file_utf8 with PNGs on icon that has PNGs\n");
 
-	outBuf = get_exe_icon_from_file_utf8(dummyExplorerPath, TRUE, &outLen);
+	outBuf = (char *)get_exe_icon_from_file_utf8(dummyExplorerPath, TRUE, &outLen);
 	assert_out_nonnull(outBuf, outLen);
-	write_file(L"testdata\\explorer_out.ico", outBuf, outLen);
+	write_file("testdata/explorer_out.ico", outBuf, outLen);
 
-	expBuf = read_file(L"testdata\\explorer_expected.ico", &expLen);
+	expBuf = read_file("testdata/explorer_expected.ico", &expLen);
 	assert_bufs_equal(expBuf, expLen, outBuf, outLen);
 
 	free_s(&outBuf);
@@ -128,11 +405,11 @@ int main(int argc, char **argv)
 	// ---------------
 	printf("Test: get_icon_from_file_utf8 without PNGs on icon that has PNGs\n");
 
-	outBuf = get_exe_icon_from_file_utf8(dummyExplorerPath, FALSE, &outLen);
+	outBuf = (char *)get_exe_icon_from_file_utf8(dummyExplorerPath, FALSE, &outLen);
 	assert_out_nonnull(outBuf, outLen);
-	write_file(L"testdata\\explorer_nopng_out.ico", outBuf, outLen);
+	write_file("testdata/explorer_nopng_out.ico", outBuf, outLen);
 
-	expBuf = read_file(L"testdata\\explorer_nopng_expected.ico", &expLen);
+	expBuf = read_file("testdata/explorer_nopng_expected.ico", &expLen);
 	assert_bufs_equal(expBuf, expLen, outBuf, outLen);
 
 	free_s(&outBuf);
@@ -141,11 +418,11 @@ int main(int argc, char **argv)
 	// ---------------
 	printf("Test: get_icon_from_file_utf8 with PNGs on icon that has no PNGs\n");
 
-	outBuf = get_exe_icon_from_file_utf8(dummyWritePath, TRUE, &outLen);
+	outBuf = (char *)get_exe_icon_from_file_utf8(dummyWritePath, TRUE, &outLen);
 	assert_out_nonnull(outBuf, outLen);
-	write_file(L"testdata\\write_out.ico", outBuf, outLen);
+	write_file("testdata/write_out.ico", outBuf, outLen);
 
-	expBuf = read_file(L"testdata\\write_expected.ico", &expLen);
+	expBuf = read_file("testdata/write_expected.ico", &expLen);
 	assert_bufs_equal(expBuf, expLen, outBuf, outLen);
 
 	free_s(&outBuf);
@@ -154,17 +431,1494 @@ int main(int argc, char **argv)
 	// ---------------
 	printf("Test: get_icon_from_file_utf8 without PNGs on icon that has no PNGs\n");
 
-	outBuf = get_exe_icon_from_file_utf8(dummyWritePath, FALSE, &outLen);
+	outBuf = (char *)get_exe_icon_from_file_utf8(dummyWritePath, FALSE, &outLen);
 	assert_out_nonnull(outBuf, outLen);
-	write_file(L"testdata\\write_nopng_out.ico", outBuf, outLen);
+	write_file("testdata/write_nopng_out.ico", outBuf, outLen);
 
 	// Same expected icon as prev test
-	expBuf = read_file(L"testdata\\write_expected.ico", &expLen);
+	expBuf = read_file("testdata/write_expected.ico", &expLen);
+	assert_bufs_equal(expBuf, expLen, outBuf, outLen);
+
+	free_s(&outBuf);
+	free_s(&expBuf);
+
+	// ---------------
+	printf("Test: get_icon_from_file_utf8 on a file that is not a PE\n");
+	outBuf = (char *)get_exe_icon_from_file_utf8("testdata/write_expected.ico", TRUE, &outLen);
+	if (outBuf != NULL) {
+		fatal("Expected null return value.\n");
+	}
+	if (get_exe_icon_last_error() != GET_EXE_ICON_ERROR_NOT_PE) {
+		fatal("Expected GET_EXE_ICON_ERROR_NOT_PE (got %d)\n", (int)get_exe_icon_last_error());
+	}
+
+	// ---------------
+	printf("Test: get_icon_from_memory\n");
+
+	size_t exeLen = 0;
+	char *exeBuf = read_file(dummyExplorerPath, &exeLen);
+
+	outBuf = (char *)get_exe_icon_from_memory(exeBuf, exeLen, FALSE, &outLen);
+	assert_out_nonnull(outBuf, outLen);
+
+	expBuf = read_file("testdata/explorer_nopng_expected.ico", &expLen);
+	assert_bufs_equal(expBuf, expLen, outBuf, outLen);
+
+	free_s(&outBuf);
+	free_s(&expBuf);
+
+	// ---------------
+	printf("Test: get_icon_from_memory on truncated buffers\n");
+
+	// Each truncated copy is in its own allocation so that reads past the
+	// end can be caught by memory checkers.
+	for (size_t truncLen = 0; truncLen < exeLen; truncLen += 97) {
+		char *truncBuf = (char *)malloc(truncLen ? truncLen : 1);
+		memcpy(truncBuf, exeBuf, truncLen);
+		outBuf = (char *)get_exe_icon_from_memory(truncBuf, truncLen, TRUE, &outLen);
+		free_s(&outBuf);
+		free(truncBuf);
+	}
+
+	free_s(&exeBuf);
+
+	// ---------------
+	printf("Test: get_icon_from_reader\n");
+
+	GetExeIconReader reader;
+	memset(&reader, 0, sizeof(reader));
+	reader.readAt = file_read_at;
+	reader.ctx = open_file(dummyExplorerPath, "rb");
+	reader.size = exeLen;
+	if (!reader.ctx) {
+		fatal("Cannot open file '%s'.\n", dummyExplorerPath);
+	}
+
+	outBuf = (char *)get_exe_icon_from_reader(&reader, TRUE, &outLen);
+	assert_out_nonnull(outBuf, outLen);
+
+	expBuf = read_file("testdata/explorer_expected.ico", &expLen);
+	assert_bufs_equal(expBuf, expLen, outBuf, outLen);
+
+	// Everything but the images should come from a few cached blocks
+	if (reader.bytesRead > outLen + 4 * 4096) {
+		fatal("Read too much data (%d bytes in %d reads)\n", (int)reader.bytesRead, (int)reader.numReads);
+	}
+
+	fclose((FILE *)reader.ctx);
+	free_s(&outBuf);
+	free_s(&expBuf);
+
+	// ---------------
+	printf("Test: get_exe_icons_batch\n");
+
+	const char *batchPaths[] = {
+		dummyExplorerPath,
+		"testdata/does_not_exist.exe",
+		dummyWritePath,
+		"testdata/write_expected.ico",
+		dummyExplorerPath,
+	};
+	const GetExeIconError batchErrors[] = {
+		GET_EXE_ICON_OK,
+		GET_EXE_ICON_ERROR_OPEN_FAILED,
+		GET_EXE_ICON_OK,
+		GET_EXE_ICON_ERROR_NOT_PE,
+		GET_EXE_ICON_OK,
+	};
+	const char *batchExpected[] = {
+		"testdata/explorer_expected.ico",
+		NULL,
+		"testdata/write_expected.ico",
+		NULL,
+		"testdata/explorer_expected.ico",
+	};
+	const size_t batchCount = sizeof(batchPaths) / sizeof(batchPaths[0]);
+
+	// With io_uring (or its fallback where it's unavailable), two files at a
+	// time per thread make the later ones wait for room
+	for (int backend = GET_EXE_ICON_BATCH_THREADS; backend <= GET_EXE_ICON_BATCH_IO_URING; backend++) {
+		GetExeIconBatchOptions batchOptions;
+		memset(&batchOptions, 0, sizeof(batchOptions));
+		batchOptions.numThreads = backend == GET_EXE_ICON_BATCH_IO_URING ? 1 : 3;
+		batchOptions.allowEmbeddedPNGs = TRUE;
+		batchOptions.backend = (GetExeIconBatchBackend)backend;
+		batchOptions.queueDepth = 2;
+
+		GetExeIconBatchResult batchResults[sizeof(batchPaths) / sizeof(batchPaths[0])];
+		if (get_exe_icons_batch(batchPaths, batchCount, &batchOptions, batchResults) != 3) {
+			fatal("Expected 3 icons to be extracted (backend %d).\n", backend);
+		}
+
+		for (size_t i = 0; i < batchCount; i++) {
+			if (batchResults[i].error != batchErrors[i]) {
+				fatal("Unexpected error for batch item %zd (got %d, backend %d)\n", i, (int)batchResults[i].error, backend);
+			}
+			if (batchExpected[i]) {
+				expBuf = read_file(batchExpected[i], &expLen);
+				assert_bufs_equal(expBuf, expLen, (char *)batchResults[i].icoBuf, batchResults[i].bufLen);
+				free_s(&expBuf);
+			} else if (batchResults[i].icoBuf != NULL) {
+				fatal("Expected no icon for batch item %zd\n", i);
+			}
+			free(batchResults[i].icoBuf);
+		}
+	}
+
+	// ---------------
+	printf("Test: get_exe_icon_scan\n");
+
+	if (get_exe_icon_scan_open("testdata/does_not_exist", NULL) != NULL
+		|| get_exe_icon_last_error() != GET_EXE_ICON_ERROR_OPEN_FAILED)
+	{
+		fatal("Expected GET_EXE_ICON_ERROR_OPEN_FAILED for a missing root\n");
+	}
+
+	// Everything else in testdata is either a directory or not a PE. With room
+	// for one pending result, the workers have to wait for each next().
+	GetExeIconScanOptions scanOptions;
+	memset(&scanOptions, 0, sizeof(scanOptions));
+	scanOptions.numThreads = 2;
+	scanOptions.allowEmbeddedPNGs = TRUE;
+	scanOptions.maxPending = 1;
+
+	GetExeIconScan *scan = get_exe_icon_scan_open("testdata", &scanOptions);
+	if (!scan) {
+		fatal("Failed to start scan (last error: %d)\n", (int)get_exe_icon_last_error());
+	}
+
+	GetExeIconScanResult scanResult;
+	int foundExplorer = 0, foundWrite = 0;
+	while (get_exe_icon_scan_next(scan, &scanResult)) {
+		size_t pathLen = strlen(scanResult.path);
+		if (pathLen > 32 && strcmp(scanResult.path + pathLen - 32, "dummy_exe_with_explorer_icon.exe") == 0) {
+			expBuf = read_file("testdata/explorer_expected.ico", &expLen);
+			foundExplorer ++;
+		} else if (pathLen > 29 && strcmp(scanResult.path + pathLen - 29, "dummy_exe_with_write_icon.exe") == 0) {
+			expBuf = read_file("testdata/write_expected.ico", &expLen);
+			foundWrite ++;
+		} else {
+			fatal("Unexpected scan result '%s'\n", scanResult.path);
+		}
+		assert_bufs_equal(expBuf, expLen, (char *)scanResult.icoBuf, scanResult.bufLen);
+		free_s(&expBuf);
+		free(scanResult.path);
+		free(scanResult.icoBuf);
+	}
+	if (foundExplorer != 1 || foundWrite != 1) {
+		fatal("Expected each dummy exe to be found once (got %d, %d)\n", foundExplorer, foundWrite);
+	}
+	if (get_exe_icon_scan_next(scan, &scanResult)) {
+		fatal("Expected the scan to stay done\n");
+	}
+	get_exe_icon_scan_close(scan);
+
+	// Closing early has to stop threads that are waiting on full queues
+	scan = get_exe_icon_scan_open("testdata", &scanOptions);
+	if (!scan || !get_exe_icon_scan_next(scan, &scanResult)) {
+		fatal("Expected a scan result\n");
+	}
+	free(scanResult.path);
+	free(scanResult.icoBuf);
+	get_exe_icon_scan_close(scan);
+
+	// With pathsOnly, the same files are found but no icons extracted
+	scanOptions.pathsOnly = TRUE;
+	scan = get_exe_icon_scan_open("testdata", &scanOptions);
+	if (!scan) {
+		fatal("Failed to start scan (last error: %d)\n", (int)get_exe_icon_last_error());
+	}
+	int numPaths = 0;
+	while (get_exe_icon_scan_next(scan, &scanResult)) {
+		if (scanResult.icoBuf || scanResult.error != GET_EXE_ICON_OK
+			|| !strstr(scanResult.path, "dummy_exe_with_"))
+		{
+			fatal("Unexpected pathsOnly result '%s'\n", scanResult.path);
+		}
+		numPaths ++;
+		free(scanResult.path);
+	}
+	if (numPaths != 2) {
+		fatal("Expected 2 paths, got %d\n", numPaths);
+	}
+	get_exe_icon_scan_close(scan);
+
+	scan = get_exe_icon_scan_open("testdata", NULL);
+	get_exe_icon_scan_cancel(scan);
+	if (get_exe_icon_scan_next(scan, &scanResult)) {
+		fatal("Expected no results after cancelling\n");
+	}
+	get_exe_icon_scan_close(scan);
+
+	// ---------------
+	printf("Test: get_exe_icon_cached\n");
+
+	// Start from an empty cache
+	make_dir("testdata/cache_out");
+	remove("testdata/cache_out/index");
+	remove("testdata/cache_out/blobs");
+
+	GetExeIconCache *cache = get_exe_icon_cache_open("testdata/cache_out", NULL);
+	if (!cache) {
+		fatal("Failed to open cache\n");
+	}
+
+	// It can't be opened again while it's open, even by the same process,
+	// and failing to doesn't unlock it
+	for (int attempt = 0; attempt < 2; attempt++) {
+		if (get_exe_icon_cache_open("testdata/cache_out", NULL) != NULL) {
+			fatal("Opening an open cache again should fail\n");
+		}
+	}
+
+	for (int pass = 0; pass < 2; pass++) {
+		outBuf = (char *)get_exe_icon_cached(cache, dummyExplorerPath, TRUE, &outLen);
+		assert_out_nonnull(outBuf, outLen);
+		expBuf = read_file("testdata/explorer_expected.ico", &expLen);
+		assert_bufs_equal(expBuf, expLen, outBuf, outLen);
+		free_s(&outBuf);
+		free_s(&expBuf);
+
+		outBuf = (char *)get_exe_icon_cached(cache, "testdata/write_expected.ico", TRUE, &outLen);
+		if (outBuf != NULL || get_exe_icon_last_error() != GET_EXE_ICON_ERROR_NOT_PE) {
+			fatal("Expected cached GET_EXE_ICON_ERROR_NOT_PE\n");
+		}
+	}
+
+	GetExeIconCacheStats cacheStats;
+	get_exe_icon_cache_stats(cache, &cacheStats);
+	if (cacheStats.hits != 2 || cacheStats.misses != 2 || cacheStats.numEntries != 2) {
+		fatal("Unexpected cache stats (hits %d, misses %d)\n", (int)cacheStats.hits, (int)cacheStats.misses);
+	}
+	get_exe_icon_cache_close(cache);
+
+	// ---------------
+	printf("Test: get_exe_icon_cached after reopening, with eviction\n");
+
+	GetExeIconCacheOptions cacheOptions;
+	memset(&cacheOptions, 0, sizeof(cacheOptions));
+	cacheOptions.maxBytes = 90000;
+	cache = get_exe_icon_cache_open("testdata/cache_out", &cacheOptions);
+	if (!cache) {
+		fatal("Failed to reopen cache\n");
+	}
+
+	outBuf = (char *)get_exe_icon_cached(cache, dummyExplorerPath, TRUE, &outLen);
+	assert_out_nonnull(outBuf, outLen);
+	free_s(&outBuf);
+
+	outBuf = (char *)get_exe_icon_cached(cache, dummyExplorerPath, FALSE, &outLen);
+	assert_out_nonnull(outBuf, outLen);
+	expBuf = read_file("testdata/explorer_nopng_expected.ico", &expLen);
+	assert_bufs_equal(expBuf, expLen, outBuf, outLen);
+	free_s(&outBuf);
+	free_s(&expBuf);
+
+	get_exe_icon_cache_stats(cache, &cacheStats);
+	if (cacheStats.hits != 1 || cacheStats.evictions == 0 || cacheStats.cachedBytes > cacheOptions.maxBytes) {
+		fatal("Unexpected cache stats (hits %d, evictions %d)\n", (int)cacheStats.hits, (int)cacheStats.evictions);
+	}
+	get_exe_icon_cache_close(cache);
+
+	// ---------------
+	printf("Test: get_exe_icon_process_cached\n");
+
+	// With room for one executable no process is running
+	GetExeIconProcessCacheOptions processOptions;
+	memset(&processOptions, 0, sizeof(processOptions));
+	processOptions.allowEmbeddedPNGs = TRUE;
+	processOptions.maxImages = 1;
+	GetExeIconProcessCache *processCache = get_exe_icon_process_cache_open(&processOptions);
+	if (!processCache) {
+		fatal("Failed to open process cache\n");
+	}
+
+	// The same file gives the same shared ICO
+	const GetExeIconSharedIco *sharedIco = get_exe_icon_process_cached_file_utf8(processCache, dummyExplorerPath);
+	const GetExeIconSharedIco *sharedIco2 = get_exe_icon_process_cached_file_utf8(processCache, dummyExplorerPath);
+	if (!sharedIco || sharedIco2 != sharedIco) {
+		fatal("Expected the same shared ICO twice\n");
+	}
+	get_exe_icon_shared_ico_release(sharedIco2);
+
+	// A second file evicts the first, whose ICO stays valid while it's held
+	sharedIco2 = get_exe_icon_process_cached_file_utf8(processCache, dummyWritePath);
+	expBuf = read_file("testdata/write_expected.ico", &expLen);
+	assert_bufs_equal(expBuf, expLen, (char *)sharedIco2->icoBuf, sharedIco2->bufLen);
+	free_s(&expBuf);
+	get_exe_icon_shared_ico_release(sharedIco2);
+	expBuf = read_file("testdata/explorer_expected.ico", &expLen);
+	assert_bufs_equal(expBuf, expLen, (char *)sharedIco->icoBuf, sharedIco->bufLen);
+	get_exe_icon_shared_ico_release(sharedIco);
+
+	// A file that changes is extracted again
+	write_file("testdata/process_out.exe", expBuf, expLen);
+	free_s(&expBuf);
+	if (get_exe_icon_process_cached_file_utf8(processCache, "testdata/process_out.exe")
+		|| get_exe_icon_last_error() != GET_EXE_ICON_ERROR_NOT_PE)
+	{
+		fatal("Expected GET_EXE_ICON_ERROR_NOT_PE for an ICO file\n");
+	}
+	expBuf = read_file(dummyWritePath, &expLen);
+	write_file("testdata/process_out.exe", expBuf, expLen);
+	free_s(&expBuf);
+	sharedIco = get_exe_icon_process_cached_file_utf8(processCache, "testdata/process_out.exe");
+	expBuf = read_file("testdata/write_expected.ico", &expLen);
+	assert_bufs_equal(expBuf, expLen, (char *)sharedIco->icoBuf, sharedIco->bufLen);
+	free_s(&expBuf);
+	get_exe_icon_shared_ico_release(sharedIco);
+
+	// The directory scan test expects only the dummy executables
+	remove("testdata/process_out.exe");
+
+	// This process has no icon, which is remembered until it exits; a PID
+	// that no process has fails to open
+	GetExeIconError processError = GET_EXE_ICON_OK;
+	for (int i = 0; i < 2; i++) {
+		if (get_exe_icon_process_cached(processCache, current_pid())
+			|| get_exe_icon_last_error() == GET_EXE_ICON_ERROR_OPEN_FAILED
+			|| (i == 1 && get_exe_icon_last_error() != processError))
+		{
+			fatal("Expected this process to have no icon (error %d)\n", (int)get_exe_icon_last_error());
+		}
+		processError = get_exe_icon_last_error();
+	}
+	if (get_exe_icon_process_cached(processCache, 0xfffffff0)
+		|| get_exe_icon_last_error() != GET_EXE_ICON_ERROR_OPEN_FAILED)
+	{
+		fatal("Expected GET_EXE_ICON_ERROR_OPEN_FAILED for a PID without a process\n");
+	}
+
+	GetExeIconProcessCacheStats processStats;
+	get_exe_icon_process_cache_stats(processCache, &processStats);
+	if (processStats.processHits != 1
+		|| processStats.imageHits != 1
+		|| processStats.extractions != 5
+		|| processStats.numProcesses != 1
+		|| processStats.numImages != 2)
+	{
+		fatal("Unexpected process cache stats (%d process hits, %d image hits, %d extractions, %d images)\n",
+			(int)processStats.processHits, (int)processStats.imageHits,
+			(int)processStats.extractions, (int)processStats.numImages);
+	}
+	get_exe_icon_process_cache_close(processCache);
+
+	// ---------------
+	printf("Test: get_exe_icon_from_file_utf8_ex hash\n");
+
+	GetExeIconHash hash, expHash;
+	GetExeIconOptions options;
+	memset(&options, 0, sizeof(options));
+	options.allowEmbeddedPNGs = TRUE;
+	options.hash = &hash;
+	outBuf = (char *)get_exe_icon_from_file_utf8_ex(dummyExplorerPath, &options, &outLen);
+	assert_out_nonnull(outBuf, outLen);
+	expBuf = read_file("testdata/explorer_expected.ico", &expLen);
+	assert_bufs_equal(expBuf, expLen, outBuf, outLen);
+	get_exe_icon_hash(expBuf, expLen, &expHash);
+	if (memcmp(&hash, &expHash, sizeof(hash)) != 0) {
+		fatal("Hash computed during extraction doesn't match\n");
+	}
+	free_s(&outBuf);
+
+	// ---------------
+	printf("Test: get_exe_icon_from_file_utf8_into\n");
+
+	options.hash = NULL;
+	DWORD needLen = 0;
+	if (get_exe_icon_from_file_utf8_into(dummyExplorerPath, &options, NULL, 0, &needLen)
+		|| get_exe_icon_last_error() != GET_EXE_ICON_ERROR_BUFFER_TOO_SMALL
+		|| needLen != expLen)
+	{
+		fatal("Expected GET_EXE_ICON_ERROR_BUFFER_TOO_SMALL with the required size\n");
+	}
+	outBuf = (char *)malloc(needLen);
+	if (get_exe_icon_from_file_utf8_into(dummyExplorerPath, &options, (PBYTE)outBuf, needLen - 1, &outLen)
+		|| get_exe_icon_last_error() != GET_EXE_ICON_ERROR_BUFFER_TOO_SMALL)
+	{
+		fatal("Expected GET_EXE_ICON_ERROR_BUFFER_TOO_SMALL for a buffer 1 byte short\n");
+	}
+	if (!get_exe_icon_from_file_utf8_into(dummyExplorerPath, &options, (PBYTE)outBuf, needLen, &outLen)) {
+		fatal("Failed to get icon into buffer (last error: %d)\n", (int)get_exe_icon_last_error());
+	}
+	assert_bufs_equal(expBuf, expLen, outBuf, outLen);
+
+	// ---------------
+	printf("Test: get_exe_icon_from_memory_into\n");
+
+	exeBuf = read_file(dummyExplorerPath, &exeLen);
+	memset(outBuf, 0, needLen);
+	if (!get_exe_icon_from_memory_into(exeBuf, exeLen, &options, (PBYTE)outBuf, needLen, &outLen)) {
+		fatal("Failed to get icon into buffer (last error: %d)\n", (int)get_exe_icon_last_error());
+	}
+	assert_bufs_equal(expBuf, expLen, outBuf, outLen);
+	free_s(&exeBuf);
+	free_s(&outBuf);
+
+	// ---------------
+	printf("Test: get_exe_icon_from_file_utf8_ex with a target size\n");
+
+	// The 32x32 image is the 5th in explorer_expected.ico, at offset 41642
+	GetExeIconImageInfo imageInfo;
+	memset(&imageInfo, 0, sizeof(imageInfo));
+	options.targetWidth = 32;
+	options.imageInfo = &imageInfo;
+	outBuf = (char *)get_exe_icon_from_file_utf8_ex(dummyExplorerPath, &options, &outLen);
+	assert_out_nonnull(outBuf, outLen);
+	if (outLen != 6 + 16 + 4264 || outBuf[4] != 1 || (BYTE)outBuf[6] != 32 || imageInfo.width != 32 || imageInfo.isPNG) {
+		fatal("Expected a single 32x32 image ICO\n");
+	}
+	assert_bufs_equal(expBuf + 41642, 4264, outBuf + 22, outLen - 22);
+	free_s(&outBuf);
+
+	// Without PNGs, the 256x256 PNG is passed over for the next largest
+	options.targetWidth = 256;
+	options.allowEmbeddedPNGs = FALSE;
+	options.rawImage = TRUE;
+	outBuf = (char *)get_exe_icon_from_file_utf8_ex(dummyExplorerPath, &options, &outLen);
+	assert_out_nonnull(outBuf, outLen);
+	if (imageInfo.width != 64 || imageInfo.isPNG) {
+		fatal("Expected the raw 64x64 DIB\n");
+	}
+	assert_bufs_equal(expBuf + 8306, 16936, outBuf, outLen);
+	free_s(&outBuf);
+
+	options.targetWidth = 30;
+	options.sizePolicy = GET_EXE_ICON_SIZE_EXACT;
+	outBuf = (char *)get_exe_icon_from_file_utf8_ex(dummyExplorerPath, &options, &outLen);
+	if (outBuf != NULL || get_exe_icon_last_error() != GET_EXE_ICON_ERROR_NO_ICON) {
+		fatal("Expected no exact 30x30 image\n");
+	}
+
+	memset(&options, 0, sizeof(options));
+	options.allowEmbeddedPNGs = TRUE;
+
+	// ---------------
+	printf("Test: get_exe_icon_layout_from_memory\n");
+
+	// Reassemble the ICO from the layout, once from the segments' pointers
+	// and once from their file offsets
+	exeBuf = read_file(dummyExplorerPath, &exeLen);
+	GetExeIconLayout layout;
+	if (!get_exe_icon_layout_from_memory(exeBuf, exeLen, &options, &layout) || layout.totalLen != expLen) {
+		fatal("Failed to get layout (last error: %d)\n", (int)get_exe_icon_last_error());
+	}
+	for (int pass = 0; pass < 2; pass++) {
+		outBuf = (char *)malloc(layout.totalLen);
+		memcpy(outBuf, layout.header, layout.headerLen);
+		outLen = layout.headerLen;
+		for (DWORD i = 0; i < layout.numSegments; i++) {
+			const BYTE *src = pass == 0 ? layout.segments[i].data : (BYTE *)exeBuf + layout.segments[i].offset;
+			memcpy(outBuf + outLen, src, layout.segments[i].len);
+			outLen += layout.segments[i].len;
+		}
+		assert_bufs_equal(expBuf, expLen, outBuf, outLen);
+		free_s(&outBuf);
+	}
+	get_exe_icon_layout_free(&layout);
+
+	// ---------------
+	printf("Test: get_exe_icon_layout_from_file_utf8\n");
+
+	if (!get_exe_icon_layout_from_file_utf8(dummyExplorerPath, &options, &layout)
+		|| layout.totalLen != expLen
+		|| layout.segments[0].data != NULL)
+	{
+		fatal("Failed to get layout (last error: %d)\n", (int)get_exe_icon_last_error());
+	}
+	outBuf = (char *)malloc(layout.totalLen);
+	memcpy(outBuf, layout.header, layout.headerLen);
+	outLen = layout.headerLen;
+	for (DWORD i = 0; i < layout.numSegments; i++) {
+		memcpy(outBuf + outLen, exeBuf + layout.segments[i].offset, layout.segments[i].len);
+		outLen += layout.segments[i].len;
+	}
+	assert_bufs_equal(expBuf, expLen, outBuf, outLen);
+	free_s(&outBuf);
+	free_s(&exeBuf);
+	get_exe_icon_layout_free(&layout);
+
+	// ---------------
+	printf("Test: get_exe_icon_store\n");
+
+	// Start without the icon in the store
+	char hashStr[33], storePath[128];
+	get_exe_icon_hash_to_string(&expHash, hashStr);
+	sprintf(storePath, "testdata/store_out/%.2s/%s.ico", hashStr, hashStr);
+	remove(storePath);
+
+	GetExeIconStore *store = get_exe_icon_store_open("testdata/store_out");
+	if (!store) {
+		fatal("Failed to open store\n");
+	}
+
+	BOOL isNew;
+	if (!get_exe_icon_store_add_file(store, dummyExplorerPath, TRUE, &hash, &isNew) || !isNew) {
+		fatal("Failed to add new icon to store\n");
+	}
+	if (memcmp(&hash, &expHash, sizeof(hash)) != 0) {
+		fatal("Unexpected store hash\n");
+	}
+	if (!get_exe_icon_store_add(store, expBuf, (DWORD)expLen, &hash, &isNew) || isNew) {
+		fatal("Expected icon to be deduplicated\n");
+	}
+
+	outBuf = (char *)get_exe_icon_store_get(store, &hash, &outLen);
+	assert_out_nonnull(outBuf, outLen);
+	assert_bufs_equal(expBuf, expLen, outBuf, outLen);
+	free_s(&outBuf);
+	free_s(&expBuf);
+
+	GetExeIconStoreStats storeStats;
+	get_exe_icon_store_stats(store, &storeStats);
+	if (storeStats.added != 1 || storeStats.duplicates != 1) {
+		fatal("Unexpected store stats (added %d, duplicates %d)\n", (int)storeStats.added, (int)storeStats.duplicates);
+	}
+	get_exe_icon_store_close(store);
+
+	// ---------------
+	printf("Test: get_exe_icon_pack\n");
+
+	{
+		const char *packPath = "testdata/pack_out.pack";
+		remove(packPath);
+
+		GetExeIconPackOptions packOptions;
+		memset(&packOptions, 0, sizeof(packOptions));
+		packOptions.alignment = 64;
+		packOptions.noSync = TRUE;
+		GetExeIconPackWriter *packWriter = get_exe_icon_pack_writer_open(packPath, &packOptions);
+		if (!packWriter) {
+			fatal("Failed to create pack (last error: %d)\n", (int)get_exe_icon_last_error());
+		}
+
+		// Only one writer at a time, even in the same process
+		if (get_exe_icon_pack_writer_open(packPath, &packOptions) != NULL
+			|| get_exe_icon_last_error() != GET_EXE_ICON_ERROR_OPEN_FAILED)
+		{
+			fatal("Opening a pack for writing twice should fail\n");
+		}
+
+		// A new pack can be read right away
+		GetExeIconPack *emptyPack = get_exe_icon_pack_open(packPath);
+		if (!emptyPack || get_exe_icon_pack_count(emptyPack) != 0) {
+			fatal("Expected an empty pack\n");
+		}
+
+		// One icon by its content and one by its path
+		size_t writeLen;
+		char *writeBuf = read_file("testdata/write_expected.ico", &writeLen);
+		expBuf = read_file("testdata/explorer_expected.ico", &expLen);
+		GetExeIconHash explorerKey, writeKey, missingKey;
+		get_exe_icon_hash(expBuf, expLen, &explorerKey);
+		get_exe_icon_hash(dummyWritePath, strlen(dummyWritePath), &writeKey);
+		get_exe_icon_hash("missing", 7, &missingKey);
+		if (!get_exe_icon_pack_writer_add(packWriter, &explorerKey, expBuf, (DWORD)expLen)
+			|| !get_exe_icon_pack_writer_add(packWriter, &writeKey, writeBuf, (DWORD)writeLen)
+			|| !get_exe_icon_pack_writer_contains(packWriter, &writeKey)
+			|| get_exe_icon_pack_writer_contains(packWriter, &missingKey)
+			|| !get_exe_icon_pack_writer_commit(packWriter))
+		{
+			fatal("Failed to add to pack (last error: %d)\n", (int)get_exe_icon_last_error());
+		}
+
+		// Readers see the pack as it was when they opened it
+		if (get_exe_icon_pack_count(emptyPack) != 0) {
+			fatal("An open pack shouldn't change\n");
+		}
+		get_exe_icon_pack_close(emptyPack);
+
+		GetExeIconPack *pack = get_exe_icon_pack_open(packPath);
+		uint64_t packOffset = 0;
+		const BYTE *packBuf = pack ? get_exe_icon_pack_get(pack, &explorerKey, &outLen, &packOffset) : NULL;
+		if (!packBuf || get_exe_icon_pack_count(pack) != 2 || packOffset % 64 != 0) {
+			fatal("Failed to read the explorer icon from the pack\n");
+		}
+		assert_bufs_equal(expBuf, expLen, (char *)packBuf, outLen);
+		packBuf = get_exe_icon_pack_get(pack, &writeKey, &outLen, NULL);
+		assert_out_nonnull((char *)packBuf, outLen);
+		assert_bufs_equal(writeBuf, writeLen, (char *)packBuf, outLen);
+		if (get_exe_icon_pack_get(pack, &missingKey, &outLen, NULL) != NULL
+			|| get_exe_icon_last_error() != GET_EXE_ICON_ERROR_NO_ICON)
+		{
+			fatal("Expected no icon for a missing key\n");
+		}
+		get_exe_icon_pack_close(pack);
+
+		// Icons that aren't committed are lost when the writer is closed
+		if (!get_exe_icon_pack_writer_add(packWriter, &missingKey, writeBuf, (DWORD)writeLen)) {
+			fatal("Failed to add to pack\n");
+		}
+		get_exe_icon_pack_writer_close(packWriter);
+		packWriter = get_exe_icon_pack_writer_open(packPath, NULL);
+		if (!packWriter || get_exe_icon_pack_writer_contains(packWriter, &missingKey)
+			|| !get_exe_icon_pack_writer_contains(packWriter, &explorerKey))
+		{
+			fatal("Expected only the committed icons after reopening the pack\n");
+		}
+
+		// Replace the write icon, add the extracted icons by their contents,
+		// of which only the write icon's is new, and many more small ones
+		if (!get_exe_icon_pack_writer_add(packWriter, &writeKey, expBuf, (DWORD)expLen)) {
+			fatal("Failed to replace an icon in the pack\n");
+		}
+		PCSTR packPaths[3] = { dummyExplorerPath, "testdata/does_not_exist.exe", dummyWritePath };
+		GetExeIconBatchResult packResults[3];
+		GetExeIconHash packKeys[3];
+		size_t numAdded = 0;
+		GetExeIconBatchOptions packBatchOptions;
+		memset(&packBatchOptions, 0, sizeof(packBatchOptions));
+		packBatchOptions.allowEmbeddedPNGs = TRUE;
+		get_exe_icons_batch(packPaths, 3, &packBatchOptions, packResults);
+		if (!get_exe_icon_pack_writer_add_batch(packWriter, packPaths, packResults, 3, GET_EXE_ICON_PACK_KEY_CONTENT, packKeys, &numAdded)
+			|| numAdded != 1
+			|| memcmp(&packKeys[0], &explorerKey, sizeof(explorerKey)) != 0
+			|| packKeys[1].bytes[0] != 0)
+		{
+			fatal("Unexpected results from adding a batch to the pack\n");
+		}
+		for (int i = 0; i < 3; i++) {
+			free(packResults[i].icoBuf);
+		}
+
+		enum { NUM_SMALL = 3000 };
+		for (DWORD i = 0; i < NUM_SMALL; i++) {
+			GetExeIconHash key;
+			get_exe_icon_hash(&i, sizeof(i), &key);
+			if (!get_exe_icon_pack_writer_add(packWriter, &key, writeBuf, 1 + i % 100)) {
+				fatal("Failed to add to pack\n");
+			}
+		}
+		if (!get_exe_icon_pack_writer_commit(packWriter)) {
+			fatal("Failed to commit the pack (last error: %d)\n", (int)get_exe_icon_last_error());
+		}
+		get_exe_icon_pack_writer_close(packWriter);
+
+		// Check every icon, before and after compacting the pack
+		GetExeIconPackStats packStats[2];
+		for (int pass = 0; pass < 2; pass++) {
+			if (pass == 1 && !get_exe_icon_pack_compact(packPath)) {
+				fatal("Failed to compact the pack (last error: %d)\n", (int)get_exe_icon_last_error());
+			}
+			pack = get_exe_icon_pack_open(packPath);
+			if (!pack || get_exe_icon_pack_count(pack) != 3 + NUM_SMALL) {
+				fatal("Expected %d icons in the pack\n", 3 + NUM_SMALL);
+			}
+			get_exe_icon_pack_stats(pack, &packStats[pass]);
+
+			packBuf = get_exe_icon_pack_get(pack, &writeKey, &outLen, NULL);
+			assert_out_nonnull((char *)packBuf, outLen);
+			assert_bufs_equal(expBuf, expLen, (char *)packBuf, outLen);
+			packBuf = get_exe_icon_pack_get(pack, &packKeys[2], &outLen, NULL);
+			assert_out_nonnull((char *)packBuf, outLen);
+			assert_bufs_equal(writeBuf, writeLen, (char *)packBuf, outLen);
+			for (DWORD i = 0; i < NUM_SMALL; i++) {
+				GetExeIconHash key;
+				get_exe_icon_hash(&i, sizeof(i), &key);
+				packBuf = get_exe_icon_pack_get(pack, &key, &outLen, &packOffset);
+				if (!packBuf || outLen != 1 + i % 100 || packOffset % 64 != 0 || memcmp(packBuf, writeBuf, outLen) != 0) {
+					fatal("Wrong small icon %lu in the pack\n", (unsigned long)i);
+				}
+			}
+
+			// Entries are listed in key order
+			GetExeIconHash prevKey, key;
+			for (size_t i = 0; i < get_exe_icon_pack_count(pack); i++) {
+				if (!get_exe_icon_pack_entry(pack, i, &key, &outLen)
+					|| (i > 0 && memcmp(&prevKey, &key, sizeof(key)) >= 0))
+				{
+					fatal("Pack entries out of order\n");
+				}
+				prevKey = key;
+			}
+			get_exe_icon_pack_close(pack);
+		}
+		if (packStats[1].liveBytes != packStats[0].liveBytes
+			|| packStats[1].alignment != 64
+			|| packStats[1].fileSize >= packStats[0].fileSize)
+		{
+			fatal("Compacting should only drop dead space\n");
+		}
+
+		// A torn header leaves the previous commit in effect
+		packWriter = get_exe_icon_pack_writer_open(packPath, &packOptions);
+		if (!packWriter
+			|| !get_exe_icon_pack_writer_add(packWriter, &missingKey, writeBuf, (DWORD)writeLen)
+			|| !get_exe_icon_pack_writer_commit(packWriter))
+		{
+			fatal("Failed to add to pack\n");
+		}
+		get_exe_icon_pack_writer_close(packWriter);
+		size_t packLen;
+		char *packFile = read_file(packPath, &packLen);
+		int newest = read_le32(packFile + 16) > read_le32(packFile + 64 + 16) ? 0 : 1;
+		packFile[newest * 64 + 56] ^= 1;
+		write_file(packPath, packFile, packLen);
+		free_s(&packFile);
+		pack = get_exe_icon_pack_open(packPath);
+		if (!pack || get_exe_icon_pack_count(pack) != 3 + NUM_SMALL
+			|| get_exe_icon_pack_get(pack, &missingKey, &outLen, NULL) != NULL)
+		{
+			fatal("Expected the pack as of its previous commit\n");
+		}
+		get_exe_icon_pack_close(pack);
+
+		// Other files aren't packs
+		if (get_exe_icon_pack_open("testdata/explorer_expected.ico") != NULL
+			|| get_exe_icon_last_error() != GET_EXE_ICON_ERROR_BAD_ARCHIVE
+			|| get_exe_icon_pack_writer_open("testdata/explorer_expected.ico", NULL) != NULL
+			|| get_exe_icon_last_error() != GET_EXE_ICON_ERROR_BAD_ARCHIVE)
+		{
+			fatal("Expected other files to be rejected as packs\n");
+		}
+
+		free_s(&writeBuf);
+		free_s(&expBuf);
+		remove(packPath);
+		remove("testdata/pack_out.pack.lock");
+		remove("testdata/explorer_expected.ico.lock");
+	}
+
+	// ---------------
+	printf("Test: get_exe_icon_module\n");
+
+	// The dummy exe has a second icon group, after the primary icon
+	GetExeIconModule *iconModule = get_exe_icon_module_open_utf8(dummyExplorerPath);
+	if (!iconModule || get_exe_icon_module_num_groups(iconModule) != 2) {
+		fatal("Failed to open module (last error: %d)\n", (int)get_exe_icon_last_error());
+	}
+
+	GetExeIconGroupInfo groupInfo;
+	GetExeIconEntryInfo entries[4];
+	DWORD numEntries, groupIndex;
+	if (!get_exe_icon_module_group(iconModule, 0, &groupInfo) || groupInfo.named || groupInfo.id != 107) {
+		fatal("Unexpected primary icon group\n");
+	}
+	if (!get_exe_icon_module_group_entries(iconModule, 0, entries, 4, &numEntries)
+		|| numEntries != 8
+		|| entries[0].width != 256
+		|| entries[3].width != 40
+		|| entries[3].bitDepth != 32)
+	{
+		fatal("Unexpected primary icon group entries\n");
+	}
+
+	outBuf = (char *)get_exe_icon_module_extract_group(iconModule, 0, &options, &outLen);
+	assert_out_nonnull(outBuf, outLen);
+	expBuf = read_file("testdata/explorer_expected.ico", &expLen);
 	assert_bufs_equal(expBuf, expLen, outBuf, outLen);
+	free_s(&outBuf);
+
+	if (!get_exe_icon_module_find_group_id(iconModule, 108, &groupIndex) || groupIndex != 1) {
+		fatal("Failed to find group 108\n");
+	}
+	outBuf = (char *)get_exe_icon_module_extract_group(iconModule, groupIndex, &options, &outLen);
+	assert_out_nonnull(outBuf, outLen);
+	if (outBuf[4] != 9) {
+		fatal("Expected 9 images in group 108\n");
+	}
+	free_s(&outBuf);
+
+	if (get_exe_icon_module_find_group_id(iconModule, 109, &groupIndex)
+		|| get_exe_icon_last_error() != GET_EXE_ICON_ERROR_NO_ICON)
+	{
+		fatal("Expected no group 109\n");
+	}
+	get_exe_icon_module_close(iconModule);
+
+	// ---------------
+	printf("Test: get_exe_icon_module on a named group of 40 images\n");
+
+	// More images than fit in the extraction's inline arrays. The named group
+	// comes first, so it's the primary icon.
+	const DWORD namedGroupSizes[] = { 40, 3 };
+	const char *const namedGroupNames[] = { "MAINICON", NULL };
+	size_t namedLen;
+	char *namedPe = make_pe(namedGroupSizes, namedGroupNames, 2, &namedLen);
+
+	outBuf = (char *)get_exe_icon_from_memory(namedPe, namedLen, TRUE, &outLen);
+	assert_out_nonnull(outBuf, outLen);
+	if (read_le32(outBuf) != 0x10000 || (BYTE)outBuf[4] != 40 || outBuf[5] != 0) {
+		fatal("Expected an ICO of 40 images\n");
+	}
+	for (DWORD i = 0; i < 40; i++) {
+		size_t dibLen;
+		char *dib = make_dib(icon_dim(i), icon_dim(i), 32, &dibLen);
+		const char *entry = outBuf + 6 + 16 * i;
+		if ((BYTE)entry[0] != icon_dim(i) || read_le32(entry + 12) + dibLen > outLen) {
+			fatal("Unexpected ICO entry %d\n", (int)i);
+		}
+		assert_bufs_equal(dib, dibLen, outBuf + read_le32(entry + 12), read_le32(entry + 8));
+		free(dib);
+	}
+	free_s(&outBuf);
+
+	iconModule = get_exe_icon_module_open_memory(namedPe, namedLen);
+	if (!iconModule || get_exe_icon_module_num_groups(iconModule) != 2) {
+		fatal("Failed to open module (last error: %d)\n", (int)get_exe_icon_last_error());
+	}
+	WCHAR groupName[16];
+	if (!get_exe_icon_module_group(iconModule, 0, &groupInfo) || !groupInfo.named || groupInfo.nameLen != 8
+		|| !get_exe_icon_module_group_name(iconModule, 0, groupName, 16)
+		|| memcmp(groupName, U16("MAINICON"), 9 * sizeof(WCHAR)) != 0)
+	{
+		fatal("Unexpected named group\n");
+	}
+	if (!get_exe_icon_module_find_group_name(iconModule, (const WCHAR *)U16("MainIcon"), &groupIndex) || groupIndex != 0
+		|| !get_exe_icon_module_find_group_id(iconModule, 101, &groupIndex) || groupIndex != 1)
+	{
+		fatal("Failed to find the groups\n");
+	}
+	if (!get_exe_icon_module_group_entries(iconModule, 0, entries, 4, &numEntries)
+		|| numEntries != 40
+		|| entries[3].width != icon_dim(3)
+		|| entries[3].resId != 4)
+	{
+		fatal("Unexpected named group entries\n");
+	}
+	outBuf = (char *)get_exe_icon_module_extract_group(iconModule, 1, &options, &outLen);
+	assert_out_nonnull(outBuf, outLen);
+	if (outBuf[4] != 3) {
+		fatal("Expected 3 images in group 101\n");
+	}
+	free_s(&outBuf);
+	get_exe_icon_module_close(iconModule);
+	free(namedPe);
+
+	// ---------------
+	printf("Test: work and output limits\n");
+
+	// A named group of 40 images, then one of 3
+	const DWORD synthGroupSizes[] = { 40, 3 };
+	const char *const synthGroupNames[] = { "MAINICON", NULL };
+	size_t synthLen;
+	char *synthPe = make_pe(synthGroupSizes, synthGroupNames, 2, &synthLen);
+
+	// Each of the 40 images is looked up in a directory of 43, so a budget of
+	// 100 nodes runs out partway
+	GetExeIconOptions limitOptions;
+	memset(&limitOptions, 0, sizeof(limitOptions));
+	limitOptions.allowEmbeddedPNGs = TRUE;
+	limitOptions.maxNodes = 100;
+	outBuf = (char *)get_exe_icon_from_memory_ex(synthPe, synthLen, &limitOptions, &outLen);
+	if (outBuf || outLen != 0 || get_exe_icon_last_error() != GET_EXE_ICON_ERROR_LIMIT_EXCEEDED) {
+		fatal("Expected GET_EXE_ICON_ERROR_LIMIT_EXCEEDED (last error: %d)\n", (int)get_exe_icon_last_error());
+	}
+	iconModule = get_exe_icon_module_open_memory(synthPe, synthLen);
+	outBuf = (char *)get_exe_icon_module_extract_group(iconModule, 0, &limitOptions, &outLen);
+	if (outBuf || get_exe_icon_last_error() != GET_EXE_ICON_ERROR_LIMIT_EXCEEDED) {
+		fatal("Expected GET_EXE_ICON_ERROR_LIMIT_EXCEEDED from the module\n");
+	}
+	get_exe_icon_module_close(iconModule);
+
+	// The output limit is checked before anything is allocated
+	limitOptions.maxNodes = 0;
+	outBuf = (char *)get_exe_icon_from_memory_ex(synthPe, synthLen, &limitOptions, &outLen);
+	assert_out_nonnull(outBuf, outLen);
+	free_s(&outBuf);
+	limitOptions.maxOutputBytes = outLen;
+	outBuf = (char *)get_exe_icon_from_memory_ex(synthPe, synthLen, &limitOptions, &outLen);
+	assert_out_nonnull(outBuf, outLen);
+	free_s(&outBuf);
+	limitOptions.maxOutputBytes = outLen - 1;
+	outBuf = (char *)get_exe_icon_from_memory_ex(synthPe, synthLen, &limitOptions, &outLen);
+	if (outBuf || get_exe_icon_last_error() != GET_EXE_ICON_ERROR_TOO_LARGE) {
+		fatal("Expected GET_EXE_ICON_ERROR_TOO_LARGE (last error: %d)\n", (int)get_exe_icon_last_error());
+	}
+
+	// Point the first image's language directory back at the RT_ICON
+	// directory: the cycle is never followed, and only that image is lost
+	write_le32(synthPe + 0x200 + 32 + 16 + 4, 0x80000000 | 32);
+	outBuf = (char *)get_exe_icon_from_memory(synthPe, synthLen, TRUE, &outLen);
+	assert_out_nonnull(outBuf, outLen);
+	if (outBuf[4] != 39) {
+		fatal("Expected 39 images\n");
+	}
+	free_s(&outBuf);
+	free(synthPe);
+
+	// ---------------
+	printf("Test: GetExeIconStats and get_exe_icon_set_stats_hook\n");
+
+	GetExeIconStats stats;
+	GetExeIconOptions statsOptions;
+	memset(&statsOptions, 0, sizeof(statsOptions));
+	statsOptions.stats = &stats;
+	outBuf = (char *)get_exe_icon_from_file_utf8_ex(dummyExplorerPath, &statsOptions, &outLen);
+	assert_out_nonnull(outBuf, outLen);
+
+	// Every image but the PNG is copied, into the ICO's only allocation
+	DWORD numImages = (BYTE)outBuf[4];
+	if (stats.error != GET_EXE_ICON_OK
+		|| stats.bytesMapped != exeLen
+		|| stats.nodesVisited == 0
+		|| stats.entriesSeen != numImages + 1
+		|| stats.entriesSkipped != 1
+		|| stats.bytesCopied != outLen - 6 - 16 * numImages
+		|| stats.allocations != 1
+		|| stats.openNs + stats.enumerateNs + stats.locateNs + stats.assembleNs == 0)
+	{
+		fatal("Unexpected stats from the file\n");
+	}
+	free_s(&outBuf);
+
+	reader.ctx = open_file(dummyExplorerPath, "rb");
+	outBuf = (char *)get_exe_icon_from_reader_ex(&reader, &statsOptions, &outLen);
+	assert_out_nonnull(outBuf, outLen);
+	if (stats.bytesRead != reader.bytesRead || stats.numReads != reader.numReads || stats.bytesMapped != 0) {
+		fatal("Unexpected stats from the reader\n");
+	}
+	free_s(&outBuf);
+	fclose((FILE *)reader.ctx);
+
+	DWORD extractions[2] = { 0, 0 };
+	get_exe_icon_set_stats_hook(count_extractions, extractions);
+	outBuf = (char *)get_exe_icon_from_file_utf8(dummyExplorerPath, TRUE, &outLen);
+	free_s(&outBuf);
+	outBuf = (char *)get_exe_icon_from_memory("MZ", 2, TRUE, &outLen);
+	get_exe_icon_set_stats_hook(NULL, NULL);
+	outBuf = (char *)get_exe_icon_from_file_utf8(dummyExplorerPath, TRUE, &outLen);
+	free_s(&outBuf);
+	if (extractions[0] != 1 || extractions[1] != 1) {
+		fatal("Expected the hook to see one success and one failure\n");
+	}
+
+	// ---------------
+	printf("Test: get_exe_icon_module_open_reader\n");
+
+	reader.ctx = open_file(dummyExplorerPath, "rb");
+	if (!reader.ctx) {
+		fatal("Cannot open file '%s'.\n", dummyExplorerPath);
+	}
+	iconModule = get_exe_icon_module_open_reader(&reader);
+	if (!iconModule) {
+		fatal("Failed to open module (last error: %d)\n", (int)get_exe_icon_last_error());
+	}
+
+	// Listing the groups reads only headers and directories
+	for (DWORD i = 0; i < get_exe_icon_module_num_groups(iconModule); i++) {
+		if (!get_exe_icon_module_group(iconModule, i, &groupInfo)) {
+			fatal("Failed to get group %d\n", (int)i);
+		}
+	}
+	if (reader.bytesRead > 4 * 4096) {
+		fatal("Read too much data (%d bytes in %d reads)\n", (int)reader.bytesRead, (int)reader.numReads);
+	}
+
+	outBuf = (char *)get_exe_icon_module_extract_group(iconModule, 0, &options, &outLen);
+	assert_out_nonnull(outBuf, outLen);
+	assert_bufs_equal(expBuf, expLen, outBuf, outLen);
+	free_s(&outBuf);
+	free_s(&expBuf);
+
+	get_exe_icon_module_close(iconModule);
+	fclose((FILE *)reader.ctx);
+
+	// ---------------
+	printf("Test: get_exe_icon_decode_ico_image\n");
+
+	// The ICO's 32x32 image is 32 bit with alpha, and opaque in the middle
+	GetExeIconDecodeOptions decodeOptions;
+	GetExeIconBitmap bitmap, expBitmap;
+	memset(&decodeOptions, 0, sizeof(decodeOptions));
+	expBuf = read_file("testdata/explorer_expected.ico", &expLen);
+	if (!get_exe_icon_decode_ico_image(expBuf, expLen, 4, &decodeOptions, &bitmap)
+		|| bitmap.width != 32
+		|| bitmap.height != 32
+		|| memcmp(bitmap.pixels + (16 * 32 + 16) * 4, "\xea\xc3\x52\xff", 4) != 0)
+	{
+		fatal("Failed to decode 32x32 image (last error: %d)\n", (int)get_exe_icon_last_error());
+	}
+	get_exe_icon_bitmap_free(&bitmap);
+
+	if (get_exe_icon_decode_ico_image(expBuf, expLen, 0, &decodeOptions, &bitmap)
+		|| get_exe_icon_last_error() != GET_EXE_ICON_ERROR_UNSUPPORTED)
+	{
+		fatal("Expected GET_EXE_ICON_ERROR_UNSUPPORTED for a PNG image\n");
+	}
+	free_s(&expBuf);
+
+	// ---------------
+	printf("Test: get_exe_icon_decode_dib with each instruction set\n");
+
+	// Odd widths leave some pixels of each row to the vector kernels' tails
+	const DWORD bitCounts[] = { 1, 4, 8, 24, 32 };
+	for (int b = 0; b < 5; b++) {
+		for (DWORD width = 1; width <= 41; width += 4) {
+			size_t dibLen;
+			char *dib = make_dib(width, 3, bitCounts[b], &dibLen);
+			for (int premultiplied = 0; premultiplied < 2; premultiplied++) {
+				decodeOptions.premultiplied = premultiplied;
+				decodeOptions.isa = GET_EXE_ICON_ISA_SCALAR;
+				if (!get_exe_icon_decode_dib(dib, dibLen, &decodeOptions, &expBitmap)) {
+					fatal("Failed to decode %d bit DIB (last error: %d)\n", (int)bitCounts[b], (int)get_exe_icon_last_error());
+				}
+				for (int isa = GET_EXE_ICON_ISA_SSE2; isa <= GET_EXE_ICON_ISA_AVX2; isa++) {
+					decodeOptions.isa = (GetExeIconIsa)isa;
+					if (!get_exe_icon_decode_dib(dib, dibLen, &decodeOptions, &bitmap)) {
+						fatal("Failed to decode %d bit DIB (last error: %d)\n", (int)bitCounts[b], (int)get_exe_icon_last_error());
+					}
+					assert_bufs_equal((char *)expBitmap.pixels, width * 3 * 4, (char *)bitmap.pixels, bitmap.width * bitmap.height * 4);
+					get_exe_icon_bitmap_free(&bitmap);
+				}
+				get_exe_icon_bitmap_free(&expBitmap);
+			}
+			free(dib);
+		}
+	}
+
+	// ---------------
+	printf("Test: get_exe_icon_resample with each filter, instruction set and thread count\n");
+
+	size_t dibLen;
+	char *dib = make_dib(37, 29, 32, &dibLen);
+	decodeOptions.premultiplied = TRUE;
+	decodeOptions.isa = GET_EXE_ICON_ISA_AUTO;
+	GetExeIconBitmap srcBitmap;
+	if (!get_exe_icon_decode_dib(dib, dibLen, &decodeOptions, &srcBitmap)) {
+		fatal("Failed to decode DIB (last error: %d)\n", (int)get_exe_icon_last_error());
+	}
+	free(dib);
+
+	const DWORD sizes[][2] = { { 13, 11 }, { 80, 70 }, { 37, 60 }, { 19, 29 } };
+	GetExeIconResampleOptions resampleOptions;
+	memset(&resampleOptions, 0, sizeof(resampleOptions));
+	for (int filter = GET_EXE_ICON_FILTER_BOX; filter <= GET_EXE_ICON_FILTER_LANCZOS3; filter++) {
+		for (int i = 0; i < 4; i++) {
+			const DWORD width = sizes[i][0], height = sizes[i][1];
+			resampleOptions.filter = (GetExeIconFilter)filter;
+			resampleOptions.isa = GET_EXE_ICON_ISA_SCALAR;
+			resampleOptions.numThreads = 1;
+			if (!get_exe_icon_resample(&srcBitmap, width, height, &resampleOptions, &expBitmap)
+				|| expBitmap.width != width
+				|| expBitmap.height != height)
+			{
+				fatal("Failed to resample to %ux%u (last error: %d)\n", (unsigned)width, (unsigned)height, (int)get_exe_icon_last_error());
+			}
+
+			// Overshoot must not leave colors above alpha
+			for (size_t k = 0; k < (size_t)width * height * 4; k += 4) {
+				const BYTE *p = expBitmap.pixels + k;
+				if (p[0] > p[3] || p[1] > p[3] || p[2] > p[3]) {
+					fatal("Resampled pixel isn't premultiplied\n");
+				}
+			}
+
+			for (int isa = GET_EXE_ICON_ISA_SSE2; isa <= GET_EXE_ICON_ISA_AVX2; isa++) {
+				resampleOptions.isa = (GetExeIconIsa)isa;
+				resampleOptions.numThreads = isa == GET_EXE_ICON_ISA_AVX2 ? 3 : 1;
+				if (!get_exe_icon_resample(&srcBitmap, width, height, &resampleOptions, &bitmap)) {
+					fatal("Failed to resample to %ux%u (last error: %d)\n", (unsigned)width, (unsigned)height, (int)get_exe_icon_last_error());
+				}
+				assert_bufs_equal((char *)expBitmap.pixels, width * height * 4, (char *)bitmap.pixels, bitmap.width * bitmap.height * 4);
+				get_exe_icon_bitmap_free(&bitmap);
+			}
+			get_exe_icon_bitmap_free(&expBitmap);
+		}
+	}
+	get_exe_icon_bitmap_free(&srcBitmap);
+
+	// ---------------
+	printf("Test: get_exe_icon_bitmap_from_file_utf8 and get_exe_icon_bitmap_to_ico\n");
+
+	// There's no 100x100 image, so the 256x256 one is shrunk
+	if (!get_exe_icon_bitmap_from_file_utf8(dummyExplorerPath, 100, 100, NULL, &bitmap)
+		|| bitmap.width != 100
+		|| bitmap.height != 100)
+	{
+		fatal("Failed to get 100x100 bitmap (last error: %d)\n", (int)get_exe_icon_last_error());
+	}
+
+	outBuf = (char *)get_exe_icon_bitmap_to_ico(&bitmap, TRUE, &outLen);
+	assert_out_nonnull(outBuf, outLen);
+	decodeOptions.premultiplied = TRUE;
+	if (!get_exe_icon_decode_ico_image(outBuf, outLen, 0, &decodeOptions, &expBitmap)
+		|| expBitmap.width != 100
+		|| expBitmap.height != 100)
+	{
+		fatal("Failed to decode ICO made from bitmap (last error: %d)\n", (int)get_exe_icon_last_error());
+	}
 
+	// Unpremultiplying and premultiplying again can be off by one
+	for (size_t i = 0; i < 100 * 100 * 4; i++) {
+		if (abs((int)bitmap.pixels[i] - (int)expBitmap.pixels[i]) > 1) {
+			fatal("Pixels differ at byte %u after round trip through ICO\n", (unsigned)i);
+		}
+	}
+	get_exe_icon_bitmap_free(&expBitmap);
+	get_exe_icon_bitmap_free(&bitmap);
 	free_s(&outBuf);
+
+	// ---------------
+	printf("Test: get_exe_icon_crc32, get_exe_icon_adler32 and stored get_exe_icon_zlib_compress\n");
+
+	if (get_exe_icon_crc32(0, "123456789", 9) != 0xcbf43926
+		|| get_exe_icon_adler32(1, "Wikipedia", 9) != 0x11e60398)
+	{
+		fatal("Wrong checksum\n");
+	}
+
+	// Level 0 is a zlib header, one stored block and the Adler-32
+	size_t zlibLen;
+	char *zlibBuf = (char *)get_exe_icon_zlib_compress("Wikipedia", 9, 0, &zlibLen);
+	assert_bufs_equal("\x78\x01\x01\x09\x00\xf6\xffWikipedia\x11\xe6\x03\x98", 20, zlibBuf, zlibLen);
+	free_s(&zlibBuf);
+
+	// ---------------
+	printf("Test: get_exe_icon_inflate\n");
+
+	// Round trip the stored, fixed and dynamic blocks of each level, without
+	// the zlib header and Adler-32
+	expBuf = read_file("testdata/explorer_expected.ico", &expLen);
+	char *inflateBuf = (char *)malloc(expLen);
+	for (int level = GET_EXE_ICON_DEFLATE_MIN_LEVEL; level <= GET_EXE_ICON_DEFLATE_MAX_LEVEL; level++) {
+		zlibBuf = (char *)get_exe_icon_zlib_compress(expBuf, expLen, level, &zlibLen);
+		size_t inflatedLen;
+		if (!get_exe_icon_inflate(zlibBuf + 2, zlibLen - 6, inflateBuf, expLen, &inflatedLen)) {
+			fatal("Failed to inflate level %d (error %d)\n", level, (int)get_exe_icon_last_error());
+		}
+		assert_bufs_equal(expBuf, expLen, inflateBuf, inflatedLen);
+
+		// One byte less room, or one byte less data, fails
+		if (get_exe_icon_inflate(zlibBuf + 2, zlibLen - 6, inflateBuf, expLen - 1, &inflatedLen)
+			|| get_exe_icon_last_error() != GET_EXE_ICON_ERROR_TOO_LARGE)
+		{
+			fatal("Expected GET_EXE_ICON_ERROR_TOO_LARGE at level %d\n", level);
+		}
+		if (get_exe_icon_inflate(zlibBuf + 2, zlibLen - 7, inflateBuf, expLen, &inflatedLen)
+			|| get_exe_icon_last_error() != GET_EXE_ICON_ERROR_BAD_ARCHIVE)
+		{
+			fatal("Expected GET_EXE_ICON_ERROR_BAD_ARCHIVE at level %d\n", level);
+		}
+		free_s(&zlibBuf);
+	}
+	free_s(&inflateBuf);
 	free_s(&expBuf);
 
+	// ---------------
+	printf("Test: get_exe_icons_from_zip_utf8\n");
+
+	size_t explorerLen, writeLen;
+	char *explorerExe = read_file(dummyExplorerPath, &explorerLen);
+	char *writeExe = read_file(dummyWritePath, &writeLen);
+	const ZipEntry zipEntries[] = {
+		{ "readme.txt", "Not an executable", 17, FALSE, 0, 0 },
+		{ "bin/Explorer.EXE", explorerExe, explorerLen, FALSE, 0, 0 },
+		{ "lib.dll/", "", 0, FALSE, 0, 0 },
+		{ "lib/write.dll", writeExe, writeLen, TRUE, 0, 0 },
+		{ "bad_crc.exe", writeExe, writeLen, TRUE, 0, 1 },
+		{ "encrypted.exe", writeExe, writeLen, FALSE, 1, 0 },
+		{ "not_pe.exe", "MZ", 2, TRUE, 0, 0 },
+	};
+	const char *zipNames[] = { "bin/Explorer.EXE", "lib/write.dll", "bad_crc.exe", "encrypted.exe", "not_pe.exe" };
+	const GetExeIconError zipErrors[] = {
+		GET_EXE_ICON_OK,
+		GET_EXE_ICON_OK,
+		GET_EXE_ICON_ERROR_BAD_ARCHIVE,
+		GET_EXE_ICON_ERROR_UNSUPPORTED,
+		GET_EXE_ICON_ERROR_NOT_PE,
+	};
+	const char *zipExpected[] = { "testdata/explorer_expected.ico", "testdata/write_expected.ico", NULL, NULL, NULL };
+
+	// With and without a self-extractor's worth of data in front
+	for (size_t prefixLen = 0; prefixLen <= 1000; prefixLen += 1000) {
+		size_t zipLen;
+		char *zipBuf = make_zip(zipEntries, sizeof(zipEntries) / sizeof(zipEntries[0]), prefixLen, &zipLen);
+		write_file("testdata/zip_out.zip", zipBuf, zipLen);
+		free_s(&zipBuf);
+
+		GetExeIconZipOptions zipOptions;
+		memset(&zipOptions, 0, sizeof(zipOptions));
+		zipOptions.numThreads = 3;
+		zipOptions.allowEmbeddedPNGs = TRUE;
+		GetExeIconZipResult *zipResults;
+		size_t zipCount;
+		if (!get_exe_icons_from_zip_utf8("testdata/zip_out.zip", &zipOptions, &zipResults, &zipCount)) {
+			fatal("Failed to read the ZIP archive (error %d)\n", (int)get_exe_icon_last_error());
+		}
+		if (zipCount != sizeof(zipNames) / sizeof(zipNames[0])) {
+			fatal("Expected %zd ZIP results, got %zd\n", sizeof(zipNames) / sizeof(zipNames[0]), zipCount);
+		}
+		for (size_t i = 0; i < zipCount; i++) {
+			if (strcmp(zipResults[i].name, zipNames[i]) != 0 || zipResults[i].error != zipErrors[i]) {
+				fatal("Unexpected ZIP result %zd: '%s', error %d\n", i, zipResults[i].name, (int)zipResults[i].error);
+			}
+			if (zipExpected[i]) {
+				expBuf = read_file(zipExpected[i], &expLen);
+				assert_bufs_equal(expBuf, expLen, (char *)zipResults[i].icoBuf, zipResults[i].bufLen);
+				free_s(&expBuf);
+			} else if (zipResults[i].icoBuf != NULL) {
+				fatal("Expected no icon for ZIP result %zd\n", i);
+			}
+		}
+		get_exe_icon_free_zip_results(zipResults, zipCount);
+	}
+
+	// An entry bigger than maxEntrySize isn't decompressed, and data that
+	// isn't an archive at all fails as a whole
+	GetExeIconZipOptions zipOptions;
+	memset(&zipOptions, 0, sizeof(zipOptions));
+	zipOptions.maxEntrySize = writeLen - 1;
+	size_t zipLen, zipCount;
+	char *zipBuf = make_zip(&zipEntries[3], 1, 0, &zipLen);
+	GetExeIconZipResult *zipResults;
+	if (!get_exe_icons_from_zip_memory(zipBuf, zipLen, &zipOptions, &zipResults, &zipCount)
+		|| zipCount != 1
+		|| zipResults[0].error != GET_EXE_ICON_ERROR_TOO_LARGE)
+	{
+		fatal("Expected GET_EXE_ICON_ERROR_TOO_LARGE for an entry over maxEntrySize\n");
+	}
+	get_exe_icon_free_zip_results(zipResults, zipCount);
+	free_s(&zipBuf);
+	if (get_exe_icons_from_zip_memory(explorerExe, explorerLen, NULL, &zipResults, &zipCount)
+		|| get_exe_icon_last_error() != GET_EXE_ICON_ERROR_BAD_ARCHIVE)
+	{
+		fatal("Expected GET_EXE_ICON_ERROR_BAD_ARCHIVE for a file that isn't a ZIP archive\n");
+	}
+	free_s(&explorerExe);
+	free_s(&writeExe);
+
+	// ---------------
+	printf("Test: get_exe_icon_png_ico_from_file_utf8\n");
+
+	// Every bitmap image becomes a PNG, and the 256x256 image, already a
+	// PNG, is kept as it is
+	GetExeIconPngOptions pngOptions;
+	memset(&pngOptions, 0, sizeof(pngOptions));
+	outBuf = (char *)get_exe_icon_png_ico_from_file_utf8(dummyExplorerPath, &pngOptions, &outLen);
+	assert_out_nonnull(outBuf, outLen);
+	expBuf = read_file("testdata/explorer_expected.ico", &expLen);
+	if (outLen >= expLen / 2 || memcmp(outBuf, expBuf, 6) != 0) {
+		fatal("ICO with PNG images is %u bytes, from %u\n", (unsigned)outLen, (unsigned)expLen);
+	}
+	for (int i = 0; i < 8; i++) {
+		const BYTE *entry = (const BYTE *)outBuf + 6 + i * 16;
+		const BYTE *expEntry = (const BYTE *)expBuf + 6 + i * 16;
+		uint32_t imageLen = read_le32(entry + 8), imageOffset = read_le32(entry + 12);
+		if (memcmp(entry, expEntry, 8) != 0
+			|| imageOffset > outLen
+			|| imageLen > outLen - imageOffset
+			|| memcmp(outBuf + imageOffset, "\x89PNG", 4) != 0)
+		{
+			fatal("Bad ICO directory entry %d\n", i);
+		}
+		if (i == 0) {
+			assert_bufs_equal(expBuf + read_le32(expEntry + 12), read_le32(expEntry + 8), outBuf + imageOffset, imageLen);
+		}
+	}
+
+	// The result doesn't depend on the number of threads or on SSE2
+	pngOptions.numThreads = 1;
+	pngOptions.isa = GET_EXE_ICON_ISA_SCALAR;
+	DWORD outLen2;
+	char *scalarBuf = (char *)get_exe_icon_ico_to_png(expBuf, expLen, &pngOptions, &outLen2);
+	assert_bufs_equal(outBuf, outLen, scalarBuf, outLen2);
+	free_s(&scalarBuf);
+
+	// minWidth leaves smaller images as bitmaps
+	pngOptions.minWidth = 48;
+	scalarBuf = (char *)get_exe_icon_ico_to_png(expBuf, expLen, &pngOptions, &outLen2);
+	assert_out_nonnull(scalarBuf, outLen2);
+	if (memcmp(scalarBuf + read_le32(scalarBuf + 6 + 2 * 16 + 12), "\x89PNG", 4) != 0
+		|| memcmp(scalarBuf + read_le32(scalarBuf + 6 + 3 * 16 + 12), "\x28\0\0\0", 4) != 0)
+	{
+		fatal("minWidth 48 should only encode images from 48x48 up\n");
+	}
+	free_s(&scalarBuf);
+	free_s(&outBuf);
+
+	// ---------------
+	printf("Test: get_exe_icon_best_png_from_file_utf8\n");
+
+	// The explorer icon's best image is its 256x256 PNG
+	outBuf = (char *)get_exe_icon_best_png_from_file_utf8(dummyExplorerPath, NULL, &outLen);
+	assert_bufs_equal(expBuf + read_le32(expBuf + 6 + 12), read_le32(expBuf + 6 + 8), outBuf, outLen);
+	free_s(&outBuf);
+
+	// The same from the ICO
+	outBuf = (char *)get_exe_icon_best_png_from_ico(expBuf, expLen, NULL, &outLen);
+	assert_bufs_equal(expBuf + read_le32(expBuf + 6 + 12), read_le32(expBuf + 6 + 8), outBuf, outLen);
+	free_s(&outBuf);
+	free_s(&expBuf);
+
+	// The write icon's is a 32x32 bitmap
+	outBuf = (char *)get_exe_icon_best_png_from_file_utf8(dummyWritePath, NULL, &outLen);
+	assert_out_nonnull(outBuf, outLen);
+	if (outLen < 24
+		|| memcmp(outBuf, "\x89PNG\r\n\x1a\n\0\0\0\x0dIHDR\0\0\0\x20\0\0\0\x20", 24) != 0)
+	{
+		fatal("Expected a 32x32 PNG\n");
+	}
+
+	// The same from the ICO
+	expBuf = read_file("testdata/write_expected.ico", &expLen);
+	DWORD icoPngLen;
+	char *icoPngBuf = (char *)get_exe_icon_best_png_from_ico(expBuf, expLen, NULL, &icoPngLen);
+	assert_bufs_equal(outBuf, outLen, icoPngBuf, icoPngLen);
+	free_s(&icoPngBuf);
+	free_s(&expBuf);
+	free_s(&outBuf);
+
+	// ---------------
+	printf("Test: get_exe_icon_phash\n");
+
+	{
+		GetExeIconPHash explorerHash, writeHash, otherHash;
+		GetExeIconPHashOptions phashOptions;
+		GetExeIconBitmap phashBitmap;
+		memset(&phashOptions, 0, sizeof(phashOptions));
+
+		if (!get_exe_icon_phash_from_file_utf8(dummyExplorerPath, NULL, &explorerHash)
+			|| !get_exe_icon_phash_from_file_utf8(dummyWritePath, NULL, &writeHash))
+		{
+			fatal("Failed to hash the dummy exes' icons (error %d)\n", get_exe_icon_last_error());
+		}
+
+		// Every instruction set gives the same hash, from a file or memory
+		char *peBuf = read_file(dummyExplorerPath, &expLen);
+		for (GetExeIconIsa isa = GET_EXE_ICON_ISA_SCALAR; isa <= get_exe_icon_cpu_isa(); isa++)
+		{
+			phashOptions.isa = isa;
+			if (!get_exe_icon_phash_from_memory(peBuf, expLen, &phashOptions, &otherHash)
+				|| memcmp(&otherHash, &explorerHash, sizeof(otherHash)) != 0)
+			{
+				fatal("The hash with instruction set %d differs\n", (int)isa);
+			}
+		}
+		free_s(&peBuf);
+		phashOptions.isa = GET_EXE_ICON_ISA_AUTO;
+
+		// Hashing the icon's bitmap at the canonical size is the same as
+		// hashing the file
+		if (!get_exe_icon_bitmap_from_file_utf8(dummyExplorerPath, GET_EXE_ICON_PHASH_SIZE, GET_EXE_ICON_PHASH_SIZE, NULL, &phashBitmap)
+			|| !get_exe_icon_phash_bitmap(&phashBitmap, NULL, &otherHash)
+			|| memcmp(&otherHash, &explorerHash, sizeof(otherHash)) != 0)
+		{
+			fatal("Hashing the 32x32 bitmap should match hashing the file\n");
+		}
+		get_exe_icon_bitmap_free(&phashBitmap);
+
+		// The same icon from a larger image is close, a different icon isn't
+		if (!get_exe_icon_bitmap_from_file_utf8(dummyExplorerPath, 64, 64, NULL, &phashBitmap)
+			|| !get_exe_icon_phash_bitmap(&phashBitmap, NULL, &otherHash))
+		{
+			fatal("Failed to hash the 64x64 explorer bitmap\n");
+		}
+		get_exe_icon_bitmap_free(&phashBitmap);
+		if (get_exe_icon_phash_distance(otherHash.code, explorerHash.code) > 12)
+		{
+			fatal("The 64x64 explorer icon should be near its 32x32 one\n");
+		}
+		if (get_exe_icon_phash_distance(writeHash.code, explorerHash.code) <= 24)
+		{
+			fatal("The explorer and write icons should be far apart\n");
+		}
+		if (get_exe_icon_phash_histogram_distance(&explorerHash, &explorerHash) != 0
+			|| get_exe_icon_phash_histogram_distance(&explorerHash, &writeHash) == 0)
+		{
+			fatal("Unexpected histogram distances\n");
+		}
+
+		// Many files at once
+		PCSTR phashPaths[3] = { dummyExplorerPath, "testdata/does_not_exist.exe", dummyWritePath };
+		GetExeIconPHashResult phashResults[3];
+		phashOptions.numThreads = 2;
+		if (get_exe_icon_phash_files(phashPaths, 3, &phashOptions, phashResults) != 2
+			|| phashResults[0].error != GET_EXE_ICON_OK
+			|| memcmp(&phashResults[0].hash, &explorerHash, sizeof(explorerHash)) != 0
+			|| phashResults[1].error != GET_EXE_ICON_ERROR_OPEN_FAILED
+			|| phashResults[2].error != GET_EXE_ICON_OK
+			|| memcmp(&phashResults[2].hash, &writeHash, sizeof(writeHash)) != 0)
+		{
+			fatal("get_exe_icon_phash_files gave unexpected results\n");
+		}
+	}
+
+	// ---------------
+	printf("Test: get_exe_icon_phash_index_query\n");
+
+	{
+		// Pseudo-random codes, with every 97th one a few bits away from the
+		// query so that there's something to find at each distance
+		enum { NUM_CODES = 200000 };
+		const uint64_t query = 0x0123456789abcdefull;
+		uint64_t *codes = malloc(NUM_CODES * sizeof(uint64_t));
+		GetExeIconPHashMatch *matches = malloc(NUM_CODES * sizeof(GetExeIconPHashMatch));
+		BYTE *found = malloc(NUM_CODES);
+		if (codes == NULL || matches == NULL || found == NULL)
+		{
+			fatal("Out of memory\n");
+		}
+		uint64_t seed = 88172645463325252ull;
+		for (size_t i = 0; i < NUM_CODES; i++)
+		{
+			seed ^= seed << 13;
+			seed ^= seed >> 7;
+			seed ^= seed << 17;
+			codes[i] = seed;
+			if (i % 97 == 0)
+			{
+				// Flip up to 20 bits of the query
+				codes[i] = query;
+				for (size_t j = 0; j < (i / 97) % 21; j++)
+				{
+					codes[i] ^= 1ull << ((seed >> (j * 3)) & 63);
+				}
+			}
+		}
+
+		for (DWORD numThreads = 1; numThreads <= 4; numThreads += 3)
+		{
+			GetExeIconPHashIndex *index = get_exe_icon_phash_index_build(codes, NUM_CODES, numThreads);
+			if (index == NULL)
+			{
+				fatal("get_exe_icon_phash_index_build failed (error %d)\n", get_exe_icon_last_error());
+			}
+
+			for (DWORD maxDistance = 0; maxDistance <= 20; maxDistance++)
+			{
+				size_t expected = 0;
+				for (size_t i = 0; i < NUM_CODES; i++)
+				{
+					expected += get_exe_icon_phash_distance(codes[i], query) <= maxDistance;
+				}
+
+				size_t numMatches = get_exe_icon_phash_index_query(index, query, maxDistance, matches, NUM_CODES);
+				if (numMatches != expected)
+				{
+					fatal("Expected %zu codes within %lu bits, found %zu\n", expected, (unsigned long)maxDistance, numMatches);
+				}
+
+				// Each match is right and found only once
+				memset(found, 0, NUM_CODES);
+				for (size_t i = 0; i < numMatches; i++)
+				{
+					if (matches[i].index >= NUM_CODES
+						|| found[matches[i].index]
+						|| matches[i].distance > maxDistance
+						|| matches[i].distance != get_exe_icon_phash_distance(codes[matches[i].index], query))
+					{
+						fatal("Bad match within %lu bits\n", (unsigned long)maxDistance);
+					}
+					found[matches[i].index] = 1;
+				}
+
+				// Only the count when there's no room for the matches
+				if (get_exe_icon_phash_index_query(index, query, maxDistance, NULL, 0) != expected)
+				{
+					fatal("Counting the matches within %lu bits differs\n", (unsigned long)maxDistance);
+				}
+			}
+
+			get_exe_icon_phash_index_free(index);
+		}
+
+		free(found);
+		free(matches);
+		free(codes);
+	}
+
+#ifdef _WIN32
 	// ---------------
 	printf("Implicitly testing get_icon_from_handle via get_icon_from_pid...\n");
 	printf("Test: get_icon_from_pid\n");
@@ -180,11 +1934,11 @@ int main(int argc, char **argv)
 	}
 
 	// pid is valid until procInfo.hProcess is closed
-	outBuf = get_exe_icon_from_pid(procInfo.dwProcessId, TRUE, &outLen);
+	outBuf = (char *)get_exe_icon_from_pid(procInfo.dwProcessId, TRUE, &outLen);
 	assert_out_nonnull(outBuf, outLen);
-	write_file(L"testdata\\pid_test_out.ico", outBuf, outLen);
+	write_file("testdata/pid_test_out.ico", outBuf, outLen);
 
-	expBuf = read_file(L"testdata\\explorer_expected.ico", &expLen);
+	expBuf = read_file("testdata/explorer_expected.ico", &expLen);
 	assert_bufs_equal(expBuf, expLen, outBuf, outLen);
 
 	free_s(&outBuf);
@@ -195,7 +1949,7 @@ int main(int argc, char **argv)
 
 	// ---------------
 	printf("Test: get_icon_from_pid on own process should return NULL (no icon)\n");
-	outBuf = get_exe_icon_from_pid(GetProcessId(NULL), TRUE, &outLen);
+	outBuf = (char *)get_exe_icon_from_pid(GetProcessId(NULL), TRUE, &outLen);
 	if (outBuf != NULL) {
 		fatal("Expected no icon to be found.\n");
 	}
@@ -204,20 +1958,107 @@ int main(int argc, char **argv)
 	printf("Test: get_default_exe_icon\n");
 	outBuf = get_default_exe_icon(TRUE, &outLen);
 	assert_out_nonnull(outBuf, outLen);
-	write_file(L"testdata\\default_exe_out.ico", outBuf, outLen);
+	write_file("testdata/default_exe_out.ico", outBuf, outLen);
 
 	HMODULE module = LoadLibraryExA("imageres.dll", NULL, LOAD_LIBRARY_SEARCH_SYSTEM32 | LOAD_LIBRARY_AS_IMAGE_RESOURCE | LOAD_LIBRARY_AS_DATAFILE);
 	if (module) { // Vista and up
-		expBuf = read_file(L"testdata\\default_exe_imageres_expected.ico", &expLen);
+		expBuf = read_file("testdata/default_exe_imageres_expected.ico", &expLen);
 		assert_bufs_equal(expBuf, expLen, outBuf, outLen);
 	} else { // XP and below
-		expBuf = read_file(L"testdata\\default_exe_shell32_expected.ico", &expLen);
+		expBuf = read_file("testdata/default_exe_shell32_expected.ico", &expLen);
 		assert_bufs_equal(expBuf, expLen, outBuf, outLen);
 	}
 
 	free_s(&outBuf);
 	free_s(&expBuf);
 
+#endif
+
+	// ---------------
+	printf("Test: get_default_exe_icon_shared from a source file\n");
+
+	// Two groups, patched to have the IDs of the default icon in shell32.dll
+	// (3) and in imageres.dll (15). make_pe() puts their directory entries
+	// after those of the type directory and the 5 images.
+	const DWORD defaultGroupSizes[] = { 2, 3 };
+	const char *const defaultGroupNames[] = { NULL, NULL };
+	size_t sourceLen;
+	char *source = make_pe(defaultGroupSizes, defaultGroupNames, 2, &sourceLen);
+	write_le32(source + 0x200 + 32 + 16 + 8 * 5 + 16, 3);
+	write_le32(source + 0x200 + 32 + 16 + 8 * 5 + 24, 15);
+	write_file("testdata/default_source_out.dll", source, sourceLen);
+
+	GetExeIconModule *sourceModule = get_exe_icon_module_open_memory(source, sourceLen);
+	DWORD sourceIndex;
+	if (!sourceModule || !get_exe_icon_module_find_group_id(sourceModule, 15, &sourceIndex)) {
+		fatal("Failed to find group 15 of the source (error: %d)\n", get_exe_icon_last_error());
+	}
+	GetExeIconOptions sourceOptions;
+	memset(&sourceOptions, 0, sizeof(sourceOptions));
+	sourceOptions.allowEmbeddedPNGs = TRUE;
+	expBuf = (char *)get_exe_icon_module_extract_group(sourceModule, sourceIndex, &sourceOptions, &outLen);
+	assert_out_nonnull(expBuf, outLen);
+	expLen = outLen;
+	get_exe_icon_module_close(sourceModule);
+
+	DWORD sharedLen;
+	const BYTE *shared;
+#ifdef _WIN32
+	// The system's DLLs were used above, which fixed the source
+	if (get_default_exe_icon_set_source_utf8("testdata/default_source_out.dll")
+		|| get_exe_icon_last_error() != GET_EXE_ICON_ERROR_INVALID_ARGUMENT)
+	{
+		fatal("Expected the source to be fixed already\n");
+	}
+	remove("testdata/default_source_out.dll");
+	shared = get_default_exe_icon_shared(TRUE, &sharedLen);
+	assert_out_nonnull((char *)shared, sharedLen);
+#else
+	if (get_default_exe_icon_shared(TRUE, &sharedLen) != NULL
+		|| get_exe_icon_last_error() != GET_EXE_ICON_ERROR_OPEN_FAILED)
+	{
+		fatal("Expected no default icon without a source\n");
+	}
+	if (!get_default_exe_icon_set_source_utf8("testdata/default_source_out.dll")) {
+		fatal("Failed to set the source (error: %d)\n", get_exe_icon_last_error());
+	}
+	if (get_default_exe_icon_set_source_utf8("testdata/default_source_out.dll")
+		|| get_exe_icon_last_error() != GET_EXE_ICON_ERROR_INVALID_ARGUMENT)
+	{
+		fatal("Expected the source to be set only once\n");
+	}
+
+	shared = get_default_exe_icon_shared(TRUE, &sharedLen);
+	assert_out_nonnull((char *)shared, sharedLen);
+	assert_bufs_equal(expBuf, expLen, (char *)shared, sharedLen);
+	DWORD sharedNoPNGLen;
+	const BYTE *sharedNoPNG = get_default_exe_icon_shared(FALSE, &sharedNoPNGLen);
+	assert_out_nonnull((char *)sharedNoPNG, sharedNoPNGLen);
+	if (sharedNoPNG == shared) {
+		fatal("Expected separate ICOs with and without PNGs\n");
+	}
+
+	// Both are cached, so the file isn't needed anymore
+	remove("testdata/default_source_out.dll");
+	if (get_default_exe_icon_shared(FALSE, &outLen) != sharedNoPNG || outLen != sharedNoPNGLen) {
+		fatal("Expected the same shared ICO without PNGs\n");
+	}
+#endif
+	if (get_default_exe_icon_shared(TRUE, &outLen) != shared || outLen != sharedLen) {
+		fatal("Expected the same shared ICO\n");
+	}
+
+	outBuf = (char *)get_default_exe_icon(TRUE, &outLen);
+	assert_out_nonnull(outBuf, outLen);
+	if ((BYTE *)outBuf == shared) {
+		fatal("Expected get_default_exe_icon to return a copy\n");
+	}
+	assert_bufs_equal((char *)shared, sharedLen, outBuf, outLen);
+
+	free_s(&outBuf);
+	free_s(&expBuf);
+	free_s(&source);
+
 	printf("All tests passed\n");
 	return 0;
 }